@@ -0,0 +1,135 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_adc_cal.h"
+
+#include "adcq.h"
+
+#define ADCQ_OVERSAMPLE		CONFIG_ADCQ_OVERSAMPLE
+#define ADCQ_WINDOW			CONFIG_ADCQ_WINDOW
+
+// Registered channel with its window of pass sums
+typedef struct {
+	adc1_channel_t channel;
+	esp_adc_cal_characteristics_t cal;
+	uint32_t pass[ADCQ_WINDOW];		// sum of the conversions of a pass
+	uint32_t window;				// sum of pass[]
+	uint32_t passes;				// passes done, saturates at ADCQ_WINDOW
+	uint8_t head;
+	uint8_t active;					// set once the channel is configured
+} adcq_channel_t;
+
+static adcq_channel_t adcq_channels[ADCQ_MAX_CHANNELS];
+static int adcq_count = 0;
+static int adcq_started = 0;
+static portMUX_TYPE adcq_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Scan task, the only code using ADC1
+static void adcq_task(void *pvParameters){
+	TickType_t wake = xTaskGetTickCount();
+	while (1) {
+		for (int i = 0; i < ADCQ_MAX_CHANNELS; i++) {
+			adcq_channel_t *c = &adcq_channels[i];
+			uint32_t sum = 0;
+			if (!c->active) {
+				continue;
+			}
+			for (int n = 0; n < (1 << ADCQ_OVERSAMPLE); n++) {
+				sum += adc1_get_raw(c->channel);
+			}
+			// the window slides by one pass
+			portENTER_CRITICAL(&adcq_lock);
+			c->window += sum - c->pass[c->head];
+			c->pass[c->head] = sum;
+			c->head = (c->head + 1) % ADCQ_WINDOW;
+			if (c->passes < ADCQ_WINDOW) {
+				c->passes++;
+			}
+			portEXIT_CRITICAL(&adcq_lock);
+		}
+		vTaskDelayUntil(&wake, CONFIG_ADCQ_PERIOD_MS / portTICK_PERIOD_MS);
+	}
+}
+
+esp_err_t adcq_register(adc1_channel_t channel, adc_atten_t atten){
+	adcq_channel_t *c = NULL;
+	int start = 0;
+	esp_err_t err;
+
+	// reserve a slot, consumers register from their own tasks
+	portENTER_CRITICAL(&adcq_lock);
+	if (adcq_count < ADCQ_MAX_CHANNELS) {
+		c = &adcq_channels[adcq_count++];
+	}
+	portEXIT_CRITICAL(&adcq_lock);
+	if (c == NULL) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	if ((err = adc1_config_width(ADC_WIDTH_12Bit)) != ESP_OK
+			|| (err = adc1_config_channel_atten(channel, atten)) != ESP_OK) {
+		return err;
+	}
+	c->channel = channel;
+	esp_adc_cal_get_characteristics(ADCQ_VREF_MV, atten, ADC_WIDTH_12Bit, &c->cal);
+
+	// the scan task takes the channel from the next pass on
+	portENTER_CRITICAL(&adcq_lock);
+	c->active = 1;
+	if (!adcq_started) {
+		adcq_started = start = 1;
+	}
+	portEXIT_CRITICAL(&adcq_lock);
+
+	if (start) {
+		xTaskCreatePinnedToCore(&adcq_task, "adcq", 2048, NULL, 5, NULL, 0);
+	}
+	return ESP_OK;
+}
+
+esp_err_t adcq_read(adc1_channel_t channel, adcq_result_t *result){
+	uint32_t window = 0, passes = 0;
+	uint32_t raw, frac, mv0, mv1;
+	int i;
+
+	for (i = 0; i < ADCQ_MAX_CHANNELS && !(adcq_channels[i].active && adcq_channels[i].channel == channel); i++);
+	if (i == ADCQ_MAX_CHANNELS) {
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	portENTER_CRITICAL(&adcq_lock);
+	if (adcq_channels[i].passes == ADCQ_WINDOW) {
+		window = adcq_channels[i].window;
+		passes = ADCQ_WINDOW;
+	}
+	portEXIT_CRITICAL(&adcq_lock);
+	if (passes == 0) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	// mean with ADCQ_FRAC_BITS fraction bits, rounded
+	result->samples = passes << ADCQ_OVERSAMPLE;
+	result->raw_q = (((uint64_t)window << ADCQ_FRAC_BITS) + result->samples / 2) / result->samples;
+
+	// characteristic is linear between codes, interpolate the fraction
+	raw = result->raw_q >> ADCQ_FRAC_BITS;
+	frac = result->raw_q & ((1 << ADCQ_FRAC_BITS) - 1);
+	mv0 = esp_adc_cal_raw_to_voltage(raw, &adcq_channels[i].cal);
+	mv1 = esp_adc_cal_raw_to_voltage(raw + 1, &adcq_channels[i].cal);
+	result->mv = mv0 + (((mv1 - mv0) * frac + (1 << (ADCQ_FRAC_BITS - 1))) >> ADCQ_FRAC_BITS);
+	return ESP_OK;
+}
@@ -0,0 +1,46 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ADCQ_H_
+#define ADCQ_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "driver/adc.h"
+#include "sdkconfig.h"
+
+// ADC1 acquisition service.
+// Owns ADC1 (12 bit), scans all registered channels in one pass every
+// CONFIG_ADCQ_PERIOD_MS with 2^CONFIG_ADCQ_OVERSAMPLE conversions each, and
+// keeps the mean of the last CONFIG_ADCQ_WINDOW passes. Consumers only read
+// results, none of them touches the ADC configuration.
+
+#define ADCQ_MAX_CHANNELS	4
+#define ADCQ_FRAC_BITS		4		// fraction bits of averaged raw values
+#define ADCQ_VREF_MV		1100	// nominal reference used for the characteristics
+
+// Averaged result of a channel
+typedef struct {
+	uint32_t raw_q;		// raw value, ADCQ_FRAC_BITS fraction bits
+	uint32_t mv;		// calibrated voltage
+	uint32_t samples;	// conversions in the average
+} adcq_result_t;
+
+// Add a channel to the scan, starts the service with the first channel
+esp_err_t adcq_register(adc1_channel_t channel, adc_atten_t atten);
+
+// Latest result of channel, ESP_ERR_INVALID_STATE until the first window is complete
+esp_err_t adcq_read(adc1_channel_t channel, adcq_result_t *result);
+
+#endif
@@ -0,0 +1,109 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "nvs.h"
+
+#include "calib.h"
+
+esp_err_t calib_curve_init(calib_curve_t *curve, const calib_point_t *p, int n){
+	calib_curve_t c;
+	if (n < 2 || n > CALIB_POINTS_MAX) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	// insertion sort by x
+	for (int i = 0; i < n; i++) {
+		int j = i;
+		while (j > 0 && c.p[j - 1].x > p[i].x) {
+			c.p[j] = c.p[j - 1];
+			j--;
+		}
+		c.p[j] = p[i];
+	}
+	for (int i = 0; i < n - 1; i++) {
+		if (c.p[i + 1].x == c.p[i].x) {
+			return ESP_ERR_INVALID_ARG;
+		}
+		c.slope[i] = CALIB_SLOPE(c.p[i].x, c.p[i].y, c.p[i + 1].x, c.p[i + 1].y);
+	}
+	c.n = n;
+	*curve = c;
+	return ESP_OK;
+}
+
+int32_t calib_curve_eval(const calib_curve_t *curve, int32_t x){
+	int i = 0;
+	// segment of x, below the first point the first one
+	while (i < curve->n - 2 && x >= curve->p[i + 1].x) {
+		i++;
+	}
+	return curve->p[i].y + (int32_t)(((int64_t)(x - curve->p[i].x) * curve->slope[i]) >> CALIB_FRAC);
+}
+
+int32_t calib_lut_eval(const int32_t *lut, int n, int32_t x0, int32_t step, int32_t x){
+	int32_t i, f;
+	if (x <= x0) {
+		return lut[0];
+	}
+	i = (x - x0) / step;
+	if (i >= n - 1) {
+		return lut[n - 1];
+	}
+	f = (x - x0) - i * step;
+	return lut[i] + (int32_t)((int64_t)(lut[i + 1] - lut[i]) * f / step);
+}
+
+esp_err_t calib_load(const char *key, void *data, size_t len){
+	nvs_handle h;
+	size_t size = len;
+	esp_err_t err;
+	if ((err = nvs_open(CALIB_NVS_NAMESPACE, NVS_READONLY, &h)) != ESP_OK) {
+		return err;
+	}
+	err = nvs_get_blob(h, key, data, &size);
+	nvs_close(h);
+	// a blob of an older layout is not used
+	if (err == ESP_OK && size != len) {
+		return ESP_ERR_NVS_NOT_FOUND;
+	}
+	return err;
+}
+
+esp_err_t calib_save(const char *key, const void *data, size_t len){
+	nvs_handle h;
+	esp_err_t err;
+	if ((err = nvs_open(CALIB_NVS_NAMESPACE, NVS_READWRITE, &h)) != ESP_OK) {
+		return err;
+	}
+	if ((err = nvs_set_blob(h, key, data, len)) == ESP_OK) {
+		err = nvs_commit(h);
+	}
+	nvs_close(h);
+	return err;
+}
+
+esp_err_t calib_erase(const char *key){
+	nvs_handle h;
+	esp_err_t err;
+	if ((err = nvs_open(CALIB_NVS_NAMESPACE, NVS_READWRITE, &h)) != ESP_OK) {
+		return err;
+	}
+	if ((err = nvs_erase_key(h, key)) == ESP_OK) {
+		err = nvs_commit(h);
+	} else if (err == ESP_ERR_NVS_NOT_FOUND) {
+		err = ESP_OK;
+	}
+	nvs_close(h);
+	return err;
+}
@@ -0,0 +1,63 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef CALIB_H_
+#define CALIB_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Sensor calibration engine.
+// Curves are piecewise linear in fixed point: x and y are integers in the
+// units of the driver (mV, milli pH, ...), each segment keeps its slope with
+// CALIB_FRAC fraction bits, so a conversion is a segment lookup, one multiply
+// and a shift. Default curves and tables are constant expressions, the
+// compiler builds them, only calibrated curves are set up at runtime.
+// Calibration points are kept in NVS, one blob per sensor.
+
+#define CALIB_POINTS_MAX	3
+#define CALIB_FRAC			16
+#define CALIB_NVS_NAMESPACE	"calib"
+
+// Slope between two points, usable in static initializers
+#define CALIB_SLOPE(x0, y0, x1, y1)	((int32_t)(((int64_t)(y1) - (y0)) * (1 << CALIB_FRAC) / ((x1) - (x0))))
+
+typedef struct {
+	int32_t x;
+	int32_t y;
+} calib_point_t;
+
+// Curve through n points sorted by x, slope[i] from p[i] to p[i + 1]
+typedef struct {
+	uint8_t n;
+	calib_point_t p[CALIB_POINTS_MAX];
+	int32_t slope[CALIB_POINTS_MAX - 1];
+} calib_curve_t;
+
+// Build a curve from 2..CALIB_POINTS_MAX points in any order, ESP_ERR_INVALID_ARG if two share x
+esp_err_t calib_curve_init(calib_curve_t *curve, const calib_point_t *p, int n);
+
+// y at x, the outer segments are extrapolated
+int32_t calib_curve_eval(const calib_curve_t *curve, int32_t x);
+
+// Table of n values at x0, x0 + step, ..., linear in between, clamped at the ends
+int32_t calib_lut_eval(const int32_t *lut, int n, int32_t x0, int32_t step, int32_t x);
+
+// Calibration blob of a sensor in NVS, ESP_ERR_NVS_NOT_FOUND if there is none
+esp_err_t calib_load(const char *key, void *data, size_t len);
+esp_err_t calib_save(const char *key, const void *data, size_t len);
+esp_err_t calib_erase(const char *key);
+
+#endif
@@ -12,47 +12,133 @@
     You should have received a copy of the GNU General Public License
      along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include "freertos/FreeRTOS.h"
 #include "esp_system.h"
 #include "driver/gpio.h"
 #include "driver/adc.h"
-#include "esp_adc_cal.h"
+#include "adcq.h"
+#include "calib.h"
+#include "do37.h"
+
+#define DO_NVS_KEY		"do37"
+#define DO_MV_PER_C		35			// probe voltage at saturation rises by this per C
+
+// Default saturation point of the probe: 1600 mV in air saturated water at 25 C
+#define DO_DEF_SAT_MV	1600
+#define DO_DEF_SAT_CC	2500
+
+// Oxygen saturation of fresh water at sea level (ug/l) from 0 to 40 C in steps of 1 C.
+// The table is built by the compiler from the cubic fit of the solubility curve.
+#define DO_CSAT(t)		((int32_t)((14.652 - 0.41022 * (t) + 0.007991 * (t) * (t) \
+							- 0.000077774 * (t) * (t) * (t)) * 1000 + 0.5))
+#define DO_CSAT_N		41
+static const int32_t DO_CSAT_LUT[DO_CSAT_N] = {
+	DO_CSAT(0), DO_CSAT(1), DO_CSAT(2), DO_CSAT(3), DO_CSAT(4),
+	DO_CSAT(5), DO_CSAT(6), DO_CSAT(7), DO_CSAT(8), DO_CSAT(9),
+	DO_CSAT(10), DO_CSAT(11), DO_CSAT(12), DO_CSAT(13), DO_CSAT(14),
+	DO_CSAT(15), DO_CSAT(16), DO_CSAT(17), DO_CSAT(18), DO_CSAT(19),
+	DO_CSAT(20), DO_CSAT(21), DO_CSAT(22), DO_CSAT(23), DO_CSAT(24),
+	DO_CSAT(25), DO_CSAT(26), DO_CSAT(27), DO_CSAT(28), DO_CSAT(29),
+	DO_CSAT(30), DO_CSAT(31), DO_CSAT(32), DO_CSAT(33), DO_CSAT(34),
+	DO_CSAT(35), DO_CSAT(36), DO_CSAT(37), DO_CSAT(38), DO_CSAT(39),
+	DO_CSAT(40),
+};
 
 int DO_CHANNEL;
 int do_init = 0;
-esp_adc_cal_characteristics_t do_characteristics;
+static do37_cal_t do_cal = { DO_DEF_SAT_MV, DO_DEF_SAT_CC };
+static portMUX_TYPE do_lock = portMUX_INITIALIZER_UNLOCKED;
 
-// calibrate voltage to do value
+// Dissolved oxygen (ug/l) at voltage (mV) and temperature (centi C).
+// The reading is the fraction of the probe voltage at saturation, times the
+// saturation concentration at that temperature.
+static int32_t do_convert(int32_t voltage, int32_t temp_cc){
+	int32_t sat_mv, csat;
+	portENTER_CRITICAL(&do_lock);
+	sat_mv = do_cal.sat_mv + DO_MV_PER_C * (temp_cc - do_cal.sat_cc) / 100;
+	portEXIT_CRITICAL(&do_lock);
+	if (sat_mv <= 0) {
+		return 0;
+	}
+	csat = calib_lut_eval(DO_CSAT_LUT, DO_CSAT_N, 0, 100, temp_cc);
+	return (int32_t)((int64_t)voltage * csat / sat_mv);
+}
+
+// calibrate voltage to do value (mg/l) at 25 C
 float do37_calibrate(uint32_t voltage){
-	float val = 0;
-	if (voltage > 0 && voltage < 50){
-		val = 8;
+	return do_convert(voltage, 2500) / 1000.0f;
+}
+
+// calibrate voltage to do value (mg/l), temperature compensated
+float do37_convert(uint32_t voltage, float temp_c){
+	return do_convert(voltage, (int32_t)(temp_c * 100)) / 1000.0f;
+}
+
+// Probe reads voltage in air saturated water at temperature
+esp_err_t do37_cal_saturation(uint32_t voltage, float temp_c){
+	do37_cal_t cal = { voltage, (int32_t)(temp_c * 100) };
+	if (voltage == 0) {
+		return ESP_ERR_INVALID_ARG;
 	}
-	if (voltage >= 50 && voltage < 100){
-		val = 9;
+	portENTER_CRITICAL(&do_lock);
+	do_cal = cal;
+	portEXIT_CRITICAL(&do_lock);
+	return calib_save(DO_NVS_KEY, &cal, sizeof(cal));
+}
+
+// Back to the default saturation point
+esp_err_t do37_cal_reset(void){
+	do37_cal_t cal = { DO_DEF_SAT_MV, DO_DEF_SAT_CC };
+	portENTER_CRITICAL(&do_lock);
+	do_cal = cal;
+	portEXIT_CRITICAL(&do_lock);
+	return calib_erase(DO_NVS_KEY);
+}
+
+// Active saturation point
+void do37_cal_get(do37_cal_t *cal){
+	portENTER_CRITICAL(&do_lock);
+	*cal = do_cal;
+	portEXIT_CRITICAL(&do_lock);
+}
+
+// Averaged sensor voltage from the ADC1 acquisition service
+esp_err_t do37_get_voltage(uint32_t *voltage){
+	adcq_result_t result;
+	esp_err_t err;
+	if(do_init != 1){
+		return ESP_ERR_INVALID_STATE;
 	}
-	if (voltage >= 100){
-		val = 10;
+	if ((err = adcq_read(DO_CHANNEL, &result)) != ESP_OK) {
+		return err;
 	}
-	return val;
+	*voltage = result.mv;
+	return ESP_OK;
 }
 
-// Returns do meter from sensor
+// Returns do meter from sensor, 0 until the first average is available
 float do37_get_meter(void) {
-	if(do_init != 1){
+	uint32_t voltage;
+	if (do37_get_voltage(&voltage) != ESP_OK) {
 		return 0;
 	}
-	//int voltage = adc1_get_raw(DO_CHANNEL);
-	uint32_t voltage = adc1_to_voltage(DO_CHANNEL, &do_characteristics);
 	return do37_calibrate(voltage);
 }
 
-// Use adc1
-void do37_init(uint32_t CHANNEL, uint32_t WIDTH, uint32_t ATTEN_DB){
+// Registers the channel with the ADC1 acquisition service
+esp_err_t do37_init(uint32_t CHANNEL, uint32_t ATTEN_DB){
+	esp_err_t err;
 	DO_CHANNEL = CHANNEL;
-	gpio_pad_select_gpio(DO_CHANNEL);
-	gpio_set_direction(DO_CHANNEL, GPIO_MODE_INPUT);
-	adc1_config_width(WIDTH);
-	adc1_config_channel_atten(DO_CHANNEL, ATTEN_DB);
-	esp_adc_cal_get_characteristics(3300, ATTEN_DB, WIDTH, &do_characteristics);
+	// calibrated saturation point from NVS, else the default one
+	do37_cal_t cal;
+	if (calib_load(DO_NVS_KEY, &cal, sizeof(cal)) == ESP_OK && cal.sat_mv > 0) {
+		portENTER_CRITICAL(&do_lock);
+		do_cal = cal;
+		portEXIT_CRITICAL(&do_lock);
+	}
+	if ((err = adcq_register(DO_CHANNEL, ATTEN_DB)) != ESP_OK) {
+		return err;
+	}
 	do_init = 1;
+	return ESP_OK;
 }
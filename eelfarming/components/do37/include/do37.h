@@ -15,8 +15,22 @@
 #ifndef DO37_H_
 #define DO37_H_
 
+#include <stdint.h>
+#include "esp_err.h"
+
+// Saturation point of the probe
+typedef struct {
+	int32_t sat_mv;		// voltage in air saturated water
+	int32_t sat_cc;		// at this temperature (centi C)
+} do37_cal_t;
+
 float do37_calibrate(uint32_t VOLTAGE);
+float do37_convert(uint32_t VOLTAGE, float TEMP_C);
+esp_err_t do37_cal_saturation(uint32_t VOLTAGE, float TEMP_C);
+esp_err_t do37_cal_reset(void);
+void do37_cal_get(do37_cal_t *CAL);
+esp_err_t do37_get_voltage(uint32_t *voltage);
 float do37_get_meter(void);
-void do37_init(uint32_t CHANNEL, uint32_t WIDTH, uint32_t ATTEN_DB);
+esp_err_t do37_init(uint32_t CHANNEL, uint32_t ATTEN_DB);
 
 #endif
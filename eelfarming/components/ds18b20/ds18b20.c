@@ -12,98 +12,137 @@
     You should have received a copy of the GNU General Public License
      along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-#include "esp_system.h"
-#include "driver/gpio.h"
-#include "rom/ets_sys.h"
+#include <string.h>
 
-int DS_GPIO;
-int ds_init = 0;
+#include "onewire.h"
+#include "ds18b20.h"
 
-/// Sends one bit to bus
-void ds18b20_send(char bit){
-	gpio_set_direction(DS_GPIO, GPIO_MODE_OUTPUT);
-	gpio_set_level(DS_GPIO,0);
-	ets_delay_us(5);
-	if(bit==1)gpio_set_level(DS_GPIO,1);
-	ets_delay_us(80);
-	gpio_set_level(DS_GPIO,1);
-}
-// Reads one bit from bus
-unsigned char ds18b20_read(void){
-	unsigned char PRESENCE=0;
-	gpio_set_direction(DS_GPIO, GPIO_MODE_OUTPUT);
-	gpio_set_level(DS_GPIO,0);
-	ets_delay_us(2);
-	gpio_set_level(DS_GPIO,1);
-	ets_delay_us(15);
-	gpio_set_direction(DS_GPIO, GPIO_MODE_INPUT);
-	if(gpio_get_level(DS_GPIO)==1) PRESENCE=1; else PRESENCE=0;
-	return(PRESENCE);
+#define DS_FAMILY			0x28
+#define DS_MATCH_ROM		0x55
+#define DS_SKIP_ROM			0xCC
+#define DS_CONVERT_T		0x44
+#define DS_WRITE_SCRATCHPAD	0x4E
+#define DS_READ_SCRATCHPAD	0xBE
+#define DS_SCRATCHPAD_L		9
+#define DS_TH				0x4B	// alarm registers, unused, power-on values
+#define DS_TL				0x46
+
+static onewire_bus_t *ds_bus = NULL;
+static uint8_t ds_roms[DS_MAX_DEVICES][ONEWIRE_ROM_L];
+static int ds_count = 0;
+static int ds_bits = 12;
+
+// Reset and address device idx, all devices (SKIP ROM) for idx < 0 or without search
+static esp_err_t ds18b20_select(int idx){
+	bool present;
+	esp_err_t err = onewire_reset(ds_bus, &present);
+	if (err != ESP_OK) {
+		return err;
+	}
+	if (!present) {
+		return ESP_ERR_NOT_FOUND;
+	}
+	if (idx < 0 || ds_count == 0) {
+		return onewire_write_byte(ds_bus, DS_SKIP_ROM);
+	}
+	if ((err = onewire_write_byte(ds_bus, DS_MATCH_ROM)) != ESP_OK) {
+		return err;
+	}
+	return onewire_write_bytes(ds_bus, ds_roms[idx], ONEWIRE_ROM_L);
 }
-// Sends one byte to bus
-void ds18b20_send_byte(char data){
-	unsigned char i;
-	unsigned char x;
-	for(i=0;i<8;i++){
-		x = data>>i;
-		x &= 0x01;
-		ds18b20_send(x);
+
+// Enumerates the probes on the bus, returns their number
+int ds18b20_search(void){
+	if (ds_bus == NULL) {
+		return 0;
 	}
-	ets_delay_us(100);
+	ds_count = onewire_search(ds_bus, DS_FAMILY, ds_roms, DS_MAX_DEVICES);
+	return ds_count;
+}
+
+int ds18b20_count(void){
+	return ds_count;
+}
+
+const uint8_t *ds18b20_rom(int idx){
+	return (idx >= 0 && idx < ds_count) ? ds_roms[idx] : NULL;
 }
-// Reads one byte from bus
-unsigned char ds18b20_read_byte(void){
-	unsigned char i;
-	unsigned char data = 0;
-	for (i=0;i<8;i++){
-		if(ds18b20_read()) data|=0x01<<i;
-			ets_delay_us(15);
+
+// Resolution of all probes, 9..12 bits
+esp_err_t ds18b20_set_resolution(int bits){
+	uint8_t cfg[3] = { DS_TH, DS_TL, 0 };
+	esp_err_t err;
+	if (ds_bus == NULL) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (bits < 9 || bits > 12) {
+		return ESP_ERR_INVALID_ARG;
 	}
-	return(data);
+	// configuration register: R1 R0 in bits 6..5
+	cfg[2] = ((bits - 9) << 5) | 0x1F;
+	if ((err = ds18b20_select(-1)) != ESP_OK
+			|| (err = onewire_write_byte(ds_bus, DS_WRITE_SCRATCHPAD)) != ESP_OK
+			|| (err = onewire_write_bytes(ds_bus, cfg, sizeof(cfg))) != ESP_OK) {
+		return err;
+	}
+	ds_bits = bits;
+	return ESP_OK;
 }
-// Sends reset pulse
-unsigned char ds18b20_RST_PULSE(void){
-	unsigned char PRESENCE;
-	gpio_set_direction(DS_GPIO, GPIO_MODE_OUTPUT);
-	gpio_set_level(DS_GPIO,0);
-	ets_delay_us(500);
-	gpio_set_level(DS_GPIO,1);
-	gpio_set_direction(DS_GPIO, GPIO_MODE_INPUT);
-	ets_delay_us(30);
-	if(gpio_get_level(DS_GPIO)==0) PRESENCE=1; else PRESENCE=0;
-	ets_delay_us(470);
-	if(gpio_get_level(DS_GPIO)==1) PRESENCE=1; else PRESENCE=0;
-	return PRESENCE;
+
+// Conversion time at the configured resolution: 94, 188, 375 or 750 ms
+uint32_t ds18b20_conversion_ms(void){
+	return (DS_CONVERSION_MS + (1 << (12 - ds_bits)) - 1) >> (12 - ds_bits);
 }
-// Returns temperature from sensor
-float ds18b20_get_temp(void) {
-	if(ds_init != 1){
-		return 0;
+
+// Starts a conversion on all probes at once, the results can be read ds18b20_conversion_ms() later
+esp_err_t ds18b20_start_conversion(void){
+	esp_err_t err;
+	if (ds_bus == NULL) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if ((err = ds18b20_select(-1)) != ESP_OK) {
+		return err;
 	}
+	return onewire_write_byte(ds_bus, DS_CONVERT_T);
+}
 
-    unsigned char check;
-    char temp1=0, temp2=0;
-	check=ds18b20_RST_PULSE();
-	if(check ==1 ){
-		ds18b20_send_byte(0xCC);
-		ds18b20_send_byte(0x44);
-		vTaskDelay(750 / portTICK_RATE_MS);
-		check=ds18b20_RST_PULSE();
-		ds18b20_send_byte(0xCC);
-		ds18b20_send_byte(0xBE);
-		temp1=ds18b20_read_byte();
-		temp2=ds18b20_read_byte();
-		check=ds18b20_RST_PULSE();
-		float temp=0;
-		temp=(float)(temp1+(temp2*256))/16;
-		return temp;
+// Reads the result of the last conversion of probe idx, the scratchpad is CRC checked
+esp_err_t ds18b20_read_temp_idx(int idx, float *temp){
+	uint8_t data[DS_SCRATCHPAD_L];
+	esp_err_t err = ESP_ERR_INVALID_CRC;
+	int16_t raw;
+	if (ds_bus == NULL) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (idx < 0 || (ds_count > 0 && idx >= ds_count) || (ds_count == 0 && idx > 0)) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	for (int retry = 0; retry < DS_RETRIES; retry++) {
+		if ((err = ds18b20_select(idx)) != ESP_OK
+				|| (err = onewire_write_byte(ds_bus, DS_READ_SCRATCHPAD)) != ESP_OK
+				|| (err = onewire_read_bytes(ds_bus, data, sizeof(data))) != ESP_OK) {
+			continue;
+		}
+		// an open bus reads all ones, which has no valid CRC either
+		if (onewire_crc8(data, sizeof(data)) != 0) {
+			err = ESP_ERR_INVALID_CRC;
+			continue;
+		}
+		// undefined low bits below 12 bit resolution
+		raw = (int16_t)(data[0] | (data[1] << 8));
+		raw &= ~((1 << (12 - ds_bits)) - 1);
+		*temp = (float)raw / 16;
+		return ESP_OK;
 	}
-	return 0;
+	return err;
 }
-void ds18b20_init(int GPIO){
-	DS_GPIO = GPIO;
-	gpio_pad_select_gpio(DS_GPIO);
-	ds_init = 1;
+
+esp_err_t ds18b20_read_temp(float *temp){
+	return ds18b20_read_temp_idx(0, temp);
+}
+
+void ds18b20_init_bus(onewire_bus_t *bus){
+	ds_bus = bus;
+	ds18b20_search();
+	ds18b20_set_resolution(ds_bits);
 }
@@ -0,0 +1,49 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+
+#include "onewire_rmt.h"
+#include "ds18b20.h"
+
+#define DS_RMT_TX_CHANNEL	RMT_CHANNEL_0
+#define DS_RMT_RX_CHANNEL	RMT_CHANNEL_1
+
+static onewire_rmt_t ds_ow;
+
+// Returns temperature from sensor, blocks for the conversion time, 0 on failure
+float ds18b20_get_temp(void) {
+	float temp;
+	if (ds18b20_start_conversion() != ESP_OK) {
+		return 0;
+	}
+	vTaskDelay(ds18b20_conversion_ms() / portTICK_RATE_MS);
+	if (ds18b20_read_temp(&temp) != ESP_OK) {
+		return 0;
+	}
+	return temp;
+}
+
+// Uses RMT channels DS_RMT_TX_CHANNEL and DS_RMT_RX_CHANNEL, enumerates the probes
+esp_err_t ds18b20_init(int GPIO){
+	esp_err_t err;
+	gpio_pad_select_gpio(GPIO);
+	if ((err = onewire_rmt_init(&ds_ow, GPIO, DS_RMT_TX_CHANNEL, DS_RMT_RX_CHANNEL)) != ESP_OK) {
+		return err;
+	}
+	ds18b20_init_bus(&ds_ow.bus);
+	return ESP_OK;
+}
@@ -15,12 +15,35 @@
 #ifndef DS18B20_H_  
 #define DS18B20_H_
 
-void ds18b20_send(char bit);
-unsigned char ds18b20_read(void);
-void ds18b20_send_byte(char data);
-unsigned char ds18b20_read_byte(void);
-unsigned char ds18b20_RST_PULSE(void);
+#include "esp_err.h"
+#include "onewire.h"
+
+#define DS_CONVERSION_MS	750		// 12 bit conversion time
+#define DS_MAX_DEVICES		8		// probes per bus
+#define DS_RETRIES			3		// reads of a scratchpad with a bad CRC
+
+// Probes found by Search ROM, all probes convert at once and are read by address.
+// Without search (e.g. a single probe with a damaged ROM) the bus is used with SKIP ROM.
+int ds18b20_search(void);
+int ds18b20_count(void);
+const uint8_t *ds18b20_rom(int idx);
+
+// Resolution 9..12 bits, conversion time 94..750 ms
+esp_err_t ds18b20_set_resolution(int bits);
+uint32_t ds18b20_conversion_ms(void);
+
+// Non-blocking use: start the conversion, read it ds18b20_conversion_ms() later
+esp_err_t ds18b20_start_conversion(void);
+esp_err_t ds18b20_read_temp_idx(int idx, float *temp);
+esp_err_t ds18b20_read_temp(float *temp);
+
+// Blocking read, sleeps for the conversion time (ds18b20_rmt.c)
 float ds18b20_get_temp(void);
-void ds18b20_init(int GPIO);
+
+// Bus on RMT channels 0 and 1 (ds18b20_rmt.c)
+esp_err_t ds18b20_init(int GPIO);
+
+// Use another 1-Wire backend instead of RMT, needs no ESP-IDF driver
+void ds18b20_init_bus(onewire_bus_t *bus);
 
 #endif
@@ -0,0 +1,45 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ONEWIRE_H_
+#define ONEWIRE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// 1-Wire bus, the device drivers only talk to these operations.
+// Any backend (RMT, or a bus model on a host) provides them.
+typedef struct onewire_bus onewire_bus_t;
+struct onewire_bus {
+	// Reset pulse, present is set if a device answered
+	esp_err_t (*reset)(onewire_bus_t *bus, bool *present);
+	// Write n (1..8) bits of out LSB first, if in is not NULL the bus is sampled in the same slots
+	esp_err_t (*xfer_bits)(onewire_bus_t *bus, uint8_t out, int n, uint8_t *in);
+};
+
+esp_err_t onewire_reset(onewire_bus_t *bus, bool *present);
+esp_err_t onewire_write_byte(onewire_bus_t *bus, uint8_t data);
+esp_err_t onewire_write_bytes(onewire_bus_t *bus, const uint8_t *data, int len);
+esp_err_t onewire_read_bytes(onewire_bus_t *bus, uint8_t *data, int len);
+
+#define ONEWIRE_ROM_L	8
+
+// Dallas/Maxim CRC8 (x^8 + x^5 + x^4 + 1), 0 over data including its CRC byte
+uint8_t onewire_crc8(const uint8_t *data, int len);
+
+// Search ROM, stores up to max ROM codes of the given family (0 for all), returns the number found
+int onewire_search(onewire_bus_t *bus, uint8_t family, uint8_t roms[][ONEWIRE_ROM_L], int max);
+
+#endif
@@ -0,0 +1,32 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ONEWIRE_RMT_H_
+#define ONEWIRE_RMT_H_
+
+#include "driver/rmt.h"
+#include "onewire.h"
+
+// RMT backend: TX and RX channel share one open drain GPIO.
+// The slots are timed by the peripheral, the calling task sleeps while a transfer is on the bus.
+typedef struct {
+	onewire_bus_t bus;
+	rmt_channel_t tx;
+	rmt_channel_t rx;
+	RingbufHandle_t rb;
+} onewire_rmt_t;
+
+esp_err_t onewire_rmt_init(onewire_rmt_t *ow, int gpio, rmt_channel_t tx, rmt_channel_t rx);
+
+#endif
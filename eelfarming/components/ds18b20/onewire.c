@@ -0,0 +1,115 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+
+#include "onewire.h"
+
+esp_err_t onewire_reset(onewire_bus_t *bus, bool *present){
+	return bus->reset(bus, present);
+}
+
+esp_err_t onewire_write_byte(onewire_bus_t *bus, uint8_t data){
+	return bus->xfer_bits(bus, data, 8, NULL);
+}
+
+esp_err_t onewire_write_bytes(onewire_bus_t *bus, const uint8_t *data, int len){
+	for (int i = 0; i < len; i++) {
+		esp_err_t err = bus->xfer_bits(bus, data[i], 8, NULL);
+		if (err != ESP_OK) {
+			return err;
+		}
+	}
+	return ESP_OK;
+}
+
+esp_err_t onewire_read_bytes(onewire_bus_t *bus, uint8_t *data, int len){
+	// read slots are write 1 slots, the device holds the line low for a 0
+	for (int i = 0; i < len; i++) {
+		esp_err_t err = bus->xfer_bits(bus, 0xFF, 8, &data[i]);
+		if (err != ESP_OK) {
+			return err;
+		}
+	}
+	return ESP_OK;
+}
+
+#define OW_SEARCH_ROM	0xF0
+
+uint8_t onewire_crc8(const uint8_t *data, int len){
+	uint8_t crc = 0;
+	for (int i = 0; i < len; i++) {
+		uint8_t b = data[i];
+		for (int j = 0; j < 8; j++) {
+			uint8_t mix = (crc ^ b) & 0x01;
+			crc >>= 1;
+			if (mix) {
+				crc ^= 0x8C;
+			}
+			b >>= 1;
+		}
+	}
+	return crc;
+}
+
+int onewire_search(onewire_bus_t *bus, uint8_t family, uint8_t roms[][ONEWIRE_ROM_L], int max){
+	uint8_t rom[ONEWIRE_ROM_L] = { 0 };
+	int last_discrepancy = -1;
+	int found = 0;
+	bool present;
+
+	do {
+		int discrepancy = -1;
+		if (onewire_reset(bus, &present) != ESP_OK || !present
+				|| onewire_write_byte(bus, OW_SEARCH_ROM) != ESP_OK) {
+			break;
+		}
+		// per bit: all devices send the bit and its complement, then we pick the branch
+		for (int i = 0; i < ONEWIRE_ROM_L * 8; i++) {
+			uint8_t in, dir;
+			uint8_t mask = 1 << (i & 7);
+			if (bus->xfer_bits(bus, 0x03, 2, &in) != ESP_OK || (in & 0x03) == 0x03) {
+				// no device answered
+				return found;
+			}
+			if (in == 0x00) {
+				// both values present, take the 1 branch at the last discrepancy, 0 before new ones
+				if (i < last_discrepancy) {
+					dir = (rom[i >> 3] & mask) ? 1 : 0;
+				} else {
+					dir = (i == last_discrepancy);
+				}
+				if (!dir) {
+					discrepancy = i;
+				}
+			} else {
+				dir = in & 0x01;
+			}
+			if (dir) {
+				rom[i >> 3] |= mask;
+			} else {
+				rom[i >> 3] &= ~mask;
+			}
+			if (bus->xfer_bits(bus, dir, 1, NULL) != ESP_OK) {
+				return found;
+			}
+		}
+		last_discrepancy = discrepancy;
+
+		if (onewire_crc8(rom, ONEWIRE_ROM_L) == 0 && (family == 0 || rom[0] == family)) {
+			memcpy(roms[found++], rom, ONEWIRE_ROM_L);
+		}
+	} while (last_discrepancy >= 0 && found < max);
+	return found;
+}
@@ -0,0 +1,158 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "freertos/FreeRTOS.h"
+#include "freertos/ringbuf.h"
+#include "driver/gpio.h"
+#include "driver/rmt.h"
+#include "soc/gpio_struct.h"
+
+#include "onewire_rmt.h"
+
+// Slot timing in us (RMT runs at 1 MHz)
+#define OW_RESET		480
+#define OW_SLOT			75
+#define OW_1_LOW		2
+#define OW_0_LOW		65
+#define OW_RECOVERY		5
+#define OW_SAMPLE		15		// a device pulls a 0 bit low past the sample point
+#define OW_RX_IDLE		(OW_SLOT + OW_RECOVERY + 2)
+#define OW_RX_TIMEOUT	(20 / portTICK_PERIOD_MS)
+
+// Drop anything left in the RX ring buffer
+static void ow_rmt_flush(onewire_rmt_t *ow){
+	size_t size;
+	void *p;
+	while ((p = xRingbufferReceive(ow->rb, &size, 0)) != NULL) {
+		vRingbufferReturnItem(ow->rb, p);
+	}
+}
+
+static esp_err_t ow_rmt_reset(onewire_bus_t *bus, bool *present){
+	onewire_rmt_t *ow = (onewire_rmt_t *)bus;
+	// reset pulse, then the bus is released for the presence pulses (480 us at most)
+	rmt_item32_t tx[2] = {
+		{ .level0 = 0, .duration0 = OW_RESET, .level1 = 1, .duration1 = OW_RESET },
+		{ .val = 0 },
+	};
+	rmt_item32_t *rx;
+	size_t size;
+
+	*present = false;
+	ow_rmt_flush(ow);
+	rmt_rx_start(ow->rx, true);
+	rmt_write_items(ow->tx, tx, 2, true);
+
+	rx = (rmt_item32_t *)xRingbufferReceive(ow->rb, &size, OW_RX_TIMEOUT);
+	rmt_rx_stop(ow->rx);
+	if (rx == NULL) {
+		return ESP_ERR_TIMEOUT;
+	}
+	if (size >= 2 * sizeof(rmt_item32_t) && rx[0].level0 == 0 && rx[0].duration0 >= OW_RESET - 2
+			&& rx[0].level1 == 1 && rx[0].duration1 > 0 && rx[1].level0 == 0) {
+		*present = true;
+	}
+	vRingbufferReturnItem(ow->rb, rx);
+	return ESP_OK;
+}
+
+static esp_err_t ow_rmt_xfer_bits(onewire_bus_t *bus, uint8_t out, int n, uint8_t *in){
+	onewire_rmt_t *ow = (onewire_rmt_t *)bus;
+	rmt_item32_t tx[8 + 1];
+	rmt_item32_t *rx;
+	size_t size;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		int low = (out & (1 << i)) ? OW_1_LOW : OW_0_LOW;
+		tx[i].level0 = 0;
+		tx[i].duration0 = low;
+		tx[i].level1 = 1;
+		tx[i].duration1 = OW_SLOT - low + OW_RECOVERY;
+	}
+	// end marker
+	tx[n].val = 0;
+
+	if (in == NULL) {
+		return rmt_write_items(ow->tx, tx, n + 1, true);
+	}
+
+	ow_rmt_flush(ow);
+	rmt_rx_start(ow->rx, true);
+	rmt_write_items(ow->tx, tx, n + 1, true);
+	rx = (rmt_item32_t *)xRingbufferReceive(ow->rb, &size, OW_RX_TIMEOUT);
+	rmt_rx_stop(ow->rx);
+	if (rx == NULL) {
+		return ESP_ERR_TIMEOUT;
+	}
+
+	// a short low pulse is a 1, a device stretching it past the sample point a 0
+	*in = 0;
+	for (i = 0; i < n && (i + 1) * sizeof(rmt_item32_t) <= size; i++) {
+		if (rx[i].level0 == 0 && rx[i].duration0 < OW_SAMPLE) {
+			*in |= 1 << i;
+		}
+	}
+	vRingbufferReturnItem(ow->rb, rx);
+	return (i == n) ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+}
+
+esp_err_t onewire_rmt_init(onewire_rmt_t *ow, int gpio, rmt_channel_t tx, rmt_channel_t rx){
+	rmt_config_t cfg_tx = {
+		.rmt_mode = RMT_MODE_TX,
+		.channel = tx,
+		.gpio_num = gpio,
+		.clk_div = 80,
+		.mem_block_num = 1,
+		.tx_config = {
+			.loop_en = false,
+			.carrier_en = false,
+			.idle_level = RMT_IDLE_LEVEL_HIGH,
+			.idle_output_en = true,
+		},
+	};
+	rmt_config_t cfg_rx = {
+		.rmt_mode = RMT_MODE_RX,
+		.channel = rx,
+		.gpio_num = gpio,
+		.clk_div = 80,
+		.mem_block_num = 1,
+		.rx_config = {
+			.filter_en = true,
+			.filter_ticks_thresh = 30,
+			.idle_threshold = OW_RX_IDLE,
+		},
+	};
+	esp_err_t err;
+
+	ow->bus.reset = ow_rmt_reset;
+	ow->bus.xfer_bits = ow_rmt_xfer_bits;
+	ow->tx = tx;
+	ow->rx = rx;
+
+	if ((err = rmt_config(&cfg_tx)) != ESP_OK
+			|| (err = rmt_driver_install(tx, 0, 0)) != ESP_OK
+			|| (err = rmt_config(&cfg_rx)) != ESP_OK
+			|| (err = rmt_driver_install(rx, 512, 0)) != ESP_OK
+			|| (err = rmt_get_ringbuf_handle(rx, &ow->rb)) != ESP_OK) {
+		return err;
+	}
+
+	// both channels on the pin, input path enabled, open drain output
+	rmt_set_pin(tx, RMT_MODE_TX, gpio);
+	rmt_set_pin(rx, RMT_MODE_RX, gpio);
+	PIN_INPUT_ENABLE(GPIO_PIN_MUX_REG[gpio]);
+	GPIO.pin[gpio].pad_driver = 1;
+	return ESP_OK;
+}
@@ -0,0 +1,380 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "flog.h"
+
+#define FLOG_MAGIC		0x474F4C46		// "FLOG"
+#define FLOG_PAD		0x00			// record length of the padding
+#define FLOG_ERASED		0xFF
+
+// First bytes of the header page of a segment
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;
+	uint16_t crc;
+	uint16_t reserved;
+} flog_seg_hdr_t;
+
+// CRC-16/CCITT-FALSE
+static uint16_t flog_crc16(uint16_t crc, const uint8_t *data, size_t len){
+	for (size_t i = 0; i < len; i++) {
+		crc ^= (uint16_t)data[i] << 8;
+		for (int j = 0; j < 8; j++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+static size_t flog_addr(int seg, int page){
+	return (size_t)seg * FLOG_SEGMENT_L + (size_t)page * FLOG_PAGE_L;
+}
+
+// Sequence number of a valid segment, false if its header is erased or torn
+static bool flog_seg_seq(flog_t *log, int seg, uint32_t *seq){
+	flog_seg_hdr_t hdr;
+	if (log->flash->read(log->flash, flog_addr(seg, 0), &hdr, sizeof(hdr)) != ESP_OK
+			|| hdr.magic != FLOG_MAGIC
+			|| hdr.crc != flog_crc16(0xFFFF, (const uint8_t *)&hdr, offsetof(flog_seg_hdr_t, crc))) {
+		return false;
+	}
+	*seq = hdr.seq;
+	return true;
+}
+
+static bool flog_page_erased(const uint8_t *page){
+	for (int i = 0; i < FLOG_PAGE_L; i++) {
+		if (page[i] != FLOG_ERASED) {
+			return false;
+		}
+	}
+	return true;
+}
+
+esp_err_t flog_open(flog_t *log, flog_flash_t *flash){
+	int64_t start = esp_timer_get_time();
+	uint8_t page[FLOG_PAGE_L];
+	uint32_t seq;
+
+	memset(log, 0, sizeof(*log));
+	vPortCPUInitializeMutex(&log->lock);
+	log->flash = flash;
+	log->segments = flash->size / FLOG_SEGMENT_L;
+	log->seg = -1;
+	if (log->segments < 2) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	// the newest segment has the highest sequence number
+	for (int s = 0; s < log->segments; s++) {
+		if (flog_seg_seq(log, s, &seq) && (log->seg < 0 || (int32_t)(seq - log->seq) > 0)) {
+			log->seg = s;
+			log->seq = seq;
+		}
+	}
+	// the log continues at its first erased page, a torn page is left as it is
+	if (log->seg >= 0) {
+		log->page = FLOG_SEG_PAGES;
+		for (int p = FLOG_SEG_PAGES - 1; p > 0; p--) {
+			if (flash->read(flash, flog_addr(log->seg, p), page, FLOG_PAGE_L) != ESP_OK
+					|| !flog_page_erased(page)) {
+				break;
+			}
+			log->page = p;
+		}
+	}
+	log->stats.recovery_us = esp_timer_get_time() - start;
+	return ESP_OK;
+}
+
+esp_err_t flog_append(flog_t *log, uint8_t type, const void *data, size_t len){
+	uint8_t hdr[FLOG_REC_HDR];
+	uint16_t crc;
+	uint8_t *p;
+
+	if (len == 0 || len > FLOG_REC_MAX) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	// the CRC covers length, type and payload
+	hdr[0] = len;
+	hdr[1] = type;
+	crc = flog_crc16(flog_crc16(0xFFFF, hdr, 2), data, len);
+	hdr[2] = crc & 0xFF;
+	hdr[3] = crc >> 8;
+
+	portENTER_CRITICAL(&log->lock);
+	if (log->used[log->head] + FLOG_REC_HDR + len > FLOG_PAGE_L) {
+		// page is full, the next one needs to be free
+		if (log->full + 1 >= FLOG_BUF_PAGES) {
+			log->stats.dropped++;
+			portEXIT_CRITICAL(&log->lock);
+			return ESP_ERR_NO_MEM;
+		}
+		memset(&log->buf[log->head][log->used[log->head]], FLOG_PAD, FLOG_PAGE_L - log->used[log->head]);
+		log->head = (log->head + 1) % FLOG_BUF_PAGES;
+		log->used[log->head] = 0;
+		log->full++;
+		if (log->writer != NULL) {
+			xTaskNotifyGive(log->writer);
+		}
+	}
+	p = &log->buf[log->head][log->used[log->head]];
+	memcpy(p, hdr, FLOG_REC_HDR);
+	memcpy(p + FLOG_REC_HDR, data, len);
+	log->used[log->head] += FLOG_REC_HDR + len;
+	log->stats.records++;
+	log->stats.payload += FLOG_REC_HDR + len;
+	portEXIT_CRITICAL(&log->lock);
+	return ESP_OK;
+}
+
+// Erase one sector of seg
+static esp_err_t flog_erase_sector(flog_t *log, int seg, int sector){
+	int64_t start = esp_timer_get_time();
+	esp_err_t err = log->flash->erase(log->flash, flog_addr(seg, 0) + (size_t)sector * FLOG_SECTOR_L, FLOG_SECTOR_L);
+	uint32_t us = esp_timer_get_time() - start;
+
+	if (us > log->stats.stall_max_us) {
+		log->stats.stall_max_us = us;
+	}
+	return err;
+}
+
+// Erase what is left of the next segment, the oldest one, and write its header
+static esp_err_t flog_next_segment(flog_t *log){
+	flog_seg_hdr_t hdr = { .magic = FLOG_MAGIC, .reserved = 0xFFFF };
+	int seg = (log->seg + 1) % log->segments;
+	esp_err_t err;
+
+	hdr.seq = log->seq + 1;
+	hdr.crc = flog_crc16(0xFFFF, (const uint8_t *)&hdr, offsetof(flog_seg_hdr_t, crc));
+	for (; log->erased < FLOG_SEG_SECTORS; log->erased++) {
+		if ((err = flog_erase_sector(log, seg, log->erased)) != ESP_OK) {
+			return err;
+		}
+		log->stats.late++;
+	}
+	log->stats.erases++;
+	if ((err = log->flash->write(log->flash, flog_addr(seg, 0), &hdr, sizeof(hdr))) != ESP_OK) {
+		return err;
+	}
+	log->stats.pages++;
+	portENTER_CRITICAL(&log->lock);
+	log->seg = seg;
+	log->seq = hdr.seq;
+	log->page = 1;
+	log->erased = 0;
+	portEXIT_CRITICAL(&log->lock);
+	return ESP_OK;
+}
+
+// One sector of the next segment if it was asked for and the window is still open.
+// The header sector goes first, readers drop the segment from then on.
+static void flog_erase_step(flog_t *log){
+	int64_t until;
+
+	portENTER_CRITICAL(&log->lock);
+	until = log->erase_until;
+	log->erase_until = 0;
+	portEXIT_CRITICAL(&log->lock);
+	if (until == 0 || esp_timer_get_time() > until || log->erased >= FLOG_SEG_SECTORS) {
+		return;
+	}
+	if (flog_erase_sector(log, (log->seg + 1) % log->segments, log->erased) != ESP_OK) {
+		log->stats.errors++;
+		return;
+	}
+	log->erased++;
+	log->stats.ahead++;
+}
+
+void flog_erase_ahead(flog_t *log, uint32_t window_ms){
+	portENTER_CRITICAL(&log->lock);
+	log->erase_until = esp_timer_get_time() + (int64_t)window_ms * 1000;
+	portEXIT_CRITICAL(&log->lock);
+	if (log->writer != NULL) {
+		xTaskNotifyGive(log->writer);
+	}
+}
+
+int flog_flush(flog_t *log, bool partial){
+	int written = 0;
+
+	portENTER_CRITICAL(&log->lock);
+	// the page being filled is padded and queued as well
+	if (partial && log->used[log->head] > 0 && log->full + 1 < FLOG_BUF_PAGES) {
+		memset(&log->buf[log->head][log->used[log->head]], FLOG_PAD, FLOG_PAGE_L - log->used[log->head]);
+		log->head = (log->head + 1) % FLOG_BUF_PAGES;
+		log->used[log->head] = 0;
+		log->full++;
+	}
+	portEXIT_CRITICAL(&log->lock);
+
+	// appends never touch queued pages, they are written without the lock
+	while (log->full > 0) {
+		if (log->seg < 0 || log->page >= FLOG_SEG_PAGES) {
+			if (flog_next_segment(log) != ESP_OK) {
+				log->stats.errors++;
+				break;
+			}
+		}
+		if (log->flash->write(log->flash, flog_addr(log->seg, log->page), log->buf[log->tail], FLOG_PAGE_L) != ESP_OK) {
+			// the page is skipped, its flash is not erased anymore
+			log->stats.errors++;
+		}
+		log->stats.pages++;
+		written++;
+		portENTER_CRITICAL(&log->lock);
+		log->page++;
+		log->tail = (log->tail + 1) % FLOG_BUF_PAGES;
+		log->full--;
+		portEXIT_CRITICAL(&log->lock);
+	}
+	flog_erase_step(log);
+	return written;
+}
+
+static void flog_task(void *pvParameters){
+	flog_t *log = (flog_t *)pvParameters;
+	TickType_t flushed = xTaskGetTickCount();
+	const TickType_t interval = CONFIG_FLOG_FLUSH_S * 1000 / portTICK_PERIOD_MS;
+
+	while (1) {
+		TickType_t now = xTaskGetTickCount();
+		TickType_t wait = (now - flushed < interval) ? interval - (now - flushed) : 0;
+		ulTaskNotifyTake(pdTRUE, wait);
+		now = xTaskGetTickCount();
+		if (now - flushed >= interval) {
+			flog_flush(log, true);
+			flushed = now;
+		} else {
+			flog_flush(log, false);
+		}
+	}
+}
+
+void flog_start(flog_t *log, uint32_t stack, int priority, int core){
+	xTaskCreatePinnedToCore(&flog_task, "flog", stack, log, priority, &log->writer, core);
+}
+
+// Oldest valid segment, -1 if there is none
+static int flog_oldest(flog_t *log, uint32_t *oldest){
+	int found = -1;
+	uint32_t seq;
+	for (int s = 0; s < log->segments; s++) {
+		if (flog_seg_seq(log, s, &seq) && (found < 0 || (int32_t)(seq - *oldest) < 0)) {
+			found = s;
+			*oldest = seq;
+		}
+	}
+	return found;
+}
+
+int flog_read(flog_t *log, flog_cursor_t *c, uint8_t *type, void *data, size_t max){
+	uint32_t seq;
+
+	while (1) {
+		int seg, page;
+		portENTER_CRITICAL(&log->lock);
+		seg = log->seg;
+		page = log->page;
+		portEXIT_CRITICAL(&log->lock);
+		if (seg < 0) {
+			return 0;
+		}
+		// start at the oldest segment, again if the one being read was reused
+		if (c->seg < 0 || !flog_seg_seq(log, c->seg, &seq) || seq != c->seq) {
+			if ((c->seg = flog_oldest(log, &c->seq)) < 0) {
+				return 0;
+			}
+			c->page = 1;
+			c->off = 0;
+			c->loaded = false;
+		}
+		if (c->page >= FLOG_SEG_PAGES) {
+			// segment done, the next one follows in sequence
+			if (c->seg == seg) {
+				return 0;
+			}
+			c->seg = (c->seg + 1) % log->segments;
+			c->seq++;
+			c->page = 1;
+			c->off = 0;
+			c->loaded = false;
+			continue;
+		}
+		if (c->seg == seg && c->page >= page) {
+			return 0;
+		}
+		if (!c->loaded) {
+			if (log->flash->read(log->flash, flog_addr(c->seg, c->page), c->buf, FLOG_PAGE_L) != ESP_OK) {
+				return 0;
+			}
+			c->loaded = true;
+		}
+		// records up to the padding, an erased or torn record ends the page
+		if (c->off + FLOG_REC_HDR <= FLOG_PAGE_L) {
+			const uint8_t *r = &c->buf[c->off];
+			uint8_t len = r[0];
+			if (len != FLOG_PAD && len != FLOG_ERASED && c->off + FLOG_REC_HDR + len <= FLOG_PAGE_L
+					&& (r[2] | r[3] << 8) == flog_crc16(flog_crc16(0xFFFF, r, 2), r + FLOG_REC_HDR, len)) {
+				c->off += FLOG_REC_HDR + len;
+				if (len > max) {
+					continue;
+				}
+				*type = r[1];
+				memcpy(data, r + FLOG_REC_HDR, len);
+				return len;
+			}
+		}
+		c->page++;
+		c->off = 0;
+		c->loaded = false;
+	}
+}
+
+void flog_stats(flog_t *log, flog_stats_t *stats){
+	portENTER_CRITICAL(&log->lock);
+	*stats = log->stats;
+	portEXIT_CRITICAL(&log->lock);
+}
+
+static esp_err_t flog_part_read(flog_flash_t *flash, size_t addr, void *data, size_t len){
+	return esp_partition_read(((flog_partition_t *)flash)->part, addr, data, len);
+}
+
+static esp_err_t flog_part_write(flog_flash_t *flash, size_t addr, const void *data, size_t len){
+	return esp_partition_write(((flog_partition_t *)flash)->part, addr, data, len);
+}
+
+static esp_err_t flog_part_erase(flog_flash_t *flash, size_t addr, size_t len){
+	return esp_partition_erase_range(((flog_partition_t *)flash)->part, addr, len);
+}
+
+esp_err_t flog_partition_init(flog_partition_t *p, const char *label){
+	p->part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+	if (p->part == NULL) {
+		return ESP_ERR_NOT_FOUND;
+	}
+	p->flash.size = p->part->size;
+	p->flash.read = flog_part_read;
+	p->flash.write = flog_part_write;
+	p->flash.erase = flog_part_erase;
+	return ESP_OK;
+}
@@ -0,0 +1,132 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FLOG_H_
+#define FLOG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "sdkconfig.h"
+
+// Append-only record log in flash.
+// The flash is divided into segments, each one starts with a header page
+// holding a magic and a sequence number, the other pages hold records. A
+// record never spans pages: length, type, CRC16 and the payload, a zero
+// length pads the rest of the page. Appends only copy the record into a
+// ring of page buffers in RAM, a writer task programs every page once as
+// a whole. When the flash is full the oldest segment is erased and reused.
+// At boot only the segment headers and the pages of the newest segment are
+// read to find the end of the log.
+//
+// An erase turns the flash cache off on both cores for about 45 ms per 4 KB
+// sector (up to a few hundred ms), code outside IRAM waits meanwhile. The
+// next segment is therefore erased ahead, one sector per flog_erase_ahead()
+// request, at a time the caller chose. Only sectors still left when the
+// segment is needed are erased by the writer on its own.
+
+#define FLOG_PAGE_L			256
+#define FLOG_SEGMENT_L		16384
+#define FLOG_SEG_PAGES		(FLOG_SEGMENT_L / FLOG_PAGE_L)
+#define FLOG_SECTOR_L		4096			// erase unit
+#define FLOG_SEG_SECTORS	(FLOG_SEGMENT_L / FLOG_SECTOR_L)
+#define FLOG_REC_HDR		4
+#define FLOG_REC_MAX		(FLOG_PAGE_L - FLOG_REC_HDR)	// longest payload
+#define FLOG_BUF_PAGES		CONFIG_FLOG_BUF_PAGES
+
+// Flash the log lives in, any backend (a partition, or an emulator on a host) provides these
+typedef struct flog_flash flog_flash_t;
+struct flog_flash {
+	size_t size;
+	esp_err_t (*read)(flog_flash_t *flash, size_t addr, void *data, size_t len);
+	esp_err_t (*write)(flog_flash_t *flash, size_t addr, const void *data, size_t len);
+	esp_err_t (*erase)(flog_flash_t *flash, size_t addr, size_t len);
+};
+
+// Partition backend
+typedef struct {
+	flog_flash_t flash;
+	const esp_partition_t *part;
+} flog_partition_t;
+
+esp_err_t flog_partition_init(flog_partition_t *p, const char *label);
+
+typedef struct {
+	uint32_t records;		// records appended
+	uint32_t dropped;		// records lost because the RAM pages were full
+	uint32_t payload;		// bytes appended, headers included
+	uint32_t pages;			// pages programmed, segment headers included
+	uint32_t erases;		// segments erased
+	uint32_t ahead;			// sectors erased ahead on request
+	uint32_t late;			// sectors erased when the segment was needed
+	uint32_t stall_max_us;	// longest sector erase, the flash cache is off meanwhile
+	uint32_t errors;		// flash operations failed
+	uint32_t recovery_us;	// time flog_open took
+} flog_stats_t;
+
+typedef struct {
+	flog_flash_t *flash;
+	int segments;
+	int seg;				// segment being written, -1 before the first one
+	uint32_t seq;			// its sequence number
+	int page;				// next page of it
+	int erased;				// sectors of the next segment erased ahead
+	int64_t erase_until;	// an erase ahead may start until then, 0 if none was asked for
+	uint8_t buf[FLOG_BUF_PAGES][FLOG_PAGE_L];
+	uint16_t used[FLOG_BUF_PAGES];
+	int head;				// page being filled
+	int tail;				// oldest page not written
+	int full;				// pages waiting for the writer
+	portMUX_TYPE lock;
+	TaskHandle_t writer;
+	flog_stats_t stats;
+} flog_t;
+
+// Position of a reader
+typedef struct {
+	int seg;				// -1 to start at the oldest record
+	uint32_t seq;
+	int page;
+	int off;
+	bool loaded;
+	uint8_t buf[FLOG_PAGE_L];
+} flog_cursor_t;
+
+// Find the end of the log on flash
+esp_err_t flog_open(flog_t *log, flog_flash_t *flash);
+
+// Queue a record, never blocks, ESP_ERR_NO_MEM if the RAM pages are full
+esp_err_t flog_append(flog_t *log, uint8_t type, const void *data, size_t len);
+
+// Write the full pages, with partial also the page being filled, returns the pages written.
+// Then erases a sector ahead if flog_erase_ahead() asked for it.
+int flog_flush(flog_t *log, bool partial);
+
+// Ask the writer to erase one sector of the next segment, if it gets to it within window_ms.
+// Call it when a flash stall does not hurt, e.g. between sensor acquisitions.
+void flog_erase_ahead(flog_t *log, uint32_t window_ms);
+
+// Writer task, flushes full pages at once and a partial page every CONFIG_FLOG_FLUSH_S
+void flog_start(flog_t *log, uint32_t stack, int priority, int core);
+
+// Next record after cursor, returns its length, 0 at the end of what is written
+int flog_read(flog_t *log, flog_cursor_t *cursor, uint8_t *type, void *data, size_t max);
+
+void flog_stats(flog_t *log, flog_stats_t *stats);
+
+#endif
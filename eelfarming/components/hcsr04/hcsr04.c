@@ -12,50 +12,125 @@
     You should have received a copy of the GNU General Public License
      along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
-#include "sys/time.h"
+#include "rom/ets_sys.h"
+
+#include "hcsr04.h"
 
 int TRIGGER;
 int ECHO;
 int hc_init = 0;
-struct timeval tv = { .tv_sec = 0, .tv_usec = 0 };
 
-// Returns temperature from sensor
-float hcsr04_get_distance(void) {
-	if(hc_init != 1){
-		return 0;
+// Echo edges, timestamped by the interrupt
+static volatile int64_t hc_rise = 0;
+static volatile int64_t hc_fall = 0;
+
+// Burst in progress, valid echoes sorted
+static uint32_t hc_echo[HC_BURST];
+static int hc_pings = 0;
+static int hc_echoes = 0;
+
+static void IRAM_ATTR hcsr04_echo_isr(void *arg){
+	int64_t now = esp_timer_get_time();
+	if (gpio_get_level(ECHO)) {
+		hc_rise = now;
+	} else if (hc_rise != 0 && hc_fall == 0) {
+		hc_fall = now;
 	}
-	int has_echo = 0;
+}
+
+// Speed of sound in air in cm/us at temp_c (331.3 m/s + 0.606 m/s per degree)
+static float hcsr04_speed(float temp_c){
+	return (331.3f + 0.606f * temp_c) * 1e-4f;
+}
+
+// Trigger a ping, the interrupt timestamps its echo
+static void hcsr04_trigger(void){
+	hc_rise = 0;
+	hc_fall = 0;
 	gpio_set_level(TRIGGER, 1);
-	ets_delay_us(100);
+	ets_delay_us(HC_TRIGGER_US);
 	gpio_set_level(TRIGGER, 0);
-	gettimeofday(&tv, NULL);
-	uint32_t startTime = tv.tv_usec;
-	// Wait for echo to go high and THEN start the time
-	while (gpio_get_level(ECHO) == 0 && gettimeofday(&tv, NULL) && (tv.tv_usec - startTime) < 500 * 1000) {
-		// Do nothing;
-	}
-	gettimeofday(&tv, NULL);
-	startTime = tv.tv_usec;
-	while (gpio_get_level(ECHO) == 1 && gettimeofday(&tv, NULL) && (tv.tv_usec - startTime) < 500 * 1000) {
-		has_echo = 1;
-	}
-	if (gpio_get_level(ECHO) == 0 && has_echo == 1) {
-		gettimeofday(&tv, NULL);
-		uint32_t diff = tv.tv_usec - startTime; // Diff time in uSecs
-		// Distance is TimeEchoInSeconds * SpeedOfSound / 2
-		float distance  = 340.29 * diff / (1000 * 1000 * 2); // Distance in meters
-		return distance * 100;
+	hc_pings++;
+}
+
+esp_err_t hcsr04_burst_start(void){
+	if(hc_init != 1){
+		return ESP_ERR_INVALID_STATE;
+	}
+	hc_pings = 0;
+	hc_echoes = 0;
+	hcsr04_trigger();
+	return ESP_OK;
+}
+
+int hcsr04_burst_step(void){
+	uint32_t e = 0;
+	// the echo of the last ping is complete HC_CYCLE_MS after its trigger
+	if (hc_fall != 0) {
+		e = (uint32_t)(hc_fall - hc_rise);
+	}
+	// insertion sort of the valid echoes
+	if (e != 0 && e <= HC_MAX_ECHO_US) {
+		int j = hc_echoes++;
+		for (; j > 0 && hc_echo[j - 1] > e; j--) {
+			hc_echo[j] = hc_echo[j - 1];
+		}
+		hc_echo[j] = e;
+	}
+	if (hc_pings < HC_BURST) {
+		hcsr04_trigger();
+		return 1;
 	}
 	return 0;
 }
+
+esp_err_t hcsr04_burst_result(float temp_c, float *distance_cm){
+	// most pings lost, no stable reading
+	if (hc_echoes <= HC_BURST / 2) {
+		return ESP_ERR_TIMEOUT;
+	}
+	// distance is echo time * speed of sound / 2
+	*distance_cm = hc_echo[hc_echoes / 2] * hcsr04_speed(temp_c) / 2;
+	return ESP_OK;
+}
+
+// Burst of HC_BURST pings, median of the echoes in distance_cm, temp_c compensates the speed of sound
+esp_err_t hcsr04_measure(float temp_c, float *distance_cm){
+	esp_err_t err;
+	if ((err = hcsr04_burst_start()) != ESP_OK) {
+		return err;
+	}
+	do {
+		vTaskDelay(HC_CYCLE_MS / portTICK_PERIOD_MS);
+	} while (hcsr04_burst_step());
+	return hcsr04_burst_result(temp_c, distance_cm);
+}
+
+// Returns distance in cm at 20 C, 0 on failure
+float hcsr04_get_distance(void) {
+	float distance = 0;
+	if (hcsr04_measure(20.0f, &distance) != ESP_OK) {
+		return 0;
+	}
+	return distance;
+}
+
 void hcsr04_init(int _TRIGGER, int _ECHO){
 	TRIGGER = _TRIGGER;
 	ECHO = _ECHO;
 	gpio_pad_select_gpio(TRIGGER);
 	gpio_pad_select_gpio(ECHO);
 	gpio_set_direction(TRIGGER, GPIO_MODE_OUTPUT);
+	gpio_set_level(TRIGGER, 0);
 	gpio_set_direction(ECHO, GPIO_MODE_INPUT);
+	gpio_set_intr_type(ECHO, GPIO_INTR_ANYEDGE);
+	// the service may be installed already by another driver
+	gpio_install_isr_service(0);
+	gpio_isr_handler_add(ECHO, hcsr04_echo_isr, NULL);
 	hc_init = 1;
 }
@@ -15,6 +15,19 @@
 #ifndef HCSR04_H_
 #define HCSR04_H_
 
+#include "esp_err.h"
+
+#define HC_TRIGGER_US	10		// trigger pulse
+#define HC_MAX_ECHO_US	25000	// about 4 m, longer echoes are no target
+#define HC_CYCLE_MS		60		// between pings, lets the previous echo die out
+#define HC_BURST		5		// pings per measurement, median is reported
+
+// Non-blocking burst: start, then step every HC_CYCLE_MS until it returns 0, then take the result
+esp_err_t hcsr04_burst_start(void);
+int hcsr04_burst_step(void);
+esp_err_t hcsr04_burst_result(float temp_c, float *distance_cm);
+
+esp_err_t hcsr04_measure(float temp_c, float *distance_cm);
 float hcsr04_get_distance(void);
 void hcsr04_init(int _TRIGGER, int _ECHO);
 
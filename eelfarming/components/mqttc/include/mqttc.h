@@ -0,0 +1,105 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MQTTC_H_
+#define MQTTC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+// Minimal MQTT 3.1.1 client, publish only: CONNECT, PUBLISH with QoS 0
+// or 1, PUBACK and PINGREQ. It runs in the task calling it and creates no
+// task of its own. QoS 1 packets stay in a window of in-flight slots until
+// the broker acknowledges them. With a persistent session (clean session
+// off) they are sent again in order after a reconnect, with the DUP flag,
+// and nothing else is repeated.
+
+#define MQTTC_INFLIGHT_MAX	CONFIG_MQTTC_INFLIGHT
+#define MQTTC_MSG_L			CONFIG_MQTTC_MSG_L
+#define MQTTC_TIMEOUT_MS	5000	// connect and CONNACK
+#define MQTTC_ERR_QUEUED	0x7101	// QoS 1 packet kept in its slot, the send failed
+
+typedef struct {
+	const char *host;
+	uint16_t port;
+	const char *client_id;
+	const char *username;		// NULL for none
+	const char *password;		// NULL for none
+	uint16_t keepalive_s;
+	bool clean_session;
+} mqttc_config_t;
+
+typedef struct {
+	uint32_t connects;			// CONNACKs accepted
+	uint32_t published;			// PUBLISH packets, resends not counted
+	uint32_t acked;				// PUBACKs
+	uint32_t resent;			// PUBLISH packets sent again after a reconnect
+	uint32_t bytes;				// bytes sent
+	uint32_t ack_lat_avg_us;	// PUBLISH to PUBACK
+	uint32_t ack_lat_max_us;
+} mqttc_stats_t;
+
+// QoS 1 packet waiting for its PUBACK
+typedef struct {
+	uint16_t id;				// packet identifier, 0 for a free slot
+	uint16_t len;
+	int64_t sent_us;
+	uint8_t *pkt;
+} mqttc_slot_t;
+
+typedef struct {
+	const mqttc_config_t *cfg;
+	int sock;					// -1 while disconnected
+	uint16_t next_id;
+	mqttc_slot_t slot[MQTTC_INFLIGHT_MAX];	// ring, oldest at head
+	int head;
+	int n;
+	uint8_t *tx;				// QoS 0 packet
+	uint8_t rx[16];				// incoming packets are all short ones
+	int rx_len;
+	int64_t tx_us;				// last packet sent
+	int64_t ping_us;			// PINGREQ waiting for its answer, 0 for none
+	uint64_t lat_sum;
+	mqttc_stats_t stats;
+} mqttc_t;
+
+// Allocate the packet buffers
+esp_err_t mqttc_init(mqttc_t *c, const mqttc_config_t *cfg);
+
+// Open the connection and send the packets still in flight,
+// session_present tells if the broker kept the session
+esp_err_t mqttc_connect(mqttc_t *c, bool *session_present);
+
+// Send a message, QoS 1 takes an in-flight slot: ESP_ERR_NO_MEM while the window is full,
+// ESP_ERR_INVALID_SIZE if it does not fit MQTTC_MSG_L, ESP_FAIL if the connection is lost.
+// MQTTC_ERR_QUEUED if the connection is lost after a QoS 1 packet took its slot, it is
+// sent with the next connection and must not be published again
+esp_err_t mqttc_publish(mqttc_t *c, const char *topic, const void *data, size_t len, int qos, bool retain);
+
+// Free in-flight slots
+int mqttc_window(mqttc_t *c);
+
+// Wait up to timeout_ms for packets of the broker and handle them, keeps the connection alive.
+// ESP_FAIL once the connection is lost
+esp_err_t mqttc_poll(mqttc_t *c, uint32_t timeout_ms);
+
+// Close the connection, the packets in flight are kept for the next one
+void mqttc_close(mqttc_t *c);
+
+void mqttc_stats(mqttc_t *c, mqttc_stats_t *stats);
+
+#endif
@@ -0,0 +1,337 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+     along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "mqttc.h"
+
+static const char *TAG = "mqttc";
+
+// Packet types, upper nibble of the fixed header
+#define MQTTC_CONNECT		0x10
+#define MQTTC_CONNACK		0x20
+#define MQTTC_PUBLISH		0x30
+#define MQTTC_PUBACK		0x40
+#define MQTTC_PINGREQ		0xC0
+#define MQTTC_PINGRESP		0xD0
+
+#define MQTTC_DUP			0x08
+#define MQTTC_RETAIN		0x01
+
+// Remaining length, 1 to 4 bytes
+static int mqttc_put_len(uint8_t *p, size_t len){
+	int n = 0;
+	do {
+		p[n] = len & 0x7F;
+		len >>= 7;
+		if (len > 0) {
+			p[n] |= 0x80;
+		}
+		n++;
+	} while (len > 0);
+	return n;
+}
+
+static int mqttc_len_size(size_t len){
+	return (len < 128) ? 1 : (len < 16384) ? 2 : (len < 2097152) ? 3 : 4;
+}
+
+static int mqttc_put_str(uint8_t *p, const char *s){
+	size_t l = strlen(s);
+	p[0] = l >> 8;
+	p[1] = l & 0xFF;
+	memcpy(p + 2, s, l);
+	return l + 2;
+}
+
+static esp_err_t mqttc_send(mqttc_t *c, const uint8_t *p, size_t len){
+	c->stats.bytes += len;
+	while (len > 0) {
+		int n = send(c->sock, p, len, 0);
+		if (n <= 0) {
+			ESP_LOGW(TAG, "send failed (%d)", errno);
+			mqttc_close(c);
+			return ESP_FAIL;
+		}
+		p += n;
+		len -= n;
+	}
+	c->tx_us = esp_timer_get_time();
+	return ESP_OK;
+}
+
+esp_err_t mqttc_init(mqttc_t *c, const mqttc_config_t *cfg){
+	memset(c, 0, sizeof(*c));
+	c->cfg = cfg;
+	c->sock = -1;
+	c->next_id = 1;
+	// one block for the QoS 0 packet and the slots
+	if ((c->tx = malloc((MQTTC_INFLIGHT_MAX + 1) * MQTTC_MSG_L)) == NULL) {
+		return ESP_ERR_NO_MEM;
+	}
+	for (int i = 0; i < MQTTC_INFLIGHT_MAX; i++) {
+		c->slot[i].pkt = c->tx + (i + 1) * MQTTC_MSG_L;
+	}
+	return ESP_OK;
+}
+
+// Block for a packet of the broker, used before the connection is up
+static int mqttc_recv_packet(mqttc_t *c, uint8_t type, uint8_t *p, int len){
+	int got = 0;
+	while (got < len) {
+		int n = recv(c->sock, p + got, len - got, 0);
+		if (n <= 0) {
+			return -1;
+		}
+		got += n;
+	}
+	return ((p[0] & 0xF0) == type) ? got : -1;
+}
+
+esp_err_t mqttc_connect(mqttc_t *c, bool *session_present){
+	const mqttc_config_t *cfg = c->cfg;
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+	struct addrinfo *res;
+	struct timeval tv = { .tv_sec = MQTTC_TIMEOUT_MS / 1000 };
+	uint8_t *p = c->tx, ack[4] = { 0 };
+	char port[6];
+	size_t len;
+	int one = 1, n;
+
+	mqttc_close(c);
+	*session_present = false;
+	snprintf(port, sizeof(port), "%u", cfg->port);
+	if (getaddrinfo(cfg->host, port, &hints, &res) != 0 || res == NULL) {
+		ESP_LOGW(TAG, "%s: no address", cfg->host);
+		return ESP_FAIL;
+	}
+	c->sock = socket(res->ai_family, res->ai_socktype, 0);
+	if (c->sock < 0) {
+		freeaddrinfo(res);
+		return ESP_FAIL;
+	}
+	// sends and the CONNACK never block for longer than the timeout
+	setsockopt(c->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(c->sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	n = connect(c->sock, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	if (n != 0) {
+		ESP_LOGW(TAG, "%s:%u: connect failed (%d)", cfg->host, cfg->port, errno);
+		mqttc_close(c);
+		return ESP_FAIL;
+	}
+
+	len = 10 + 2 + strlen(cfg->client_id);
+	if (cfg->username != NULL) {
+		len += 2 + strlen(cfg->username);
+	}
+	if (cfg->password != NULL) {
+		len += 2 + strlen(cfg->password);
+	}
+	if (1 + mqttc_len_size(len) + len > MQTTC_MSG_L) {
+		mqttc_close(c);
+		return ESP_ERR_INVALID_SIZE;
+	}
+	*p++ = MQTTC_CONNECT;
+	p += mqttc_put_len(p, len);
+	p += mqttc_put_str(p, "MQTT");
+	*p++ = 4;	// protocol level 3.1.1
+	*p++ = (cfg->username != NULL ? 0x80 : 0) | (cfg->password != NULL ? 0x40 : 0) | (cfg->clean_session ? 0x02 : 0);
+	*p++ = cfg->keepalive_s >> 8;
+	*p++ = cfg->keepalive_s & 0xFF;
+	p += mqttc_put_str(p, cfg->client_id);
+	if (cfg->username != NULL) {
+		p += mqttc_put_str(p, cfg->username);
+	}
+	if (cfg->password != NULL) {
+		p += mqttc_put_str(p, cfg->password);
+	}
+	if (mqttc_send(c, c->tx, p - c->tx) != ESP_OK) {
+		return ESP_FAIL;
+	}
+	if (mqttc_recv_packet(c, MQTTC_CONNACK, ack, sizeof(ack)) != sizeof(ack) || ack[1] != 2 || ack[3] != 0) {
+		ESP_LOGW(TAG, "%s:%u: not accepted (%d)", cfg->host, cfg->port, ack[3]);
+		mqttc_close(c);
+		return ESP_FAIL;
+	}
+	*session_present = !cfg->clean_session && (ack[2] & 0x01);
+	c->stats.connects++;
+	c->rx_len = 0;
+	c->ping_us = 0;
+
+	// the packets in flight go again, oldest first
+	for (int i = 0; i < c->n; i++) {
+		mqttc_slot_t *s = &c->slot[(c->head + i) % MQTTC_INFLIGHT_MAX];
+		s->pkt[0] |= MQTTC_DUP;
+		s->sent_us = esp_timer_get_time();
+		c->stats.resent++;
+		if (mqttc_send(c, s->pkt, s->len) != ESP_OK) {
+			return ESP_FAIL;
+		}
+	}
+	ESP_LOGI(TAG, "connected to %s:%u, session %s, %d resent", cfg->host, cfg->port, *session_present ? "kept" : "new", c->n);
+	return ESP_OK;
+}
+
+esp_err_t mqttc_publish(mqttc_t *c, const char *topic, const void *data, size_t len, int qos, bool retain){
+	size_t rem = 2 + strlen(topic) + (qos > 0 ? 2 : 0) + len;
+	mqttc_slot_t *s = NULL;
+	uint8_t *p;
+
+	if (c->sock < 0) {
+		return ESP_FAIL;
+	}
+	if (1 + mqttc_len_size(rem) + rem > MQTTC_MSG_L) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	if (qos > 0) {
+		if (c->n == MQTTC_INFLIGHT_MAX) {
+			return ESP_ERR_NO_MEM;
+		}
+		s = &c->slot[(c->head + c->n) % MQTTC_INFLIGHT_MAX];
+		p = s->pkt;
+	} else {
+		p = c->tx;
+	}
+	*p++ = MQTTC_PUBLISH | (qos > 0 ? 0x02 : 0) | (retain ? MQTTC_RETAIN : 0);
+	p += mqttc_put_len(p, rem);
+	p += mqttc_put_str(p, topic);
+	if (s != NULL) {
+		// identifiers are never 0
+		s->id = c->next_id++;
+		if (c->next_id == 0) {
+			c->next_id = 1;
+		}
+		*p++ = s->id >> 8;
+		*p++ = s->id & 0xFF;
+	}
+	memcpy(p, data, len);
+	p += len;
+	c->stats.published++;
+	if (s == NULL) {
+		return mqttc_send(c, c->tx, p - c->tx);
+	}
+	// the slot is taken before the send, a failed send is repeated on the next connection
+	s->len = p - s->pkt;
+	s->sent_us = esp_timer_get_time();
+	c->n++;
+	return (mqttc_send(c, s->pkt, s->len) == ESP_OK) ? ESP_OK : MQTTC_ERR_QUEUED;
+}
+
+int mqttc_window(mqttc_t *c){
+	return MQTTC_INFLIGHT_MAX - c->n;
+}
+
+static void mqttc_acked(mqttc_t *c, uint16_t id){
+	uint32_t lat;
+
+	for (int i = 0; i < c->n; i++) {
+		mqttc_slot_t *s = &c->slot[(c->head + i) % MQTTC_INFLIGHT_MAX];
+		if (s->id != id) {
+			continue;
+		}
+		lat = esp_timer_get_time() - s->sent_us;
+		c->stats.acked++;
+		c->lat_sum += lat;
+		c->stats.ack_lat_avg_us = c->lat_sum / c->stats.acked;
+		if (lat > c->stats.ack_lat_max_us) {
+			c->stats.ack_lat_max_us = lat;
+		}
+		s->id = 0;
+		break;
+	}
+	// acks come in order, a gap only holds back the slots behind it
+	while (c->n > 0 && c->slot[c->head].id == 0) {
+		c->head = (c->head + 1) % MQTTC_INFLIGHT_MAX;
+		c->n--;
+	}
+}
+
+esp_err_t mqttc_poll(mqttc_t *c, uint32_t timeout_ms){
+	struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+	int64_t now, keepalive_us;
+	fd_set rd;
+	int n;
+
+	if (c->sock < 0) {
+		return ESP_FAIL;
+	}
+	FD_ZERO(&rd);
+	FD_SET(c->sock, &rd);
+	if (select(c->sock + 1, &rd, NULL, NULL, &tv) > 0) {
+		n = recv(c->sock, c->rx + c->rx_len, sizeof(c->rx) - c->rx_len, MSG_DONTWAIT);
+		if (n <= 0) {
+			ESP_LOGW(TAG, "connection closed by the broker");
+			mqttc_close(c);
+			return ESP_FAIL;
+		}
+		c->rx_len += n;
+	}
+	// without subscriptions the broker only sends PUBACK and PINGRESP
+	while (c->rx_len >= 2) {
+		int l = 2 + c->rx[1];
+		if (c->rx[1] & 0x80 || l > sizeof(c->rx)) {
+			ESP_LOGW(TAG, "unexpected packet %02x", c->rx[0]);
+			mqttc_close(c);
+			return ESP_FAIL;
+		}
+		if (c->rx_len < l) {
+			break;
+		}
+		if ((c->rx[0] & 0xF0) == MQTTC_PUBACK && l == 4) {
+			mqttc_acked(c, (c->rx[2] << 8) | c->rx[3]);
+		} else if ((c->rx[0] & 0xF0) == MQTTC_PINGRESP) {
+			c->ping_us = 0;
+		}
+		memmove(c->rx, c->rx + l, c->rx_len - l);
+		c->rx_len -= l;
+	}
+
+	// a PINGREQ after half the keepalive without packets, the link is dead when the answer takes longer than the rest
+	now = esp_timer_get_time();
+	keepalive_us = (int64_t)c->cfg->keepalive_s * 1000000;
+	if (keepalive_us == 0) {
+		return ESP_OK;
+	}
+	if (c->ping_us != 0 && now - c->ping_us > keepalive_us / 2) {
+		ESP_LOGW(TAG, "no PINGRESP");
+		mqttc_close(c);
+		return ESP_FAIL;
+	}
+	if (c->ping_us == 0 && now - c->tx_us > keepalive_us / 2) {
+		static const uint8_t ping[2] = { MQTTC_PINGREQ, 0 };
+		c->ping_us = now;
+		return mqttc_send(c, ping, sizeof(ping));
+	}
+	return ESP_OK;
+}
+
+void mqttc_close(mqttc_t *c){
+	if (c->sock >= 0) {
+		close(c->sock);
+		c->sock = -1;
+	}
+}
+
+void mqttc_stats(mqttc_t *c, mqttc_stats_t *stats){
+	*stats = c->stats;
+}
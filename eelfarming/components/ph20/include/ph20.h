@@ -15,8 +15,17 @@
 #ifndef PH20_H_
 #define PH20_H_
 
+#include <stdint.h>
+#include "esp_err.h"
+#include "calib.h"
+
 float ph20_calibrate(uint32_t VOLTAGE);
+float ph20_convert(uint32_t VOLTAGE, float TEMP_C);
+esp_err_t ph20_cal_point(uint32_t VOLTAGE, float PH, float TEMP_C);
+esp_err_t ph20_cal_reset(void);
+int ph20_cal_points(calib_point_t *POINTS);
+esp_err_t ph20_get_voltage(uint32_t *voltage);
 float ph20_get_meter(void);
-void ph20_init(uint32_t CHANNEL, uint32_t WIDTH, uint32_t ATTEN_DB);
+esp_err_t ph20_init(uint32_t CHANNEL, uint32_t ATTEN_DB);
 
 #endif
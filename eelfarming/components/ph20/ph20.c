@@ -12,47 +12,169 @@
     You should have received a copy of the GNU General Public License
      along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
 #include "esp_system.h"
 #include "driver/gpio.h"
 #include "driver/adc.h"
-#include "esp_adc_cal.h"
+#include "adcq.h"
+#include "calib.h"
+#include "ph20.h"
+
+#define PH_NVS_KEY		"ph20"
+#define PH_ISO			7000		// isopotential point (milli pH), the probe reads 0 mV here at any temperature
+#define PH_REF_CK		29815		// reference temperature of the curve, 25 C in centi Kelvin
+#define PH_ZERO_CK		27315
+#define PH_BUFFER_SAME	1000		// buffers closer than this replace each other (milli pH)
+
+// Default curve of the board: pH 7 at 1500 mV, pH 4 at 2032 mV (25 C)
+#define PH_DEF_MV7		1500
+#define PH_DEF_MV4		2032
+#define PH_DEFAULT_CURVE { \
+	.n = 2, \
+	.p = { { PH_DEF_MV7, 7000 }, { PH_DEF_MV4, 4000 } }, \
+	.slope = { CALIB_SLOPE(PH_DEF_MV7, 7000, PH_DEF_MV4, 4000) }, \
+}
+static const calib_curve_t PH_DEFAULT = PH_DEFAULT_CURVE;
+
+// Buffer points as stored in NVS, pH referred to 25 C
+typedef struct {
+	int32_t n;
+	calib_point_t p[CALIB_POINTS_MAX];
+} ph_cal_t;
 
 int PH_CHANNEL;
 int ph_init = 0;
-esp_adc_cal_characteristics_t ph_characteristics;
+static ph_cal_t ph_cal;
+static calib_curve_t ph_curve = PH_DEFAULT_CURVE;
+static portMUX_TYPE ph_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Curve through the buffer points, a single buffer shifts the default slope
+static esp_err_t ph_curve_build(const ph_cal_t *cal, calib_curve_t *curve){
+	calib_point_t p[2];
+	if (cal->n == 0) {
+		*curve = PH_DEFAULT;
+		return ESP_OK;
+	}
+	if (cal->n == 1) {
+		p[0] = cal->p[0];
+		p[1].x = p[0].x + 1000;
+		p[1].y = p[0].y + (int32_t)(((int64_t)1000 * PH_DEFAULT.slope[0]) >> CALIB_FRAC);
+		return calib_curve_init(curve, p, 2);
+	}
+	return calib_curve_init(curve, cal->p, cal->n);
+}
 
-// calibrate voltage to ph value
+// Milli pH at voltage (mV) and temperature (centi C).
+// The electrode slope is proportional to the absolute temperature (Nernst),
+// around the isopotential point the 25 C reading scales with 298.15 / T.
+static int32_t ph_convert(int32_t voltage, int32_t temp_cc){
+	int32_t ph25;
+	portENTER_CRITICAL(&ph_lock);
+	ph25 = calib_curve_eval(&ph_curve, voltage);
+	portEXIT_CRITICAL(&ph_lock);
+	return PH_ISO + (int32_t)((int64_t)(ph25 - PH_ISO) * PH_REF_CK / (temp_cc + PH_ZERO_CK));
+}
+
+// calibrate voltage to ph value at 25 C
 float ph20_calibrate(uint32_t voltage){
-	float ph = 0;
-	if (voltage > 0 && voltage < 50){
-		ph = 8;
+	return ph_convert(voltage, 2500) / 1000.0f;
+}
+
+// calibrate voltage to ph value, temperature compensated
+float ph20_convert(uint32_t voltage, float temp_c){
+	return ph_convert(voltage, (int32_t)(temp_c * 100)) / 1000.0f;
+}
+
+// Set the active curve and store the points
+static esp_err_t ph_cal_apply(const ph_cal_t *cal){
+	calib_curve_t curve;
+	esp_err_t err;
+	if ((err = ph_curve_build(cal, &curve)) != ESP_OK) {
+		return err;
+	}
+	portENTER_CRITICAL(&ph_lock);
+	ph_curve = curve;
+	portEXIT_CRITICAL(&ph_lock);
+	ph_cal = *cal;
+	if (cal->n == 0) {
+		return calib_erase(PH_NVS_KEY);
 	}
-	if (voltage >= 50 && voltage < 100){
-		ph = 9;
+	return calib_save(PH_NVS_KEY, cal, sizeof(*cal));
+}
+
+// Probe reads voltage in a buffer of pH at temperature, replaces the point of the same buffer
+esp_err_t ph20_cal_point(uint32_t voltage, float ph, float temp_c){
+	ph_cal_t cal = ph_cal;
+	int32_t y = (int32_t)(ph * 1000);
+	int i, near = 0;
+	// refer the buffer to 25 C
+	y = PH_ISO + (int32_t)((int64_t)(y - PH_ISO) * ((int32_t)(temp_c * 100) + PH_ZERO_CK) / PH_REF_CK);
+	for (i = 0; i < cal.n; i++) {
+		if (abs(cal.p[i].y - y) < abs(cal.p[near].y - y)) {
+			near = i;
+		}
 	}
-	if (voltage >= 100){
-		ph = 10;
+	// a new buffer is added while there is room, else the nearest one is replaced
+	if (cal.n == 0 || (abs(cal.p[near].y - y) >= PH_BUFFER_SAME && cal.n < CALIB_POINTS_MAX)) {
+		near = cal.n++;
 	}
-	return ph;
+	cal.p[near].x = voltage;
+	cal.p[near].y = y;
+	return ph_cal_apply(&cal);
 }
 
-// Returns ph meter from sensor
-float ph20_get_meter(void) {
+// Back to the default curve
+esp_err_t ph20_cal_reset(void){
+	ph_cal_t cal = { 0 };
+	return ph_cal_apply(&cal);
+}
+
+// Buffer points in mV and milli pH at 25 C, returns their number
+int ph20_cal_points(calib_point_t *p){
+	for (int i = 0; i < ph_cal.n; i++) {
+		p[i] = ph_cal.p[i];
+	}
+	return ph_cal.n;
+}
+
+// Averaged sensor voltage from the ADC1 acquisition service
+esp_err_t ph20_get_voltage(uint32_t *voltage){
+	adcq_result_t result;
+	esp_err_t err;
 	if(ph_init != 1){
+		return ESP_ERR_INVALID_STATE;
+	}
+	if ((err = adcq_read(PH_CHANNEL, &result)) != ESP_OK) {
+		return err;
+	}
+	*voltage = result.mv;
+	return ESP_OK;
+}
+
+// Returns ph meter from sensor, 0 until the first average is available
+float ph20_get_meter(void) {
+	uint32_t voltage;
+	if (ph20_get_voltage(&voltage) != ESP_OK) {
 		return 0;
 	}
-	//int voltage = adc1_get_raw(PH_CHANNEL);
-	uint32_t voltage = adc1_to_voltage(PH_CHANNEL, &ph_characteristics);
 	return ph20_calibrate(voltage);
 }
 
-// Use adc1
-void ph20_init(int CHANNEL, int WIDTH, int ATTEN_DB){
+// Registers the channel with the ADC1 acquisition service
+esp_err_t ph20_init(uint32_t CHANNEL, uint32_t ATTEN_DB){
+	esp_err_t err;
 	PH_CHANNEL = CHANNEL;
-	gpio_pad_select_gpio(PH_CHANNEL);
-	gpio_set_direction(PH_CHANNEL, GPIO_MODE_INPUT);
-	adc1_config_width(WIDTH);
-	adc1_config_channel_atten(PH_CHANNEL, ATTEN_DB);
-	esp_adc_cal_get_characteristics(3300, ATTEN_DB, WIDTH, &ph_characteristics);
+	// calibrated points from NVS, else the default curve
+	if (calib_load(PH_NVS_KEY, &ph_cal, sizeof(ph_cal)) != ESP_OK
+			|| ph_cal.n < 0 || ph_cal.n > CALIB_POINTS_MAX
+			|| ph_curve_build(&ph_cal, &ph_curve) != ESP_OK) {
+		ph_cal.n = 0;
+		ph_curve = PH_DEFAULT;
+	}
+	if ((err = adcq_register(PH_CHANNEL, ATTEN_DB)) != ESP_OK) {
+		return err;
+	}
 	ph_init = 1;
+	return ESP_OK;
 }
@@ -30,9 +30,25 @@
 #ifndef	WEBSOCKET_H_
 #define WEBSOCKET_H_
 
+#include "sdkconfig.h"
 #include <lwip/err.h>
 
 #define WS_MASK_L		0x4		/**< \brief Length of MASK field in WebSocket Header*/
+#define WS_MAX_MSG_LEN	(CONFIG_WS_POOL_LARGE_SIZE - 1)	/**< \brief Maximum length of a received (reassembled) message*/
+#define WS_POOL_CLASSES	2			/**< \brief Number of receive buffer classes (small, large)*/
+#define WS_TX_NOCOPY	0x1			/**< \brief Send straight from the caller's buffer, never batch*/
+#define WS_TX_FLUSH		0x2			/**< \brief Send batched frames together with this one right away*/
+#define WS_CLIENT_ALL	(-1)		/**< \brief Client id addressing all open connections*/
+
+/** \brief Opcode according to RFC 6455*/
+typedef enum {
+	WS_OP_CON = 0x0, 				/*!< Continuation Frame*/
+	WS_OP_TXT = 0x1, 				/*!< Text Frame*/
+	WS_OP_BIN = 0x2, 				/*!< Binary Frame*/
+	WS_OP_CLS = 0x8, 				/*!< Connection Close Frame*/
+	WS_OP_PIN = 0x9, 				/*!< Ping Frame*/
+	WS_OP_PON = 0xa 				/*!< Pong Frame*/
+} WS_OPCODES;
 
 /** \brief Websocket frame header type*/
 typedef struct {
@@ -43,36 +59,138 @@ typedef struct {
 	uint8_t mask :1;
 } WS_frame_header_t;
 
-/** \brief Websocket frame type*/
+/** \brief Websocket message type (all fragments of a message reassembled)*/
 typedef struct{
-	struct netconn* 	conenction;
+	int				 	client;
+	int					slot;			/**< \brief Connection slot of the client, 0 .. CONFIG_WS_MAX_CLIENTS - 1*/
+	int					protocol;		/**< \brief Subprotocol negotiated by the client (index), -1 for none*/
 	WS_frame_header_t	frame_header;
 	size_t				payload_length;
-	char*				payload;
+	char*				payload;		/**< \brief Pool buffer, 0 terminated, release with #WS_frame_free*/
 } WebSocket_frame_t;
 
+/** \brief Usage of one receive buffer class*/
+typedef struct {
+	uint16_t			size;			/**< \brief Size of one buffer*/
+	uint16_t			count;			/**< \brief Number of buffers*/
+	uint32_t			in_use;			/**< \brief Buffers currently taken*/
+	uint32_t			high_water;		/**< \brief Maximum number of buffers taken at the same time*/
+	uint32_t			exhausted;		/**< \brief Requests that found no free buffer*/
+} WS_pool_stats_t;
+
+/** \brief Transmit counters*/
+typedef struct {
+	uint32_t			frames;				/**< \brief Frames sent*/
+	uint32_t			segments;			/**< \brief Socket writes, each pushes its data out as one run of TCP segments*/
+	uint32_t			bytes;				/**< \brief Bytes sent (headers and payloads)*/
+	uint32_t			flushes;			/**< \brief Batches sent*/
+	uint32_t			flush_lat_avg_us;	/**< \brief Average time a frame waited in a batch*/
+	uint32_t			flush_lat_max_us;	/**< \brief Maximum time a frame waited in a batch*/
+} WS_tx_stats_t;
+
+/** \brief Connection counters*/
+typedef struct {
+	uint32_t			accepted;			/**< \brief TCP connections accepted*/
+	uint32_t			rejected;			/**< \brief TCP connections closed because all slots were taken*/
+	uint32_t			handshakes;			/**< \brief Successful handshakes*/
+	uint32_t			hs_failed;			/**< \brief Handshakes answered with 400/426*/
+	uint32_t			hs_lat_avg_us;		/**< \brief Average time from accept to the 101 response*/
+	uint32_t			hs_lat_max_us;		/**< \brief Maximum time from accept to the 101 response*/
+	uint32_t			rx_dropped;			/**< \brief Messages dropped, no receive buffer or queue slot was free*/
+} WS_conn_stats_t;
+
+/**
+ * \brief Return the payload of a received message to the buffer pool
+ */
+void WS_frame_free(char* payload);
+
+/**
+ * \brief Get usage of the receive buffer pool, one entry per buffer class
+ */
+void WS_pool_stats(WS_pool_stats_t stats[WS_POOL_CLASSES]);
+
+/**
+ * \brief Send a frame to a websocket client
+ *
+ * Header and payload are written in one go. With CONFIG_WS_TX_BATCH small
+ * frames are collected per client and sent together after at most
+ * CONFIG_WS_TX_FLUSH_US, unless \p flags has #WS_TX_NOCOPY (the payload is
+ * sent straight from \p p_data, use it for static and pool buffers) or
+ * #WS_TX_FLUSH set.
+ *
+ * \param	client	id of the client (#WebSocket_frame_t.client) or #WS_CLIENT_ALL to broadcast
+ *
+ * \return 	see #WS_write_data
+ */
+err_t WS_write(int client, WS_OPCODES opcode, char* p_data, size_t length, int flags);
+
+/**
+ * \brief Send data to a websocket client
+ *
+ * Payloads above 125 bytes are sent with a 16 or 64 bit extended length.
+ *
+ * \param	client	id of the client (#WebSocket_frame_t.client) or #WS_CLIENT_ALL to broadcast
+ *
+ * \return 	#ERR_CONN:	There is no open connection, or a send failed after part of a frame went out
+ * 						(the connection is closed)
+ * 			#ERR_TIMEOUT:	The socket stayed full, nothing of the frame was sent
+ * 			#ERR_OK:	Header and payload send (broadcast: to at least one client)
+ */
+err_t WS_write_data(int client, char* p_data, size_t length);
+
 /**
- * \brief Send data to the websocket client
+ * \brief Send one fragment of a text message to a websocket client
+ *
+ * A message is streamed as a sequence of calls, the first with \p first set
+ * and the last with \p last set. Other data frames must not be sent to the
+ * client until the last fragment went out.
  *
- * \return 	#ERR_VAL: 	Payload length exceeded 2^7 bytes.
- * 			#ERR_CONN:	There is no open connection
- * 			#ERR_OK:	Header and payload send
- * 			all other values: derived from #netconn_write (sending frame header or payload)
+ * \return 	see #WS_write_data
  */
-err_t WS_write_data(char* p_data, size_t length);
+err_t WS_write_fragment(int client, char* p_data, size_t length, int first, int last);
+
+/**
+ * \brief Set the subprotocols offered in the handshake (Sec-WebSocket-Protocol)
+ *
+ * The first protocol of the client's list found in \p protocols is selected.
+ * Clients asking for none of them are served without a subprotocol.
+ * The list must stay valid, call before starting #ws_server.
+ */
+void WS_set_protocols(const char* const* protocols, int count);
+
+/**
+ * \brief Subprotocol of a client
+ *
+ * \return	index into the list of #WS_set_protocols, -1 for none or unknown client
+ */
+int WS_client_protocol(int client);
+
+/**
+ * \brief Get connection and handshake counters
+ */
+void WS_conn_stats(WS_conn_stats_t* stats);
+
+/**
+ * \brief Get transmit counters of all clients
+ */
+void WS_tx_stats(WS_tx_stats_t* stats);
 
 /**
  * \brief WebSocket Server task
+ *
+ * Serves up to CONFIG_WS_MAX_CLIENTS connections from one select() loop.
  */
 void ws_server(void *pvParameters);
 
 /**
- * \brief reset ws connection
+ * \brief reset all ws connections
  */
 void ws_rst_client();
 
 /**
- * \brief check state of connection
+ * \brief check state of connections
+ *
+ * \return number of open connections
  */
 int ws_check_client();
 
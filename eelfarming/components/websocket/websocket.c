@@ -27,280 +27,1100 @@
  */
 
 #include "websocket.h"
+#include "ws_pool.h"
 
 #include "freertos/FreeRTOS.h"
-//#include "esp_heap_alloc_caps.h"
-#include "esp_heap_caps.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
 #include "hwcrypto/sha.h"
 #include "esp_system.h"
-#include "wpa2/utils/base64.h"
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include "lwip/netdb.h"
 #include "lwip/dns.h"
-#include "lwip/api.h"
 #include <lwip/err.h>
 
 #define WS_PORT				9998	/**< \brief TCP Port for the Server*/
 #define WS_CLIENT_KEY_L		24		/**< \brief Length of the Client Key*/
 #define SHA1_RES_L			20		/**< \brief SHA1 result*/
 #define WS_STD_LEN			125		/**< \brief Maximum Length of standard length frames*/
-#define WS_SPRINTF_ARG_L	4		/**< \brief Length of sprintf argument for string (%.*s)*/
+#define WS_EXT16_LEN		126		/**< \brief Length code of frames with a 16 bit extended length*/
+#define WS_EXT64_LEN		127		/**< \brief Length code of frames with a 64 bit extended length*/
+#define WS_MAX_HDR_L		14		/**< \brief Maximum length of a frame header (incl. extended length and mask)*/
+#define WS_CTRL_BIT			0x8		/**< \brief Opcode bit of control frames*/
+#define WS_CLOSE_PROTOCOL	1002	/**< \brief Close status: protocol error*/
+#define WS_CLOSE_TOO_BIG	1009	/**< \brief Close status: message too big*/
+#define WS_ACCEPT_L			28		/**< \brief Length of the base64 encoded SHA1 result*/
+#define WS_VERSION			"13"	/**< \brief Supported protocol version*/
+#define WS_HS_LINE_L		128		/**< \brief Longest request line or header kept, longer ones are truncated*/
+#define WS_HS_MAX_L			4096	/**< \brief Longest handshake request accepted*/
+#define WS_HS_RESP_L		256		/**< \brief Size of the handshake response buffer*/
+#define WS_LISTEN_BACKLOG	2		/**< \brief Pending connections of the listening socket*/
+#define WS_SEND_TIMEOUT_MS	2000	/**< \brief Send timeout, a stalled client must not block the others*/
+#define WS_RX_CHUNK_L		1436	/**< \brief Bytes read per recv() call (one TCP MSS)*/
+
+/** \brief State of a client slot*/
+typedef enum {
+	WS_CL_FREE = 0,					/*!< Slot unused*/
+	WS_CL_HANDSHAKE,				/*!< Waiting for the HTTP upgrade request*/
+	WS_CL_OPEN						/*!< WebSocket connection open*/
+} WS_CLIENT_STATE;
 
-/** \brief Opcode according to RFC 6455*/
+/** \brief Handshake request headers seen*/
 typedef enum {
-	WS_OP_CON = 0x0, 				/*!< Continuation Frame*/
-	WS_OP_TXT = 0x1, 				/*!< Text Frame*/
-	WS_OP_BIN = 0x2, 				/*!< Binary Frame*/
-	WS_OP_CLS = 0x8, 				/*!< Connection Close Frame*/
-	WS_OP_PIN = 0x9, 				/*!< Ping Frame*/
-	WS_OP_PON = 0xa 				/*!< Pong Frame*/
-} WS_OPCODES;
+	WS_HS_HOST = 0x01,				/*!< Host*/
+	WS_HS_UPGRADE = 0x02,			/*!< Upgrade: websocket*/
+	WS_HS_CONNECTION = 0x04,		/*!< Connection: Upgrade*/
+	WS_HS_VERSION = 0x08,			/*!< Sec-WebSocket-Version: 13*/
+	WS_HS_KEY = 0x10,				/*!< Sec-WebSocket-Key*/
+	WS_HS_ALL = 0x1F
+} WS_HS_FLAGS;
+
+/** \brief Incremental HTTP/1.1 upgrade request parser*/
+typedef struct {
+	uint16_t			total;					/**< \brief Request bytes received*/
+	uint8_t				line_l;					/**< \brief Bytes in line*/
+	uint8_t				req_line;				/**< \brief Request line done*/
+	uint8_t				flags;					/**< \brief #WS_HS_FLAGS*/
+	uint8_t				bad_version;			/**< \brief Unsupported Sec-WebSocket-Version*/
+	char				line[WS_HS_LINE_L];		/**< \brief Current line*/
+	char				key[WS_CLIENT_KEY_L];	/**< \brief Sec-WebSocket-Key*/
+} ws_hs_t;
+
+/** \brief Client connection*/
+typedef struct {
+	int					sock;					/**< \brief Socket, -1 if the slot is free*/
+	int					id;						/**< \brief Client id handed out to the application*/
+	WS_CLIENT_STATE		state;					/**< \brief Connection state*/
+	int					protocol;				/**< \brief Negotiated subprotocol (index), -1 for none*/
+	int64_t				accept_t;				/**< \brief Time the connection was accepted*/
+	ws_hs_t				hs;						/**< \brief Handshake parser*/
+	SemaphoreHandle_t	tx_lock;				/**< \brief Serializes frames sent to this client*/
+	err_t				tx_err;					/**< \brief Send that lost or cut off frames, sticks until the slot is reused*/
+#ifdef CONFIG_WS_TX_BATCH
+	char				tx_batch[CONFIG_WS_TX_BATCH_SIZE];	/**< \brief Small frames waiting to be sent together*/
+	size_t				tx_batch_l;				/**< \brief Bytes in the batch*/
+	int64_t				tx_batch_t;				/**< \brief Time the first frame entered the batch*/
+	esp_timer_handle_t	tx_timer;				/**< \brief Flushes the batch at the deadline*/
+#endif
+
+	uint8_t				hdr[WS_MAX_HDR_L];		/**< \brief Header of the frame being received*/
+	uint8_t				hdr_l;					/**< \brief Header bytes received*/
+	uint8_t				hdr_need;				/**< \brief Header bytes expected*/
+	uint64_t			payload_l;				/**< \brief Payload length of the frame being received*/
+	size_t				copied;					/**< \brief Payload bytes received*/
+	char*				p_dst;					/**< \brief Destination of the payload, NULL to drop it*/
+	char				ctrl[WS_STD_LEN];		/**< \brief Control frame payload*/
+
+	char*				p_msg;					/**< \brief Message reassembly buffer (from the pool)*/
+	size_t				msg_l;					/**< \brief Length of the reassembled message*/
+	WS_frame_header_t	msg_hdr;				/**< \brief Header of the first fragment*/
+	int					msg_active;				/**< \brief A fragmented message is being received*/
+	int					msg_discard;			/**< \brief No buffer was free, the message is dropped*/
+} ws_client_t;
 
 //Reference to the RX queue
 extern QueueHandle_t WebSocket_rx_queue;
 
-//Reference to open websocket connection
-static struct netconn* WS_conn = NULL;
-const char WS_sec_WS_keys[] = "Sec-WebSocket-Key:";
+//Client connections
+static ws_client_t WS_clients[CONFIG_WS_MAX_CLIENTS];
+
+//Last handed out client id
+static int WS_last_id = 0;
+
+//Receive buffer, may hold several frames or parts of frames, only used by the server task
+static char WS_rx_chunk[WS_RX_CHUNK_L];
+
+//Connection counters
+static WS_conn_stats_t WS_conn_cnt;
+static uint64_t WS_hs_lat_sum = 0;
+
+//Transmit counters
+static WS_tx_stats_t WS_tx_cnt;
+static uint64_t WS_tx_flush_lat_sum = 0;
+static portMUX_TYPE WS_tx_cnt_lock = portMUX_INITIALIZER_UNLOCKED;
+
+//Subprotocols offered to clients
+static const char* const* WS_protocols = NULL;
+static int WS_protocols_n = 0;
+
 const char WS_sec_conKey[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-const char WS_srv_hs[] ="HTTP/1.1 101 Switching Protocols \r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %.*s\r\n\r\n";
+const char WS_srv_hs[] = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+const char WS_srv_proto[] = "\r\nSec-WebSocket-Protocol: ";
+const char WS_srv_400[] = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+const char WS_srv_426[] = "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: " WS_VERSION "\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+const char WS_base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+static err_t ws_send_iov(int sock, struct iovec* iov, int iov_cnt) {
+
+	size_t total = 0, sent = 0;
+	int n;
+
+	for (int i = 0; i < iov_cnt; i++)
+		total += iov[i].iov_len;
+
+	//header and payload go out in one write, so they share a segment
+	while (iov_cnt > 0) {
+		n = writev(sock, iov, iov_cnt);
+
+		//only a send that wrote nothing may be retried, a frame cut off in the middle breaks the stream
+		if (n <= 0)
+			return (sent == 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? ERR_TIMEOUT : ERR_CONN;
+		sent += n;
+
+		portENTER_CRITICAL(&WS_tx_cnt_lock);
+		WS_tx_cnt.segments++;
+		portEXIT_CRITICAL(&WS_tx_cnt_lock);
+
+		//skip what was written after a partial write
+		while (iov_cnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iov_cnt--;
+		}
+		if (iov_cnt > 0) {
+			iov->iov_base = (char*) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
 
+	portENTER_CRITICAL(&WS_tx_cnt_lock);
+	WS_tx_cnt.bytes += total;
+	portEXIT_CRITICAL(&WS_tx_cnt_lock);
 
-err_t WS_write_data(char* p_data, size_t length) {
+	return ERR_OK;
+}
 
-	//check if we have an open connection
-	if (WS_conn == NULL)
-		return ERR_CONN;
+static err_t ws_send_all(int sock, const void* p_data, size_t length) {
+
+	struct iovec iov = { .iov_base = (void*) p_data, .iov_len = length };
+
+	return ws_send_iov(sock, &iov, 1);
+}
+
+static void ws_tx_broken(ws_client_t* cl, err_t err) {
+
+	//frames are lost or cut off, the server task sees the shutdown as end of stream and closes the connection
+	cl->tx_err = err;
+	shutdown(cl->sock, SHUT_RDWR);
+}
+
+#ifdef CONFIG_WS_TX_BATCH
+static void ws_tx_done(ws_client_t* cl) {
+
+	uint32_t lat = esp_timer_get_time() - cl->tx_batch_t;
+
+	cl->tx_batch_l = 0;
+	portENTER_CRITICAL(&WS_tx_cnt_lock);
+	WS_tx_cnt.flushes++;
+	WS_tx_flush_lat_sum += lat;
+	if (lat > WS_tx_cnt.flush_lat_max_us)
+		WS_tx_cnt.flush_lat_max_us = lat;
+	portEXIT_CRITICAL(&WS_tx_cnt_lock);
+}
 
-	//currently only frames with a payload length <WS_STD_LEN are supported
-	if (length > WS_STD_LEN)
-		return ERR_VAL;
+static err_t ws_tx_flush(ws_client_t* cl) {
 
-	//netconn_write result buffer
 	err_t result;
 
+	if (cl->tx_batch_l == 0)
+		return ERR_OK;
+
+	esp_timer_stop(cl->tx_timer);
+	result = ws_send_all(cl->sock, cl->tx_batch, cl->tx_batch_l);
+	if (result != ERR_OK)
+		ws_tx_broken(cl, result);
+	ws_tx_done(cl);
+
+	return result;
+}
+
+static void ws_tx_timer_cb(void* arg) {
+
+	ws_client_t* cl = arg;
+	int n;
+
+	//runs in the esp_timer task, which must never wait for a writer or a stalled client
+	if (xSemaphoreTake(cl->tx_lock, 0) != pdTRUE) {
+		esp_timer_start_once(cl->tx_timer, CONFIG_WS_TX_FLUSH_US);
+		return;
+	}
+
+	if (cl->state == WS_CL_OPEN && cl->tx_err == ERR_OK && cl->tx_batch_l > 0) {
+		n = send(cl->sock, cl->tx_batch, cl->tx_batch_l, MSG_DONTWAIT);
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			ws_tx_broken(cl, ERR_CONN);
+			cl->tx_batch_l = 0;
+		} else if (n > 0) {
+			portENTER_CRITICAL(&WS_tx_cnt_lock);
+			WS_tx_cnt.segments++;
+			WS_tx_cnt.bytes += n;
+			portEXIT_CRITICAL(&WS_tx_cnt_lock);
+			cl->tx_batch_l -= n;
+			memmove(cl->tx_batch, &cl->tx_batch[n], cl->tx_batch_l);
+		}
+
+		//socket buffer full, the rest goes with the next try
+		if (cl->tx_batch_l > 0)
+			esp_timer_start_once(cl->tx_timer, CONFIG_WS_TX_FLUSH_US);
+		else if (cl->tx_err == ERR_OK)
+			ws_tx_done(cl);
+	}
+	xSemaphoreGive(cl->tx_lock);
+}
+#endif
+
+static err_t ws_write_frame(ws_client_t* cl, int id, WS_OPCODES opcode, int fin, char* p_data, size_t length, int flags) {
+
+	//header buffer (2 byte header + up to 8 byte extended length)
+	uint8_t hdr_buf[WS_MAX_HDR_L - WS_MASK_L];
+	size_t hdr_l = sizeof(WS_frame_header_t);
+
+	//send result buffer
+	err_t result = ERR_OK;
+
+	//header and payload
+	struct iovec iov[2];
+
 	//prepare header
-	WS_frame_header_t hdr;
-	hdr.FIN = 0x1;
-	hdr.payload_length = length;
-	hdr.mask = 0;
-	hdr.reserved = 0;
-	hdr.opcode = WS_OP_TXT;
+	WS_frame_header_t* p_hdr = (WS_frame_header_t*) hdr_buf;
+	p_hdr->FIN = fin ? 0x1 : 0x0;
+	p_hdr->mask = 0;
+	p_hdr->reserved = 0;
+	p_hdr->opcode = opcode;
+
+	//write payload length, extended lengths are in network byte order
+	if (length <= WS_STD_LEN) {
+		p_hdr->payload_length = length;
+	} else if (length <= 0xFFFF) {
+		p_hdr->payload_length = WS_EXT16_LEN;
+		hdr_buf[hdr_l++] = (length >> 8) & 0xFF;
+		hdr_buf[hdr_l++] = length & 0xFF;
+	} else {
+		p_hdr->payload_length = WS_EXT64_LEN;
+		for (int i = 7; i >= 0; i--)
+			hdr_buf[hdr_l++] = ((uint64_t) length >> (8 * i)) & 0xFF;
+	}
 
-	//send header
-	result = netconn_write(WS_conn, &hdr, sizeof(WS_frame_header_t), NETCONN_COPY);
+	xSemaphoreTake(cl->tx_lock, portMAX_DELAY);
 
-	//check if header was send
-	if (result != ERR_OK)
+	//check if the client is (still) connected
+	if (cl->state != WS_CL_OPEN || cl->id != id) {
+		xSemaphoreGive(cl->tx_lock);
+		return ERR_CONN;
+	}
+
+	//a failed send sticks, the connection is lost
+	if (cl->tx_err != ERR_OK) {
+		xSemaphoreGive(cl->tx_lock);
+		return cl->tx_err;
+	}
+
+	portENTER_CRITICAL(&WS_tx_cnt_lock);
+	WS_tx_cnt.frames++;
+	portEXIT_CRITICAL(&WS_tx_cnt_lock);
+
+#ifdef CONFIG_WS_TX_BATCH
+	//small frames are copied into the batch and sent together at the deadline
+	if (!(flags & WS_TX_NOCOPY) && hdr_l + length <= CONFIG_WS_TX_BATCH_SIZE) {
+
+		//make room
+		if (cl->tx_batch_l + hdr_l + length > CONFIG_WS_TX_BATCH_SIZE)
+			result = ws_tx_flush(cl);
+		if (result != ERR_OK) {
+			xSemaphoreGive(cl->tx_lock);
+			return result;
+		}
+
+		//first frame starts the deadline
+		if (cl->tx_batch_l == 0) {
+			cl->tx_batch_t = esp_timer_get_time();
+			esp_timer_start_once(cl->tx_timer, CONFIG_WS_TX_FLUSH_US);
+		}
+
+		memcpy(&cl->tx_batch[cl->tx_batch_l], hdr_buf, hdr_l);
+		if (length > 0)
+			memcpy(&cl->tx_batch[cl->tx_batch_l + hdr_l], p_data, length);
+		cl->tx_batch_l += hdr_l + length;
+
+		if (flags & WS_TX_FLUSH)
+			result = ws_tx_flush(cl);
+
+		xSemaphoreGive(cl->tx_lock);
 		return result;
+	}
+
+	//keep frame order
+	result = ws_tx_flush(cl);
+#endif
+
+	//send header and payload straight from the callers buffer
+	iov[0].iov_base = hdr_buf;
+	iov[0].iov_len = hdr_l;
+	iov[1].iov_base = p_data;
+	iov[1].iov_len = length;
+	if (result == ERR_OK) {
+		result = ws_send_iov(cl->sock, iov, (length > 0) ? 2 : 1);
+		if (result == ERR_CONN)
+			ws_tx_broken(cl, result);
+	}
+
+	xSemaphoreGive(cl->tx_lock);
+
+	return result;
+}
+
+static ws_client_t* ws_client_get(int client) {
+
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++)
+		if (WS_clients[i].state == WS_CL_OPEN && WS_clients[i].id == client)
+			return &WS_clients[i];
+	return NULL;
+}
+
+err_t WS_write(int client, WS_OPCODES opcode, char* p_data, size_t length, int flags) {
+
+	ws_client_t* cl;
+	err_t result = ERR_CONN;
+
+	//send to one client
+	if (client != WS_CLIENT_ALL) {
+		cl = ws_client_get(client);
+		if (cl == NULL)
+			return ERR_CONN;
+		return ws_write_frame(cl, client, opcode, 1, p_data, length, flags);
+	}
+
+	//broadcast, succeeds if at least one client got the frame
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		cl = &WS_clients[i];
+		if (cl->state == WS_CL_OPEN && ws_write_frame(cl, cl->id, opcode, 1, p_data, length, flags) == ERR_OK)
+			result = ERR_OK;
+	}
+	return result;
+}
+
+err_t WS_write_data(int client, char* p_data, size_t length) {
+
+	return WS_write(client, WS_OP_TXT, p_data, length, 0);
+}
+
+err_t WS_write_fragment(int client, char* p_data, size_t length, int first, int last) {
+
+	ws_client_t* cl = ws_client_get(client);
+
+	//check if we have an open connection
+	if (cl == NULL)
+		return ERR_CONN;
+
+	//first fragment carries the opcode, all others are continuation frames
+	return ws_write_frame(cl, client, first ? WS_OP_TXT : WS_OP_CON, last, p_data, length, last ? WS_TX_FLUSH : 0);
+}
+
+void WS_set_protocols(const char* const* protocols, int count) {
+
+	WS_protocols = protocols;
+	WS_protocols_n = count;
+}
+
+int WS_client_protocol(int client) {
+
+	ws_client_t* cl = ws_client_get(client);
+
+	return (cl != NULL) ? cl->protocol : -1;
+}
+
+void WS_conn_stats(WS_conn_stats_t* stats) {
+
+	portENTER_CRITICAL(&WS_tx_cnt_lock);
+	*stats = WS_conn_cnt;
+	stats->hs_lat_avg_us = (WS_conn_cnt.handshakes > 0) ? WS_hs_lat_sum / WS_conn_cnt.handshakes : 0;
+	portEXIT_CRITICAL(&WS_tx_cnt_lock);
+}
 
-	//send payload
-	return netconn_write(WS_conn, p_data, length, NETCONN_COPY);
+void WS_tx_stats(WS_tx_stats_t* stats) {
+
+	portENTER_CRITICAL(&WS_tx_cnt_lock);
+	*stats = WS_tx_cnt;
+	stats->flush_lat_avg_us = (WS_tx_cnt.flushes > 0) ? WS_tx_flush_lat_sum / WS_tx_cnt.flushes : 0;
+	portEXIT_CRITICAL(&WS_tx_cnt_lock);
+}
+
+static void ws_client_close(ws_client_t* cl) {
+
+	xSemaphoreTake(cl->tx_lock, portMAX_DELAY);
+
+#ifdef CONFIG_WS_TX_BATCH
+	//drop frames the client will not get anymore
+	esp_timer_stop(cl->tx_timer);
+	cl->tx_batch_l = 0;
+#endif
+
+	// Close the connection
+	close(cl->sock);
+	cl->sock = -1;
+	cl->state = WS_CL_FREE;
+
+	xSemaphoreGive(cl->tx_lock);
+
+	//release unfinished message
+	if (cl->p_msg != NULL)
+		ws_pool_put(cl->p_msg);
+	cl->p_msg = NULL;
+}
+
+static void ws_unmask(char* p_data, size_t length, const uint8_t* p_mask, size_t offset) {
+
+	size_t i = 0;
+	uint32_t mask_w;
+	uint8_t mask_b[WS_MASK_L];
+
+	//bytewise until the data is word aligned
+	for (; i < length && ((uintptr_t) &p_data[i] & 0x3); i++)
+		p_data[i] ^= p_mask[(offset + i) % WS_MASK_L];
+
+	//32 bit at a time, with the mask rotated to the current offset
+	for (int k = 0; k < WS_MASK_L; k++)
+		mask_b[k] = p_mask[(offset + i + k) % WS_MASK_L];
+	memcpy(&mask_w, mask_b, sizeof(mask_w));
+	for (; i + sizeof(uint32_t) <= length; i += sizeof(uint32_t))
+		*(uint32_t*) &p_data[i] ^= mask_w;
+
+	//remaining bytes
+	for (; i < length; i++)
+		p_data[i] ^= p_mask[(offset + i) % WS_MASK_L];
 }
 
-static void ws_server_netconn_serve(struct netconn *conn) {
+static void ws_close_status(ws_client_t* cl, uint16_t status) {
+
+	//close frame with a status code, the connection is closed by the caller
+	uint8_t payload[2] = { status >> 8, status & 0xFF };
+
+	ws_write_frame(cl, cl->id, WS_OP_CLS, 1, (char*) payload, sizeof(payload), WS_TX_FLUSH);
+}
+
+static void ws_rx_dropped(void) {
+
+	portENTER_CRITICAL(&WS_tx_cnt_lock);
+	WS_conn_cnt.rx_dropped++;
+	portEXIT_CRITICAL(&WS_tx_cnt_lock);
+}
 
-	//Netbuf
-	struct netbuf *inbuf;
+static int ws_frame_begin(ws_client_t* cl) {
 
-	//message buffer
-	char *buf;
+	//Frame header pointer
+	WS_frame_header_t* p_frame_hdr = (WS_frame_header_t*) cl->hdr;
 
-	//pointer to buffer (multi purpose)
+	uint8_t i = sizeof(WS_frame_header_t);
 	char* p_buf;
 
-	//Pointer to SHA1 input
-	char* p_SHA1_Inp;
+	//get payload length, extended lengths are in network byte order
+	cl->payload_l = p_frame_hdr->payload_length;
+	if (cl->payload_l == WS_EXT16_LEN) {
+		cl->payload_l = ((uint16_t) cl->hdr[i] << 8) | cl->hdr[i + 1];
+	} else if (cl->payload_l == WS_EXT64_LEN) {
+		cl->payload_l = 0;
+		for (int j = 0; j < 8; j++)
+			cl->payload_l = (cl->payload_l << 8) | cl->hdr[i + j];
+	}
+	cl->copied = 0;
+
+	//reserved opcodes are a protocol error, they never reach the message path
+	switch (p_frame_hdr->opcode) {
+	case WS_OP_CON:
+	case WS_OP_TXT:
+	case WS_OP_BIN:
+	case WS_OP_CLS:
+	case WS_OP_PIN:
+	case WS_OP_PON:
+		break;
+	default:
+		ws_close_status(cl, WS_CLOSE_PROTOCOL);
+		return -1;
+	}
+
+	//clients must mask all frames (RFC 6455 5.1)
+	if (!p_frame_hdr->mask) {
+		ws_close_status(cl, WS_CLOSE_PROTOCOL);
+		return -1;
+	}
+
+	if (p_frame_hdr->opcode & WS_CTRL_BIT) {
+
+		//control frames must not be fragmented or exceed 125 bytes
+		if (!p_frame_hdr->FIN || cl->payload_l > WS_STD_LEN) {
+			ws_close_status(cl, WS_CLOSE_PROTOCOL);
+			return -1;
+		}
+
+		cl->p_dst = cl->ctrl;
+		return 0;
+	}
+
+	//first fragment of a new message
+	if (p_frame_hdr->opcode != WS_OP_CON) {
+		if (cl->p_msg != NULL)
+			ws_pool_put(cl->p_msg);
+		cl->p_msg = NULL;
+		cl->msg_hdr = *p_frame_hdr;
+		cl->msg_l = 0;
+		cl->msg_active = 1;
+		cl->msg_discard = 0;
+	}
+
+	//continuation without a started message
+	if (!cl->msg_active) {
+		ws_close_status(cl, WS_CLOSE_PROTOCOL);
+		return -1;
+	}
+
+	//check if the reassembled message fits
+	if (cl->payload_l > WS_MAX_MSG_LEN - cl->msg_l) {
+		ws_close_status(cl, WS_CLOSE_TOO_BIG);
+		return -1;
+	}
+
+	//move to a larger buffer if needed (+1 for the 0 terminator)
+	if (!cl->msg_discard && (cl->p_msg == NULL || cl->msg_l + cl->payload_l + 1 > ws_pool_size(cl->p_msg))) {
+
+		//the server task never waits, other clients would stall with it
+		p_buf = ws_pool_get(cl->msg_l + cl->payload_l + 1);
 
-	//Pointer to SHA1 result
-	char* p_SHA1_result;
+		if (cl->p_msg != NULL) {
+			if (p_buf != NULL)
+				memcpy(p_buf, cl->p_msg, cl->msg_l);
+			ws_pool_put(cl->p_msg);
+		}
+		cl->p_msg = p_buf;
+
+		//no buffer free, drop the message but stay in sync with the stream
+		if (p_buf == NULL)
+			cl->msg_discard = 1;
+	}
 
-	//multi purpose number buffer
-	uint16_t i;
+	cl->p_dst = cl->msg_discard ? NULL : &cl->p_msg[cl->msg_l];
+	return 0;
+}
 
-	//will point to payload (send and receive
-	char* p_payload;
+static int ws_frame_end(ws_client_t* cl) {
 
 	//Frame header pointer
-	WS_frame_header_t* p_frame_hdr;
+	WS_frame_header_t* p_frame_hdr = (WS_frame_header_t*) cl->hdr;
+
+	//next frame starts with a new header
+	cl->hdr_l = 0;
+	cl->hdr_need = sizeof(WS_frame_header_t);
+
+	switch (p_frame_hdr->opcode) {
+
+	//check if clients wants to close the connection
+	case WS_OP_CLS:
+		ws_write_frame(cl, cl->id, WS_OP_CLS, 1, NULL, 0, WS_TX_FLUSH);
+		return -1;
+
+	//answer ping with the same payload
+	case WS_OP_PIN:
+		ws_write_frame(cl, cl->id, WS_OP_PON, 1, cl->ctrl, cl->payload_l, WS_TX_FLUSH);
+		return 0;
 
-	//allocate memory for SHA1 input
-//	p_SHA1_Inp = pvPortMallocCaps(WS_CLIENT_KEY_L + sizeof(WS_sec_conKey), MALLOC_CAP_8BIT);
-	p_SHA1_Inp = heap_caps_malloc(WS_CLIENT_KEY_L + sizeof(WS_sec_conKey), MALLOC_CAP_8BIT);
+	case WS_OP_PON:
+		return 0;
 
-	//allocate memory for SHA1 result
-//	p_SHA1_result = pvPortMallocCaps(SHA1_RES_L, MALLOC_CAP_8BIT);
-	p_SHA1_result = heap_caps_malloc(SHA1_RES_L, MALLOC_CAP_8BIT);
+	case WS_OP_CON:
+	case WS_OP_TXT:
+	case WS_OP_BIN:
+		break;
 
-	//Check if malloc suceeded
-	if ((p_SHA1_Inp != NULL) && (p_SHA1_result != NULL)) {
+	//rejected by ws_frame_begin
+	default:
+		return -1;
+	}
+
+	//no message to add to, ws_frame_begin refused it already
+	if (!cl->msg_active)
+		return -1;
+
+	cl->msg_l += cl->payload_l;
 
-		//receive handshake request
-		if (netconn_recv(conn, &inbuf) == ERR_OK) {
+	//wait for further fragments
+	if (!p_frame_hdr->FIN)
+		return 0;
 
-			//read buffer
-			netbuf_data(inbuf, (void**) &buf, &i);
+	cl->msg_active = 0;
+
+	//message was dropped
+	if (cl->msg_discard) {
+		ws_rx_dropped();
+		return 0;
+	}
 
-			//write static key into SHA1 Input
-			for (i = 0; i < sizeof(WS_sec_conKey); i++)
-				p_SHA1_Inp[i + WS_CLIENT_KEY_L] = WS_sec_conKey[i];
+	//add 0 terminator
+	cl->p_msg[cl->msg_l] = 0;
+
+	//do stuff
+	if (cl->msg_hdr.opcode == WS_OP_TXT || cl->msg_hdr.opcode == WS_OP_BIN) {
+
+		//prepare FreeRTOS message
+		WebSocket_frame_t __ws_frame;
+		__ws_frame.client=cl->id;
+		__ws_frame.slot=cl - WS_clients;
+		__ws_frame.protocol=cl->protocol;
+		__ws_frame.frame_header=cl->msg_hdr;
+		__ws_frame.payload_length=cl->msg_l;
+		__ws_frame.payload=cl->p_msg;
+
+		//send message, payload is released by the receive task, a full queue drops it
+		if (xQueueSend(WebSocket_rx_queue,&__ws_frame,0) == pdTRUE)
+			cl->p_msg = NULL;
+		else
+			ws_rx_dropped();
+	}
 
-			//find Client Sec-WebSocket-Key:
-			p_buf = strstr(buf, WS_sec_WS_keys);
+	//release payload buffer if not handed over
+	if (cl->p_msg != NULL)
+		ws_pool_put(cl->p_msg);
+	cl->p_msg = NULL;
+	cl->msg_l = 0;
+	return 0;
+}
 
-			//check if needle "Sec-WebSocket-Key:" was found
-			if (p_buf != NULL) {
+static int ws_client_feed(ws_client_t* cl, const char* p_data, size_t length) {
+
+	WS_frame_header_t* p_frame_hdr = (WS_frame_header_t*) cl->hdr;
+	size_t n;
+
+	//resumable: headers and payloads may end anywhere in the data
+	while (length > 0) {
+
+		//collect header
+		if (cl->hdr_l < cl->hdr_need) {
+			n = cl->hdr_need - cl->hdr_l;
+			if (n > length)
+				n = length;
+			memcpy(&cl->hdr[cl->hdr_l], p_data, n);
+			cl->hdr_l += n;
+			p_data += n;
+			length -= n;
+
+			if (cl->hdr_l < cl->hdr_need)
+				return 0;
+
+			//the first two bytes tell the length of the complete header
+			if (cl->hdr_need == sizeof(WS_frame_header_t)) {
+				if (p_frame_hdr->payload_length == WS_EXT16_LEN)
+					cl->hdr_need += 2;
+				else if (p_frame_hdr->payload_length == WS_EXT64_LEN)
+					cl->hdr_need += 8;
+				if (p_frame_hdr->mask)
+					cl->hdr_need += WS_MASK_L;
+				if (cl->hdr_l < cl->hdr_need)
+					continue;
+			}
+
+			if (ws_frame_begin(cl) < 0)
+				return -1;
+		}
+
+		//copy and decode payload, the mask is the last part of the header
+		n = cl->payload_l - cl->copied;
+		if (n > length)
+			n = length;
+		if (n > 0 && cl->p_dst != NULL) {
+			memcpy(&cl->p_dst[cl->copied], p_data, n);
+			ws_unmask(&cl->p_dst[cl->copied], n, &cl->hdr[cl->hdr_need - WS_MASK_L], cl->copied);
+		}
+		cl->copied += n;
+		p_data += n;
+		length -= n;
+
+		//frame complete, the rest of the data belongs to the next frame
+		if (cl->copied == cl->payload_l && ws_frame_end(cl) < 0)
+			return -1;
+	}
+	return 0;
+}
 
-				//get Client Key
-				for (i = 0; i < WS_CLIENT_KEY_L; i++)
-					p_SHA1_Inp[i] = *(p_buf + sizeof(WS_sec_WS_keys) + i);
+static int ws_has_token(const char* p_value, const char* p_token) {
 
-				// calculate hash
-				esp_sha(SHA1, (unsigned char*) p_SHA1_Inp, strlen(p_SHA1_Inp), (unsigned char*) p_SHA1_result);
+	size_t l = strlen(p_token);
 
-				//hex to base64
-				p_buf = (char*) _base64_encode((unsigned char*) p_SHA1_result, SHA1_RES_L, (size_t*) &i);
+	//comma separated list, tokens are case-insensitive
+	while (*p_value != 0) {
+		while (*p_value == ' ' || *p_value == '\t' || *p_value == ',')
+			p_value++;
+		if (strncasecmp(p_value, p_token, l) == 0
+				&& (p_value[l] == 0 || p_value[l] == ',' || p_value[l] == ' ' || p_value[l] == '\t'))
+			return 1;
+		while (*p_value != 0 && *p_value != ',')
+			p_value++;
+	}
+	return 0;
+}
 
-				//free SHA1 input
-				free(p_SHA1_Inp);
+static int ws_select_protocol(const char* p_value) {
 
-				//free SHA1 result
-				free(p_SHA1_result);
+	const char* p_tok;
 
-				//allocate memory for handshake
-//				p_payload = pvPortMallocCaps(sizeof(WS_srv_hs) + i - WS_SPRINTF_ARG_L, MALLOC_CAP_8BIT);
-				p_payload = heap_caps_malloc(sizeof(WS_srv_hs) + i - WS_SPRINTF_ARG_L, MALLOC_CAP_8BIT);
+	//first protocol of the client's list we support
+	while (*p_value != 0) {
+		while (*p_value == ' ' || *p_value == '\t' || *p_value == ',')
+			p_value++;
+		for (p_tok = p_value; *p_value != 0 && *p_value != ',' && *p_value != ' ' && *p_value != '\t'; p_value++);
+		for (int k = 0; k < WS_protocols_n; k++)
+			if (strlen(WS_protocols[k]) == (size_t) (p_value - p_tok) && strncmp(p_tok, WS_protocols[k], p_value - p_tok) == 0)
+				return k;
+	}
+	return -1;
+}
 
-				//check if malloc suceeded
-				if (p_payload != NULL) {
+static int ws_hs_line(ws_client_t* cl) {
 
-					//prepare handshake
-					sprintf(p_payload, WS_srv_hs, i - 1, p_buf);
+	ws_hs_t* hs = &cl->hs;
+	char* p_value;
+	size_t l = hs->line_l;
 
-					//send handshake
-					netconn_write(conn, p_payload, strlen(p_payload), NETCONN_COPY);
+	//request line: GET <resource> HTTP/1.1
+	if (!hs->req_line) {
+		hs->req_line = 1;
+		if (l < 14 || strncmp(hs->line, "GET ", 4) != 0 || strcmp(&hs->line[l - 9], " HTTP/1.1") != 0)
+			return 400;
+		return 0;
+	}
 
-					//free base 64 encoded sec key
-					free(p_buf);
+	//empty line ends the headers
+	if (l == 0) {
+		if (hs->bad_version)
+			return 426;
+		return (hs->flags == WS_HS_ALL) ? 1 : 400;
+	}
 
-					//free handshake memory
-					free(p_payload);
+	//split header name and value
+	p_value = strchr(hs->line, ':');
+	if (p_value == NULL)
+		return 400;
+	*p_value++ = 0;
+	while (*p_value == ' ' || *p_value == '\t')
+		p_value++;
+	while (l > 0 && (hs->line[l - 1] == ' ' || hs->line[l - 1] == '\t'))
+		hs->line[--l] = 0;
+
+	//header names are case-insensitive
+	if (strcasecmp(hs->line, "Host") == 0) {
+		hs->flags |= WS_HS_HOST;
+	} else if (strcasecmp(hs->line, "Upgrade") == 0) {
+		if (ws_has_token(p_value, "websocket"))
+			hs->flags |= WS_HS_UPGRADE;
+	} else if (strcasecmp(hs->line, "Connection") == 0) {
+		if (ws_has_token(p_value, "Upgrade"))
+			hs->flags |= WS_HS_CONNECTION;
+	} else if (strcasecmp(hs->line, "Sec-WebSocket-Version") == 0) {
+		if (strcmp(p_value, WS_VERSION) == 0)
+			hs->flags |= WS_HS_VERSION;
+		else
+			hs->bad_version = 1;
+	} else if (strcasecmp(hs->line, "Sec-WebSocket-Key") == 0) {
+		if (strlen(p_value) != WS_CLIENT_KEY_L)
+			return 400;
+		memcpy(hs->key, p_value, WS_CLIENT_KEY_L);
+		hs->flags |= WS_HS_KEY;
+	} else if (strcasecmp(hs->line, "Sec-WebSocket-Protocol") == 0) {
+		if (cl->protocol < 0)
+			cl->protocol = ws_select_protocol(p_value);
+	}
+	return 0;
+}
 
-					//set pointer to open WebSocket connection
-					WS_conn = conn;
+static int ws_hs_feed(ws_client_t* cl, const char* p_data, size_t length, size_t* p_used) {
 
-					//Wait for new data
-					while (netconn_recv(conn, &inbuf) == ERR_OK) {
+	ws_hs_t* hs = &cl->hs;
+	int r;
+	char c;
 
-						//read data from inbuf
-						netbuf_data(inbuf, (void**) &buf, &i);
+	for (*p_used = 0; *p_used < length;) {
+		c = p_data[(*p_used)++];
 
-						//get pointer to header
-						p_frame_hdr = (WS_frame_header_t*) buf;
+		//bounded request size
+		if (++hs->total > WS_HS_MAX_L)
+			return 400;
 
-						//check if clients wants to close the connection
-						if (p_frame_hdr->opcode == WS_OP_CLS){
-							break;
-						}
+		if (c == '\r')
+			continue;
 
-						//get payload length
-						if (p_frame_hdr->payload_length <= WS_STD_LEN) {
+		//collect line, the tail of overlong lines is dropped
+		if (c != '\n') {
+			if (hs->line_l < WS_HS_LINE_L - 1)
+				hs->line[hs->line_l++] = c;
+			continue;
+		}
 
-							//get beginning of mask or payload
-							p_buf = (char*) &buf[sizeof(WS_frame_header_t)];
+		hs->line[hs->line_l] = 0;
+		r = ws_hs_line(cl);
+		hs->line_l = 0;
+		if (r != 0)
+			return r;
+	}
+	return 0;
+}
 
-							//check if content is masked
-							if (p_frame_hdr->mask) {
+static void ws_hs_accept_key(const char* p_key, char* p_accept) {
 
-								//allocate memory for decoded message
-//								p_payload = pvPortMallocCaps(p_frame_hdr->payload_length + 1, MALLOC_CAP_8BIT);
-								p_payload = heap_caps_malloc(p_frame_hdr->payload_length + 1, MALLOC_CAP_8BIT);
+	//SHA1 input: client key + GUID
+	uint8_t sha_in[WS_CLIENT_KEY_L + sizeof(WS_sec_conKey) - 1];
+	uint8_t sha_res[SHA1_RES_L + 1];
+	uint32_t v;
+	int i, j;
 
-								//check if malloc succeeded
-								if (p_payload != NULL) {
+	memcpy(sha_in, p_key, WS_CLIENT_KEY_L);
+	memcpy(&sha_in[WS_CLIENT_KEY_L], WS_sec_conKey, sizeof(WS_sec_conKey) - 1);
 
-									//decode playload
-									for (i = 0; i < p_frame_hdr->payload_length; i++)
-										p_payload[i] = (p_buf + WS_MASK_L)[i] ^ p_buf[i % WS_MASK_L];
+	// calculate hash
+	esp_sha(SHA1, sha_in, sizeof(sha_in), sha_res);
 
-									//add 0 terminator
-									p_payload[p_frame_hdr->payload_length] = 0;
-								}
-							} else
-								//content is not masked
-								p_payload = p_buf;
+	//base64, 20 bytes are 6 full groups and one padded group
+	sha_res[SHA1_RES_L] = 0;
+	for (i = 0, j = 0; i < SHA1_RES_L; i += 3) {
+		v = (sha_res[i] << 16) | (sha_res[i + 1] << 8) | ((i + 2 < SHA1_RES_L) ? sha_res[i + 2] : 0);
+		p_accept[j++] = WS_base64[(v >> 18) & 0x3F];
+		p_accept[j++] = WS_base64[(v >> 12) & 0x3F];
+		p_accept[j++] = WS_base64[(v >> 6) & 0x3F];
+		p_accept[j++] = (i + 2 < SHA1_RES_L) ? WS_base64[v & 0x3F] : '=';
+	}
+}
 
-							//do stuff
-							if ((p_payload != NULL)	&& (p_frame_hdr->opcode == WS_OP_TXT)) {
+static int ws_client_handshake(ws_client_t* cl) {
+
+	//handshake response
+	char resp[WS_HS_RESP_L];
+	size_t l, used;
+	int n, r;
+	uint32_t lat;
+
+	//receive (part of) handshake request
+	n = recv(cl->sock, WS_rx_chunk, sizeof(WS_rx_chunk), MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (n <= 0)
+		return -1;
+
+	r = ws_hs_feed(cl, WS_rx_chunk, n, &used);
+
+	//wait for the rest of the request
+	if (r == 0)
+		return 0;
+
+	//reject bad requests
+	if (r != 1) {
+		if (r == 426)
+			ws_send_all(cl->sock, WS_srv_426, sizeof(WS_srv_426) - 1);
+		else
+			ws_send_all(cl->sock, WS_srv_400, sizeof(WS_srv_400) - 1);
+		portENTER_CRITICAL(&WS_tx_cnt_lock);
+		WS_conn_cnt.hs_failed++;
+		portEXIT_CRITICAL(&WS_tx_cnt_lock);
+		return -1;
+	}
 
-								//prepare FreeRTOS message
-								WebSocket_frame_t __ws_frame;
-								__ws_frame.conenction=conn;
-								__ws_frame.frame_header=*p_frame_hdr;
-								__ws_frame.payload_length=p_frame_hdr->payload_length;
-								__ws_frame.payload=p_payload;
+	//prepare handshake
+	l = sizeof(WS_srv_hs) - 1;
+	memcpy(resp, WS_srv_hs, l);
+	ws_hs_accept_key(cl->hs.key, &resp[l]);
+	l += WS_ACCEPT_L;
+	if (cl->protocol >= 0 && l + sizeof(WS_srv_proto) + strlen(WS_protocols[cl->protocol]) + 4 <= sizeof(resp)) {
+		memcpy(&resp[l], WS_srv_proto, sizeof(WS_srv_proto) - 1);
+		l += sizeof(WS_srv_proto) - 1;
+		memcpy(&resp[l], WS_protocols[cl->protocol], strlen(WS_protocols[cl->protocol]));
+		l += strlen(WS_protocols[cl->protocol]);
+	} else {
+		cl->protocol = -1;
+	}
+	memcpy(&resp[l], "\r\n\r\n", 4);
+	l += 4;
+
+	//send handshake
+	if (ws_send_all(cl->sock, resp, l) != ERR_OK)
+		return -1;
+
+	lat = esp_timer_get_time() - cl->accept_t;
+	portENTER_CRITICAL(&WS_tx_cnt_lock);
+	WS_conn_cnt.handshakes++;
+	WS_hs_lat_sum += lat;
+	if (lat > WS_conn_cnt.hs_lat_max_us)
+		WS_conn_cnt.hs_lat_max_us = lat;
+	portEXIT_CRITICAL(&WS_tx_cnt_lock);
+
+	//connection is open now
+	cl->hdr_l = 0;
+	cl->hdr_need = sizeof(WS_frame_header_t);
+	cl->msg_active = 0;
+	cl->state = WS_CL_OPEN;
+
+	//data behind the request already belongs to frames
+	return (ws_client_feed(cl, &WS_rx_chunk[used], n - used) < 0) ? -1 : 0;
+}
 
-								//send message
-								xQueueSendFromISR(WebSocket_rx_queue,&__ws_frame,0);
-							}
+static int ws_client_read(ws_client_t* cl) {
 
-							//free payload buffer (in this demo done by the receive task)
-//							if (p_frame_hdr->mask && p_payload != NULL)
-//								free(p_payload);
+	int n;
 
-						} //p_frame_hdr->payload_length<126
+	//read as much as available, one read may hold several frames
+	n = recv(cl->sock, WS_rx_chunk, sizeof(WS_rx_chunk), MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (n <= 0)
+		return -1;
 
-						//free input buffer
-						netbuf_delete(inbuf);
+	return (ws_client_feed(cl, WS_rx_chunk, n) < 0) ? -1 : 1;
+}
 
-					} //while(netconn_recv(conn, &inbuf)==ERR_OK)
-				} //p_payload!=NULL
-			} //check if needle "Sec-WebSocket-Key:" was found
-		} //receive handshake
-	} //p_SHA1_Inp!=NULL&p_SHA1_result!=NULL
+static void ws_client_accept(int listen_sock) {
 
-	//release pointer to open WebSocket connection
-	WS_conn = NULL;
+	struct sockaddr_in addr;
+	socklen_t addr_l = sizeof(addr);
+	struct timeval tv = { .tv_sec = WS_SEND_TIMEOUT_MS / 1000, .tv_usec = (WS_SEND_TIMEOUT_MS % 1000) * 1000 };
+	ws_client_t* cl = NULL;
 
-	//delete buffer
-	netbuf_delete(inbuf);
+	int sock = accept(listen_sock, (struct sockaddr*) &addr, &addr_l);
+	if (sock < 0)
+		return;
 
-	// Close the connection
-	netconn_close(conn);
+	//find a free slot
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		if (WS_clients[i].state == WS_CL_FREE) {
+			cl = &WS_clients[i];
+			break;
+		}
+	}
 
-	//Delete connection
-	netconn_delete(conn);
+	//all slots taken
+	if (cl == NULL) {
+		close(sock);
+		portENTER_CRITICAL(&WS_tx_cnt_lock);
+		WS_conn_cnt.rejected++;
+		portEXIT_CRITICAL(&WS_tx_cnt_lock);
+		return;
+	}
 
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+#ifdef CONFIG_WS_TCP_NODELAY
+	//frames are written in one piece, no need to wait for more data
+	int nodelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+#endif
+
+	xSemaphoreTake(cl->tx_lock, portMAX_DELAY);
+	cl->sock = sock;
+	cl->id = ++WS_last_id;
+	cl->protocol = -1;
+	cl->accept_t = esp_timer_get_time();
+	cl->tx_err = ERR_OK;
+	memset(&cl->hs, 0, sizeof(cl->hs));
+	cl->state = WS_CL_HANDSHAKE;
+	xSemaphoreGive(cl->tx_lock);
+
+	portENTER_CRITICAL(&WS_tx_cnt_lock);
+	WS_conn_cnt.accepted++;
+	portEXIT_CRITICAL(&WS_tx_cnt_lock);
 }
 
 void ws_server(void *pvParameters) {
-	//connection references
-	struct netconn *conn, *newconn;
 
-	//set up new TCP listener
-	conn = netconn_new(NETCONN_TCP);
-	netconn_bind(conn, NULL, WS_PORT);
-	netconn_listen(conn);
+	struct sockaddr_in addr;
+	fd_set rfds;
+	int listen_sock, max_fd, i, r;
+	ws_client_t* cl;
+
+	//set up receive buffers
+	ws_pool_init();
+
+	//set up client table
+	for (i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		WS_clients[i].sock = -1;
+		WS_clients[i].state = WS_CL_FREE;
+		WS_clients[i].tx_lock = xSemaphoreCreateMutex();
+#ifdef CONFIG_WS_TX_BATCH
+		esp_timer_create_args_t timer_args = {
+			.callback = ws_tx_timer_cb,
+			.arg = &WS_clients[i],
+			.name = "ws_tx"
+		};
+		esp_timer_create(&timer_args, &WS_clients[i].tx_timer);
+#endif
+	}
 
-	//wait for connections
-	while (netconn_accept(conn, &newconn) == ERR_OK){
-		ws_server_netconn_serve(newconn);
+	//set up new TCP listener
+	listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(WS_PORT);
+	if (listen_sock < 0 || bind(listen_sock, (struct sockaddr*) &addr, sizeof(addr)) != 0
+			|| listen(listen_sock, WS_LISTEN_BACKLOG) != 0) {
+		close(listen_sock);
+		vTaskDelete(NULL);
+		return;
 	}
 
-	//close connection
-	netconn_close(conn);
-	netconn_delete(conn);
+	//wait for connections and data
+	while (1) {
+		FD_ZERO(&rfds);
+		FD_SET(listen_sock, &rfds);
+		max_fd = listen_sock;
+		for (i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+			if (WS_clients[i].state != WS_CL_FREE) {
+				FD_SET(WS_clients[i].sock, &rfds);
+				if (WS_clients[i].sock > max_fd)
+					max_fd = WS_clients[i].sock;
+			}
+		}
+
+		if (select(max_fd + 1, &rfds, NULL, NULL, NULL) <= 0)
+			continue;
+
+		//new connection
+		if (FD_ISSET(listen_sock, &rfds))
+			ws_client_accept(listen_sock);
+
+		//serve clients with pending data
+		for (i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+			cl = &WS_clients[i];
+			if (cl->state == WS_CL_FREE || !FD_ISSET(cl->sock, &rfds))
+				continue;
+
+			if (cl->state == WS_CL_HANDSHAKE) {
+				r = ws_client_handshake(cl);
+			} else {
+				//consume everything available without blocking
+				while ((r = ws_client_read(cl)) > 0);
+			}
+
+			if (r < 0)
+				ws_client_close(cl);
+		}
+	}
 }
 
 int ws_check_client() {
-	return (WS_conn == NULL) ? 0 : 1;
+
+	int n = 0;
+
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++)
+		if (WS_clients[i].state == WS_CL_OPEN)
+			n++;
+	return n;
 }
 
 void ws_rst_client() {
-	netconn_close(WS_conn);
-	netconn_delete(WS_conn);
+
+	//the server task sees the shutdown as end of stream and closes the sockets
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++)
+		if (WS_clients[i].state != WS_CL_FREE)
+			shutdown(WS_clients[i].sock, SHUT_RDWR);
 }
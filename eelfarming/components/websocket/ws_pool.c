@@ -0,0 +1,186 @@
+/**
+ * @section License
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017, Thomas Barth, barth-dev.de
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "ws_pool.h"
+#include "websocket.h"
+
+#include "freertos/FreeRTOS.h"
+
+#define WS_POOL_NIL			0xFFFF		/**< \brief End of a free-list*/
+#define WS_POOL_TAG_INC		0x10000		/**< \brief Tag increment, the tag defeats ABA on the list head*/
+
+/** \brief Buffer class with a lock-free free-list (Treiber stack of buffer indices)*/
+typedef struct {
+	volatile uint32_t	head;			/**< \brief Index of the first free buffer (low 16 bit) and tag (high 16 bit)*/
+	uint16_t*			next;			/**< \brief Free-list links*/
+	char*				mem;			/**< \brief Buffer memory*/
+	uint16_t			size;			/**< \brief Size of one buffer*/
+	uint16_t			count;			/**< \brief Number of buffers*/
+	volatile uint32_t	in_use;			/**< \brief Buffers taken*/
+	volatile uint32_t	high_water;		/**< \brief Maximum of in_use*/
+	volatile uint32_t	exhausted;		/**< \brief Requests that found the class empty*/
+} ws_pool_t;
+
+static char WS_pool_small_mem[CONFIG_WS_POOL_SMALL_NUM * CONFIG_WS_POOL_SMALL_SIZE] __attribute__((aligned(4)));
+static uint16_t WS_pool_small_next[CONFIG_WS_POOL_SMALL_NUM];
+static char WS_pool_large_mem[CONFIG_WS_POOL_LARGE_NUM * CONFIG_WS_POOL_LARGE_SIZE] __attribute__((aligned(4)));
+static uint16_t WS_pool_large_next[CONFIG_WS_POOL_LARGE_NUM];
+
+//buffer classes, ordered by size
+static ws_pool_t WS_pools[WS_POOL_CLASSES] = {
+	{ .next = WS_pool_small_next, .mem = WS_pool_small_mem, .size = CONFIG_WS_POOL_SMALL_SIZE, .count = CONFIG_WS_POOL_SMALL_NUM },
+	{ .next = WS_pool_large_next, .mem = WS_pool_large_mem, .size = CONFIG_WS_POOL_LARGE_SIZE, .count = CONFIG_WS_POOL_LARGE_NUM },
+};
+
+static uint32_t ws_atomic_add(volatile uint32_t* p_val, int32_t delta) {
+
+	uint32_t old, set;
+
+	do {
+		old = *p_val;
+		set = old + delta;
+		uxPortCompareSet(p_val, old, &set);
+	} while (set != old);
+
+	return old + delta;
+}
+
+static void ws_atomic_max(volatile uint32_t* p_val, uint32_t val) {
+
+	uint32_t old, set;
+
+	do {
+		old = *p_val;
+		if (old >= val)
+			return;
+		set = val;
+		uxPortCompareSet(p_val, old, &set);
+	} while (set != old);
+}
+
+static ws_pool_t* ws_pool_of(const char* p_buf) {
+
+	for (int i = 0; i < WS_POOL_CLASSES; i++)
+		if (p_buf >= WS_pools[i].mem && p_buf < WS_pools[i].mem + WS_pools[i].size * WS_pools[i].count)
+			return &WS_pools[i];
+	return NULL;
+}
+
+static char* ws_pool_take(ws_pool_t* pool) {
+
+	uint32_t old, set;
+	uint16_t idx;
+
+	//pop the head of the free-list
+	do {
+		old = pool->head;
+		idx = old & 0xFFFF;
+		if (idx == WS_POOL_NIL) {
+			ws_atomic_add(&pool->exhausted, 1);
+			return NULL;
+		}
+		set = ((old + WS_POOL_TAG_INC) & ~0xFFFF) | pool->next[idx];
+		uxPortCompareSet(&pool->head, old, &set);
+	} while (set != old);
+
+	ws_atomic_max(&pool->high_water, ws_atomic_add(&pool->in_use, 1));
+
+	return &pool->mem[idx * pool->size];
+}
+
+void ws_pool_init(void) {
+
+	for (int i = 0; i < WS_POOL_CLASSES; i++) {
+		ws_pool_t* pool = &WS_pools[i];
+		for (uint16_t j = 0; j < pool->count; j++)
+			pool->next[j] = (j + 1 < pool->count) ? j + 1 : WS_POOL_NIL;
+		pool->head = 0;
+		pool->in_use = 0;
+	}
+}
+
+char* ws_pool_get(size_t size) {
+
+	char* p_buf;
+
+	for (int i = 0; i < WS_POOL_CLASSES; i++) {
+		if (size > WS_pools[i].size)
+			continue;
+
+		//fall back to a larger class if this one is empty
+		p_buf = ws_pool_take(&WS_pools[i]);
+		if (p_buf != NULL)
+			return p_buf;
+	}
+	return NULL;
+}
+
+void ws_pool_put(char* p_buf) {
+
+	ws_pool_t* pool = ws_pool_of(p_buf);
+	uint32_t old, set;
+	uint16_t idx;
+
+	if (pool == NULL)
+		return;
+
+	idx = (p_buf - pool->mem) / pool->size;
+
+	//push onto the free-list
+	do {
+		old = pool->head;
+		pool->next[idx] = old & 0xFFFF;
+		set = ((old + WS_POOL_TAG_INC) & ~0xFFFF) | idx;
+		uxPortCompareSet(&pool->head, old, &set);
+	} while (set != old);
+
+	ws_atomic_add(&pool->in_use, -1);
+}
+
+size_t ws_pool_size(const char* p_buf) {
+
+	ws_pool_t* pool = ws_pool_of(p_buf);
+
+	return (pool != NULL) ? pool->size : 0;
+}
+
+void WS_frame_free(char* payload) {
+
+	ws_pool_put(payload);
+}
+
+void WS_pool_stats(WS_pool_stats_t stats[WS_POOL_CLASSES]) {
+
+	for (int i = 0; i < WS_POOL_CLASSES; i++) {
+		stats[i].size = WS_pools[i].size;
+		stats[i].count = WS_pools[i].count;
+		stats[i].in_use = WS_pools[i].in_use;
+		stats[i].high_water = WS_pools[i].high_water;
+		stats[i].exhausted = WS_pools[i].exhausted;
+	}
+}
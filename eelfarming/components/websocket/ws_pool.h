@@ -0,0 +1,60 @@
+/**
+ * @section License
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2017, Thomas Barth, barth-dev.de
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WS_POOL_H_
+#define WS_POOL_H_
+
+#include <stddef.h>
+
+/**
+ * \brief Set up the free-lists of all buffer classes
+ */
+void ws_pool_init(void);
+
+/**
+ * \brief Take the smallest free buffer holding at least \p size bytes
+ *
+ * Lock-free, may be called from any task.
+ *
+ * \return 	buffer or NULL if no buffer of a fitting class is free
+ */
+char* ws_pool_get(size_t size);
+
+/**
+ * \brief Return a buffer taken with #ws_pool_get
+ *
+ * Lock-free, may be called from any task.
+ */
+void ws_pool_put(char* p_buf);
+
+/**
+ * \brief Capacity of a buffer taken with #ws_pool_get
+ */
+size_t ws_pool_size(const char* p_buf);
+
+#endif /* WS_POOL_H_ */
@@ -0,0 +1,106 @@
+/*
+ * Compact binary telemetry protocol
+ *
+ * */
+#include <string.h>
+
+#include "binproto.h"
+
+static void bp_put_u32(uint8_t *buf, uint32_t v)
+{
+	buf[0] = v;
+	buf[1] = v >> 8;
+	buf[2] = v >> 16;
+	buf[3] = v >> 24;
+}
+
+static uint32_t bp_get_u32(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static void bp_put_float(uint8_t *buf, float f)
+{
+	uint32_t v;
+	memcpy(&v, &f, sizeof(v));
+	bp_put_u32(buf, v);
+}
+
+static float bp_get_float(const uint8_t *buf)
+{
+	uint32_t v = bp_get_u32(buf);
+	float f;
+	memcpy(&f, &v, sizeof(f));
+	return f;
+}
+
+static void bp_put_hdr(uint8_t *buf, bp_type_t type, uint8_t arg, uint8_t status)
+{
+	buf[0] = BP_VERSION;
+	buf[1] = type;
+	buf[2] = arg;
+	buf[3] = status;
+}
+
+int bp_decode_cmd(const uint8_t *buf, size_t len, bp_cmd_t *cmd)
+{
+	if (len < BP_HDR_L || buf[0] != BP_VERSION || buf[1] != BP_T_CMD) {
+		return -1;
+	}
+	cmd->cmd = buf[2];
+	cmd->mask = (buf[3] ? buf[3] : TM_CH_ALL) & TM_CH_ALL;
+	if (cmd->mask == 0) {
+		/*only unknown channels*/
+		return -1;
+	}
+	cmd->ms = (len >= BP_HDR_L + 4) ? bp_get_u32(&buf[BP_HDR_L]) : 0;
+	cmd->threshold = (len >= BP_HDR_L + 8) ? bp_get_float(&buf[BP_HDR_L + 4]) : 0;
+	return 0;
+}
+
+size_t bp_encode_cmd(uint8_t *buf, const bp_cmd_t *cmd)
+{
+	bp_put_hdr(buf, BP_T_CMD, cmd->cmd, cmd->mask);
+	bp_put_u32(&buf[BP_HDR_L], cmd->ms);
+	bp_put_float(&buf[BP_HDR_L + 4], cmd->threshold);
+	return BP_CMD_MAX_L;
+}
+
+size_t bp_encode_status(uint8_t *buf, uint8_t cmd, uint8_t status)
+{
+	bp_put_hdr(buf, BP_T_STATUS, cmd, status);
+	return BP_HDR_L;
+}
+
+size_t bp_encode_snapshot(uint8_t *buf, uint8_t mask, const float values[TM_CH_MAX])
+{
+	size_t len = BP_HDR_L;
+
+	bp_put_hdr(buf, BP_T_SNAPSHOT, mask, 0);
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		if (mask & (1 << ch)) {
+			bp_put_float(&buf[len], values[ch]);
+			len += sizeof(float);
+		}
+	}
+	return len;
+}
+
+int bp_decode_snapshot(const uint8_t *buf, size_t len, float values[TM_CH_MAX])
+{
+	size_t pos = BP_HDR_L;
+
+	if (len < BP_HDR_L || buf[0] != BP_VERSION || buf[1] != BP_T_SNAPSHOT) {
+		return -1;
+	}
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		if (buf[2] & (1 << ch)) {
+			if (pos + sizeof(float) > len) {
+				return -1;
+			}
+			values[ch] = bp_get_float(&buf[pos]);
+			pos += sizeof(float);
+		}
+	}
+	return buf[2];
+}
@@ -0,0 +1,66 @@
+/*
+ * Compact binary telemetry protocol
+ *
+ * Negotiated with "Sec-WebSocket-Protocol: eel-bin.1" and carried in binary
+ * frames. Every record starts with a 4 byte header, multi byte fields are
+ * little-endian:
+ *
+ *   0: version (BP_VERSION)
+ *   1: type (BP_T_*)
+ *   2: command or channel mask
+ *   3: status or 0
+ *
+ * Command (client -> device), optional arguments after the header:
+ *   4: uint32 minimum interval in ms (subscribe)
+ *   8: float threshold (subscribe)
+ *
+ * Snapshot (device -> client): one float per channel set in the mask,
+ * ordered by channel. A full snapshot takes 20 bytes.
+ *
+ * */
+#ifndef BINPROTO_H_
+#define BINPROTO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "telemetry.h"
+
+#define BP_PROTOCOL		"eel-bin.1"	/*Sec-WebSocket-Protocol of this encoding*/
+#define BP_PROTOCOL_ID	0			/*Index of BP_PROTOCOL in the list given to WS_set_protocols()*/
+#define BP_VERSION		1
+#define BP_HDR_L		4
+#define BP_CMD_MAX_L	(BP_HDR_L + 8)
+#define BP_SNAPSHOT_MAX_L	(BP_HDR_L + TM_CH_MAX * sizeof(float))
+
+/*Record types*/
+typedef enum {
+	BP_T_CMD = 0x01,		/*Command*/
+	BP_T_STATUS = 0x02,		/*Command result*/
+	BP_T_SNAPSHOT = 0x03	/*Sensor values*/
+} bp_type_t;
+
+/*Decoded command*/
+typedef struct {
+	uint8_t cmd;
+	uint8_t mask;			/*Channel mask, TM_CH_ALL if not given*/
+	uint32_t ms;
+	float threshold;
+} bp_cmd_t;
+
+/*Decode a command, returns 0 or -1 if the record is malformed or has no known channel in its mask*/
+int bp_decode_cmd(const uint8_t *buf, size_t len, bp_cmd_t *cmd);
+
+/*Encode a command, returns record length*/
+size_t bp_encode_cmd(uint8_t *buf, const bp_cmd_t *cmd);
+
+/*Encode a command result, returns record length (BP_HDR_L)*/
+size_t bp_encode_status(uint8_t *buf, uint8_t cmd, uint8_t status);
+
+/*Encode the channels in mask, returns record length*/
+size_t bp_encode_snapshot(uint8_t *buf, uint8_t mask, const float values[TM_CH_MAX]);
+
+/*Decode a snapshot into values, returns channel mask or -1 if the record is malformed*/
+int bp_decode_snapshot(const uint8_t *buf, size_t len, float values[TM_CH_MAX]);
+
+#endif
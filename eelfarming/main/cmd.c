@@ -0,0 +1,275 @@
+/*
+ * WebSocket command dispatcher
+ *
+ * */
+#include <string.h>
+
+#include "cmd.h"
+
+static cmd_handler_t CMD_handlers[CMD_MAX];
+
+int cmd_register(int id, cmd_handler_t handler)
+{
+	if (id < 0 || id >= CMD_MAX) {
+		return -1;
+	}
+	CMD_handlers[id] = handler;
+	return 0;
+}
+
+/*Index of the token behind the value starting at i*/
+static int cmd_tok_skip(const jsmntok_t *tok, int i)
+{
+	int n = 1;
+
+	/*size counts direct children, a key has its value as child*/
+	while (n > 0) {
+		n += tok[i].size - 1;
+		i++;
+	}
+	return i;
+}
+
+/*Token of the value of key in the object at obj, -1 if missing*/
+static int cmd_tok_find(const cmd_req_t *req, const char *key)
+{
+	const jsmntok_t *tok = req->tok;
+	size_t l = strlen(key);
+	int i = req->obj + 1;
+
+	for (int k = 0; k < tok[req->obj].size; k++) {
+		if (tok[i].type == JSMN_STRING && (size_t)(tok[i].end - tok[i].start) == l
+				&& memcmp(&req->json[tok[i].start], key, l) == 0) {
+			return i + 1;
+		}
+		i = cmd_tok_skip(tok, i);
+	}
+	return -1;
+}
+
+/*Decimal number with optional fraction and exponent, no libc (strtod allocates)*/
+static int cmd_parse_num(const char *p, const char *end, int64_t *mant, int *exp10)
+{
+	int neg = 0, digits = 0, e = 0, e_neg = 0, frac = 0;
+	int64_t m = 0;
+
+	if (p < end && (*p == '-' || *p == '+')) {
+		neg = (*p++ == '-');
+	}
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+		if (m < (INT64_MAX / 10)) {
+			m = m * 10 + (*p - '0');
+		} else {
+			frac--;
+		}
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+			if (m < (INT64_MAX / 10)) {
+				m = m * 10 + (*p - '0');
+				frac++;
+			}
+		}
+	}
+	if (digits == 0) {
+		return -1;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (p < end && (*p == '-' || *p == '+')) {
+			e_neg = (*p++ == '-');
+		}
+		for (; p < end && *p >= '0' && *p <= '9'; p++) {
+			if (e < 1000) {
+				e = e * 10 + (*p - '0');
+			}
+		}
+	}
+	if (p != end) {
+		return -1;
+	}
+	*mant = neg ? -m : m;
+	*exp10 = (e_neg ? -e : e) - frac;
+	return 0;
+}
+
+static int cmd_arg_num(const cmd_req_t *req, const char *key, int64_t *mant, int *exp10)
+{
+	int i = cmd_tok_find(req, key);
+
+	if (i < 0 || req->tok[i].type != JSMN_PRIMITIVE) {
+		return -1;
+	}
+	return cmd_parse_num(&req->json[req->tok[i].start], &req->json[req->tok[i].end], mant, exp10);
+}
+
+int cmd_arg_int(const cmd_req_t *req, const char *key, int32_t *value)
+{
+	int64_t m;
+	int e;
+
+	if (cmd_arg_num(req, key, &m, &e) != 0) {
+		return -1;
+	}
+	for (; e > 0 && m < INT32_MAX && m > INT32_MIN; e--) {
+		m *= 10;
+	}
+	for (; e < 0; e++) {
+		m /= 10;
+	}
+	*value = (m > INT32_MAX) ? INT32_MAX : (m < INT32_MIN) ? INT32_MIN : (int32_t)m;
+	return 0;
+}
+
+int cmd_arg_uint(const cmd_req_t *req, const char *key, uint32_t *value)
+{
+	int64_t m;
+	int e;
+
+	if (cmd_arg_num(req, key, &m, &e) != 0 || m < 0) {
+		return -1;
+	}
+	for (; e > 0 && m < UINT32_MAX; e--) {
+		m *= 10;
+	}
+	for (; e < 0; e++) {
+		m /= 10;
+	}
+	*value = (m > UINT32_MAX) ? UINT32_MAX : (uint32_t)m;
+	return 0;
+}
+
+int cmd_arg_float(const cmd_req_t *req, const char *key, float *value)
+{
+	int64_t m;
+	int e;
+	double v;
+
+	if (cmd_arg_num(req, key, &m, &e) != 0) {
+		return -1;
+	}
+	v = (double)m;
+	for (; e > 0; e--) {
+		v *= 10;
+	}
+	for (; e < 0; e++) {
+		v /= 10;
+	}
+	*value = (float)v;
+	return 0;
+}
+
+const char *cmd_arg_str(const cmd_req_t *req, const char *key)
+{
+	int i = cmd_tok_find(req, key);
+
+	if (i < 0 || req->tok[i].type != JSMN_STRING) {
+		return NULL;
+	}
+	/*overwrites the closing quote*/
+	req->json[req->tok[i].end] = 0;
+	return &req->json[req->tok[i].start];
+}
+
+/*Run the command object at req->obj*/
+static int cmd_run(cmd_req_t *req, jw_t *res)
+{
+	int32_t id;
+
+	if (req->tok[req->obj].type != JSMN_OBJECT || cmd_arg_int(req, "cmd", &id) != 0) {
+		return CMD_NONE;
+	}
+	req->cmd = id;
+
+	if (id >= 0 && id < CMD_MAX && CMD_handlers[id] != NULL) {
+		CMD_handlers[id](req, res);
+	} else {
+		jw_int(res, JW_KEY("status"), 0);
+	}
+	return id;
+}
+
+/*Echo the correlation id token as sent, string or number*/
+static void cmd_echo_id(const cmd_req_t *req, int id, jw_t *res)
+{
+	const jsmntok_t *t = &req->tok[id];
+
+	if (t->type == JSMN_STRING) {
+		jw_raw(res, JW_KEY("id"), &req->json[t->start - 1], t->end - t->start + 2);
+	} else if (t->type == JSMN_PRIMITIVE) {
+		jw_raw(res, JW_KEY("id"), &req->json[t->start], t->end - t->start);
+	}
+}
+
+/*Run the commands of the batch array at arr, one result object each*/
+static void cmd_run_batch(cmd_req_t *req, int arr, jw_t *res)
+{
+	const jsmntok_t *tok = req->tok;
+	int n = tok[arr].size;
+	int i = arr + 1;
+	int32_t cmd;
+	int id;
+	jw_t undo;
+
+	if (n > CMD_BATCH_MAX) {
+		n = CMD_BATCH_MAX;
+	}
+
+	jw_arr(res, JW_KEY("batch"));
+	for (int k = 0; k < n; k++, i = cmd_tok_skip(tok, i)) {
+		undo = *res;
+		jw_obj(res, NULL);
+
+		req->obj = i;
+		id = (tok[i].type == JSMN_OBJECT) ? cmd_tok_find(req, "id") : -1;
+		if (id >= 0) {
+			cmd_echo_id(req, id, res);
+		}
+
+		if (tok[i].type == JSMN_OBJECT && cmd_arg_int(req, "cmd", &cmd) == 0) {
+			cmd_run(req, res);
+		} else {
+			jw_int(res, JW_KEY("status"), 0);
+		}
+		jw_close(res);
+
+		/*result does not fit, answer with the status only*/
+		if (res->overflow) {
+			*res = undo;
+			jw_obj(res, NULL);
+			if (id >= 0) {
+				cmd_echo_id(req, id, res);
+			}
+			jw_int(res, JW_KEY("status"), 0);
+			jw_close(res);
+			if (res->overflow) {
+				*res = undo;
+				break;
+			}
+		}
+	}
+	jw_close(res);
+}
+
+int cmd_dispatch(int client, char *json, size_t len, jw_t *res, char *buf, size_t buf_l)
+{
+	jsmntok_t tok[CMD_TOKENS];
+	jsmn_parser parser;
+	cmd_req_t req = { .client = client, .json = json, .tok = tok, .obj = 0, .buf = buf, .buf_l = buf_l };
+	int n, batch;
+
+	jsmn_init(&parser);
+	n = jsmn_parse(&parser, json, len, tok, CMD_TOKENS);
+	if (n < 1 || tok[0].type != JSMN_OBJECT) {
+		return -1;
+	}
+
+	batch = cmd_tok_find(&req, "batch");
+	if (batch >= 0 && tok[batch].type == JSMN_ARRAY) {
+		cmd_run_batch(&req, batch, res);
+		return CMD_BATCH;
+	}
+
+	/*requests without command get an empty response*/
+	return cmd_run(&req, res);
+}
@@ -0,0 +1,65 @@
+/*
+ * WebSocket command dispatcher
+ *
+ * Requests like {"cmd":4,"ch":"te_m","ms":1000} are tokenized in place by
+ * jsmn into a fixed token array and dispatched through a table indexed by
+ * the command id. Handlers read their arguments with the typed getters
+ * below and write their results with the JSON writer, nothing is allocated
+ * while parsing, dispatching or answering.
+ *
+ * Several commands can be sent in one frame:
+ *   {"batch":[{"id":1,"cmd":0},{"id":"m","cmd":1}]}
+ * They run in order and are answered in one frame, each result carries the
+ * id of its command:
+ *   {"batch":[{"id":1,"status":1},{"id":"m","te_m":25.5,...}]}
+ * Commands that no longer fit into the response are answered with status 0.
+ *
+ * */
+#ifndef CMD_H_
+#define CMD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "jsmn.h"
+#include "jsonw.h"
+
+#define CMD_MAX		16	/*Number of command ids*/
+#define CMD_BATCH	CMD_MAX	/*Returned by cmd_dispatch for a batch*/
+#define CMD_NONE	(CMD_MAX + 1)	/*Returned by cmd_dispatch for a request without command*/
+#define CMD_BATCH_MAX	8	/*Commands per batch*/
+#define CMD_TOKENS	64	/*JSON tokens per request*/
+#define CMD_RES_L	1024	/*Response buffer*/
+
+/*Request being dispatched*/
+typedef struct {
+	int client;				/*WebSocket client id*/
+	int cmd;				/*Command id*/
+	char *json;				/*Request text, strings are terminated in place*/
+	const jsmntok_t *tok;	/*Tokens of the request*/
+	int obj;				/*Index of the command object in tok*/
+	char *buf;				/*Buffer of the worker for frames the handler sends itself*/
+	size_t buf_l;
+} cmd_req_t;
+
+/*Command handler, adds its results to res*/
+typedef void (*cmd_handler_t)(const cmd_req_t *req, jw_t *res);
+
+/*Register handler for command id, returns 0 or -1 if id is out of range*/
+int cmd_register(int id, cmd_handler_t handler);
+
+/*
+ * Parse and dispatch the request in json (len bytes, terminated), buf is
+ * lent to the handler for the duration of the request (may be NULL)
+ * Returns the command id, CMD_BATCH, CMD_NONE if the request has no command or -1 if it is no JSON object
+ */
+int cmd_dispatch(int client, char *json, size_t len, jw_t *res, char *buf, size_t buf_l);
+
+/*Typed arguments, return 0 or -1 if key is missing or has another type*/
+int cmd_arg_int(const cmd_req_t *req, const char *key, int32_t *value);
+int cmd_arg_uint(const cmd_req_t *req, const char *key, uint32_t *value);	/*-1 for negative numbers too*/
+int cmd_arg_float(const cmd_req_t *req, const char *key, float *value);
+
+/*String argument, terminated in place, NULL if missing*/
+const char *cmd_arg_str(const cmd_req_t *req, const char *key);
+
+#endif
@@ -0,0 +1,442 @@
+/*
+ * Sensor history
+ *
+ * */
+#include <stdlib.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "history.h"
+
+static const char *TAG = "history";
+
+#define HIST_SAMPLE_BITS	73		/*Longest code of a sample, time and value*/
+#define HIST_HEAP_RESERVE	(CONFIG_HIST_HEAP_RESERVE_KB * 1024)
+
+/*Compressed block, the first sample is kept in the header*/
+typedef struct {
+	uint32_t seq;		/*Allocation number, 0 for a free block*/
+	uint8_t ch;
+	uint16_t n;			/*Samples*/
+	uint16_t bits;		/*Bits of data used*/
+	uint32_t t0;		/*First sample, ms*/
+	int32_t v0;
+	uint32_t t_last;	/*Last sample as decoded, ms, the encoder continues from here*/
+	int32_t dt_last;
+	int32_t v_last;
+	uint8_t data[HIST_BLOCK_L];
+} hist_block_t;
+
+/*Blocks are allocated one by one, the heap has no region as large as the pool*/
+static hist_block_t **HIST_blocks = NULL;
+static int HIST_n = 0;
+static int HIST_next = 0;				/*Next block to reuse, the pool is a ring in allocation order*/
+static int HIST_open[TM_CH_MAX];		/*Block being filled per channel, -1 for none*/
+static uint32_t HIST_seq = 0;
+static uint32_t HIST_evicted = 0;
+static SemaphoreHandle_t HIST_lock = NULL;
+
+/*Quantization of the channels, 10 ^ TM_CH_DECIMALS*/
+static float hist_scale(tm_channel_t ch)
+{
+	static const float scale[] = { 1, 10, 100, 1000, 10000 };
+	return scale[TM_CH_DECIMALS[ch]];
+}
+
+static uint32_t hist_zz(int32_t v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t hist_unzz(uint32_t v)
+{
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+/*Append the n low bits of v, most significant first*/
+static void hist_put(hist_block_t *b, uint32_t v, int n)
+{
+	while (n > 0) {
+		int room = 8 - (b->bits & 7);
+		int take = (n < room) ? n : room;
+		uint8_t part = (v >> (n - take)) & ((1 << take) - 1);
+		if ((b->bits & 7) == 0) {
+			b->data[b->bits >> 3] = 0;
+		}
+		b->data[b->bits >> 3] |= part << (room - take);
+		b->bits += take;
+		n -= take;
+	}
+}
+
+static uint32_t hist_get(const hist_block_t *b, uint16_t *bit, int n)
+{
+	uint32_t v = 0;
+	while (n > 0) {
+		int room = 8 - (*bit & 7);
+		int take = (n < room) ? n : room;
+		v = (v << take) | ((b->data[*bit >> 3] >> (room - take)) & ((1 << take) - 1));
+		*bit += take;
+		n -= take;
+	}
+	return v;
+}
+
+/*Number of leading ones before a zero, at most max*/
+static int hist_get_prefix(const hist_block_t *b, uint16_t *bit, int max)
+{
+	int n = 0;
+	while (n < max && hist_get(b, bit, 1)) {
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Delta of delta of the timestamp
+ * 0 -> 0, 10 + 4 bits, 110 + 9 bits, 1110 + 16 bits, 1111 + 32 bits
+ * */
+static void hist_put_dod(hist_block_t *b, int32_t dod)
+{
+	uint32_t z = hist_zz(dod);
+	if (z == 0) {
+		hist_put(b, 0x0, 1);
+	} else if (z < (1 << 4)) {
+		hist_put(b, 0x2, 2);
+		hist_put(b, z, 4);
+	} else if (z < (1 << 9)) {
+		hist_put(b, 0x6, 3);
+		hist_put(b, z, 9);
+	} else if (z < (1 << 16)) {
+		hist_put(b, 0xE, 4);
+		hist_put(b, z, 16);
+	} else {
+		hist_put(b, 0xF, 4);
+		hist_put(b, z, 32);
+	}
+}
+
+static int32_t hist_get_dod(const hist_block_t *b, uint16_t *bit)
+{
+	static const uint8_t len[] = { 0, 4, 9, 16, 32 };
+	int code = hist_get_prefix(b, bit, 4);
+	return (code == 0) ? 0 : hist_unzz(hist_get(b, bit, len[code]));
+}
+
+/*
+ * Delta of the quantized value
+ * 0 -> 0, 10 + 2 bits for -2, -1, 1, 2, 110 + 5 bits, 1110 + 10 bits, 11110 + 16 bits, 11111 + 32 bits
+ * */
+static void hist_put_delta(hist_block_t *b, int32_t d)
+{
+	uint32_t z = hist_zz(d);
+	if (d == 0) {
+		hist_put(b, 0x0, 1);
+	} else if (d >= -2 && d <= 2) {
+		hist_put(b, 0x2, 2);
+		hist_put(b, (d < 0) ? d + 2 : d + 1, 2);
+	} else if (z < (1 << 5)) {
+		hist_put(b, 0x6, 3);
+		hist_put(b, z, 5);
+	} else if (z < (1 << 10)) {
+		hist_put(b, 0xE, 4);
+		hist_put(b, z, 10);
+	} else if (z < (1 << 16)) {
+		hist_put(b, 0x1E, 5);
+		hist_put(b, z, 16);
+	} else {
+		hist_put(b, 0x1F, 5);
+		hist_put(b, z, 32);
+	}
+}
+
+static int32_t hist_get_delta(const hist_block_t *b, uint16_t *bit)
+{
+	static const uint8_t len[] = { 0, 2, 5, 10, 16, 32 };
+	int code = hist_get_prefix(b, bit, 5);
+	uint32_t z;
+	if (code == 0) {
+		return 0;
+	}
+	z = hist_get(b, bit, len[code]);
+	if (code == 1) {
+		return (z < 2) ? (int32_t)z - 2 : (int32_t)z - 1;
+	}
+	return hist_unzz(z);
+}
+
+/*Take the next block of the ring for channel ch, called with HIST_lock held*/
+static hist_block_t *hist_alloc(tm_channel_t ch)
+{
+	hist_block_t *b;
+	int idx;
+
+	/*blocks still being filled by other channels are skipped*/
+	while (1) {
+		int open = 0;
+		idx = HIST_next;
+		HIST_next = (HIST_next + 1) % HIST_n;
+		for (int c = 0; c < TM_CH_MAX; c++) {
+			open |= (HIST_open[c] == idx);
+		}
+		if (!open) {
+			break;
+		}
+	}
+	b = HIST_blocks[idx];
+	if (b->seq != 0 && b->n > 0) {
+		HIST_evicted++;
+	}
+	if (++HIST_seq == 0) {
+		HIST_seq = 1;
+	}
+	b->seq = HIST_seq;
+	b->ch = ch;
+	b->n = 0;
+	b->bits = 0;
+	HIST_open[ch] = idx;
+	return b;
+}
+
+int hist_init(size_t budget)
+{
+	int max = budget / sizeof(hist_block_t);
+
+	HIST_lock = xSemaphoreCreateMutex();
+	HIST_blocks = calloc(max, sizeof(hist_block_t *));
+	if (HIST_lock == NULL || HIST_blocks == NULL) {
+		return 0;
+	}
+	/*the pool gets what is left above the reserve of the rest of the firmware*/
+	while (HIST_n < max && esp_get_free_heap_size() >= sizeof(hist_block_t) + HIST_HEAP_RESERVE) {
+		hist_block_t *b = malloc(sizeof(hist_block_t));
+		if (b == NULL) {
+			break;
+		}
+		b->seq = 0;
+		b->n = 0;
+		HIST_blocks[HIST_n++] = b;
+	}
+	/*every channel fills one block while another one is reused*/
+	if (HIST_n <= TM_CH_MAX) {
+		for (int i = 0; i < HIST_n; i++) {
+			free(HIST_blocks[i]);
+		}
+		HIST_n = 0;
+	}
+	for (int c = 0; c < TM_CH_MAX; c++) {
+		HIST_open[c] = -1;
+	}
+	ESP_LOGI(TAG, "%d blocks, %d bytes", HIST_n, HIST_n * (int)sizeof(hist_block_t));
+	return HIST_n;
+}
+
+void hist_append_at(tm_channel_t ch, uint32_t ms, float value)
+{
+	int32_t v = lroundf(value * hist_scale(ch));
+	hist_block_t *b;
+
+	if (HIST_n == 0) {
+		return;
+	}
+	xSemaphoreTake(HIST_lock, portMAX_DELAY);
+	b = (HIST_open[ch] >= 0) ? HIST_blocks[HIST_open[ch]] : NULL;
+	if (b == NULL || b->n == UINT16_MAX || b->bits + HIST_SAMPLE_BITS > HIST_BLOCK_L * 8) {
+		/*a new block starts with the sample in its header*/
+		b = hist_alloc(ch);
+		b->t0 = ms;
+		b->t_last = ms;
+		b->v0 = v;
+		b->dt_last = 0;
+	} else {
+		/*
+		 * Deltas are coded in HIST_RES_MS ticks, times stay in ms and wrap
+		 * with the uptime, ms / HIST_RES_MS would jump at the wrap instead
+		 */
+		int32_t dt = (int32_t)(ms - b->t_last) / HIST_RES_MS;
+		hist_put_dod(b, dt - b->dt_last);
+		hist_put_delta(b, v - b->v_last);
+		b->dt_last = dt;
+		b->t_last += dt * HIST_RES_MS;
+	}
+	b->v_last = v;
+	b->n++;
+	xSemaphoreGive(HIST_lock);
+}
+
+void hist_append(tm_channel_t ch, float value)
+{
+	hist_append_at(ch, esp_timer_get_time() / 1000, value);
+}
+
+void hist_iter_init(hist_iter_t *it, tm_channel_t ch, uint32_t from_ms, uint32_t to_ms)
+{
+	it->ch = ch;
+	it->from = from_ms;
+	it->to = to_ms;
+	it->seq = 0;
+	it->block = 0;
+	it->k = 0;
+}
+
+/*Oldest block of the walk newer than the current one and not ending before the range, -1 if none*/
+static int hist_iter_block(const hist_iter_t *it)
+{
+	int best = -1;
+
+	for (int i = 0; i < HIST_n; i++) {
+		const hist_block_t *b = HIST_blocks[i];
+		if (b->seq == 0 || b->n == 0 || b->ch != it->ch
+				|| (it->seq != 0 && (int32_t)(b->seq - it->seq) <= 0)
+				|| (int32_t)(b->t_last - it->from) < 0) {
+			continue;
+		}
+		if (best < 0 || (int32_t)(b->seq - HIST_blocks[best]->seq) < 0) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+int hist_iter_next(hist_iter_t *it, hist_sample_t *out, int max)
+{
+	float scale;
+	int n = 0;
+
+	if (it->block < 0 || HIST_n == 0) {
+		return 0;
+	}
+	scale = hist_scale(it->ch);
+	xSemaphoreTake(HIST_lock, portMAX_DELAY);
+	while (n < max) {
+		const hist_block_t *b = (it->seq != 0) ? HIST_blocks[it->block] : NULL;
+		/*next block when this one is done or was reused meanwhile*/
+		if (b == NULL || b->seq != it->seq || it->k >= b->n) {
+			int i = hist_iter_block(it);
+			if (i < 0) {
+				break;
+			}
+			b = HIST_blocks[i];
+			it->block = i;
+			it->seq = b->seq;
+			it->k = 0;
+		}
+		if (it->k == 0) {
+			it->t = b->t0;
+			it->v = b->v0;
+			it->dt = 0;
+			it->bit = 0;
+		} else {
+			it->dt += hist_get_dod(b, &it->bit);
+			it->t += it->dt * HIST_RES_MS;
+			it->v += hist_get_delta(b, &it->bit);
+		}
+		it->k++;
+		if ((int32_t)(it->t - it->to) > 0) {
+			it->block = -1;
+			break;
+		}
+		if ((int32_t)(it->t - it->from) >= 0) {
+			out[n].ms = it->t;
+			out[n].value = it->v / scale;
+			n++;
+		}
+	}
+	xSemaphoreGive(HIST_lock);
+	return n;
+}
+
+/*Points of a bucket, min and max in time order*/
+static int hist_bucket_out(hist_sample_t *out, int n, const hist_sample_t *lo, const hist_sample_t *hi)
+{
+	if (lo->ms == hi->ms) {
+		out[n++] = *lo;
+	} else if ((int32_t)(lo->ms - hi->ms) < 0) {
+		out[n++] = *lo;
+		out[n++] = *hi;
+	} else {
+		out[n++] = *hi;
+		out[n++] = *lo;
+	}
+	return n;
+}
+
+int hist_minmax(tm_channel_t ch, uint32_t from_ms, uint32_t to_ms, uint32_t w_ms, int32_t *bucket, hist_sample_t *out, int max)
+{
+	hist_iter_t it;
+	hist_sample_t s[16], lo, hi;
+	int32_t start = *bucket, cur = -1;
+	int n = 0, k;
+
+	if (start < 0 || w_ms == 0 || max < 2) {
+		return 0;
+	}
+	/*a bucket is only complete once a sample of a later one is seen*/
+	hist_iter_init(&it, ch, from_ms + start * w_ms, to_ms);
+	while ((k = hist_iter_next(&it, s, sizeof(s) / sizeof(s[0]))) > 0) {
+		for (int i = 0; i < k; i++) {
+			int32_t b;
+			if ((int32_t)(s[i].ms - from_ms) < 0 || (b = (s[i].ms - from_ms) / w_ms) < start) {
+				continue;
+			}
+			if (b != cur) {
+				if (cur >= 0) {
+					if (n + 2 > max) {
+						*bucket = cur;
+						return n;
+					}
+					n = hist_bucket_out(out, n, &lo, &hi);
+				}
+				cur = b;
+				lo = hi = s[i];
+			} else if (s[i].value < lo.value) {
+				lo = s[i];
+			} else if (s[i].value > hi.value) {
+				hi = s[i];
+			}
+		}
+	}
+	if (cur >= 0) {
+		if (n + 2 > max) {
+			*bucket = cur;
+			return n;
+		}
+		n = hist_bucket_out(out, n, &lo, &hi);
+	}
+	*bucket = -1;
+	return n;
+}
+
+/*pts/2 buckets of w cover w*pts/2 ms, more than the to-from ms of the range*/
+uint32_t hist_bucket_ms(uint32_t from_ms, uint32_t to_ms, int pts)
+{
+	return (to_ms - from_ms + pts / 2) / (pts / 2);
+}
+
+void hist_stats(hist_stats_t *stats)
+{
+	stats->blocks = HIST_n;
+	stats->used = 0;
+	stats->samples = 0;
+	stats->bytes = 0;
+	if (HIST_n == 0) {
+		stats->evicted = 0;
+		return;
+	}
+	xSemaphoreTake(HIST_lock, portMAX_DELAY);
+	for (int i = 0; i < HIST_n; i++) {
+		const hist_block_t *b = HIST_blocks[i];
+		if (b->seq != 0 && b->n > 0) {
+			stats->used++;
+			stats->samples += b->n;
+			stats->bytes += sizeof(hist_block_t) - HIST_BLOCK_L + (b->bits + 7) / 8;
+		}
+	}
+	stats->evicted = HIST_evicted;
+	xSemaphoreGive(HIST_lock);
+}
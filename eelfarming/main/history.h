@@ -0,0 +1,84 @@
+/*
+ * Sensor history
+ *
+ * Samples of every channel are kept in compressed blocks of a fixed pool
+ * allocated once at boot. Timestamps are stored as delta of delta, a sensor
+ * sampled at a steady rate costs one bit per sample. Values are quantized
+ * to the decimals of their channel and stored as the delta to the previous
+ * value, an unchanged value costs one bit too. When the pool is full the
+ * oldest sealed block is reused, appends never allocate and take constant
+ * time. Readers walk a channel with an iterator that decodes in batches.
+ * Times are uint32 ms of uptime and compared as serial numbers, so they
+ * stay ordered across the wrap as long as a range is below 24.8 days.
+ *
+ * */
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "telemetry.h"
+
+#define HIST_RES_MS		10		/*Timestamp resolution*/
+#define HIST_BLOCK_L	1024	/*Compressed data per block*/
+
+/*Decoded sample*/
+typedef struct {
+	uint32_t ms;	/*esp_timer time in ms, wraps after 49.7 days*/
+	float value;
+} hist_sample_t;
+
+/*Iterator over one channel, oldest sample first*/
+typedef struct {
+	tm_channel_t ch;
+	uint32_t from;		/*Time range, ms*/
+	uint32_t to;
+	uint32_t seq;		/*Block being decoded, 0 before the first one*/
+	int16_t block;		/*Its index, -1 at the end of the walk*/
+	uint16_t k;			/*Samples of the block decoded*/
+	uint16_t bit;		/*Position in the block data*/
+	uint32_t t;			/*Decoder state, t in ms*/
+	int32_t dt;
+	int32_t v;
+} hist_iter_t;
+
+/*Pool usage*/
+typedef struct {
+	uint32_t blocks;	/*Blocks in the pool*/
+	uint32_t used;		/*Blocks holding samples*/
+	uint32_t samples;	/*Samples held*/
+	uint32_t bytes;		/*Compressed bytes held, block headers included*/
+	uint32_t evicted;	/*Blocks reused while holding samples*/
+} hist_stats_t;
+
+/*Allocate the pool, up to budget bytes, returns the number of blocks*/
+int hist_init(size_t budget);
+
+/*Add a sample of channel ch taken now*/
+void hist_append(tm_channel_t ch, float value);
+
+/*Add a sample of channel ch taken at ms*/
+void hist_append_at(tm_channel_t ch, uint32_t ms, float value);
+
+/*Start a walk over the samples of channel ch from from_ms to to_ms (both included)*/
+void hist_iter_init(hist_iter_t *it, tm_channel_t ch, uint32_t from_ms, uint32_t to_ms);
+
+/*Next samples of the walk, up to max, returns their number, 0 at the end*/
+int hist_iter_next(hist_iter_t *it, hist_sample_t *out, int max);
+
+/*
+ * Downsampled walk: the range from from_ms to to_ms is cut into buckets of
+ * w_ms, every bucket gives its min and max sample in time order (one point
+ * if they are the same), so peaks survive at any zoom. Starts at bucket
+ * *bucket and stops before a bucket would exceed max points, *bucket is
+ * then the bucket to continue with or -1 at the end of the range.
+ * Returns the number of points in out.
+ */
+int hist_minmax(tm_channel_t ch, uint32_t from_ms, uint32_t to_ms, uint32_t w_ms, int32_t *bucket, hist_sample_t *out, int max);
+
+/*Bucket width for hist_minmax giving at most pts points (pts >= 2) from from_ms to to_ms*/
+uint32_t hist_bucket_ms(uint32_t from_ms, uint32_t to_ms, int pts);
+
+void hist_stats(hist_stats_t *stats);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Streaming JSON writer
+ *
+ * */
+#include <string.h>
+#include <math.h>
+
+#include "jsonw.h"
+
+static const uint32_t JW_POW10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
+#define JW_DECIMALS_MAX	(sizeof(JW_POW10) / sizeof(JW_POW10[0]) - 1)
+
+static void jw_put(jw_t *w, const char *p, size_t l)
+{
+	if (w->overflow || w->len + l > w->cap) {
+		w->overflow = 1;
+		return;
+	}
+	memcpy(&w->buf[w->len], p, l);
+	w->len += l;
+}
+
+static void jw_putc(jw_t *w, char c)
+{
+	jw_put(w, &c, 1);
+}
+
+/*Separator and key of the next member*/
+static void jw_member(jw_t *w, const jw_key_t *key)
+{
+	if (w->depth > 0) {
+		uint8_t bit = 1 << (w->depth - 1);
+		if (w->more & bit) {
+			jw_putc(w, ',');
+		}
+		w->more |= bit;
+	}
+	if (key != NULL) {
+		jw_put(w, key->p, key->l);
+	}
+}
+
+/*Unsigned decimal*/
+static void jw_put_u64(jw_t *w, uint64_t v, uint8_t min_digits)
+{
+	char tmp[20];
+	uint8_t n = 0;
+
+	do {
+		tmp[sizeof(tmp) - 1 - n++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0 || n < min_digits);
+	jw_put(w, &tmp[sizeof(tmp) - n], n);
+}
+
+static void jw_open(jw_t *w, const jw_key_t *key, char c)
+{
+	jw_member(w, key);
+	jw_putc(w, c);
+	if (w->depth >= JW_DEPTH) {
+		w->overflow = 1;
+		return;
+	}
+	w->more &= ~(1 << w->depth);
+	w->depth++;
+}
+
+void jw_init(jw_t *w, char *buf, size_t cap)
+{
+	w->buf = buf;
+	w->cap = cap;
+	w->len = 0;
+	w->depth = 0;
+	w->overflow = 0;
+	w->more = 0;
+	w->arr = 0;
+}
+
+void jw_obj(jw_t *w, const jw_key_t *key)
+{
+	jw_open(w, key, '{');
+	w->arr &= ~(1 << (w->depth - 1));
+}
+
+void jw_arr(jw_t *w, const jw_key_t *key)
+{
+	jw_open(w, key, '[');
+	w->arr |= 1 << (w->depth - 1);
+}
+
+void jw_close(jw_t *w)
+{
+	if (w->depth == 0) {
+		return;
+	}
+	w->depth--;
+	jw_putc(w, (w->arr & (1 << w->depth)) ? ']' : '}');
+}
+
+void jw_int(jw_t *w, const jw_key_t *key, int32_t v)
+{
+	jw_member(w, key);
+	if (v < 0) {
+		jw_putc(w, '-');
+		jw_put_u64(w, -(int64_t)v, 1);
+	} else {
+		jw_put_u64(w, v, 1);
+	}
+}
+
+void jw_uint(jw_t *w, const jw_key_t *key, uint32_t v)
+{
+	jw_member(w, key);
+	jw_put_u64(w, v, 1);
+}
+
+void jw_float(jw_t *w, const jw_key_t *key, float v, uint8_t decimals)
+{
+	uint32_t scale;
+	uint64_t q, frac;
+	float a;
+
+	if (isnan(v) || isinf(v)) {
+		jw_null(w, key);
+		return;
+	}
+	if (decimals > JW_DECIMALS_MAX) {
+		decimals = JW_DECIMALS_MAX;
+	}
+	scale = JW_POW10[decimals];
+
+	/*single precision covers the sensor range, double only for huge values*/
+	a = fabsf(v) * scale;
+	if (a < 4.0e9f) {
+		q = (uint32_t)(a + 0.5f);
+	} else if (a < 1.0e19f) {
+		q = (uint64_t)((double)fabsf(v) * scale + 0.5);
+	} else {
+		jw_null(w, key);
+		return;
+	}
+
+	jw_member(w, key);
+	if (v < 0 && q != 0) {
+		jw_putc(w, '-');
+	}
+	jw_put_u64(w, q / scale, 1);
+
+	/*fraction without trailing zeros*/
+	frac = q % scale;
+	if (frac != 0) {
+		while (frac % 10 == 0) {
+			frac /= 10;
+			decimals--;
+		}
+		jw_putc(w, '.');
+		jw_put_u64(w, frac, decimals);
+	}
+}
+
+void jw_str(jw_t *w, const jw_key_t *key, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *run;
+	char esc[6];
+
+	jw_member(w, key);
+	jw_putc(w, '"');
+	for (run = s; *s != 0; s++) {
+		if (*s != '"' && *s != '\\' && (uint8_t)*s >= 0x20) {
+			continue;
+		}
+		/*copy up to the character to escape*/
+		jw_put(w, run, s - run);
+		run = s + 1;
+		esc[0] = '\\';
+		if (*s == '"' || *s == '\\') {
+			esc[1] = *s;
+			jw_put(w, esc, 2);
+		} else {
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = hex[(uint8_t)*s >> 4];
+			esc[5] = hex[*s & 0xF];
+			jw_put(w, esc, 6);
+		}
+	}
+	jw_put(w, run, s - run);
+	jw_putc(w, '"');
+}
+
+void jw_null(jw_t *w, const jw_key_t *key)
+{
+	jw_member(w, key);
+	jw_put(w, "null", 4);
+}
+
+void jw_raw(jw_t *w, const jw_key_t *key, const char *p, size_t l)
+{
+	jw_member(w, key);
+	jw_put(w, p, l);
+}
+
+int jw_end(jw_t *w)
+{
+	while (w->depth > 0) {
+		jw_close(w);
+	}
+	if (w->overflow) {
+		return -1;
+	}
+	/*terminate for logging when there is room, not counted*/
+	if (w->len < w->cap) {
+		w->buf[w->len] = 0;
+	}
+	return w->len;
+}
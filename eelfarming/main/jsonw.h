@@ -0,0 +1,61 @@
+/*
+ * Streaming JSON writer
+ *
+ * Formats compact JSON straight into a caller supplied buffer, no heap and
+ * no printf. Keys are kept pre-quoted ("\"te_m\":") so writing one is a
+ * single copy. Floats are written with a fixed number of decimals, trailing
+ * zeros dropped. If the buffer is too small the writer stops and jw_end()
+ * fails, the output is never truncated silently.
+ *
+ * */
+#ifndef JSONW_H_
+#define JSONW_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define JW_DEPTH	8	/*Nesting levels of objects and arrays*/
+
+/*Pre-quoted key*/
+typedef struct {
+	const char *p;	/*"\"key\":"*/
+	uint8_t l;		/*Length of p*/
+} jw_key_t;
+
+/*Key from a string literal, built at compile time*/
+#define JW_KEY_INIT(k)	{ "\"" k "\":", sizeof(k) + 2 }
+#define JW_KEY(k)		(&(const jw_key_t)JW_KEY_INIT(k))
+
+/*Writer state*/
+typedef struct {
+	char *buf;
+	size_t cap;
+	size_t len;
+	uint8_t depth;		/*Open objects/arrays*/
+	uint8_t overflow;	/*Buffer was too small*/
+	uint8_t more;		/*Bit per level, set once the level has a member*/
+	uint8_t arr;		/*Bit per level, set for arrays*/
+} jw_t;
+
+/*Start writing into buf, cap bytes*/
+void jw_init(jw_t *w, char *buf, size_t cap);
+
+/*Objects and arrays, key is NULL inside arrays and at the top level*/
+void jw_obj(jw_t *w, const jw_key_t *key);
+void jw_arr(jw_t *w, const jw_key_t *key);
+void jw_close(jw_t *w);
+
+/*Values*/
+void jw_int(jw_t *w, const jw_key_t *key, int32_t v);
+void jw_uint(jw_t *w, const jw_key_t *key, uint32_t v);
+void jw_float(jw_t *w, const jw_key_t *key, float v, uint8_t decimals);
+void jw_str(jw_t *w, const jw_key_t *key, const char *s);
+void jw_null(jw_t *w, const jw_key_t *key);
+
+/*Append a complete JSON value (already formatted)*/
+void jw_raw(jw_t *w, const jw_key_t *key, const char *p, size_t l);
+
+/*Close all open levels, returns the length or -1 if the buffer overflowed*/
+int jw_end(jw_t *w);
+
+#endif
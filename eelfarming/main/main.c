@@ -5,22 +5,25 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <string.h>
+#include <stdlib.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
 #include "esp_wifi.h"
 #include "esp_event_loop.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include "lwip/netdb.h"
 #include "lwip/dns.h"
-#include "cJSON.h"
 #include "driver/adc.h"
+#include "rom/rtc.h"
 
 /*Add websocket lib*/
 #include "websocket.h"
@@ -37,20 +40,56 @@
 /*Include dissolved oxygen lib*/
 #include "do37.h"
 
-/*Define temperature pin and storage*/
+/*Server push of sensor samples*/
+#include "telemetry.h"
+
+/*Binary protocol*/
+#include "binproto.h"
+
+/*Command dispatcher*/
+#include "cmd.h"
+
+/*Latest sensor readings*/
+#include "snapshot.h"
+
+/*Sensor scheduler, rollups, history and its replay*/
+#include "sched.h"
+#include "rollup.h"
+#include "history.h"
+#include "outbox.h"
+
+/*Sensor log in flash*/
+#include "flog.h"
+
+/*MQTT publisher*/
+#include "uplink.h"
+
+/*Define temperature pin, probes at several depths share it*/
 const int DS_PIN = 14;
-float VAR_TEMPERATURE = 0;
+static float TEMP_probes[DS_MAX_DEVICES];
+static int TEMP_probes_n = 0;
 
-/*Define ultrasonic sensor pin and storage*/
-const int HC_TRIG = 18;
-const int HC_ECHO = 19;
-float VAR_DISTANCE = 0;
+/*
+ * Sensor log in the flog partition, kept across reboots. Samples only go
+ * to the RAM pages of the log, its writer task programs the flash.
+ *
+ * */
+#define LOG_REC_BOOT	1	/*Boot, payload: reset reason (uint8_t)*/
+#define LOG_REC_SAMPLE	2	/*Sample, payload: log_sample_t, ms restart at every boot record*/
 
-/*Define PH sensor pin and storage*/
-float VAR_PH = 0;
+typedef struct __attribute__((packed)) {
+	uint8_t ch;
+	uint32_t ms;	/*esp_timer time*/
+	float value;
+} log_sample_t;
 
-/*Define DO sensor pin and storage*/
-float VAR_DO = 0;
+static flog_partition_t LOG_part;
+static flog_t LOG;
+static int LOG_open = 0;
+
+/*Define ultrasonic sensor pin*/
+const int HC_TRIG = 18;
+const int HC_ECHO = 19;
 
 /* The examples use simple WiFi configuration that you can set via
    'make menuconfig'.
@@ -70,8 +109,21 @@ const int CONNECTED_BIT = BIT0;
 
 static const char *TAG = "example";
 
+/*Tasks whose stack use is reported in the stats*/
+static TaskHandle_t WS_server_task = NULL;
+static TaskHandle_t REQ_tasks[CONFIG_REQ_WORKERS];
+
 //WebSocket frame receive queue
 QueueHandle_t WebSocket_rx_queue;
+static uint32_t REQ_dropped = 0;	/*Requests dropped, their client had too many waiting*/
+
+//WebSocket subprotocols, index BP_PROTOCOL_ID is the binary protocol
+static const char *const WS_PROTOCOLS[] = { BP_PROTOCOL };
+
+/*WiFi outages*/
+static int64_t LINK_down_us = 0;		/*Time the link went down, 0 while up*/
+static uint32_t LINK_down_ms = 0;		/*Time spent down*/
+static uint32_t LINK_outages = 0;
 
 /*
  * Event handler
@@ -85,8 +137,19 @@ static esp_err_t event_handler(void *ctx, system_event_t *event)
         break;
     case SYSTEM_EVENT_STA_GOT_IP:
         xEventGroupSetBits(wifi_event_group, CONNECTED_BIT);
+        if (LINK_down_us != 0) {
+            uint32_t down_ms = (esp_timer_get_time() - LINK_down_us) / 1000;
+            LINK_down_ms += down_ms;
+            LINK_down_us = 0;
+            ESP_LOGI(TAG, "link back after %u s, replay from the history", down_ms / 1000);
+        }
         break;
     case SYSTEM_EVENT_STA_DISCONNECTED:
+        /*samples keep going to the history, clients replay them with cmd 11*/
+        if (LINK_down_us == 0) {
+            LINK_down_us = esp_timer_get_time();
+            LINK_outages++;
+        }
         /* This is a workaround as ESP32 WiFi libs don't currently
            auto-reassociate. */
         esp_wifi_connect();
@@ -122,83 +185,676 @@ static void initialise_wifi(void)
     ESP_ERROR_CHECK( esp_wifi_start() );
 }
 
+/*
+ * Binary request (BP_PROTOCOL)
+ * Answered with a binary record, encoded on the stack
+ *
+ * */
+static void waiting_req_bin(WebSocket_frame_t *frame)
+{
+	uint8_t res[BP_SNAPSHOT_MAX_L];
+	size_t len;
+	bp_cmd_t cmd;
+
+	if (bp_decode_cmd((uint8_t *)frame->payload, frame->payload_length, &cmd) != 0) {
+		len = bp_encode_status(res, 0xFF, 0);
+	} else {
+		switch (cmd.cmd) {
+			case 0:{
+				len = bp_encode_status(res, cmd.cmd, 1);
+				break;
+			}
+			case 1:{ /*Get water meter*/
+				snap_reading_t r[TM_CH_MAX];
+				float values[TM_CH_MAX];
+				uint32_t valid = snapshot_changed(0, r);
+				for (int ch = 0; ch < TM_CH_MAX; ch++) {
+					values[ch] = r[ch].value;
+				}
+				len = bp_encode_snapshot(res, cmd.mask & valid, values);
+				break;
+			}
+			case 4:{ /*Subscribe*/
+				len = bp_encode_status(res, cmd.cmd, telemetry_subscribe(frame->client, cmd.mask, cmd.ms, cmd.threshold) == 0);
+				break;
+			}
+			case 5:{ /*Unsubscribe*/
+				telemetry_unsubscribe(frame->client, cmd.mask);
+				len = bp_encode_status(res, cmd.cmd, 1);
+				break;
+			}
+			default:{
+				len = bp_encode_status(res, cmd.cmd, 0);
+				break;
+			}
+		}
+	}
+	WS_write(frame->client, WS_OP_BIN, (char *)res, len, 0);
+}
+
+/*
+ * JSON commands
+ * 0 => ack, 1 -> info, 2 set ssid, 3 control pin, 4 subscribe, 5 unsubscribe, 6 stats, 7 temperature probes, 8 calibration, 9 rollups, 10 history, 11 replay
+ *
+ * */
+static void cmd_ack(const cmd_req_t *req, jw_t *response)
+{
+	jw_int(response, JW_KEY("status"), 1);
+}
+
+/*
+ * Get water meter: {"cmd":1}, only channels updated after a sequence number: {"cmd":1,"since":42}
+ * Answer: {"te_m":25.5,...,"seq":57,"age":{"te_m":120,...},"st":{"ph_m":2}}
+ * age in ms, st only for channels not SNAP_OK, seq is the since of the next request
+ *
+ * */
+static void cmd_meters(const cmd_req_t *req, jw_t *response)
+{
+	snap_reading_t r[TM_CH_MAX];
+	uint32_t since = 0;
+	uint32_t seq = snapshot_seq();
+	uint32_t mask, failed = 0;
+	int64_t now = esp_timer_get_time();
+
+	cmd_arg_uint(req, "since", &since);
+	mask = snapshot_changed(since, r);
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		if (mask & (1 << ch)) {
+			jw_float(response, &TM_CH_JKEYS[ch], r[ch].value, TM_CH_DECIMALS[ch]);
+			if (r[ch].status != SNAP_OK) {
+				failed |= 1 << ch;
+			}
+		}
+	}
+	jw_uint(response, JW_KEY("seq"), seq);
+	jw_obj(response, JW_KEY("age"));
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		if (mask & (1 << ch)) {
+			jw_uint(response, &TM_CH_JKEYS[ch], (now - r[ch].time_us) / 1000);
+		}
+	}
+	jw_close(response);
+	if (failed) {
+		jw_obj(response, JW_KEY("st"));
+		for (int ch = 0; ch < TM_CH_MAX; ch++) {
+			if (failed & (1 << ch)) {
+				jw_uint(response, &TM_CH_JKEYS[ch], r[ch].status);
+			}
+		}
+		jw_close(response);
+	}
+}
+
+/*
+ * Subscribe: {"cmd":4,"ch":"te_m","ms":1000,"th":0.1}, all channels without ch
+ * Unsubscribe: {"cmd":5,"ch":"te_m"}
+ *
+ * */
+static void cmd_subscribe(const cmd_req_t *req, jw_t *response)
+{
+	const char *ch = cmd_arg_str(req, "ch");
+	int32_t ms = 0;
+	float th = 0;
+	uint32_t mask = TM_CH_ALL;
+	int status = 1;
+
+	if (ch != NULL) {
+		int channel = telemetry_channel(ch);
+		mask = (channel >= 0) ? (1 << channel) : 0;
+	}
+	cmd_arg_int(req, "ms", &ms);
+	cmd_arg_float(req, "th", &th);
+	if (mask == 0) {
+		status = 0;
+	} else if (req->cmd == 4) {
+		status = telemetry_subscribe(req->client, mask, (ms > 0) ? ms : 0, th) == 0;
+	} else {
+		telemetry_unsubscribe(req->client, mask);
+	}
+	jw_int(response, JW_KEY("status"), status);
+}
+
+static void cmd_stats(const cmd_req_t *req, jw_t *response) /*Receive buffer pool usage*/
+{
+	WS_pool_stats_t pool[WS_POOL_CLASSES];
+	WS_pool_stats(pool);
+	jw_uint(response, JW_KEY("pool_s_hw"), pool[0].high_water); /*Small buffers high-water mark*/
+	jw_uint(response, JW_KEY("pool_l_hw"), pool[1].high_water); /*Large buffers high-water mark*/
+	jw_uint(response, JW_KEY("pool_miss"), pool[0].exhausted + pool[1].exhausted); /*Requests without free buffer*/
+	WS_tx_stats_t tx;
+	WS_tx_stats(&tx);
+	jw_uint(response, JW_KEY("tx_seg"), tx.segments); /*Socket writes*/
+	jw_uint(response, JW_KEY("tx_bytes"), tx.bytes); /*Bytes sent*/
+	jw_uint(response, JW_KEY("tx_lat"), tx.flush_lat_avg_us); /*Average batch flush latency (us)*/
+	WS_conn_stats_t conn;
+	WS_conn_stats(&conn);
+	jw_uint(response, JW_KEY("hs_fail"), conn.hs_failed); /*Rejected handshakes*/
+	jw_uint(response, JW_KEY("hs_lat"), conn.hs_lat_avg_us); /*Average handshake latency (us)*/
+	jw_uint(response, JW_KEY("rx_drop"), conn.rx_dropped); /*Messages dropped, no buffer or queue slot free*/
+	hist_stats_t hist;
+	hist_stats(&hist);
+	jw_uint(response, JW_KEY("hist_n"), hist.samples); /*Samples in the history*/
+	jw_uint(response, JW_KEY("hist_b"), hist.bytes); /*Their compressed size*/
+	jw_uint(response, JW_KEY("hist_cap"), hist.blocks * HIST_BLOCK_L); /*Size of the pool*/
+	jw_uint(response, JW_KEY("outages"), LINK_outages); /*WiFi outages since boot*/
+	jw_uint(response, JW_KEY("down_s"), LINK_down_ms / 1000); /*Time spent in them (s)*/
+	uplink_stats_t up;
+	if (uplink_stats(&up) == 0) {
+		jw_uint(response, JW_KEY("mq_up"), up.connected); /*Connected to the broker*/
+		jw_uint(response, JW_KEY("mq_pub"), up.mqtt.published); /*Messages published*/
+		jw_uint(response, JW_KEY("mq_ack"), up.mqtt.acked); /*QoS 1 messages acknowledged*/
+		jw_uint(response, JW_KEY("mq_resent"), up.mqtt.resent); /*Sent again after a reconnect*/
+		jw_uint(response, JW_KEY("mq_lat"), up.mqtt.ack_lat_avg_us); /*Average PUBLISH to PUBACK (us)*/
+	}
+	if (LOG_open) {
+		flog_stats_t log;
+		flog_stats(&LOG, &log);
+		jw_uint(response, JW_KEY("log_rec"), log.records); /*Records logged since boot*/
+		jw_uint(response, JW_KEY("log_drop"), log.dropped); /*Records lost, the writer fell behind*/
+		jw_uint(response, JW_KEY("log_pages"), log.pages); /*Flash pages written*/
+		jw_uint(response, JW_KEY("log_late"), log.late); /*Sectors erased outside the erase job*/
+		jw_uint(response, JW_KEY("log_stall"), log.stall_max_us); /*Longest sector erase, flash cache off (us)*/
+	}
+	jw_uint(response, JW_KEY("req_drop"), REQ_dropped); /*Requests dropped, too many of one client waiting*/
+	jw_uint(response, JW_KEY("stk_ws"), uxTaskGetStackHighWaterMark(WS_server_task)); /*Stack never used by the server task (bytes)*/
+	uint32_t stk_req = UINT32_MAX;
+	for (int i = 0; i < CONFIG_REQ_WORKERS; i++) {
+		uint32_t unused = uxTaskGetStackHighWaterMark(REQ_tasks[i]);
+		stk_req = (unused < stk_req) ? unused : stk_req;
+	}
+	jw_uint(response, JW_KEY("stk_req"), stk_req); /*Stack never used by the busiest request worker (bytes)*/
+	sched_stats_t job;
+	const char *name;
+	jw_arr(response, JW_KEY("jobs")); /*Sensor jobs: runs, overruns, average and max jitter, max busy time (us)*/
+	for (int id = 0; (name = sched_stats(id, &job)) != NULL; id++) {
+		jw_obj(response, NULL);
+		jw_str(response, JW_KEY("name"), name);
+		jw_uint(response, JW_KEY("runs"), job.runs);
+		jw_uint(response, JW_KEY("ovr"), job.overruns);
+		jw_uint(response, JW_KEY("jit"), job.jitter_avg_us);
+		jw_uint(response, JW_KEY("jit_max"), job.jitter_max_us);
+		jw_uint(response, JW_KEY("busy_max"), job.busy_max_us);
+		jw_close(response);
+	}
+	jw_close(response);
+}
+
+/*
+ * Temperature of all probes: {"cmd":7} -> {"probes":[25.1,24.8]}
+ *
+ * */
+static void cmd_probes(const cmd_req_t *req, jw_t *response)
+{
+	jw_arr(response, JW_KEY("probes"));
+	for (int i = 0; i < TEMP_probes_n; i++) {
+		jw_float(response, NULL, TEMP_probes[i], TM_CH_DECIMALS[TM_CH_TEMPERATURE]);
+	}
+	jw_close(response);
+}
+
+/*
+ * Water temperature for the compensations, fallback until there is a valid reading
+ *
+ * */
+static float water_temp(float fallback)
+{
+	snap_reading_t temp;
+	snapshot_read(TM_CH_TEMPERATURE, &temp);
+	return (temp.status == SNAP_OK) ? temp.value : fallback;
+}
+
+/*
+ * Calibration, the probe voltage is the current average unless mv is given,
+ * the temperature the current water temperature unless t is given
+ * pH buffer: {"cmd":8,"ch":"ph_m","ph":4.01} -> {"status":1,"pts":[[2032,4],[1500,7]]}
+ * DO in air saturated water: {"cmd":8,"ch":"do_m","sat":1} -> {"status":1,"sat_mv":1600,"sat_t":25}
+ * Default curve: {"cmd":8,"ch":"ph_m","reset":1}, without action only the calibration is returned
+ * pts in mV and pH at 25 C
+ *
+ * */
+static void cmd_calib(const cmd_req_t *req, jw_t *response)
+{
+	const char *ch = cmd_arg_str(req, "ch");
+	int channel = (ch != NULL) ? telemetry_channel(ch) : -1;
+	int32_t mv = -1, reset = 0, sat = 0;
+	float t = water_temp(25.0f), ph;
+	uint32_t voltage;
+	esp_err_t err = ESP_OK;
+
+	cmd_arg_int(req, "mv", &mv);
+	cmd_arg_float(req, "t", &t);
+	cmd_arg_int(req, "reset", &reset);
+	cmd_arg_int(req, "sat", &sat);
+	if (channel == TM_CH_PH) {
+		if (reset) {
+			err = ph20_cal_reset();
+		} else if (cmd_arg_float(req, "ph", &ph) == 0) {
+			if (mv >= 0) {
+				voltage = mv;
+			} else {
+				err = ph20_get_voltage(&voltage);
+			}
+			if (err == ESP_OK) {
+				err = ph20_cal_point(voltage, ph, t);
+			}
+		}
+		calib_point_t pts[CALIB_POINTS_MAX];
+		int n = ph20_cal_points(pts);
+		jw_int(response, JW_KEY("status"), err == ESP_OK);
+		jw_arr(response, JW_KEY("pts"));
+		for (int i = 0; i < n; i++) {
+			jw_arr(response, NULL);
+			jw_int(response, NULL, pts[i].x);
+			jw_float(response, NULL, pts[i].y / 1000.0f, 3);
+			jw_close(response);
+		}
+		jw_close(response);
+	} else if (channel == TM_CH_DO) {
+		if (reset) {
+			err = do37_cal_reset();
+		} else if (sat) {
+			if (mv >= 0) {
+				voltage = mv;
+			} else {
+				err = do37_get_voltage(&voltage);
+			}
+			if (err == ESP_OK) {
+				err = do37_cal_saturation(voltage, t);
+			}
+		}
+		do37_cal_t cal;
+		do37_cal_get(&cal);
+		jw_int(response, JW_KEY("status"), err == ESP_OK);
+		jw_int(response, JW_KEY("sat_mv"), cal.sat_mv);
+		jw_float(response, JW_KEY("sat_t"), cal.sat_cc / 100.0f, 2);
+	} else {
+		jw_int(response, JW_KEY("status"), 0);
+	}
+}
+
+/*
+ * Rollups of a channel: {"cmd":9,"ch":"te_m"}, one window only: {"cmd":9,"ch":"te_m","w":60}
+ * Answer: {"win":[{"s":60,"cur":{"n":42,"min":25.1,"max":25.6,"mean":25.3,"sd":0.12,"age":42},"done":{...}}]}
+ * cur is the running window, done the last completed one, age in s since the window started
+ *
+ * */
+static void rollup_write(jw_t *response, const jw_key_t *key, const rollup_t *r, int ch, int64_t now)
+{
+	uint8_t decimals = TM_CH_DECIMALS[ch];
+	jw_obj(response, key);
+	jw_uint(response, JW_KEY("n"), r->n);
+	if (r->n > 0) {
+		jw_float(response, JW_KEY("min"), r->min, decimals);
+		jw_float(response, JW_KEY("max"), r->max, decimals);
+		jw_float(response, JW_KEY("mean"), r->mean, decimals + 1);
+		jw_float(response, JW_KEY("sd"), r->sd, decimals + 1);
+	}
+	jw_uint(response, JW_KEY("age"), (now - r->start_us) / 1000000);
+	jw_close(response);
+}
+
+static void cmd_rollup(const cmd_req_t *req, jw_t *response)
+{
+	const char *ch = cmd_arg_str(req, "ch");
+	int channel = (ch != NULL) ? telemetry_channel(ch) : -1;
+	int32_t s = 0;
+	int64_t now = esp_timer_get_time();
+	rollup_t cur, done;
+
+	if (channel < 0) {
+		jw_int(response, JW_KEY("status"), 0);
+		return;
+	}
+	cmd_arg_int(req, "w", &s);
+	jw_arr(response, JW_KEY("win"));
+	for (int w = 0; w < ROLLUP_WINDOWS; w++) {
+		if ((s != 0 && ROLLUP_WINDOW_S[w] != s) || rollup_read(channel, w, &cur, &done) != 0) {
+			continue;
+		}
+		jw_obj(response, NULL);
+		jw_uint(response, JW_KEY("s"), ROLLUP_WINDOW_S[w]);
+		rollup_write(response, JW_KEY("cur"), &cur, channel, now);
+		rollup_write(response, JW_KEY("done"), &done, channel, now);
+		jw_close(response);
+	}
+	jw_close(response);
+}
+
+/*
+ * History of a channel, downsampled to min/max buckets:
+ * {"cmd":10,"ch":"te_m","s":604800,"pts":1000,"win":4}
+ * s is the range in s back from now, or "from" and "to" in ms of device time.
+ * Device time is uint32 and wraps after 49.7 days, a range is below 24.8 days.
+ * pts is the most points wanted, every bucket of "w" ms gives its min and max.
+ * Points come in chunk frames {"ch":"te_m","from":..,"w":..,"b":..,"pts":[[t,v],...]}
+ * with t in ms after from, at most win of them per request. The answer after
+ * the chunks: {"from":..,"to":..,"w":..,"n":points sent,"next":bucket}
+ * Send the request again with "from", "to" and "b":next for the next chunks,
+ * next is -1 when the range is done. Nothing is kept between requests.
+ *
+ * */
+#define HIST_CHUNK_PTS	28		/*Points of a chunk frame, fits 1 KB*/
+#define HIST_PTS_MAX	4000
+#define HIST_WIN_MAX	16
+#define HIST_SPAN_MAX_S	(INT32_MAX / 1000)	/*Longest range, times are compared as serial numbers*/
+
+static void cmd_history(const cmd_req_t *req, jw_t *response)
+{
+	const char *ch = cmd_arg_str(req, "ch");
+	int channel = (ch != NULL) ? telemetry_channel(ch) : -1;
+	int32_t s = 3600, pts = 500, win = 4, b = 0;
+	uint32_t now = esp_timer_get_time() / 1000, from, to, w, sent = 0;
+	hist_sample_t out[HIST_CHUNK_PTS];
+
+	cmd_arg_int(req, "s", &s);
+	cmd_arg_int(req, "pts", &pts);
+	cmd_arg_int(req, "win", &win);
+	cmd_arg_int(req, "b", &b);
+	if (cmd_arg_uint(req, "to", &to) != 0) {
+		to = now;
+	}
+	if (cmd_arg_uint(req, "from", &from) != 0) {
+		from = to - (uint32_t)((s > 0 && s < HIST_SPAN_MAX_S) ? s : HIST_SPAN_MAX_S) * 1000;
+	}
+	if (channel < 0 || pts < 2 || (int32_t)(to - from) <= 0 || req->buf == NULL) {
+		jw_int(response, JW_KEY("status"), 0);
+		return;
+	}
+	if (pts > HIST_PTS_MAX) {
+		pts = HIST_PTS_MAX;
+	}
+	if (win < 1 || win > HIST_WIN_MAX) {
+		win = (win < 1) ? 1 : HIST_WIN_MAX;
+	}
+	w = hist_bucket_ms(from, to, pts);
+
+	/*one chunk decoded at a time, the socket blocks while the client lags*/
+	for (int c = 0; c < win && b >= 0; c++) {
+		int32_t first = b;
+		int n = hist_minmax(channel, from, to, w, &b, out, HIST_CHUNK_PTS);
+		jw_t chunk;
+		int len;
+
+		if (n == 0) {
+			continue;
+		}
+		jw_init(&chunk, req->buf, req->buf_l);
+		jw_obj(&chunk, NULL);
+		jw_str(&chunk, JW_KEY("ch"), ch);
+		jw_uint(&chunk, JW_KEY("from"), from);
+		jw_uint(&chunk, JW_KEY("w"), w);
+		jw_int(&chunk, JW_KEY("b"), first);
+		jw_arr(&chunk, JW_KEY("pts"));
+		for (int i = 0; i < n; i++) {
+			jw_arr(&chunk, NULL);
+			jw_uint(&chunk, NULL, out[i].ms - from);
+			jw_float(&chunk, NULL, out[i].value, TM_CH_DECIMALS[channel]);
+			jw_close(&chunk);
+		}
+		jw_close(&chunk);
+		if ((len = jw_end(&chunk)) < 0 || WS_write(req->client, WS_OP_TXT, req->buf, len, WS_TX_NOCOPY) != ERR_OK) {
+			b = first;
+			break;
+		}
+		sent += n;
+	}
+	jw_uint(response, JW_KEY("from"), from);
+	jw_uint(response, JW_KEY("to"), to);
+	jw_uint(response, JW_KEY("w"), w);
+	jw_uint(response, JW_KEY("n"), sent);
+	jw_int(response, JW_KEY("next"), b);
+}
+
+/*
+ * Replay after an outage: {"cmd":11,"seq":123456,"win":4}
+ * Sends up to win batch frames (see outbox.h) of the samples taken after seq,
+ * then answers {"seq":..,"n":samples sent,"more":1,"up":ms of device time}.
+ * The client acknowledges with the next request, seq set to the seq of the
+ * last frame it got, so a frame lost on the way is sent again. seq 0 replays
+ * the whole history, a seq ahead of up means the device restarted since and
+ * the replay starts over. seq is compared as a serial number, it goes on
+ * across the wrap of up. Live pushes go on between the frames, the frames
+ * are written one at a time into the frame buffer of the worker.
+ *
+ * */
+#define OUTBOX_WIN_MAX	16
+
+static void cmd_replay(const cmd_req_t *req, jw_t *response)
+{
+	uint32_t now = esp_timer_get_time() / 1000, seq = 0;
+	int32_t win = 4;
+	outbox_t ob;
+	int len = 0;
+
+	cmd_arg_uint(req, "seq", &seq);
+	cmd_arg_int(req, "win", &win);
+	if ((int32_t)(seq - now) > 0) {
+		seq = 0;
+	}
+	if (win < 1 || win > OUTBOX_WIN_MAX) {
+		win = (win < 1) ? 1 : OUTBOX_WIN_MAX;
+	}
+	if (req->buf == NULL) {
+		jw_int(response, JW_KEY("status"), 0);
+		return;
+	}
+	outbox_init(&ob, seq, now);
+	for (int f = 0; f < win; f++) {
+		if ((len = outbox_batch(&ob, req->buf, req->buf_l)) <= 0) {
+			break;
+		}
+		if (WS_write(req->client, WS_OP_TXT, req->buf, len, WS_TX_NOCOPY) != ERR_OK) {
+			len = -1;
+			break;
+		}
+		seq = ob.seq;
+	}
+	jw_uint(response, JW_KEY("seq"), seq);
+	jw_uint(response, JW_KEY("n"), ob.sent);
+	jw_int(response, JW_KEY("more"), len != 0 && outbox_more(&ob));
+	jw_uint(response, JW_KEY("up"), now);
+}
+
+/*
+ * Request workers share the receive queue. A worker that takes a frame of a
+ * client another worker is busy with leaves it in the backlog of that
+ * connection slot and goes on, the busy worker handles it next. So requests
+ * of a client are handled in the order they arrived and a slow client only
+ * holds up its own requests. The take lock covers receiving and claiming,
+ * it is never held while a request runs.
+ *
+ * */
+#define REQ_BACKLOG		4	/*Frames of one client waiting for its worker*/
+
+typedef struct {
+	uint8_t busy;		/*A worker handles this slot*/
+	uint8_t head;
+	uint8_t n;
+	WebSocket_frame_t backlog[REQ_BACKLOG];
+} req_slot_t;
+
+/*Buffers of a worker, requests take them neither from the heap nor from the stack*/
+typedef struct {
+	char res[CMD_RES_L];				/*Response*/
+	char frame[CONFIG_OUTBOX_FRAME_L];	/*Frames a handler sends itself*/
+} req_worker_t;
+
+static SemaphoreHandle_t req_take_lock;
+static req_slot_t REQ_slots[CONFIG_WS_MAX_CLIENTS];
+static portMUX_TYPE REQ_lock = portMUX_INITIALIZER_UNLOCKED;
+static req_worker_t REQ_workers[CONFIG_REQ_WORKERS];
+
+/*
+ * Handle one received message
+ *
+ * */
+static void handle_req(req_worker_t *worker, WebSocket_frame_t *frame)
+{
+	//write frame inforamtion to UART
+	printf("New Websocket frame. Length %d, payload %.*s \r\n", frame->payload_length, frame->payload_length, frame->payload);
+
+	if(frame->frame_header.opcode == WS_OP_BIN){
+		if(frame->protocol == BP_PROTOCOL_ID){
+			waiting_req_bin(frame);
+		}
+	} else {
+		char *res = worker->res;
+		jw_t response;
+		jw_init(&response, res, sizeof(worker->res));
+		jw_obj(&response, NULL);
+		int cmd = cmd_dispatch(frame->client, frame->payload, frame->payload_length, &response, worker->frame, sizeof(worker->frame));
+		if(cmd >= 0){
+			ESP_LOGI(TAG, "cmd --> %d", cmd);
+			int len = jw_end(&response);
+			if(len >= 0){
+				esp_err_t err = WS_write_data(frame->client, res, len);
+				ESP_LOGI(TAG, "send %.*s -> %d", len, res, err);
+			}
+		} else{
+			//loop back frame
+			WS_write_data(frame->client, frame->payload, frame->payload_length);
+		}
+	}
+}
+
 /*
  * Queue of web socket
+ * Blocks until a frame arrives, no wakeups while idle
  *
  * */
 static void waiting_req(void *pvParameters)
 {
     //frame buffer
 	WebSocket_frame_t __RX_frame;
-
-	//create WebSocket RX Queue
-	WebSocket_rx_queue = xQueueCreate(10,sizeof(WebSocket_frame_t));
+	req_worker_t *worker = pvParameters;
+	req_slot_t *slot;
+	int own;
 
     while(1) {
-        /* Wait for the callback to set the CONNECTED_BIT in the
-           event group.
-        */
-        xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT, false, true, portMAX_DELAY);
-        //ESP_LOGI(TAG, "Connected to AP");
-
-        if(xQueueReceive(WebSocket_rx_queue,&__RX_frame, 3*portTICK_PERIOD_MS)==pdTRUE){
-			//write frame inforamtion to UART
-			printf("New Websocket frame. Length %d, payload %.*s \r\n", __RX_frame.payload_length, __RX_frame.payload_length, __RX_frame.payload);
-
-			cJSON *socketQ = cJSON_Parse(__RX_frame.payload);
-			if(socketQ != NULL){
-				cJSON *response = cJSON_CreateObject();
-				cJSON *cmd = cJSON_GetObjectItem(socketQ, "cmd");
-				if(cmd != NULL){
-					ESP_LOGI(TAG, "cmd --> %d", cmd->valueint);
-					switch (cmd->valueint){ // 0 => ack, 1 -> info, 2 set ssid, 3 control pin
-						case 0:{
-							cJSON_AddNumberToObject(response, "status", 1);
-							break;
-						}
-						case 1:{ /*Get water meter*/
-							cJSON_AddNumberToObject(response, "te_m", VAR_TEMPERATURE); /*Temperature meter*/
-							cJSON_AddNumberToObject(response, "di_m", VAR_DISTANCE); /*Distance meter*/
-							cJSON_AddNumberToObject(response, "ph_m", VAR_PH); /*PH meter*/
-							cJSON_AddNumberToObject(response, "do_m", VAR_DO); /*DO meter*/
-							break;
-						}
-						default:{
-							cJSON_AddNumberToObject(response, "status", 0);
-							break;
-						}
-					}
-				}
-				char *res = cJSON_Print(response);
-				esp_err_t err = WS_write_data(res, strlen(res));
-				ESP_LOGI(TAG, "send %s -> %d", res, err);
-			} else{
-				//loop back frame
-				WS_write_data(__RX_frame.payload, __RX_frame.payload_length);
-			}
+		xSemaphoreTake(req_take_lock, portMAX_DELAY);
+		xQueueReceive(WebSocket_rx_queue, &__RX_frame, portMAX_DELAY);
+		slot = &REQ_slots[__RX_frame.slot];
+		portENTER_CRITICAL(&REQ_lock);
+		own = !slot->busy;
+		if (own) {
+			slot->busy = 1;
+		} else if (slot->n < REQ_BACKLOG) {
+			slot->backlog[(slot->head + slot->n++) % REQ_BACKLOG] = __RX_frame;
+			__RX_frame.payload = NULL;
+		} else {
+			REQ_dropped++;
+		}
+		portEXIT_CRITICAL(&REQ_lock);
+		xSemaphoreGive(req_take_lock);
+
+		while (own) {
+			handle_req(worker, &__RX_frame);
 
-			//free memory
+			//return frame buffer to the pool
 			if (__RX_frame.payload != NULL){
-				free(__RX_frame.payload);
+				WS_frame_free(__RX_frame.payload);
+			}
+
+			//next frame of the client, or release it
+			portENTER_CRITICAL(&REQ_lock);
+			own = (slot->n > 0);
+			if (own) {
+				__RX_frame = slot->backlog[slot->head];
+				slot->head = (slot->head + 1) % REQ_BACKLOG;
+				slot->n--;
+			} else {
+				slot->busy = 0;
 			}
+			portEXIT_CRITICAL(&REQ_lock);
+		}
+
+		//handed to the busy worker or dropped
+		if (__RX_frame.payload != NULL){
+			WS_frame_free(__RX_frame.payload);
 		}
     }
 }
 
+/*
+ * Sensor jobs, run by the scheduler every second. The phases spread the
+ * acquisitions over the period, hooks that wait for a sensor return the
+ * delay and the scheduler runs the other jobs meanwhile.
+ *
+ * */
+static uint32_t TEMP_conversion_ms;
+
+/*Open the sensor log, recovery reads only the newest segment*/
+static void log_init(void)
+{
+	uint8_t reason = rtc_get_reset_reason(0);
+	if (flog_partition_init(&LOG_part, CONFIG_FLOG_PARTITION) != ESP_OK || flog_open(&LOG, &LOG_part.flash) != ESP_OK) {
+		ESP_LOGE(TAG, "no sensor log");
+		return;
+	}
+	LOG_open = 1;
+	ESP_LOGI(TAG, "sensor log: segment %d page %d, recovered in %u us", LOG.seg, LOG.page, LOG.stats.recovery_us);
+	flog_append(&LOG, LOG_REC_BOOT, &reason, sizeof(reason));
+	flog_start(&LOG, 2048, 3, 0);
+}
+
+/*
+ * Erase ahead for the sensor log, one sector per run. An erase stops code
+ * outside IRAM on both cores, the job runs after the temperature reads and
+ * before the next conversion, far from the echo timing of the distance
+ * burst (250..550 ms).
+ *
+ * */
+#define LOG_ERASE_PHASE_MS	900
+#define LOG_ERASE_WINDOW_MS	40	/*Skip the sector if the writer starts later*/
+
+static uint32_t log_erase(void *arg)
+{
+	flog_erase_ahead(&LOG, LOG_ERASE_WINDOW_MS);
+	return 0;
+}
+
+/*New valid sample of channel ch*/
+static void sensor_publish(tm_channel_t ch, float value)
+{
+	log_sample_t rec = { ch, esp_timer_get_time() / 1000, value };
+
+	snapshot_update(ch, value, SNAP_OK);
+	telemetry_publish(ch, value);
+	rollup_add(ch, value);
+	hist_append(ch, value);
+	if (LOG_open) {
+		flog_append(&LOG, LOG_REC_SAMPLE, &rec, sizeof(rec));
+	}
+}
+
 /*
  * Read temperature
  * Sensor DS18B20 waterproof
  * GPIO 14
  *
  * */
-static void temperature(void *pvParameters)
+static uint32_t temperature_start(void *arg)
 {
-	ds18b20_init(DS_PIN);
-	while (1) {
-		VAR_TEMPERATURE = ds18b20_get_temp();
-	    printf("Temperature: %0.1f C\n", VAR_TEMPERATURE);
-	    vTaskDelay(1000 / portTICK_PERIOD_MS);
+	/*one conversion for all probes*/
+	ds18b20_start_conversion();
+	return TEMP_conversion_ms;
+}
+
+static uint32_t temperature_complete(void *arg)
+{
+	float value = TEMP_probes[0];
+	for (int i = 1; i < TEMP_probes_n; i++) {
+		ds18b20_read_temp_idx(i, &TEMP_probes[i]);
 	}
+	/*first probe is the temperature channel*/
+	if (ds18b20_read_temp_idx(0, &value) == ESP_OK) {
+		TEMP_probes[0] = value;
+		sensor_publish(TM_CH_TEMPERATURE, value);
+	} else {
+		snapshot_update(TM_CH_TEMPERATURE, value, SNAP_ERROR);
+	}
+	printf("Temperature: %0.1f C (%d probes)\n", value, TEMP_probes_n);
+	return 0;
 }
 
 /*
@@ -208,14 +864,29 @@ static void temperature(void *pvParameters)
  * GPIO 19 -> echo
  *
  * */
-static void distance(void *pvParameters)
+static uint32_t distance_start(void *arg)
 {
-	hcsr04_init(HC_TRIG, HC_ECHO);
-	while (1) {
-		VAR_DISTANCE = hcsr04_get_distance();
-		printf("Distance: %0.1f Cm\n", VAR_DISTANCE);
-		vTaskDelay(1000 / portTICK_PERIOD_MS);
+	if (hcsr04_burst_start() != ESP_OK) {
+		return 0;
+	}
+	return HC_CYCLE_MS;
+}
+
+static uint32_t distance_complete(void *arg)
+{
+	float value = 0;
+	/*one ping per step until the burst is done*/
+	if (hcsr04_burst_step()) {
+		return HC_CYCLE_MS;
 	}
+	/*speed of sound from the surface temperature, 20 C until there is one*/
+	if (hcsr04_burst_result(water_temp(20.0f), &value) == ESP_OK) {
+		sensor_publish(TM_CH_DISTANCE, value);
+	} else {
+		snapshot_update(TM_CH_DISTANCE, value, SNAP_ERROR);
+	}
+	printf("Distance: %0.1f Cm\n", value);
+	return 0;
 }
 
 /*
@@ -224,14 +895,17 @@ static void distance(void *pvParameters)
  * GPIO 36 -> ADC1_CHANNEL_0 -> DB_11 3.3v
  *
  * */
-static void ph_meter(void *pvParameters)
+static uint32_t ph_meter(void *arg)
 {
-	ph20_init(ADC1_CHANNEL_0, ADC_WIDTH_MAX, ADC_ATTEN_DB_11);
-	while (1) {
-		VAR_PH = ph20_get_meter();
-		printf("PH: %0.1f U\n", VAR_PH);
-		vTaskDelay(1000 / portTICK_PERIOD_MS);
+	uint32_t voltage;
+	float value = 0;
+	/*averages come from the ADC1 acquisition service, compensated to the water temperature*/
+	if (ph20_get_voltage(&voltage) == ESP_OK) {
+		value = ph20_convert(voltage, water_temp(25.0f));
+		sensor_publish(TM_CH_PH, value);
 	}
+	printf("PH: %0.1f U\n", value);
+	return 0;
 }
 
 /*
@@ -240,29 +914,75 @@ static void ph_meter(void *pvParameters)
  * GPIO 39 -> ADC1_CHANNEL_3 -> DB_11 3.3v
  *
  * */
-static void do_meter(void *pvParameters)
+static uint32_t do_meter(void *arg)
 {
-	do37_init(ADC1_CHANNEL_3, ADC_WIDTH_MAX, ADC_ATTEN_DB_11);
-	while (1) {
-		VAR_DO = do37_get_meter();
-		printf("DO: %0.1f mg/l\n", VAR_DO);
-		vTaskDelay(1000 / portTICK_PERIOD_MS);
+	uint32_t voltage;
+	float value = 0;
+	/*averages come from the ADC1 acquisition service, compensated to the water temperature*/
+	if (do37_get_voltage(&voltage) == ESP_OK) {
+		value = do37_convert(voltage, water_temp(25.0f));
+		sensor_publish(TM_CH_DO, value);
+	}
+	printf("DO: %0.1f mg/l\n", value);
+	return 0;
+}
+
+/*
+ * Initialise the sensors and register their jobs
+ *
+ * */
+static void sensors_init(void)
+{
+	ds18b20_init(DS_PIN);
+	TEMP_conversion_ms = ds18b20_conversion_ms();
+	TEMP_probes_n = (ds18b20_count() > 0) ? ds18b20_count() : 1;
+	hcsr04_init(HC_TRIG, HC_ECHO);
+	ph20_init(ADC1_CHANNEL_0, ADC_ATTEN_DB_11);
+	do37_init(ADC1_CHANNEL_3, ADC_ATTEN_DB_11);
+
+	sched_register("temperature", 1000, 0, temperature_start, temperature_complete, NULL);
+	sched_register("distance", 1000, 250, distance_start, distance_complete, NULL);
+	sched_register("ph", 1000, 500, ph_meter, NULL, NULL);
+	sched_register("do", 1000, 750, do_meter, NULL, NULL);
+	if (LOG_open) {
+		sched_register("log_erase", 1000, LOG_ERASE_PHASE_MS, log_erase, NULL, NULL);
 	}
 }
 
 /*
  * Main function
- * Pin tasks to core (0, 1)
+ * The WebSocket server and the request workers run on either core, the
+ * telemetry task and the uplink on core 1, the sensor schedule on core 0
  *
  * */
 void app_main()
 {
     ESP_ERROR_CHECK( nvs_flash_init() );
     initialise_wifi();
-    xTaskCreate(&ws_server, "ws_server", 2048, NULL, 4, NULL);
-    xTaskCreatePinnedToCore(&waiting_req, "waiting_req", 2048, NULL, 5, NULL, 1);
-    xTaskCreatePinnedToCore(&temperature, "temperature", 2048, NULL, 5, NULL, 0);
-    xTaskCreatePinnedToCore(&distance, "distance", 2048, NULL, 5, NULL, 0);
-    xTaskCreatePinnedToCore(&ph_meter, "ph_meter", 2048, NULL, 5, NULL, 0);
-    xTaskCreatePinnedToCore(&do_meter, "do_meter", 2048, NULL, 5, NULL, 0);
+    WS_set_protocols(WS_PROTOCOLS, sizeof(WS_PROTOCOLS) / sizeof(WS_PROTOCOLS[0]));
+    cmd_register(0, cmd_ack);
+    cmd_register(1, cmd_meters);
+    cmd_register(4, cmd_subscribe);
+    cmd_register(5, cmd_subscribe);
+    cmd_register(6, cmd_stats);
+    cmd_register(7, cmd_probes);
+    cmd_register(8, cmd_calib);
+    cmd_register(9, cmd_rollup);
+    cmd_register(10, cmd_history);
+    cmd_register(11, cmd_replay);
+    //create WebSocket RX Queue and the request workers
+    WebSocket_rx_queue = xQueueCreate(CONFIG_REQ_QUEUE_LEN, sizeof(WebSocket_frame_t));
+    req_take_lock = xSemaphoreCreateMutex();
+    for (int i = 0; i < CONFIG_REQ_WORKERS; i++) {
+        xTaskCreatePinnedToCore(&waiting_req, "waiting_req", 5120, &REQ_workers[i], 5, &REQ_tasks[i], tskNO_AFFINITY);
+    }
+    xTaskCreate(&ws_server, "ws_server", 4096, NULL, 4, &WS_server_task);
+    xTaskCreatePinnedToCore(&telemetry_task, "telemetry", 3072, NULL, 4, NULL, 1);
+    hist_init(CONFIG_HIST_BUDGET_KB * 1024);
+    log_init();
+    sensors_init();
+    sched_start(3072, 5, 0);
+    if (strlen(CONFIG_MQTT_BROKER) > 0) {
+        uplink_start(wifi_event_group, CONNECTED_BIT, 3072, 4, 1);
+    }
 }
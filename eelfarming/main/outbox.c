@@ -0,0 +1,93 @@
+/*
+ * Telemetry outbox
+ *
+ * */
+#include "jsonw.h"
+#include "outbox.h"
+
+#define OUTBOX_ROW_L	28	/*Longest row: [4294967295,3,-2147483.648],*/
+
+void outbox_init(outbox_t *ob, uint32_t seq, uint32_t to_ms)
+{
+	/*everything that can be ordered against to_ms, the clock may have wrapped*/
+	if (seq == 0) {
+		seq = to_ms - OUTBOX_SPAN_MS;
+	}
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		hist_iter_init(&ob->it[ch], ch, seq + 1, to_ms);
+		ob->n[ch] = 0;
+		ob->k[ch] = 0;
+	}
+	ob->after = seq;
+	ob->seq = seq;
+	ob->sent = 0;
+}
+
+/*Channel holding the oldest sample not sent, -1 at the end*/
+static int outbox_next(outbox_t *ob)
+{
+	int next = -1;
+
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		while (1) {
+			if (ob->k[ch] == ob->n[ch]) {
+				ob->n[ch] = hist_iter_next(&ob->it[ch], ob->buf[ch], OUTBOX_DECODE);
+				ob->k[ch] = 0;
+				if (ob->n[ch] == 0) {
+					break;
+				}
+			}
+			/*the iterator starts on a tick, samples up to the resume point are skipped*/
+			if ((int32_t)(ob->buf[ch][ob->k[ch]].ms - ob->after) > 0) {
+				break;
+			}
+			ob->k[ch]++;
+		}
+		if (ob->n[ch] > 0 && (next < 0 || (int32_t)(ob->buf[ch][ob->k[ch]].ms - ob->buf[next][ob->k[next]].ms) < 0)) {
+			next = ch;
+		}
+	}
+	return next;
+}
+
+int outbox_batch(outbox_t *ob, char *buf, size_t len)
+{
+	const hist_sample_t *s;
+	uint32_t base;
+	jw_t w;
+	int ch;
+
+	if ((ch = outbox_next(ob)) < 0) {
+		return 0;
+	}
+	base = ob->buf[ch][ob->k[ch]].ms;
+	jw_init(&w, buf, len);
+	jw_obj(&w, NULL);
+	jw_uint(&w, JW_KEY("base"), base);
+	jw_arr(&w, JW_KEY("s"));
+	ob->seq = base;
+	while (ch >= 0) {
+		s = &ob->buf[ch][ob->k[ch]];
+		/*room for the samples of the same ms, seq and the closing brackets*/
+		if (s->ms != ob->seq && w.len + (TM_CH_MAX + 1) * OUTBOX_ROW_L > len) {
+			break;
+		}
+		jw_arr(&w, NULL);
+		jw_uint(&w, NULL, s->ms - base);
+		jw_uint(&w, NULL, ch);
+		jw_float(&w, NULL, s->value, TM_CH_DECIMALS[ch]);
+		jw_close(&w);
+		ob->seq = s->ms;
+		ob->k[ch]++;
+		ob->sent++;
+		ch = outbox_next(ob);
+	}
+	jw_close(&w);
+	jw_uint(&w, JW_KEY("seq"), ob->seq);
+	return jw_end(&w);
+}
+
+int outbox_more(outbox_t *ob)
+{
+	return outbox_next(ob) >= 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Telemetry outbox
+ *
+ * Replays the samples a client missed while its link was down. They are
+ * read back from the sensor history, which already keeps every sample in a
+ * bounded pool and drops the oldest blocks first, so nothing is queued
+ * twice. The channels are merged in time order and packed into batch frames:
+ *
+ *   {"base":ms,"s":[[dt,ch,value],...],"seq":ms}
+ *
+ * base is the time of the first sample, dt is added to it, ch is the index
+ * of the channel (te_m, ds_m, ph_m, do_m). seq is the time of the last
+ * sample, the client acknowledges a frame by resuming after its seq.
+ * Samples taken in the same ms never end up in different frames.
+ *
+ * */
+#ifndef OUTBOX_H_
+#define OUTBOX_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "telemetry.h"
+#include "history.h"
+
+#define OUTBOX_DECODE	8	/*Samples decoded ahead per channel*/
+#define OUTBOX_SPAN_MS	INT32_MAX	/*Oldest sample replayed, ms before the end*/
+
+/*Replay position*/
+typedef struct {
+	hist_iter_t it[TM_CH_MAX];
+	hist_sample_t buf[TM_CH_MAX][OUTBOX_DECODE];
+	uint8_t n[TM_CH_MAX];	/*Samples decoded*/
+	uint8_t k[TM_CH_MAX];	/*Samples of them sent*/
+	uint32_t after;			/*Resume point*/
+	uint32_t seq;			/*Time of the last sample sent*/
+	uint32_t sent;
+} outbox_t;
+
+/*Start a replay of the samples after seq up to to_ms, seq 0 for all of them*/
+void outbox_init(outbox_t *ob, uint32_t seq, uint32_t to_ms);
+
+/*
+ * Write the next batch frame into buf, up to len bytes
+ * Returns its length, 0 when the replay is done, -1 if len is too short
+ */
+int outbox_batch(outbox_t *ob, char *buf, size_t len);
+
+/*Samples left to replay*/
+int outbox_more(outbox_t *ob);
+
+#endif
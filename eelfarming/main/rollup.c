@@ -0,0 +1,106 @@
+/*
+ * Sensor rollups
+ *
+ * */
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "rollup.h"
+
+const uint32_t ROLLUP_WINDOW_S[ROLLUP_WINDOWS] = {
+	CONFIG_ROLLUP_WINDOW_1, CONFIG_ROLLUP_WINDOW_2, CONFIG_ROLLUP_WINDOW_3, CONFIG_ROLLUP_WINDOW_4
+};
+
+/*Welford accumulator*/
+typedef struct {
+	uint32_t n;
+	float min;
+	float max;
+	float mean;
+	float m2;			/*Sum of squared deviations from the mean*/
+	int64_t index;		/*Window number since boot*/
+} rollup_acc_t;
+
+typedef struct {
+	rollup_acc_t cur;
+	rollup_acc_t done;
+} rollup_win_t;
+
+static rollup_win_t RU_win[TM_CH_MAX][ROLLUP_WINDOWS];
+static portMUX_TYPE RU_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/*Close the running window if time is past it, called with RU_lock held*/
+static void rollup_roll(rollup_win_t *win, int64_t index)
+{
+	if (win->cur.index == index) {
+		return;
+	}
+	/*the completed window is the previous one only if it had samples*/
+	win->done = win->cur;
+	if (win->cur.index != index - 1) {
+		win->done.n = 0;
+		win->done.index = index - 1;
+	}
+	win->cur.n = 0;
+	win->cur.index = index;
+}
+
+void rollup_add(tm_channel_t ch, float value)
+{
+	int64_t now = esp_timer_get_time();
+
+	portENTER_CRITICAL(&RU_lock);
+	for (int w = 0; w < ROLLUP_WINDOWS; w++) {
+		rollup_win_t *win = &RU_win[ch][w];
+		rollup_acc_t *a = &win->cur;
+		float delta;
+		if (ROLLUP_WINDOW_S[w] == 0) {
+			continue;
+		}
+		rollup_roll(win, now / ((int64_t)ROLLUP_WINDOW_S[w] * 1000000));
+		if (a->n++ == 0) {
+			a->min = a->max = a->mean = value;
+			a->m2 = 0;
+			continue;
+		}
+		if (value < a->min) {
+			a->min = value;
+		}
+		if (value > a->max) {
+			a->max = value;
+		}
+		delta = value - a->mean;
+		a->mean += delta / a->n;
+		a->m2 += delta * (value - a->mean);
+	}
+	portEXIT_CRITICAL(&RU_lock);
+}
+
+static void rollup_result(const rollup_acc_t *a, uint32_t window_s, rollup_t *r)
+{
+	r->n = a->n;
+	r->min = a->min;
+	r->max = a->max;
+	r->mean = a->mean;
+	r->sd = (a->n > 1) ? sqrtf(a->m2 / (a->n - 1)) : 0;
+	r->start_us = a->index * window_s * 1000000;
+}
+
+int rollup_read(tm_channel_t ch, int w, rollup_t *cur, rollup_t *done)
+{
+	rollup_win_t win;
+
+	if (w < 0 || w >= ROLLUP_WINDOWS || ROLLUP_WINDOW_S[w] == 0) {
+		return -1;
+	}
+	portENTER_CRITICAL(&RU_lock);
+	rollup_roll(&RU_win[ch][w], esp_timer_get_time() / ((int64_t)ROLLUP_WINDOW_S[w] * 1000000));
+	win = RU_win[ch][w];
+	portEXIT_CRITICAL(&RU_lock);
+
+	rollup_result(&win.cur, ROLLUP_WINDOW_S[w], cur);
+	rollup_result(&win.done, ROLLUP_WINDOW_S[w], done);
+	return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * Sensor rollups
+ *
+ * Every channel keeps aggregates over tumbling windows of the lengths set in
+ * the configuration. Windows are aligned to multiples of their length since
+ * boot. A sample updates count, min, max, mean and the sum of squared
+ * deviations of each window in constant time (Welford), the running window
+ * and the last completed one are kept, the memory is fixed.
+ *
+ * */
+#ifndef ROLLUP_H_
+#define ROLLUP_H_
+
+#include <stdint.h>
+#include "telemetry.h"
+
+#define ROLLUP_WINDOWS	4
+
+/*Aggregate of one window*/
+typedef struct {
+	uint32_t n;			/*Samples, 0 for an empty window*/
+	float min;
+	float max;
+	float mean;
+	float sd;			/*Sample standard deviation*/
+	int64_t start_us;	/*esp_timer time the window starts*/
+} rollup_t;
+
+/*Window lengths in s, 0 for a disabled window*/
+extern const uint32_t ROLLUP_WINDOW_S[ROLLUP_WINDOWS];
+
+/*Add a valid sample of channel ch*/
+void rollup_add(tm_channel_t ch, float value);
+
+/*
+ * Running and last completed aggregate of channel ch for window w
+ * Returns 0 or -1 if the window is disabled
+ */
+int rollup_read(tm_channel_t ch, int w, rollup_t *cur, rollup_t *done);
+
+#endif
@@ -0,0 +1,226 @@
+/*
+ * Sensor scheduler
+ *
+ * */
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "sched.h"
+
+static const char *TAG = "sched";
+
+/*Registered job*/
+typedef struct {
+	const char *name;
+	int64_t period_us;
+	int64_t phase_us;
+	sched_hook_t start;
+	sched_hook_t complete;
+	void *arg;
+	int64_t release;		/*Time of the current release*/
+	int64_t due;			/*Time of the next hook call*/
+	int64_t started;		/*Time the start hook was called*/
+	uint64_t jitter_sum;
+	sched_stats_t stats;
+	uint8_t busy;			/*Waiting for the complete hook*/
+} sched_job_t;
+
+static sched_job_t SCHED_jobs[SCHED_JOBS_MAX];
+static int SCHED_jobs_n = 0;
+static uint8_t SCHED_heap[SCHED_JOBS_MAX];	/*Job ids, earliest due first*/
+static int SCHED_heap_n = 0;
+static int64_t SCHED_epoch = 0;				/*Start of the scheduler, 0 before*/
+static TaskHandle_t SCHED_task = NULL;
+static esp_timer_handle_t SCHED_timer = NULL;
+static portMUX_TYPE SCHED_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int sched_before(int a, int b)
+{
+	return SCHED_jobs[SCHED_heap[a]].due < SCHED_jobs[SCHED_heap[b]].due;
+}
+
+static void sched_swap(int a, int b)
+{
+	uint8_t t = SCHED_heap[a];
+	SCHED_heap[a] = SCHED_heap[b];
+	SCHED_heap[b] = t;
+}
+
+/*Heap operations, called with SCHED_lock held*/
+static void sched_push(int id)
+{
+	int i = SCHED_heap_n++;
+	SCHED_heap[i] = id;
+	while (i > 0 && sched_before(i, (i - 1) / 2)) {
+		sched_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static int sched_pop(void)
+{
+	int id = SCHED_heap[0];
+	int i = 0;
+
+	SCHED_heap[0] = SCHED_heap[--SCHED_heap_n];
+	while (1) {
+		int c = 2 * i + 1;
+		if (c >= SCHED_heap_n) {
+			break;
+		}
+		if (c + 1 < SCHED_heap_n && sched_before(c + 1, c)) {
+			c++;
+		}
+		if (!sched_before(c, i)) {
+			break;
+		}
+		sched_swap(i, c);
+		i = c;
+	}
+	return id;
+}
+
+static void sched_wakeup(void *arg)
+{
+	xTaskNotifyGive(SCHED_task);
+}
+
+/*Next release of a job that is done at now, releases already missed are skipped*/
+static void sched_release_next(sched_job_t *job, int64_t now)
+{
+	job->release += job->period_us;
+	if (job->release < now) {
+		int64_t missed = (now - job->release + job->period_us - 1) / job->period_us;
+		job->release += missed * job->period_us;
+		job->stats.overruns += missed;
+	}
+	job->due = job->release;
+}
+
+static void sched_run(void *pvParameters)
+{
+	while (1) {
+		int64_t now = esp_timer_get_time();
+		sched_job_t *job;
+		uint32_t delay_ms;
+		int id;
+
+		portENTER_CRITICAL(&SCHED_lock);
+		if (SCHED_heap_n == 0 || SCHED_jobs[SCHED_heap[0]].due > now) {
+			int64_t wait = (SCHED_heap_n > 0) ? SCHED_jobs[SCHED_heap[0]].due - now : 0;
+			portEXIT_CRITICAL(&SCHED_lock);
+			/*sleep until the earliest deadline or a new job*/
+			esp_timer_stop(SCHED_timer);
+			if (wait > 0) {
+				esp_timer_start_once(SCHED_timer, wait);
+			}
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			continue;
+		}
+		id = sched_pop();
+		portEXIT_CRITICAL(&SCHED_lock);
+
+		/*hooks run without the lock*/
+		job = &SCHED_jobs[id];
+		if (!job->busy) {
+			uint32_t jitter = now - job->release;
+			job->started = now;
+			job->jitter_sum += jitter;
+			job->stats.runs++;
+			if (jitter > job->stats.jitter_max_us) {
+				job->stats.jitter_max_us = jitter;
+			}
+			delay_ms = job->start(job->arg);
+		} else {
+			delay_ms = job->complete(job->arg);
+		}
+
+		now = esp_timer_get_time();
+		portENTER_CRITICAL(&SCHED_lock);
+		if (delay_ms > 0 && job->complete != NULL) {
+			job->busy = 1;
+			job->due = now + (int64_t)delay_ms * 1000;
+		} else {
+			uint32_t busy = now - job->started;
+			job->busy = 0;
+			if (busy > job->stats.busy_max_us) {
+				job->stats.busy_max_us = busy;
+			}
+			job->stats.jitter_avg_us = job->jitter_sum / job->stats.runs;
+			sched_release_next(job, now);
+		}
+		sched_push(id);
+		portEXIT_CRITICAL(&SCHED_lock);
+	}
+}
+
+int sched_register(const char *name, uint32_t period_ms, uint32_t phase_ms, sched_hook_t start, sched_hook_t complete, void *arg)
+{
+	sched_job_t *job;
+	int id;
+
+	if (period_ms == 0 || start == NULL) {
+		return -1;
+	}
+	portENTER_CRITICAL(&SCHED_lock);
+	if (SCHED_jobs_n >= SCHED_JOBS_MAX) {
+		portEXIT_CRITICAL(&SCHED_lock);
+		return -1;
+	}
+	id = SCHED_jobs_n++;
+	job = &SCHED_jobs[id];
+	job->name = name;
+	job->period_us = (int64_t)period_ms * 1000;
+	job->phase_us = (int64_t)phase_ms * 1000;
+	job->start = start;
+	job->complete = complete;
+	job->arg = arg;
+	/*jobs added to a running scheduler are phased from now*/
+	if (SCHED_epoch != 0) {
+		job->release = esp_timer_get_time() + job->phase_us;
+		job->due = job->release;
+		sched_push(id);
+	}
+	portEXIT_CRITICAL(&SCHED_lock);
+	if (SCHED_task != NULL) {
+		xTaskNotifyGive(SCHED_task);
+	}
+	return id;
+}
+
+void sched_start(uint32_t stack, int priority, int core)
+{
+	esp_timer_create_args_t timer = {
+		.callback = sched_wakeup,
+		.name = "sched",
+	};
+
+	ESP_ERROR_CHECK(esp_timer_create(&timer, &SCHED_timer));
+	portENTER_CRITICAL(&SCHED_lock);
+	SCHED_epoch = esp_timer_get_time();
+	for (int id = 0; id < SCHED_jobs_n; id++) {
+		SCHED_jobs[id].release = SCHED_epoch + SCHED_jobs[id].phase_us;
+		SCHED_jobs[id].due = SCHED_jobs[id].release;
+		sched_push(id);
+	}
+	portEXIT_CRITICAL(&SCHED_lock);
+	xTaskCreatePinnedToCore(&sched_run, "sched", stack, NULL, priority, &SCHED_task, core);
+	ESP_LOGI(TAG, "%d jobs", SCHED_jobs_n);
+}
+
+const char *sched_stats(int id, sched_stats_t *stats)
+{
+	const char *name;
+
+	if (id < 0 || id >= SCHED_jobs_n) {
+		return NULL;
+	}
+	portENTER_CRITICAL(&SCHED_lock);
+	*stats = SCHED_jobs[id].stats;
+	name = SCHED_jobs[id].name;
+	portEXIT_CRITICAL(&SCHED_lock);
+	return name;
+}
@@ -0,0 +1,44 @@
+/*
+ * Sensor scheduler
+ *
+ * One task runs all sensor jobs from a min-heap ordered by deadline. A job
+ * is released every period at a fixed phase, release times are computed
+ * from the start of the scheduler so the rates do not drift. The start hook
+ * may return the time its acquisition needs, the complete hook is then
+ * called that much later and may ask for another delay, the scheduler runs
+ * other jobs meanwhile. Wakeups come from an esp_timer, not the tick.
+ *
+ * */
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <stdint.h>
+
+#define SCHED_JOBS_MAX	8
+
+/*Hook of a job, returns ms until the complete hook or 0 when the job is done*/
+typedef uint32_t (*sched_hook_t)(void *arg);
+
+/*Timing of one job*/
+typedef struct {
+	uint32_t runs;			/*Releases started*/
+	uint32_t overruns;		/*Releases skipped, the job was still busy or started too late*/
+	uint32_t jitter_avg_us;	/*Start behind the release time*/
+	uint32_t jitter_max_us;
+	uint32_t busy_max_us;	/*Start to done*/
+} sched_stats_t;
+
+/*
+ * Register a job, start is called every period_ms beginning phase_ms after
+ * the scheduler started, complete (may be NULL) when start asked for a delay
+ * Returns the job id or -1 if there are SCHED_JOBS_MAX jobs already
+ */
+int sched_register(const char *name, uint32_t period_ms, uint32_t phase_ms, sched_hook_t start, sched_hook_t complete, void *arg);
+
+/*Create the scheduler task*/
+void sched_start(uint32_t stack, int priority, int core);
+
+/*Timing of job id, returns its name or NULL if there is no such job*/
+const char *sched_stats(int id, sched_stats_t *stats);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * Sensor snapshot store
+ *
+ * */
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+#include "snapshot.h"
+
+/*Latched reading, r[0] is written while seq is odd, r[1] while it is even*/
+typedef struct {
+	volatile uint32_t seq;
+	snap_reading_t r[2];
+} snap_slot_t;
+
+static snap_slot_t SNAP_slots[TM_CH_MAX];
+static volatile uint32_t SNAP_seq = 0;
+
+/*Next global sequence number, channels are written from several tasks*/
+static uint32_t snapshot_next_seq(void)
+{
+	uint32_t old, set;
+
+	do {
+		old = SNAP_seq;
+		set = old + 1;
+		uxPortCompareSet(&SNAP_seq, old, &set);
+	} while (set != old);
+	return old + 1;
+}
+
+void snapshot_update(tm_channel_t ch, float value, snap_status_t status)
+{
+	snap_slot_t *s = &SNAP_slots[ch];
+	snap_reading_t r = s->r[0];
+
+	/*a failed acquisition keeps the last good value*/
+	if (status == SNAP_OK || r.status == SNAP_NONE) {
+		r.value = value;
+	}
+	r.time_us = esp_timer_get_time();
+	r.status = status;
+	r.seq = snapshot_next_seq();
+
+	/*readers use r[1] meanwhile*/
+	s->seq++;
+	__sync_synchronize();
+	s->r[0] = r;
+	__sync_synchronize();
+
+	/*readers use r[0] meanwhile*/
+	s->seq++;
+	__sync_synchronize();
+	s->r[1] = r;
+	__sync_synchronize();
+}
+
+void snapshot_read(tm_channel_t ch, snap_reading_t *r)
+{
+	const snap_slot_t *s = &SNAP_slots[ch];
+	uint32_t seq;
+
+	do {
+		seq = s->seq;
+		__sync_synchronize();
+		*r = s->r[seq & 1];
+		__sync_synchronize();
+	} while (s->seq != seq);
+
+	if (r->status == SNAP_OK && esp_timer_get_time() - r->time_us > (int64_t)SNAP_STALE_MS * 1000) {
+		r->status = SNAP_STALE;
+	}
+}
+
+uint32_t snapshot_changed(uint32_t since, snap_reading_t r[TM_CH_MAX])
+{
+	uint32_t mask = 0;
+
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		snapshot_read(ch, &r[ch]);
+		if (r[ch].status != SNAP_NONE && (int32_t)(r[ch].seq - since) > 0) {
+			mask |= 1 << ch;
+		}
+	}
+	return mask;
+}
+
+uint32_t snapshot_seq(void)
+{
+	return SNAP_seq;
+}
@@ -0,0 +1,52 @@
+/*
+ * Sensor snapshot store
+ *
+ * Latest reading of every channel with acquisition time, sequence number and
+ * status. Each channel is written by one sensor task only and kept twice,
+ * the writer updates one copy while readers use the other (seqcount latch).
+ * Readers never wait for a preempted writer, they retry only if an update
+ * completed while they were copying. Every update takes the next global
+ * sequence number, so a reader can ask for the channels that changed since
+ * the last sequence number it has seen.
+ *
+ * */
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdint.h>
+#include "telemetry.h"
+
+#define SNAP_STALE_MS	10000	/*Readings older than this are reported stale*/
+
+/*Reading status*/
+typedef enum {
+	SNAP_NONE = 0,	/*No reading yet*/
+	SNAP_OK,		/*Valid reading*/
+	SNAP_ERROR,		/*Sensor did not answer, value is the last good one*/
+	SNAP_STALE		/*Valid but older than SNAP_STALE_MS*/
+} snap_status_t;
+
+/*Reading of one channel*/
+typedef struct {
+	float value;
+	int64_t time_us;	/*esp_timer time of the acquisition*/
+	uint32_t seq;		/*Global sequence number of the update*/
+	uint8_t status;		/*snap_status_t*/
+} snap_reading_t;
+
+/*Store a reading, only the task owning channel ch may call this*/
+void snapshot_update(tm_channel_t ch, float value, snap_status_t status);
+
+/*Latest reading of channel ch*/
+void snapshot_read(tm_channel_t ch, snap_reading_t *r);
+
+/*
+ * Readings of all channels updated after sequence number since (0 for all)
+ * Returns the mask of the channels filled in r
+ */
+uint32_t snapshot_changed(uint32_t since, snap_reading_t r[TM_CH_MAX]);
+
+/*Sequence number of the latest update*/
+uint32_t snapshot_seq(void);
+
+#endif
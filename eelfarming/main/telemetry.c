@@ -0,0 +1,263 @@
+/*
+ * Telemetry push subscriptions
+ *
+ * */
+#include <string.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "websocket.h"
+#include "telemetry.h"
+#include "binproto.h"
+
+/*Subscription of one channel*/
+typedef struct {
+	TickType_t min_ticks;	/*Minimum ticks between two pushes*/
+	float threshold;		/*Minimum change against the last pushed value*/
+	float sent;				/*Last pushed value*/
+	TickType_t sent_tick;	/*Tick of the last push*/
+	float pending;			/*Latest value not pushed yet*/
+	uint8_t active;
+	uint8_t has_sent;
+	uint8_t has_pending;
+} tm_sub_t;
+
+/*Subscriptions of one client*/
+typedef struct {
+	int client;				/*WebSocket client id, 0 if unused*/
+	tm_sub_t ch[TM_CH_MAX];
+} tm_client_t;
+
+const char *const TM_CH_KEYS[TM_CH_MAX] = { "te_m", "di_m", "ph_m", "do_m" };
+const jw_key_t TM_CH_JKEYS[TM_CH_MAX] = { JW_KEY_INIT("te_m"), JW_KEY_INIT("di_m"), JW_KEY_INIT("ph_m"), JW_KEY_INIT("do_m") };
+const uint8_t TM_CH_DECIMALS[TM_CH_MAX] = { 2, 1, 2, 2 };
+
+static const char *TAG = "telemetry";
+
+static tm_client_t TM_clients[CONFIG_WS_MAX_CLIENTS];
+static float TM_latest[TM_CH_MAX];
+static uint32_t TM_latest_valid = 0;
+static portMUX_TYPE TM_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t TM_task = NULL;
+
+int telemetry_channel(const char *key)
+{
+	for (int i = 0; i < TM_CH_MAX; i++) {
+		if (strcmp(key, TM_CH_KEYS[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Mark value as pending if it passes the threshold, TM_lock must be held
+ *
+ * */
+static int telemetry_offer(tm_sub_t *sub, float value)
+{
+	if (!sub->active) {
+		return 0;
+	}
+	if (sub->has_sent && fabsf(value - sub->sent) < sub->threshold) {
+		/*a pending value that moved back into the dead band is dropped*/
+		sub->has_pending = 0;
+		return 0;
+	}
+	sub->pending = value;
+	sub->has_pending = 1;
+	return 1;
+}
+
+void telemetry_publish(tm_channel_t ch, float value)
+{
+	int wake = 0;
+
+	portENTER_CRITICAL(&TM_lock);
+	TM_latest[ch] = value;
+	TM_latest_valid |= 1 << ch;
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		if (TM_clients[i].client != 0) {
+			wake |= telemetry_offer(&TM_clients[i].ch[ch], value);
+		}
+	}
+	portEXIT_CRITICAL(&TM_lock);
+
+	if (wake && TM_task != NULL) {
+		xTaskNotifyGive(TM_task);
+	}
+}
+
+int telemetry_subscribe(int client, uint32_t mask, uint32_t min_ms, float threshold)
+{
+	tm_client_t *cl = NULL;
+
+	portENTER_CRITICAL(&TM_lock);
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		if (TM_clients[i].client == client) {
+			cl = &TM_clients[i];
+			break;
+		}
+		if (cl == NULL && TM_clients[i].client == 0) {
+			cl = &TM_clients[i];
+		}
+	}
+	if (cl != NULL) {
+		if (cl->client != client) {
+			memset(cl, 0, sizeof(*cl));
+			cl->client = client;
+		}
+		for (int ch = 0; ch < TM_CH_MAX; ch++) {
+			if (mask & (1 << ch)) {
+				tm_sub_t *sub = &cl->ch[ch];
+				sub->min_ticks = min_ms / portTICK_PERIOD_MS;
+				sub->threshold = threshold;
+				sub->active = 1;
+				sub->has_sent = 0;
+				/*start with the current value*/
+				if (TM_latest_valid & (1 << ch)) {
+					telemetry_offer(sub, TM_latest[ch]);
+				}
+			}
+		}
+	}
+	portEXIT_CRITICAL(&TM_lock);
+
+	if (cl == NULL) {
+		return -1;
+	}
+	if (TM_task != NULL) {
+		xTaskNotifyGive(TM_task);
+	}
+	return 0;
+}
+
+void telemetry_unsubscribe(int client, uint32_t mask)
+{
+	portENTER_CRITICAL(&TM_lock);
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		tm_client_t *cl = &TM_clients[i];
+		if (cl->client != client) {
+			continue;
+		}
+		int active = 0;
+		for (int ch = 0; ch < TM_CH_MAX; ch++) {
+			if (mask & (1 << ch)) {
+				cl->ch[ch].active = 0;
+				cl->ch[ch].has_pending = 0;
+			}
+			active |= cl->ch[ch].active;
+		}
+		if (!active) {
+			cl->client = 0;
+		}
+	}
+	portEXIT_CRITICAL(&TM_lock);
+}
+
+/*
+ * Push the due channels as JSON
+ *
+ * */
+static err_t telemetry_push_json(int client, uint32_t due, const float values[TM_CH_MAX])
+{
+	char res[TM_JSON_L];
+	jw_t w;
+	int len;
+
+	jw_init(&w, res, sizeof(res));
+	jw_obj(&w, NULL);
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		if (due & (1 << ch)) {
+			jw_float(&w, &TM_CH_JKEYS[ch], values[ch], TM_CH_DECIMALS[ch]);
+		}
+	}
+	if ((len = jw_end(&w)) < 0) {
+		return ERR_MEM;
+	}
+	return WS_write_data(client, res, len);
+}
+
+/*
+ * Send all due channels of a client in one frame
+ * Returns the ticks until the next pending value is due
+ *
+ * */
+static TickType_t telemetry_push(void)
+{
+	TickType_t wait = portMAX_DELAY;
+
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		float values[TM_CH_MAX];
+		uint32_t due = 0;
+		int client;
+
+		/*take the due values, keep the others pending*/
+		portENTER_CRITICAL(&TM_lock);
+		TickType_t now = xTaskGetTickCount();
+		tm_client_t *cl = &TM_clients[i];
+		client = cl->client;
+		if (client != 0) {
+			for (int ch = 0; ch < TM_CH_MAX; ch++) {
+				tm_sub_t *sub = &cl->ch[ch];
+				if (!sub->has_pending) {
+					continue;
+				}
+				TickType_t elapsed = now - sub->sent_tick;
+				if (sub->has_sent && elapsed < sub->min_ticks) {
+					if (sub->min_ticks - elapsed < wait) {
+						wait = sub->min_ticks - elapsed;
+					}
+					continue;
+				}
+				values[ch] = sub->pending;
+				sub->sent = sub->pending;
+				sub->sent_tick = now;
+				sub->has_sent = 1;
+				sub->has_pending = 0;
+				due |= 1 << ch;
+			}
+		}
+		portEXIT_CRITICAL(&TM_lock);
+
+		if (due == 0) {
+			continue;
+		}
+
+		err_t err;
+		if (WS_client_protocol(client) == BP_PROTOCOL_ID) {
+			/*binary clients get a snapshot record of the due channels*/
+			uint8_t rec[BP_SNAPSHOT_MAX_L];
+			size_t len = bp_encode_snapshot(rec, due, values);
+			err = WS_write(client, WS_OP_BIN, (char *)rec, len, 0);
+		} else {
+			err = telemetry_push_json(client, due, values);
+		}
+
+		/*client is gone, drop its subscriptions*/
+		if (err == ERR_CONN) {
+			ESP_LOGI(TAG, "client %d gone", client);
+			telemetry_unsubscribe(client, TM_CH_ALL);
+		}
+	}
+	return wait;
+}
+
+/*
+ * Push task
+ * Sleeps until a sample is pending or due
+ *
+ * */
+void telemetry_task(void *pvParameters)
+{
+	TickType_t wait = portMAX_DELAY;
+
+	TM_task = xTaskGetCurrentTaskHandle();
+
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, wait);
+		wait = telemetry_push();
+	}
+}
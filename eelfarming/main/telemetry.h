@@ -0,0 +1,51 @@
+/*
+ * Telemetry push subscriptions
+ *
+ * Sensor tasks publish every new sample, clients subscribe per channel with
+ * a minimum interval and a change threshold. Samples that arrive faster than
+ * a client may receive them are coalesced, a client always gets the latest
+ * value instead of a backlog.
+ *
+ * */
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdint.h>
+#include "jsonw.h"
+
+/*Sensor channels*/
+typedef enum {
+	TM_CH_TEMPERATURE = 0,
+	TM_CH_DISTANCE,
+	TM_CH_PH,
+	TM_CH_DO,
+	TM_CH_MAX
+} tm_channel_t;
+
+#define TM_CH_ALL	((1 << TM_CH_MAX) - 1)	/*Mask of all channels*/
+
+/*JSON keys of the channels ("te_m", "di_m", "ph_m", "do_m")*/
+extern const char *const TM_CH_KEYS[TM_CH_MAX];
+
+/*Pre-quoted JSON keys and decimals of the channels*/
+extern const jw_key_t TM_CH_JKEYS[TM_CH_MAX];
+extern const uint8_t TM_CH_DECIMALS[TM_CH_MAX];
+
+#define TM_JSON_L	80	/*Longest JSON push of all channels*/
+
+/*Returns channel of a JSON key or -1*/
+int telemetry_channel(const char *key);
+
+/*Publish a new sample, called by the sensor tasks*/
+void telemetry_publish(tm_channel_t ch, float value);
+
+/*Subscribe client to the channels in mask, min_ms between pushes, push only if changed by threshold*/
+int telemetry_subscribe(int client, uint32_t mask, uint32_t min_ms, float threshold);
+
+/*Remove channels in mask from the subscription of client*/
+void telemetry_unsubscribe(int client, uint32_t mask);
+
+/*Push task*/
+void telemetry_task(void *pvParameters);
+
+#endif
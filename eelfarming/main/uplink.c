@@ -0,0 +1,167 @@
+/*
+ * MQTT uplink
+ *
+ * */
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "jsonw.h"
+#include "snapshot.h"
+#include "outbox.h"
+#include "uplink.h"
+
+/*Room left for the payload by the PUBLISH header*/
+#define UPLINK_PAYLOAD_L	(MQTTC_MSG_L - 5 - 2 - sizeof(UPLINK_TOPIC_SAMPLES) - 2)
+
+static const char *TAG = "uplink";
+
+static char UPLINK_client_id[24];
+static mqttc_config_t UPLINK_cfg = {
+	.host = CONFIG_MQTT_BROKER,
+	.port = CONFIG_MQTT_PORT,
+	.client_id = UPLINK_client_id,
+	.keepalive_s = CONFIG_MQTT_KEEPALIVE_S,
+	.clean_session = false,
+};
+static mqttc_t UPLINK_mqtt;
+static char UPLINK_buf[UPLINK_PAYLOAD_L];
+static EventGroupHandle_t UPLINK_wifi = NULL;
+static EventBits_t UPLINK_bits;
+static uint32_t UPLINK_seq = 0;				/*Time of the last sample published*/
+static int64_t UPLINK_next_us = 0;			/*Next batch*/
+static uplink_stats_t UPLINK_stats;
+static portMUX_TYPE UPLINK_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/*Latest value of the channels, retained*/
+static esp_err_t uplink_latest(mqttc_t *c, uint32_t now)
+{
+	snap_reading_t r;
+	jw_t w;
+	int len;
+
+	jw_init(&w, UPLINK_buf, sizeof(UPLINK_buf));
+	jw_obj(&w, NULL);
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		snapshot_read(ch, &r);
+		if (r.status == SNAP_OK) {
+			jw_float(&w, &TM_CH_JKEYS[ch], r.value, TM_CH_DECIMALS[ch]);
+		}
+	}
+	jw_uint(&w, JW_KEY("ms"), now);
+	if ((len = jw_end(&w)) < 0) {
+		return ESP_OK;
+	}
+	/*QoS 0: a lost one is replaced by the next batch anyway*/
+	return mqttc_publish(c, UPLINK_TOPIC_LATEST, UPLINK_buf, len, 0, true);
+}
+
+/*
+ * Samples not published yet, as long as the window has room
+ * The batch interval only starts once the uplink caught up
+ */
+static esp_err_t uplink_publish(mqttc_t *c)
+{
+	int64_t now = esp_timer_get_time();
+	outbox_t ob;
+	esp_err_t err;
+	int len;
+
+	if (now < UPLINK_next_us) {
+		return ESP_OK;
+	}
+	while (1) {
+		outbox_init(&ob, UPLINK_seq, now / 1000);
+		if ((len = outbox_batch(&ob, UPLINK_buf, sizeof(UPLINK_buf))) <= 0) {
+			break;
+		}
+		err = mqttc_publish(c, UPLINK_TOPIC_SAMPLES, UPLINK_buf, len, CONFIG_MQTT_QOS, false);
+		if (err == ESP_ERR_NO_MEM) {
+			/*window full, again after the next acks*/
+			return ESP_OK;
+		}
+		/*QoS 1 goes again after the reconnect once it has its slot, QoS 0 only counts when sent*/
+		if (err == ESP_OK || err == MQTTC_ERR_QUEUED) {
+			UPLINK_seq = ob.seq;
+		}
+		if (err != ESP_OK) {
+			return err;
+		}
+	}
+	UPLINK_next_us = now + CONFIG_MQTT_BATCH_MS * 1000LL;
+	return uplink_latest(c, now / 1000);
+}
+
+static void uplink_update_stats(mqttc_t *c, uint8_t connected)
+{
+	portENTER_CRITICAL(&UPLINK_lock);
+	mqttc_stats(c, &UPLINK_stats.mqtt);
+	UPLINK_stats.seq = UPLINK_seq;
+	UPLINK_stats.connected = connected;
+	portEXIT_CRITICAL(&UPLINK_lock);
+}
+
+static void uplink_task(void *pvParameters)
+{
+	mqttc_t *c = &UPLINK_mqtt;
+	uint32_t backoff_ms = 1000;
+	bool present;
+
+	while (1) {
+		xEventGroupWaitBits(UPLINK_wifi, UPLINK_bits, pdFALSE, pdTRUE, portMAX_DELAY);
+		if (mqttc_connect(c, &present) != ESP_OK) {
+			vTaskDelay(backoff_ms / portTICK_PERIOD_MS);
+			backoff_ms = (backoff_ms * 2 < UPLINK_BACKOFF_MAX_MS) ? backoff_ms * 2 : UPLINK_BACKOFF_MAX_MS;
+			continue;
+		}
+		backoff_ms = 1000;
+		while (uplink_publish(c) == ESP_OK && mqttc_poll(c, UPLINK_POLL_MS) == ESP_OK) {
+			uplink_update_stats(c, 1);
+		}
+		mqttc_close(c);
+		uplink_update_stats(c, 0);
+	}
+}
+
+void uplink_start(EventGroupHandle_t wifi, EventBits_t bits, uint32_t stack, int priority, int core)
+{
+	uint8_t mac[6];
+
+	if (CONFIG_MQTT_CLIENT_ID[0] != '\0') {
+		snprintf(UPLINK_client_id, sizeof(UPLINK_client_id), "%s", CONFIG_MQTT_CLIENT_ID);
+	} else {
+		/*stable across reboots, the broker finds the session again*/
+		esp_efuse_mac_get_default(mac);
+		snprintf(UPLINK_client_id, sizeof(UPLINK_client_id), "eel-%02x%02x%02x", mac[3], mac[4], mac[5]);
+	}
+	if (CONFIG_MQTT_USERNAME[0] != '\0') {
+		UPLINK_cfg.username = CONFIG_MQTT_USERNAME;
+	}
+	if (CONFIG_MQTT_PASSWORD[0] != '\0') {
+		UPLINK_cfg.password = CONFIG_MQTT_PASSWORD;
+	}
+	if (mqttc_init(&UPLINK_mqtt, &UPLINK_cfg) != ESP_OK) {
+		ESP_LOGE(TAG, "no memory for the MQTT buffers");
+		return;
+	}
+	UPLINK_wifi = wifi;
+	UPLINK_bits = bits;
+	xTaskCreatePinnedToCore(&uplink_task, "uplink", stack, NULL, priority, NULL, core);
+	ESP_LOGI(TAG, "%s -> %s:%u, QoS %d", UPLINK_client_id, CONFIG_MQTT_BROKER, CONFIG_MQTT_PORT, CONFIG_MQTT_QOS);
+}
+
+int uplink_stats(uplink_stats_t *stats)
+{
+	if (UPLINK_wifi == NULL) {
+		return -1;
+	}
+	portENTER_CRITICAL(&UPLINK_lock);
+	*stats = UPLINK_stats;
+	portEXIT_CRITICAL(&UPLINK_lock);
+	return 0;
+}
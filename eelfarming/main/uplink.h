@@ -0,0 +1,37 @@
+/*
+ * MQTT uplink
+ *
+ * One task publishes the samples of the history in batches to
+ * <topic>/samples, in the outbox frame format (see outbox.h), and the
+ * latest value of every channel retained to <topic>/latest. Its position
+ * in the history survives reconnects: with the persistent session only the
+ * messages the broker did not acknowledge yet are sent again, and samples
+ * taken while the broker was out of reach follow in full batches.
+ *
+ * */
+#ifndef UPLINK_H_
+#define UPLINK_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "mqttc.h"
+
+#define UPLINK_TOPIC_SAMPLES	CONFIG_MQTT_TOPIC "/samples"
+#define UPLINK_TOPIC_LATEST		CONFIG_MQTT_TOPIC "/latest"
+#define UPLINK_POLL_MS			100
+#define UPLINK_BACKOFF_MAX_MS	60000
+
+typedef struct {
+	mqttc_stats_t mqtt;
+	uint32_t seq;			/*Time of the last sample published*/
+	uint8_t connected;
+} uplink_stats_t;
+
+/*Start the publisher, it connects whenever bits are set in the event group*/
+void uplink_start(EventGroupHandle_t wifi, EventBits_t bits, uint32_t stack, int priority, int core);
+
+/*Returns -1 if the uplink is not running*/
+int uplink_stats(uplink_stats_t *stats);
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * 1-Wire bus model with DS18B20 probes
+ *
+ * */
+#include <string.h>
+
+#include "owsim.h"
+
+enum {
+	OWS_IDLE,		/*Not addressed until the next reset*/
+	OWS_ROM,		/*Receiving the ROM command*/
+	OWS_SEARCH,		/*Search ROM*/
+	OWS_MATCH,		/*Receiving the ROM code of MATCH ROM*/
+	OWS_FUNC,		/*Selected, receiving the function command*/
+	OWS_WRITE,		/*Receiving TH, TL and configuration*/
+	OWS_READ,		/*Sending the scratchpad*/
+};
+
+/*Scratchpad after power-on: 85 C, 12 bit*/
+static const uint8_t OWS_SP_INIT[8] = { 0x50, 0x05, 0x4B, 0x46, 0x7F, 0xFF, 0x0C, 0x10 };
+
+static void ows_sp_crc(owsim_dev_t *d)
+{
+	d->sp[8] = onewire_crc8(d->sp, 8);
+}
+
+/*Convert T, undefined low bits below 12 bit read as ones*/
+static void ows_convert(owsim_dev_t *d)
+{
+	int bits = 9 + ((d->sp[4] >> 5) & 0x03);
+	int16_t raw = (int16_t)(d->temp * 16 + (d->temp < 0 ? -0.5f : 0.5f));
+
+	raw |= (1 << (12 - bits)) - 1;
+	d->sp[0] = raw & 0xFF;
+	d->sp[1] = (uint16_t)raw >> 8;
+	ows_sp_crc(d);
+	d->conversions++;
+}
+
+static int ows_rom_bit(const owsim_dev_t *d)
+{
+	return (d->rom[d->bit >> 3] >> (d->bit & 7)) & 1;
+}
+
+/*Level the probe drives in the next slot, 1 releases the line*/
+static int ows_out(const owsim_dev_t *d)
+{
+	if (d->state == OWS_READ && d->bit < 72) {
+		return ((d->sp[d->bit >> 3] >> (d->bit & 7)) & 1) ^ (d->flip && d->bit == 13);
+	}
+	if (d->state == OWS_SEARCH && d->acc < 2) {
+		return ows_rom_bit(d) ^ d->acc;
+	}
+	return 1;
+}
+
+/*Probe samples the line*/
+static void ows_in(owsim_dev_t *d, int line)
+{
+	switch (d->state) {
+	case OWS_ROM:
+	case OWS_FUNC:
+		d->acc |= line << d->bit;
+		if (++d->bit < 8) {
+			break;
+		}
+		d->bit = 0;
+		if (d->state == OWS_ROM) {
+			d->state = (d->acc == 0xCC) ? OWS_FUNC : (d->acc == 0xF0) ? OWS_SEARCH
+					: (d->acc == 0x55) ? OWS_MATCH : OWS_IDLE;
+		} else if (d->acc == 0x44) {
+			ows_convert(d);
+			d->state = OWS_IDLE;
+		} else if (d->acc == 0x4E) {
+			d->state = OWS_WRITE;
+		} else if (d->acc == 0xBE) {
+			d->flip = (d->noise > 0);
+			d->noise -= d->flip;
+			d->state = OWS_READ;
+		} else {
+			d->state = OWS_IDLE;
+		}
+		d->acc = 0;
+		break;
+	case OWS_SEARCH:
+		/*after bit and complement the master writes the branch, the others drop out*/
+		if (d->acc < 2) {
+			d->acc++;
+			break;
+		}
+		d->acc = 0;
+		if (line != ows_rom_bit(d)) {
+			d->state = OWS_IDLE;
+		} else if (++d->bit == 64) {
+			d->bit = 0;
+			d->state = OWS_FUNC;
+		}
+		break;
+	case OWS_MATCH:
+		if (line != ows_rom_bit(d)) {
+			d->state = OWS_IDLE;
+		} else if (++d->bit == 64) {
+			d->bit = 0;
+			d->state = OWS_FUNC;
+		}
+		break;
+	case OWS_WRITE:
+		/*TH, TL and configuration land in bytes 2..4*/
+		d->sp[2 + (d->bit >> 3)] = (d->sp[2 + (d->bit >> 3)] & ~(1 << (d->bit & 7))) | (line << (d->bit & 7));
+		if (++d->bit == 24) {
+			d->sp[4] |= 0x1F;
+			ows_sp_crc(d);
+			d->state = OWS_IDLE;
+		}
+		break;
+	case OWS_READ:
+		d->bit++;
+		break;
+	}
+}
+
+static esp_err_t ows_reset(onewire_bus_t *bus, bool *present)
+{
+	owsim_t *sim = (owsim_t *)bus;
+
+	for (int i = 0; i < sim->n; i++) {
+		sim->dev[i].state = OWS_ROM;
+		sim->dev[i].bit = 0;
+		sim->dev[i].acc = 0;
+	}
+	*present = (sim->n > 0);
+	sim->resets++;
+	sim->bus_us += OWSIM_RESET_US;
+	return ESP_OK;
+}
+
+static esp_err_t ows_xfer_bits(onewire_bus_t *bus, uint8_t out, int n, uint8_t *in)
+{
+	owsim_t *sim = (owsim_t *)bus;
+
+	if (in != NULL) {
+		*in = 0;
+	}
+	for (int i = 0; i < n; i++) {
+		int line = (out >> i) & 1;
+
+		for (int k = 0; k < sim->n; k++) {
+			line &= ows_out(&sim->dev[k]);
+		}
+		for (int k = 0; k < sim->n; k++) {
+			ows_in(&sim->dev[k], line);
+		}
+		if (in != NULL) {
+			*in |= line << i;
+		}
+	}
+	sim->slots += n;
+	sim->bus_us += (uint64_t)n * OWSIM_SLOT_US;
+	return ESP_OK;
+}
+
+void owsim_init(owsim_t *sim)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->bus.reset = ows_reset;
+	sim->bus.xfer_bits = ows_xfer_bits;
+}
+
+owsim_dev_t *owsim_add(owsim_t *sim, uint64_t serial, float temp)
+{
+	owsim_dev_t *d;
+
+	if (sim->n == OWSIM_DEVICES) {
+		return NULL;
+	}
+	d = &sim->dev[sim->n++];
+	memset(d, 0, sizeof(*d));
+	/*family 0x28, 48 bit serial, CRC*/
+	d->rom[0] = OWSIM_FAMILY;
+	for (int i = 1; i < 7; i++) {
+		d->rom[i] = serial >> (8 * (i - 1));
+	}
+	d->rom[7] = onewire_crc8(d->rom, 7);
+	d->temp = temp;
+	memcpy(d->sp, OWS_SP_INIT, sizeof(OWS_SP_INIT));
+	ows_sp_crc(d);
+	return d;
+}
@@ -0,0 +1,51 @@
+/*
+ * 1-Wire bus model with DS18B20 probes
+ *
+ * Implements the onewire_bus_t operations on the host. Every slot is
+ * resolved bit by bit: the master drives its bit, each probe releases the
+ * line or pulls it low, the line is the wired AND of both. The bus time the
+ * transfers would take on the wire is added up. Search ROM and MATCH ROM
+ * address the probes, a probe can be made to flip a bit of its next
+ * scratchpad reads.
+ *
+ * */
+#ifndef OWSIM_H_
+#define OWSIM_H_
+
+#include "onewire.h"
+
+#define OWSIM_DEVICES	16
+#define OWSIM_FAMILY	0x28	/*DS18B20*/
+#define OWSIM_RESET_US	960		/*Reset pulse and presence window*/
+#define OWSIM_SLOT_US	80		/*Slot and recovery*/
+
+/*One DS18B20*/
+typedef struct {
+	uint8_t rom[ONEWIRE_ROM_L];
+	float temp;			/*Temperature the next conversion reads*/
+	uint8_t noise;		/*Scratchpad reads with a flipped bit still to come*/
+	uint8_t sp[9];		/*Scratchpad*/
+	/*slave state*/
+	uint8_t state;
+	uint8_t acc;		/*Command bits received, Search ROM: bit, complement, direction*/
+	uint8_t flip;		/*This scratchpad read has a flipped bit*/
+	int bit;			/*Bit position in the current state*/
+	uint32_t conversions;
+} owsim_dev_t;
+
+typedef struct {
+	onewire_bus_t bus;
+	owsim_dev_t dev[OWSIM_DEVICES];
+	int n;
+	uint32_t resets;
+	uint32_t slots;
+	uint64_t bus_us;	/*Time the transfers took on the wire*/
+} owsim_t;
+
+/*Empty bus*/
+void owsim_init(owsim_t *sim);
+
+/*Attach a probe with the ROM code of serial (CRC added), returns it*/
+owsim_dev_t *owsim_add(owsim_t *sim, uint64_t serial, float temp);
+
+#endif
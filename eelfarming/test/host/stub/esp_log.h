@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for esp_log, logs go nowhere
+ *
+ * */
+#ifndef ESP_LOG_H_
+#define ESP_LOG_H_
+
+#define ESP_LOGE(tag, ...)	((void)(tag))
+#define ESP_LOGW(tag, ...)	((void)(tag))
+#define ESP_LOGI(tag, ...)	((void)(tag))
+#define ESP_LOGD(tag, ...)	((void)(tag))
+
+#endif
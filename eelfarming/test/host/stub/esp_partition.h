@@ -0,0 +1,43 @@
+/*
+ * Host stand-in for partitions, there are none
+ *
+ * */
+#ifndef ESP_PARTITION_H_
+#define ESP_PARTITION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef enum { ESP_PARTITION_TYPE_APP = 0, ESP_PARTITION_TYPE_DATA = 1 } esp_partition_type_t;
+typedef enum { ESP_PARTITION_SUBTYPE_ANY = 0xff } esp_partition_subtype_t;
+
+typedef struct {
+	esp_partition_type_t type;
+	esp_partition_subtype_t subtype;
+	uint32_t address;
+	uint32_t size;
+	char label[17];
+} esp_partition_t;
+
+static inline const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+	return NULL;
+}
+
+static inline esp_err_t esp_partition_read(const esp_partition_t *part, size_t addr, void *data, size_t len)
+{
+	return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline esp_err_t esp_partition_write(const esp_partition_t *part, size_t addr, const void *data, size_t len)
+{
+	return ESP_ERR_NOT_SUPPORTED;
+}
+
+static inline esp_err_t esp_partition_erase_range(const esp_partition_t *part, uint32_t addr, uint32_t len)
+{
+	return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif
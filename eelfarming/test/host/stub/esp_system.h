@@ -0,0 +1,16 @@
+/*
+ * Host stand-in for esp_system
+ *
+ * */
+#ifndef ESP_SYSTEM_H_
+#define ESP_SYSTEM_H_
+
+#include <stdint.h>
+
+/*Heap of an ESP32 with nothing else running*/
+static inline uint32_t esp_get_free_heap_size(void)
+{
+	return 300 * 1024;
+}
+
+#endif
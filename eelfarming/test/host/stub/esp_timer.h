@@ -0,0 +1,18 @@
+/*
+ * Host stand-in for esp_timer, the test drives the clock
+ *
+ * */
+#ifndef ESP_TIMER_H_
+#define ESP_TIMER_H_
+
+#include <stdint.h>
+
+/*Defined by the test*/
+extern int64_t TEST_now_us;
+
+static inline int64_t esp_timer_get_time(void)
+{
+	return TEST_now_us;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ * Host stand-in for FreeRTOS, critical sections do nothing
+ *
+ * */
+#ifndef FREERTOS_H_
+#define FREERTOS_H_
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef struct { int owner; } portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED	{ 0 }
+#define portENTER_CRITICAL(m)			((void)(m))
+#define portEXIT_CRITICAL(m)			((void)(m))
+#define vPortCPUInitializeMutex(m)		((void)(m))
+#define portTICK_PERIOD_MS				10
+#define portMAX_DELAY					0xFFFFFFFFu
+#define pdTRUE							1
+#define pdFALSE							0
+#define pdPASS							1
+
+/*Atomic compare and swap, *set gets the old value*/
+static inline void uxPortCompareSet(volatile uint32_t *addr, uint32_t compare, uint32_t *set)
+{
+	uint32_t old = compare;
+
+	__atomic_compare_exchange_n(addr, &old, *set, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	*set = old;
+}
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Host stand-in for FreeRTOS queues on pthreads, a full queue never waits
+ *
+ * */
+#ifndef QUEUE_H_
+#define QUEUE_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	size_t item;
+	UBaseType_t len;
+	UBaseType_t head;
+	UBaseType_t n;
+	char *buf;
+} host_queue_t;
+
+typedef host_queue_t *QueueHandle_t;
+
+static inline QueueHandle_t xQueueCreate(UBaseType_t len, size_t item)
+{
+	QueueHandle_t q = calloc(1, sizeof(*q));
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->filled, NULL);
+	q->item = item;
+	q->len = len;
+	q->buf = calloc(len, item);
+	return q;
+}
+
+static inline BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait)
+{
+	BaseType_t r = pdFALSE;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->n < q->len) {
+		memcpy(&q->buf[((q->head + q->n++) % q->len) * q->item], item, q->item);
+		pthread_cond_signal(&q->filled);
+		r = pdTRUE;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return r;
+}
+
+static inline BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait)
+{
+	struct timespec until;
+	BaseType_t r = pdFALSE;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += wait * portTICK_PERIOD_MS / 1000;
+	until.tv_nsec += wait * portTICK_PERIOD_MS % 1000 * 1000000L;
+	if (until.tv_nsec >= 1000000000L) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&q->lock);
+	while (q->n == 0 && wait != 0) {
+		if (wait == portMAX_DELAY) {
+			pthread_cond_wait(&q->filled, &q->lock);
+		} else if (pthread_cond_timedwait(&q->filled, &q->lock, &until) != 0) {
+			break;
+		}
+	}
+	if (q->n > 0) {
+		memcpy(item, &q->buf[q->head * q->item], q->item);
+		q->head = (q->head + 1) % q->len;
+		q->n--;
+		r = pdTRUE;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return r;
+}
+
+static inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+	UBaseType_t n;
+
+	pthread_mutex_lock(&q->lock);
+	n = q->n;
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * Host stand-in for FreeRTOS semaphores, mutexes are pthread mutexes and
+ * a wait other than 0 never times out
+ *
+ * */
+#ifndef SEMPHR_H_
+#define SEMPHR_H_
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+typedef pthread_mutex_t *SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	SemaphoreHandle_t s = malloc(sizeof(*s));
+
+	pthread_mutex_init(s, NULL);
+	return s;
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait)
+{
+	if (wait == 0) {
+		return (pthread_mutex_trylock(s) == 0) ? pdTRUE : pdFALSE;
+	}
+	pthread_mutex_lock(s);
+	return pdTRUE;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+	pthread_mutex_unlock(s);
+	return pdTRUE;
+}
+
+#endif
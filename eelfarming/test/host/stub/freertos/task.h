@@ -0,0 +1,48 @@
+/*
+ * Host stand-in for FreeRTOS tasks, no task is ever created
+ *
+ * */
+#ifndef TASK_H_
+#define TASK_H_
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+static inline void xTaskNotifyGive(TaskHandle_t task)
+{
+}
+
+static inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait)
+{
+	return 0;
+}
+
+/*Ticks of the test clock*/
+static inline TickType_t xTaskGetTickCount(void)
+{
+	return TEST_now_us / 1000 / portTICK_PERIOD_MS;
+}
+
+static inline TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+	return NULL;
+}
+
+static inline void vTaskDelay(TickType_t ticks)
+{
+}
+
+static inline void vTaskDelete(TaskHandle_t task)
+{
+}
+
+static inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t f, const char *name, uint32_t stack, void *arg,
+		int priority, TaskHandle_t *task, int core)
+{
+	return pdFALSE;
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Host stand-in for the SHA accelerator, SHA1 in software
+ *
+ * */
+#ifndef HWCRYPTO_SHA_H_
+#define HWCRYPTO_SHA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef enum {
+	SHA1 = 0,
+} esp_sha_type;
+
+static inline uint32_t sha1_rol(uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static inline void sha1_block(uint32_t h[5], const uint8_t *p)
+{
+	uint32_t w[80], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f, k, t;
+
+	for (int i = 0; i < 16; i++) {
+		w[i] = (p[4 * i] << 24) | (p[4 * i + 1] << 16) | (p[4 * i + 2] << 8) | p[4 * i + 3];
+	}
+	for (int i = 16; i < 80; i++) {
+		w[i] = sha1_rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+	for (int i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		t = sha1_rol(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = sha1_rol(b, 30);
+		b = a;
+		a = t;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+static inline void esp_sha(esp_sha_type type, const unsigned char *input, size_t ilen, unsigned char *output)
+{
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	uint8_t last[128] = { 0 };
+	size_t full = ilen & ~(size_t)63, rest = ilen - full, n;
+	uint64_t bits = (uint64_t)ilen * 8;
+
+	for (size_t i = 0; i < full; i += 64) {
+		sha1_block(h, &input[i]);
+	}
+	memcpy(last, &input[full], rest);
+	last[rest] = 0x80;
+	n = (rest < 56) ? 64 : 128;
+	for (int i = 0; i < 8; i++) {
+		last[n - 1 - i] = bits >> (8 * i);
+	}
+	sha1_block(h, last);
+	if (n == 128) {
+		sha1_block(h, &last[64]);
+	}
+	for (int i = 0; i < 20; i++) {
+		output[i] = h[i / 4] >> (24 - 8 * (i % 4));
+	}
+}
+
+#endif
@@ -0,0 +1,8 @@
+/*
+ * Host stand-in for the lwIP DNS client, nothing of it is used
+ *
+ * */
+#ifndef LWIP_DNS_H_
+#define LWIP_DNS_H_
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ * Host stand-in for the lwIP error codes
+ *
+ * */
+#ifndef LWIP_ERR_H_
+#define LWIP_ERR_H_
+
+#include <stdint.h>
+
+typedef int8_t err_t;
+
+#define ERR_OK			0
+#define ERR_MEM			-1
+#define ERR_BUF			-2
+#define ERR_TIMEOUT		-3
+#define ERR_VAL			-6
+#define ERR_WOULDBLOCK	-7
+#define ERR_CONN		-11
+#define ERR_ABRT		-13
+#define ERR_RST			-14
+#define ERR_CLSD		-15
+#define ERR_ARG			-16
+
+#endif
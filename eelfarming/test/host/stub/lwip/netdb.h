@@ -0,0 +1,10 @@
+/*
+ * Host stand-in for the lwIP resolver
+ *
+ * */
+#ifndef LWIP_NETDB_H_
+#define LWIP_NETDB_H_
+
+#include <netdb.h>
+
+#endif
@@ -0,0 +1,15 @@
+/*
+ * Host stand-in for the lwIP sockets, they are the BSD ones
+ *
+ * */
+#ifndef LWIP_SOCKETS_H_
+#define LWIP_SOCKETS_H_
+
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#endif
@@ -0,0 +1,8 @@
+/*
+ * Host stand-in for the lwIP system layer, nothing of it is used
+ *
+ * */
+#ifndef LWIP_SYS_H_
+#define LWIP_SYS_H_
+
+#endif
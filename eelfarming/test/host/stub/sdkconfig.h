@@ -0,0 +1,20 @@
+/*
+ * Host configuration, the defaults of the Kconfig files
+ *
+ * */
+#ifndef SDKCONFIG_H_
+#define SDKCONFIG_H_
+
+#define CONFIG_FLOG_BUF_PAGES	8
+#define CONFIG_FLOG_FLUSH_S		30
+#define CONFIG_HIST_HEAP_RESERVE_KB	64
+#define CONFIG_MQTTC_INFLIGHT	4
+#define CONFIG_MQTTC_MSG_L		1024
+#define CONFIG_WS_MAX_CLIENTS	8		/*Largest allowed, the benchmark runs 8 clients*/
+#define CONFIG_WS_POOL_SMALL_NUM	64		/*Largest allowed, one read holds up to 62 commands*/
+#define CONFIG_WS_POOL_SMALL_SIZE	256
+#define CONFIG_WS_POOL_LARGE_NUM	4		/*One read may end a 1 KB message, hold the next and start a third*/
+#define CONFIG_WS_POOL_LARGE_SIZE	32768	/*Largest allowed, the benchmark receives 16 KB messages*/
+#define CONFIG_WS_TCP_NODELAY	1
+
+#endif
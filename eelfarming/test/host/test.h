@@ -0,0 +1,42 @@
+/*
+ * Minimal checks for the host tests
+ *
+ * */
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+static int TEST_fail;
+
+#define CHECK(c) do { \
+	if (!(c)) { \
+		printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #c); \
+		TEST_fail++; \
+	} \
+} while (0)
+
+#define CHECK_STR(a, b) do { \
+	const char *a_ = (a), *b_ = (b); \
+	if (strcmp(a_, b_) != 0) { \
+		printf("%s:%d: \"%s\" != \"%s\"\n", __FILE__, __LINE__, a_, b_); \
+		TEST_fail++; \
+	} \
+} while (0)
+
+/*Exit status of main*/
+#define TEST_END(name) (printf("%s: %s\n", (name), TEST_fail ? "FAILED" : "ok"), TEST_fail != 0)
+
+/*Monotonic time in us*/
+static inline double test_us(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+#endif
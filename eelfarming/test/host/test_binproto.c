@@ -0,0 +1,184 @@
+/*
+ * Host test of the binary telemetry protocol: commands and snapshots encoded
+ * and decoded again, malformed records, and size and time of a record
+ * against the JSON a text client sends and gets.
+ *
+ * */
+#include <stdlib.h>
+#include <math.h>
+
+#include "test.h"
+#include "cmd.h"
+#include "binproto.h"
+
+const char *const TM_CH_KEYS[TM_CH_MAX] = { "te_m", "di_m", "ph_m", "do_m" };
+const jw_key_t TM_CH_JKEYS[TM_CH_MAX] = { JW_KEY_INIT("te_m"), JW_KEY_INIT("di_m"), JW_KEY_INIT("ph_m"), JW_KEY_INIT("do_m") };
+const uint8_t TM_CH_DECIMALS[TM_CH_MAX] = { 2, 1, 2, 2 };
+
+#define BENCH_N		1000000
+#define SUBSCRIBE	"{\"cmd\":4,\"ms\":1000,\"th\":0.1}"
+
+static const float VALUES[TM_CH_MAX] = { 25.5f, 103.2f, 7.08f, 8.45f };
+static volatile uint32_t sink;
+
+static void test_cmd(void)
+{
+	bp_cmd_t in = { .cmd = 4, .mask = 0x5, .ms = 1000, .threshold = 0.1f }, out;
+	uint8_t rec[BP_CMD_MAX_L];
+	size_t len;
+
+	len = bp_encode_cmd(rec, &in);
+	CHECK(len == BP_CMD_MAX_L);
+	CHECK(bp_decode_cmd(rec, len, &out) == 0);
+	CHECK(out.cmd == 4 && out.mask == 0x5 && out.ms == 1000 && out.threshold == 0.1f);
+
+	/*arguments are optional, no mask is all channels*/
+	CHECK(bp_decode_cmd(rec, BP_HDR_L, &out) == 0 && out.ms == 0 && out.threshold == 0);
+	rec[3] = 0;
+	CHECK(bp_decode_cmd(rec, len, &out) == 0 && out.mask == TM_CH_ALL);
+
+	/*unknown channels are ignored, none known is an error*/
+	rec[3] = 0x13;
+	CHECK(bp_decode_cmd(rec, len, &out) == 0 && out.mask == 0x3);
+	rec[3] = 0xF0;
+	CHECK(bp_decode_cmd(rec, len, &out) == -1);
+
+	/*malformed*/
+	rec[3] = 0x1;
+	CHECK(bp_decode_cmd(rec, BP_HDR_L - 1, &out) == -1);
+	rec[0] = BP_VERSION + 1;
+	CHECK(bp_decode_cmd(rec, len, &out) == -1);
+	rec[0] = BP_VERSION;
+	rec[1] = BP_T_SNAPSHOT;
+	CHECK(bp_decode_cmd(rec, len, &out) == -1);
+}
+
+static void test_snapshot(void)
+{
+	uint8_t rec[BP_SNAPSHOT_MAX_L];
+	float out[TM_CH_MAX] = { 0 };
+	size_t len;
+
+	len = bp_encode_snapshot(rec, TM_CH_ALL, VALUES);
+	CHECK(len == BP_SNAPSHOT_MAX_L);
+	CHECK(bp_decode_snapshot(rec, len, out) == TM_CH_ALL);
+	CHECK(memcmp(out, VALUES, sizeof(out)) == 0);
+
+	/*only the channels of the mask, in channel order*/
+	memset(out, 0, sizeof(out));
+	len = bp_encode_snapshot(rec, 0x5, VALUES);
+	CHECK(len == BP_HDR_L + 2 * sizeof(float));
+	CHECK(bp_decode_snapshot(rec, len, out) == 0x5);
+	CHECK(out[0] == VALUES[0] && out[1] == 0 && out[2] == VALUES[2] && out[3] == 0);
+
+	/*truncated, wrong type*/
+	CHECK(bp_decode_snapshot(rec, len - 1, out) == -1);
+	CHECK(bp_encode_status(rec, 4, 1) == BP_HDR_L && rec[1] == BP_T_STATUS && rec[2] == 4 && rec[3] == 1);
+	CHECK(bp_decode_snapshot(rec, BP_HDR_L, out) == -1);
+}
+
+/*Subscribe arguments as cmd_subscribe reads them*/
+static void cmd_subscribe(const cmd_req_t *req, jw_t *res)
+{
+	int32_t ms = 0;
+	float th = 0;
+
+	cmd_arg_int(req, "ms", &ms);
+	cmd_arg_float(req, "th", &th);
+	sink += ms + (th > 0);
+}
+
+/*A JSON push as telemetry_push_json writes it*/
+static int json_snapshot(char *buf, size_t cap)
+{
+	jw_t w;
+
+	jw_init(&w, buf, cap);
+	jw_obj(&w, NULL);
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		jw_float(&w, &TM_CH_JKEYS[ch], VALUES[ch], TM_CH_DECIMALS[ch]);
+	}
+	return jw_end(&w);
+}
+
+/*A JSON push read back by a client, returns the channel mask*/
+static int json_read(const char *p, size_t len, float values[TM_CH_MAX])
+{
+	jsmntok_t tok[1 + 2 * TM_CH_MAX];
+	jsmn_parser parser;
+	int n, mask = 0;
+
+	jsmn_init(&parser);
+	n = jsmn_parse(&parser, p, len, tok, sizeof(tok) / sizeof(tok[0]));
+	for (int i = 1; i + 1 < n; i += 2) {
+		for (int ch = 0; ch < TM_CH_MAX; ch++) {
+			if (tok[i].end - tok[i].start == 4 && memcmp(&p[tok[i].start], TM_CH_KEYS[ch], 4) == 0) {
+				values[ch] = strtof(&p[tok[i + 1].start], NULL);
+				mask |= 1 << ch;
+			}
+		}
+	}
+	return mask;
+}
+
+/*Size and ns per record of both encodings*/
+static void bench(void)
+{
+	char json[TM_JSON_L], req[sizeof(SUBSCRIBE)], res[64];
+	uint8_t rec[BP_SNAPSHOT_MAX_L];
+	bp_cmd_t cmd = { .cmd = 4, .mask = TM_CH_ALL, .ms = 1000, .threshold = 0.1f };
+	float values[TM_CH_MAX];
+	int json_l = json_snapshot(json, sizeof(json));
+	size_t rec_l = bp_encode_snapshot(rec, TM_CH_ALL, VALUES);
+	double t[5];
+	jw_t w;
+
+	t[0] = test_us();
+	for (int i = 0; i < BENCH_N; i++) {
+		sink += json_snapshot(json, sizeof(json));
+	}
+	t[1] = test_us();
+	for (int i = 0; i < BENCH_N; i++) {
+		sink += bp_encode_snapshot(rec, TM_CH_ALL, VALUES);
+	}
+	t[2] = test_us();
+	for (int i = 0; i < BENCH_N; i++) {
+		sink += json_read(json, json_l, values);
+	}
+	t[3] = test_us();
+	for (int i = 0; i < BENCH_N; i++) {
+		sink += bp_decode_snapshot(rec, rec_l, values);
+	}
+	t[4] = test_us();
+	CHECK(json_read(json, json_l, values) == TM_CH_ALL && fabsf(values[1] - VALUES[1]) < 0.05f);
+	printf("  snapshot json   %3d B, encode %4.0f ns, decode %4.0f ns\n", json_l,
+			(t[1] - t[0]) * 1e3 / BENCH_N, (t[3] - t[2]) * 1e3 / BENCH_N);
+	printf("  snapshot binary %3zu B, encode %4.0f ns, decode %4.0f ns\n", rec_l,
+			(t[2] - t[1]) * 1e3 / BENCH_N, (t[4] - t[3]) * 1e3 / BENCH_N);
+
+	/*subscribe command decoded by the device*/
+	t[0] = test_us();
+	for (int i = 0; i < BENCH_N; i++) {
+		memcpy(req, SUBSCRIBE, sizeof(req));
+		jw_init(&w, res, sizeof(res));
+		jw_obj(&w, NULL);
+		sink += cmd_dispatch(1, req, sizeof(req) - 1, &w, NULL, 0);
+	}
+	t[1] = test_us();
+	rec_l = bp_encode_cmd(rec, &cmd);
+	for (int i = 0; i < BENCH_N; i++) {
+		sink += bp_decode_cmd(rec, rec_l, &cmd);
+	}
+	t[2] = test_us();
+	printf("  subscribe json   %2zu B, decode %4.0f ns\n", sizeof(SUBSCRIBE) - 1, (t[1] - t[0]) * 1e3 / BENCH_N);
+	printf("  subscribe binary %2zu B, decode %4.0f ns\n", rec_l, (t[2] - t[1]) * 1e3 / BENCH_N);
+}
+
+int main(void)
+{
+	cmd_register(4, cmd_subscribe);
+	test_cmd();
+	test_snapshot();
+	bench();
+	return TEST_END("binproto");
+}
@@ -0,0 +1,225 @@
+/*
+ * Host test and benchmark of the command dispatcher
+ *
+ * Dispatching must not allocate, malloc/calloc/realloc are wrapped by the
+ * linker and counted while requests run. The cJSON dispatch the firmware
+ * used before is run on the same request as the baseline.
+ *
+ * */
+#include <stdlib.h>
+
+#include "test.h"
+#include "cmd.h"
+#include "cJSON.h"
+
+#define BENCH_N		1000000
+#define SINGLE		"{\"cmd\":1,\"i\":42,\"f\":3.25,\"s\":\"te_m\"}"
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+static volatile unsigned long HEAP_calls;
+
+void *__wrap_malloc(size_t size)
+{
+	HEAP_calls++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	HEAP_calls++;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+	HEAP_calls++;
+	return __real_realloc(p, size);
+}
+
+/*Echoes its arguments like a sensor read*/
+static void cmd_echo(const cmd_req_t *req, jw_t *res)
+{
+	int32_t i;
+	uint32_t u;
+	float f;
+	const char *s;
+
+	if (cmd_arg_int(req, "i", &i) == 0) {
+		jw_int(res, JW_KEY("i"), i);
+	}
+	if (cmd_arg_uint(req, "u", &u) == 0) {
+		jw_uint(res, JW_KEY("u"), u);
+	}
+	if (cmd_arg_float(req, "f", &f) == 0) {
+		jw_float(res, JW_KEY("f"), f, 2);
+	}
+	if ((s = cmd_arg_str(req, "s")) != NULL) {
+		jw_str(res, JW_KEY("s"), s);
+	}
+	jw_int(res, JW_KEY("status"), 1);
+}
+
+/*Answer close to the size of a full sensor read*/
+static void cmd_big(const cmd_req_t *req, jw_t *res)
+{
+	jw_arr(res, JW_KEY("v"));
+	for (int k = 0; k < 32; k++) {
+		jw_float(res, NULL, k * 1.25f, 2);
+	}
+	jw_close(res);
+}
+
+/*Dispatch req (copied, it is modified in place), the response goes to out*/
+static int run(const char *req, char *out, size_t cap)
+{
+	char json[512];
+	jw_t w;
+	int cmd, len;
+
+	strcpy(json, req);
+	jw_init(&w, out, cap);
+	jw_obj(&w, NULL);
+	cmd = cmd_dispatch(7, json, strlen(json), &w, NULL, 0);
+	len = jw_end(&w);
+	if (len < 0) {
+		strcpy(out, "<overflow>");
+	}
+	return cmd;
+}
+
+static void test_dispatch(void)
+{
+	char out[CMD_RES_L];
+
+	CHECK(run("{\"cmd\":1,\"i\":-12,\"f\":2.5e1,\"s\":\"te_m\"}", out, sizeof(out)) == 1);
+	CHECK_STR(out, "{\"i\":-12,\"f\":25,\"s\":\"te_m\",\"status\":1}");
+
+	/*numbers are clamped, fractions truncated*/
+	CHECK(run("{\"cmd\":1,\"i\":1e12}", out, sizeof(out)) == 1);
+	CHECK_STR(out, "{\"i\":2147483647,\"status\":1}");
+	CHECK(run("{\"cmd\":1,\"i\":-99.9}", out, sizeof(out)) == 1);
+	CHECK_STR(out, "{\"i\":-99,\"status\":1}");
+
+	/*device times above INT32_MAX, negative ones are missing*/
+	CHECK(run("{\"cmd\":1,\"u\":4294967295}", out, sizeof(out)) == 1);
+	CHECK_STR(out, "{\"u\":4294967295,\"status\":1}");
+	CHECK(run("{\"cmd\":1,\"u\":5e9}", out, sizeof(out)) == 1);
+	CHECK_STR(out, "{\"u\":4294967295,\"status\":1}");
+	CHECK(run("{\"cmd\":1,\"u\":-1}", out, sizeof(out)) == 1);
+	CHECK_STR(out, "{\"status\":1}");
+
+	/*wrong types are missing arguments*/
+	CHECK(run("{\"cmd\":1,\"i\":\"5\",\"s\":5}", out, sizeof(out)) == 1);
+	CHECK_STR(out, "{\"status\":1}");
+
+	CHECK(run("{\"cmd\":9}", out, sizeof(out)) == 9);
+	CHECK_STR(out, "{\"status\":0}");
+	CHECK(run("{\"x\":1}", out, sizeof(out)) == CMD_NONE);
+	CHECK_STR(out, "{}");
+	CHECK(run("[1,2]", out, sizeof(out)) == -1);
+	CHECK(run("{\"cmd\":", out, sizeof(out)) == -1);
+}
+
+static void test_batch(void)
+{
+	char out[CMD_RES_L];
+
+	CHECK(run("{\"batch\":[{\"id\":1,\"cmd\":1,\"i\":3},{\"id\":\"m\",\"cmd\":9},5,{\"cmd\":1}]}",
+			out, sizeof(out)) == CMD_BATCH);
+	CHECK_STR(out, "{\"batch\":[{\"id\":1,\"i\":3,\"status\":1},{\"id\":\"m\",\"status\":0},"
+			"{\"status\":0},{\"status\":1}]}");
+
+	/*results that do not fit are answered with their status only*/
+	CHECK(run("{\"batch\":[{\"id\":1,\"cmd\":2},{\"id\":2,\"cmd\":2}]}", out, 220) == CMD_BATCH);
+	CHECK(strncmp(out, "{\"batch\":[{\"id\":1,\"v\":[", 23) == 0);
+	CHECK(strstr(out, "{\"id\":2,\"status\":0}]}") != NULL);
+
+	/*and dropped if not even that fits*/
+	CHECK(run("{\"batch\":[{\"id\":1,\"cmd\":2},{\"id\":2,\"cmd\":2}]}", out, 20) == CMD_BATCH);
+	CHECK_STR(out, "{\"batch\":[]}");
+}
+
+/*The dispatch before cmd.c: a cJSON tree of the request and one of the response, printed and freed*/
+static int run_cjson(const char *req, char *out, size_t cap)
+{
+	cJSON *q = cJSON_Parse(req), *res, *cmd, *arg;
+	char *p;
+	int n = -1;
+
+	if (q == NULL) {
+		return -1;
+	}
+	res = cJSON_CreateObject();
+	if ((cmd = cJSON_GetObjectItem(q, "cmd")) != NULL) {
+		n = cmd->valueint;
+		if (n == 1) {
+			if ((arg = cJSON_GetObjectItem(q, "i")) != NULL && arg->type == cJSON_Number) {
+				cJSON_AddNumberToObject(res, "i", arg->valueint);
+			}
+			if ((arg = cJSON_GetObjectItem(q, "f")) != NULL && arg->type == cJSON_Number) {
+				cJSON_AddNumberToObject(res, "f", arg->valuedouble);
+			}
+			if ((arg = cJSON_GetObjectItem(q, "s")) != NULL && arg->type == cJSON_String) {
+				cJSON_AddStringToObject(res, "s", arg->valuestring);
+			}
+		}
+		cJSON_AddNumberToObject(res, "status", n == 1);
+	}
+	p = cJSON_Print(res);
+	snprintf(out, cap, "%s", p);
+	free(p);
+	cJSON_Delete(res);
+	cJSON_Delete(q);
+	return n;
+}
+
+/*Requests per second and heap calls per request*/
+static unsigned long bench(const char *name, int (*fn)(const char *, char *, size_t), const char *req, int n)
+{
+	char out[CMD_RES_L];
+	unsigned long calls;
+	double t;
+
+	fn(req, out, sizeof(out));
+	calls = HEAP_calls;
+	t = test_us();
+	for (int k = 0; k < n; k++) {
+		fn(req, out, sizeof(out));
+	}
+	t = test_us() - t;
+	calls = HEAP_calls - calls;
+	printf("  %-8s %8.0f requests/s, %5.1f heap calls/request\n", name, n / t * 1e6, (double)calls / n);
+	return calls;
+}
+
+int main(void)
+{
+	unsigned long calls = HEAP_calls;
+	char out[CMD_RES_L];
+	void *volatile p;
+
+	/*the wrappers are linked in*/
+	p = malloc(16);
+	free(p);
+	CHECK(HEAP_calls == calls + 1);
+
+	cmd_register(1, cmd_echo);
+	cmd_register(2, cmd_big);
+	CHECK(cmd_register(CMD_MAX, cmd_echo) == -1);
+
+	test_dispatch();
+	test_batch();
+
+	/*the old dispatch answers the same fields*/
+	CHECK(run_cjson(SINGLE, out, sizeof(out)) == 1);
+	CHECK(strstr(out, "\"i\":\t42") != NULL && strstr(out, "\"s\":\t\"te_m\"") != NULL && strstr(out, "\"status\":\t1") != NULL);
+
+	CHECK(bench("single", run, SINGLE, BENCH_N) == 0);
+	bench("cJSON", run_cjson, SINGLE, BENCH_N);
+	CHECK(bench("batch", run, "{\"batch\":[{\"id\":1,\"cmd\":1,\"i\":1},{\"id\":2,\"cmd\":1,\"f\":2.5},"
+			"{\"id\":3,\"cmd\":2},{\"id\":4,\"cmd\":9}]}", BENCH_N / 4) == 0);
+	return TEST_END("cmd");
+}
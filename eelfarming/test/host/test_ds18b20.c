@@ -0,0 +1,225 @@
+/*
+ * Host test of the DS18B20 driver against the 1-Wire bus model
+ *
+ * */
+#include "test.h"
+#include "owsim.h"
+#include "ds18b20.h"
+
+static owsim_t SIM;
+
+/*xorshift, ROM serials*/
+static uint64_t rnd(void)
+{
+	static uint64_t x = 88172645463325252ull;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+/*Index of the probe with the ROM code rom, -1 if none*/
+static int find_dev(const uint8_t *rom)
+{
+	for (int i = 0; rom != NULL && i < SIM.n; i++) {
+		if (memcmp(SIM.dev[i].rom, rom, ONEWIRE_ROM_L) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*Every probe of the family found exactly once*/
+static int found_all(int n)
+{
+	uint32_t seen = 0;
+
+	for (int i = 0; i < ds18b20_count(); i++) {
+		int k = find_dev(ds18b20_rom(i));
+		if (k < 0 || (seen & (1 << k))) {
+			return 0;
+		}
+		seen |= 1 << k;
+	}
+	return ds18b20_count() == n;
+}
+
+static void test_empty(void)
+{
+	float t;
+
+	owsim_init(&SIM);
+	ds18b20_init_bus(&SIM.bus);
+	CHECK(ds18b20_count() == 0);
+	CHECK(ds18b20_start_conversion() == ESP_ERR_NOT_FOUND);
+	CHECK(ds18b20_read_temp(&t) == ESP_ERR_NOT_FOUND);
+}
+
+static void test_single(void)
+{
+	owsim_dev_t *d;
+	float t = 0;
+	uint64_t us;
+
+	owsim_init(&SIM);
+	d = owsim_add(&SIM, 0x1234, 21.5f);
+	ds18b20_init_bus(&SIM.bus);
+	CHECK(ds18b20_conversion_ms() == 750);
+
+	/*power-on value before the first conversion*/
+	CHECK(ds18b20_read_temp(&t) == ESP_OK && t == 85.0f);
+
+	us = SIM.bus_us;
+	CHECK(ds18b20_start_conversion() == ESP_OK);
+	CHECK(ds18b20_read_temp(&t) == ESP_OK && t == 21.5f);
+	CHECK(d->conversions == 1);
+	printf("  bus time per reading %llu us\n", (unsigned long long)(SIM.bus_us - us));
+
+	d->temp = -10.125f;
+	CHECK(ds18b20_start_conversion() == ESP_OK);
+	CHECK(ds18b20_read_temp(&t) == ESP_OK && t == -10.125f);
+	CHECK(ds18b20_read_temp_idx(1, &t) == ESP_ERR_INVALID_ARG);
+}
+
+static void test_resolution(void)
+{
+	static const uint32_t ms[] = { 94, 188, 375, 750 };
+	static const float expect[] = { 21.5f, 21.75f, 21.875f, 21.9375f };
+	owsim_dev_t *d;
+	float t;
+
+	owsim_init(&SIM);
+	d = owsim_add(&SIM, 0x1234, 21.9375f);
+	ds18b20_init_bus(&SIM.bus);
+	for (int bits = 9; bits <= 12; bits++) {
+		CHECK(ds18b20_set_resolution(bits) == ESP_OK);
+		CHECK(d->sp[4] == (((bits - 9) << 5) | 0x1F));
+		CHECK(ds18b20_conversion_ms() == ms[bits - 9]);
+		CHECK(ds18b20_start_conversion() == ESP_OK);
+		/*undefined low bits are masked*/
+		CHECK(ds18b20_read_temp(&t) == ESP_OK && t == expect[bits - 9]);
+	}
+	CHECK(ds18b20_set_resolution(13) == ESP_ERR_INVALID_ARG);
+}
+
+static void test_search(void)
+{
+	uint8_t roms[OWSIM_DEVICES][ONEWIRE_ROM_L];
+	owsim_dev_t *d;
+
+	/*random serials and a probe of another family*/
+	owsim_init(&SIM);
+	for (int i = 0; i < 5; i++) {
+		owsim_add(&SIM, rnd(), 20);
+	}
+	d = owsim_add(&SIM, rnd(), 20);
+	d->rom[0] = 0x10;
+	d->rom[7] = onewire_crc8(d->rom, 7);
+	ds18b20_init_bus(&SIM.bus);
+	CHECK(found_all(5));
+	CHECK(onewire_search(&SIM.bus, 0, roms, OWSIM_DEVICES) == 6);
+
+	/*serials that only differ in their last bits, a discrepancy at every level*/
+	owsim_init(&SIM);
+	for (int i = 0; i < 8; i++) {
+		owsim_add(&SIM, (uint64_t)i << 45, 20);
+	}
+	ds18b20_init_bus(&SIM.bus);
+	CHECK(found_all(8));
+
+	/*more probes than DS_MAX_DEVICES*/
+	owsim_init(&SIM);
+	for (int i = 0; i < DS_MAX_DEVICES + 3; i++) {
+		owsim_add(&SIM, rnd(), 20);
+	}
+	ds18b20_init_bus(&SIM.bus);
+	CHECK(ds18b20_count() == DS_MAX_DEVICES);
+}
+
+/*One conversion for all probes, each read by its address*/
+static void test_multi(void)
+{
+	float t;
+
+	owsim_init(&SIM);
+	for (int i = 0; i < 6; i++) {
+		owsim_add(&SIM, rnd(), 18 + i * 1.5f);
+	}
+	ds18b20_init_bus(&SIM.bus);
+	CHECK(found_all(6));
+	CHECK(ds18b20_start_conversion() == ESP_OK);
+	for (int i = 0; i < 6; i++) {
+		owsim_dev_t *d = &SIM.dev[find_dev(ds18b20_rom(i))];
+		CHECK(ds18b20_read_temp_idx(i, &t) == ESP_OK && t == d->temp);
+		CHECK(d->conversions == 1);
+	}
+	CHECK(ds18b20_read_temp_idx(6, &t) == ESP_ERR_INVALID_ARG);
+}
+
+/*Scratchpads with a bad CRC are read again, DS_RETRIES times*/
+static void test_crc(void)
+{
+	owsim_dev_t *d;
+	float t;
+
+	owsim_init(&SIM);
+	owsim_add(&SIM, rnd(), 30);
+	owsim_add(&SIM, rnd(), 31);
+	ds18b20_init_bus(&SIM.bus);
+	CHECK(ds18b20_start_conversion() == ESP_OK);
+	d = &SIM.dev[find_dev(ds18b20_rom(0))];
+
+	d->noise = DS_RETRIES - 1;
+	CHECK(ds18b20_read_temp_idx(0, &t) == ESP_OK && t == d->temp && d->noise == 0);
+	d->noise = DS_RETRIES;
+	CHECK(ds18b20_read_temp_idx(0, &t) == ESP_ERR_INVALID_CRC);
+	CHECK(ds18b20_read_temp_idx(1, &t) == ESP_OK && t == SIM.dev[find_dev(ds18b20_rom(1))].temp);
+}
+
+/*
+ * Readings per second against the number of probes: one conversion and N
+ * addressed reads, against a conversion per probe. The bus time is the one
+ * of the model, the conversion time the one of the datasheet.
+ *
+ * */
+static void bench(void)
+{
+	float t;
+
+	printf("  probes bits  shared conversion  conversion per probe (readings/s)\n");
+	for (int bits = 12; bits >= 9; bits -= 3) {
+		for (int n = 1; n <= DS_MAX_DEVICES; n *= 2) {
+			uint64_t us, read_us;
+
+			owsim_init(&SIM);
+			for (int i = 0; i < n; i++) {
+				owsim_add(&SIM, rnd(), 20);
+			}
+			ds18b20_init_bus(&SIM.bus);
+			ds18b20_set_resolution(bits);
+			us = SIM.bus_us;
+			ds18b20_start_conversion();
+			for (int i = 0; i < n; i++) {
+				CHECK(ds18b20_read_temp_idx(i, &t) == ESP_OK);
+			}
+			us = SIM.bus_us - us;
+			read_us = us / n;
+			printf("  %6d %4d  %17.2f  %20.2f\n", n, bits,
+					n * 1e6 / (ds18b20_conversion_ms() * 1000.0 + us),
+					1e6 / (ds18b20_conversion_ms() * 1000.0 + read_us));
+		}
+	}
+}
+
+int main(void)
+{
+	test_empty();
+	test_single();
+	test_resolution();
+	test_search();
+	test_multi();
+	test_crc();
+	bench();
+	return TEST_END("ds18b20");
+}
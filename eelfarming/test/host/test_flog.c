@@ -0,0 +1,298 @@
+/*
+ * Host test of the flash log on a NOR flash emulator
+ *
+ * Programming only clears bits, erases work on 4 KB sectors. Every
+ * operation advances the model clock by its typical time, so the times the
+ * log measures (recovery, erase stall) are the ones of the flash.
+ *
+ * */
+#include <stdlib.h>
+
+#include "test.h"
+#include "flog.h"
+
+#define EMU_SIZE		(960 * 1024)	/*The flog partition*/
+#define EMU_READ_MBS	10				/*SPI read rate*/
+#define EMU_PROG_US		700				/*256 byte page program*/
+#define EMU_ERASE_US	45000			/*4 KB sector erase*/
+
+int64_t TEST_now_us;
+
+typedef struct {
+	flog_flash_t flash;
+	uint8_t mem[EMU_SIZE];
+	uint64_t programmed;
+	uint64_t read;
+	uint32_t erases;
+	uint32_t erases_outside;	/*Erases that started outside the window of the erase job*/
+	int cut;					/*Power is off, every operation fails*/
+	long cut_after;				/*Page writes until the power fails while writing, -1 never*/
+} emu_t;
+
+static emu_t EMU;
+
+/*Erase job window in the 1 s period, as in main*/
+#define ERASE_PHASE_MS	900
+#define ERASE_WINDOW_MS	40
+
+static esp_err_t emu_read(flog_flash_t *flash, size_t addr, void *data, size_t len)
+{
+	emu_t *e = (emu_t *)flash;
+
+	memcpy(data, &e->mem[addr], len);
+	e->read += len;
+	TEST_now_us += len / EMU_READ_MBS;
+	return ESP_OK;
+}
+
+static esp_err_t emu_write(flog_flash_t *flash, size_t addr, const void *data, size_t len)
+{
+	emu_t *e = (emu_t *)flash;
+	const uint8_t *p = data;
+
+	if (e->cut) {
+		return ESP_FAIL;
+	}
+	if (e->cut_after >= 0 && e->cut_after-- == 0) {
+		/*torn write: part of the page with random bits*/
+		for (size_t i = 0; i < len / 2; i++) {
+			e->mem[addr + i] &= p[i] ^ (rand() & 0xFF);
+		}
+		e->cut = 1;
+		return ESP_FAIL;
+	}
+	for (size_t i = 0; i < len; i++) {
+		e->mem[addr + i] &= p[i];
+	}
+	e->programmed += len;
+	TEST_now_us += EMU_PROG_US;
+	return ESP_OK;
+}
+
+static esp_err_t emu_erase(flog_flash_t *flash, size_t addr, size_t len)
+{
+	emu_t *e = (emu_t *)flash;
+	uint32_t phase = (TEST_now_us / 1000) % 1000;
+
+	if (e->cut) {
+		return ESP_FAIL;
+	}
+	CHECK(addr % FLOG_SECTOR_L == 0 && len % FLOG_SECTOR_L == 0);
+	if (phase < ERASE_PHASE_MS || phase >= ERASE_PHASE_MS + ERASE_WINDOW_MS) {
+		e->erases_outside++;
+	}
+	memset(&e->mem[addr], 0xFF, len);
+	e->erases += len / FLOG_SECTOR_L;
+	TEST_now_us += (int64_t)len / FLOG_SECTOR_L * EMU_ERASE_US;
+	return ESP_OK;
+}
+
+static void emu_init(emu_t *e)
+{
+	memset(e, 0, sizeof(*e));
+	memset(e->mem, 0xFF, sizeof(e->mem));
+	e->flash.size = EMU_SIZE;
+	e->flash.read = emu_read;
+	e->flash.write = emu_write;
+	e->flash.erase = emu_erase;
+	e->cut_after = -1;
+}
+
+/*A sample record of main*/
+typedef struct __attribute__((packed)) {
+	uint8_t ch;
+	uint32_t ms;
+	float value;
+} rec_t;
+
+static flog_t LOG;
+
+/*Log secs seconds of 4 channels at 1 Hz the way the firmware does, with or without the erase job*/
+static void run(uint32_t *seq, long secs, int erase_job)
+{
+	for (long s = 0; s < secs; s++) {
+		int64_t start = (TEST_now_us / 1000000 + 1) * 1000000;
+
+		for (int ch = 0; ch < 4; ch++) {
+			rec_t r = { ch, (*seq)++, ch * 1.5f };
+			TEST_now_us = start + ch * 250000;
+			CHECK(flog_append(&LOG, 2, &r, sizeof(r)) == ESP_OK);
+			if (LOG.full > 0) {
+				flog_flush(&LOG, false);
+			}
+		}
+		TEST_now_us = start + ERASE_PHASE_MS * 1000;
+		if (erase_job) {
+			flog_erase_ahead(&LOG, ERASE_WINDOW_MS);
+			flog_flush(&LOG, false);
+		}
+		if (s % CONFIG_FLOG_FLUSH_S == 0) {
+			flog_flush(&LOG, true);
+		}
+	}
+}
+
+/*All records from the oldest on are consecutive, returns their number*/
+static long read_back(flog_t *log, uint32_t *last)
+{
+	flog_cursor_t c = { .seg = -1 };
+	uint8_t type;
+	rec_t r;
+	long n = 0;
+
+	while (flog_read(log, &c, &type, &r, sizeof(r)) > 0) {
+		if (type != 2 || (n > 0 && r.ms != *last + 1)) {
+			return -1;
+		}
+		*last = r.ms;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * One day with the erase job, every erase falls into its window. Right
+ * after boot the first segment is needed before the job could erase all of
+ * it, that minute is left out.
+ *
+ * */
+static void test_day(void)
+{
+	flog_stats_t st;
+	uint32_t seq = 0, last = 0, late, outside, timed;
+	double t;
+	long n;
+
+	emu_init(&EMU);
+	TEST_now_us = 0;
+	CHECK(flog_open(&LOG, &EMU.flash) == ESP_OK);
+	run(&seq, 60, 1);
+	late = LOG.stats.late;
+	outside = EMU.erases_outside;
+	timed = LOG.stats.records;
+	t = test_us();
+	run(&seq, 86400 - 60, 1);
+	t = test_us() - t;
+	flog_flush(&LOG, true);
+	flog_stats(&LOG, &st);
+
+	CHECK(st.dropped == 0 && st.errors == 0);
+	CHECK(st.erases > 2 * LOG.segments);
+	CHECK(st.late == late && EMU.erases_outside == outside);
+	CHECK(st.stall_max_us == EMU_ERASE_US);
+	n = read_back(&LOG, &last);
+	CHECK(n > 0 && last == seq - 1);
+	printf("  day: %u records, %.2f programmed bytes per record byte, %.0f records/s on the host\n",
+			st.records, (double)EMU.programmed / st.payload, (st.records - timed) / t * 1e6);
+	printf("  day: %u segments reused, %u sectors erased ahead, %u late, longest stall %u us\n",
+			st.erases, st.ahead, st.late, st.stall_max_us);
+	printf("  day: %ld records readable, %.1f h of 4 channels at 1 Hz\n", n, n / 4 / 3600.0);
+}
+
+/*Without the job, or with a request the writer got to too late, the writer erases on its own*/
+static void test_no_job(void)
+{
+	flog_stats_t st;
+	uint32_t seq = 0, last = 0;
+
+	emu_init(&EMU);
+	TEST_now_us = 0;
+	flog_open(&LOG, &EMU.flash);
+	run(&seq, 4 * 3600, 0);
+	flog_flush(&LOG, true);
+	flog_stats(&LOG, &st);
+	CHECK(st.ahead == 0 && st.late == st.erases * FLOG_SEG_SECTORS && EMU.erases_outside > 0);
+	CHECK(read_back(&LOG, &last) > 0 && last == seq - 1);
+
+	flog_erase_ahead(&LOG, ERASE_WINDOW_MS);
+	TEST_now_us += (ERASE_WINDOW_MS + 1) * 1000;
+	flog_flush(&LOG, false);
+	CHECK(LOG.erased == 0);
+	flog_erase_ahead(&LOG, ERASE_WINDOW_MS);
+	flog_flush(&LOG, false);
+	CHECK(LOG.erased == 1);
+}
+
+/*Boot reads the segment headers and the newest segment only*/
+static void test_recovery(void)
+{
+	flog_t log;
+	uint32_t seq = 0, last = 0;
+	uint64_t read;
+
+	emu_init(&EMU);
+	TEST_now_us = 0;
+	flog_open(&LOG, &EMU.flash);
+	run(&seq, 3 * 3600, 1);
+	flog_flush(&LOG, true);
+
+	EMU.read = 0;
+	CHECK(flog_open(&log, &EMU.flash) == ESP_OK);
+	read = EMU.read;
+	CHECK(log.seg == LOG.seg && log.page == LOG.page);
+	CHECK(read_back(&log, &last) > 0 && last == seq - 1);
+	printf("  recovery: %llu bytes read, %u us at %d MB/s\n", (unsigned long long)read,
+			log.stats.recovery_us, EMU_READ_MBS);
+}
+
+/*ms of the last record*/
+static uint32_t read_last(flog_t *log)
+{
+	flog_cursor_t c = { .seg = -1 };
+	uint8_t type;
+	rec_t r = { 0, 0xFFFFFFFF, 0 };
+
+	while (flog_read(log, &c, &type, &r, sizeof(r)) > 0) {
+	}
+	return r.ms;
+}
+
+/*Power fails while a page is written, the log recovers and goes on*/
+static void test_power_cut(void)
+{
+	uint32_t seq = 0, last;
+	int bad = 0;
+
+	emu_init(&EMU);
+	TEST_now_us = 0;
+	flog_open(&LOG, &EMU.flash);
+	srand(1);
+	for (int trial = 0; trial < 200; trial++) {
+		EMU.cut_after = rand() % 40;
+		for (long i = 0; i < 5000 && !EMU.cut; i++) {
+			rec_t r = { 0, seq++, 0 };
+			flog_append(&LOG, 2, &r, sizeof(r));
+			if (LOG.full > 0) {
+				flog_flush(&LOG, false);
+			}
+		}
+		EMU.cut = 0;
+		EMU.cut_after = -1;
+		flog_open(&LOG, &EMU.flash);
+
+		/*the records left are in order, a record appended now is the last one*/
+		flog_cursor_t c = { .seg = -1 };
+		uint8_t type;
+		rec_t r, end = { 9, seq, 1 };
+		long n = 0;
+		last = 0;
+		while (flog_read(&LOG, &c, &type, &r, sizeof(r)) > 0) {
+			bad += (type != 2) || (n++ > 0 && r.ms <= last);
+			last = r.ms;
+		}
+		flog_append(&LOG, 2, &end, sizeof(end));
+		flog_flush(&LOG, true);
+		bad += (read_last(&LOG) != seq);
+		seq++;
+	}
+	CHECK(bad == 0);
+}
+
+int main(void)
+{
+	test_day();
+	test_no_job();
+	test_recovery();
+	test_power_cut();
+	return TEST_END("flog");
+}
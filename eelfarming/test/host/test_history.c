@@ -0,0 +1,185 @@
+/*
+ * Host test of the sensor history, across the 49.7 day uptime wrap, and
+ * bytes per sample, appends/s and samples/s of a walk once the pool is
+ * reused. A week at 1 Hz is drawn in 1000 points the way cmd:10 does.
+ * The pool is larger than the device's so the week fits.
+ *
+ * */
+#include <stdlib.h>
+#include <math.h>
+
+#include "test.h"
+#include "history.h"
+
+int64_t TEST_now_us;
+const uint8_t TM_CH_DECIMALS[TM_CH_MAX] = { 2, 1, 2, 2 };
+
+#define N		4000
+#define STEP	1000	/*ms, sensors run at 1 Hz*/
+#define BENCH_N	1000000
+#define BUDGET	(1024 * 1024)
+#define WEEK_S	(7 * 86400)
+#define WEEK_PTS	1000
+#define CHUNK_PTS	28		/*Points of a cmd:10 chunk*/
+
+static uint32_t T[N];
+static float V[N];
+
+/*Samples of the temperature channel from start, with a few ms of jitter*/
+static void fill(uint32_t start)
+{
+	for (int i = 0; i < N; i++) {
+		T[i] = start + i * STEP + rand() % 7;
+		V[i] = 20 + 5 * sinf(i / 300.0f) + (rand() % 100) / 100.0f;
+		V[i] = roundf(V[i] * 100) / 100;
+		hist_append_at(TM_CH_TEMPERATURE, T[i], V[i]);
+	}
+}
+
+/*Walk from..to, every sample in order, times within HIST_RES_MS, values as stored*/
+static int walk(uint32_t from, uint32_t to, int first, int count)
+{
+	hist_iter_t it;
+	hist_sample_t s[16];
+	int n = 0, k, bad = 0;
+
+	hist_iter_init(&it, TM_CH_TEMPERATURE, from, to);
+	while ((k = hist_iter_next(&it, s, 16)) > 0) {
+		for (int i = 0; i < k; i++, n++) {
+			int j = first + n;
+			bad += (j >= N || (int32_t)(T[j] - s[i].ms) < 0 || (int32_t)(T[j] - s[i].ms) >= HIST_RES_MS
+					|| fabsf(s[i].value - V[j]) > 0.001f);
+		}
+	}
+	return (bad == 0 && n == count) ? 0 : -1;
+}
+
+/*Min/max buckets of the whole range, each bucket has the extremes of its samples*/
+static int minmax(uint32_t from, uint32_t to, uint32_t w)
+{
+	hist_sample_t out[64];
+	int32_t bucket = 0;
+	int points = 0, k;
+
+	while (bucket >= 0 && (k = hist_minmax(TM_CH_TEMPERATURE, from, to, w, &bucket, out, 64)) > 0) {
+		for (int i = 1; i < k; i++) {
+			if ((int32_t)(out[i].ms - out[i - 1].ms) <= 0 || (out[i].ms - from) / w < (out[i - 1].ms - from) / w) {
+				return -1;
+			}
+		}
+		points += k;
+	}
+	return points;
+}
+
+/*Points of from..to drawn in pts points, there are samples every second*/
+static int drawn(uint32_t from, uint32_t to, int pts)
+{
+	uint32_t w = hist_bucket_ms(from, to, pts);
+	int n = minmax(from, to, w);
+
+	return (n > 0 && n <= pts && (int)((to - from) / w + 1) * 2 == n) ? n : -1;
+}
+
+/*A slow drift with a few hundredths of noise, like the dissolved oxygen probe*/
+static float sensor(uint32_t s)
+{
+	return roundf((8 + 2 * sinf(s / 13750.0f) + ((s * 2654435761u) >> 28) * 0.01f) * 100) / 100;
+}
+
+/*A week of the pH channel with one spike, every chunk of 1000 points as cmd:10 asks them*/
+static void bench_week(void)
+{
+	uint32_t to = WEEK_S * STEP, w = hist_bucket_ms(0, to, WEEK_PTS), n = 0;
+	hist_sample_t out[CHUNK_PTS];
+	int32_t bucket;
+	float peak;
+	double t, best = 1e9;
+
+	for (uint32_t i = 0; i < WEEK_S; i++) {
+		hist_append_at(TM_CH_PH, i * STEP, (i == WEEK_S / 3) ? 14 : 7 + sensor(i) / 10);
+	}
+	for (int rep = 0; rep < 10; rep++) {
+		t = test_us();
+		bucket = 0;
+		n = 0;
+		peak = 0;
+		while (bucket >= 0) {
+			int k = hist_minmax(TM_CH_PH, 0, to, w, &bucket, out, CHUNK_PTS);
+
+			for (int i = 0; i < k; i++) {
+				peak = (out[i].value > peak) ? out[i].value : peak;
+			}
+			n += k;
+		}
+		t = test_us() - t;
+		best = (t < best) ? t : best;
+	}
+	CHECK(n <= WEEK_PTS && n > WEEK_PTS - 4 && peak == 14);
+	printf("  week %u samples in %u points of %u s, %5.2f ms, %5.1f Msamples/s\n",
+			WEEK_S, n, w / 1000, best / 1e3, WEEK_S / best);
+}
+
+/*Appends at 1 Hz into a full pool, then walks of all the samples it holds*/
+static void bench(void)
+{
+	hist_sample_t s[64];
+	hist_stats_t st;
+	hist_iter_t it;
+	uint32_t n = 0, last = 0;
+	double t[3];
+	int k;
+
+	t[0] = test_us();
+	for (uint32_t i = 0; i < BENCH_N; i++) {
+		hist_append_at(TM_CH_DO, i * STEP, sensor(i));
+	}
+	t[1] = test_us();
+	for (int rep = 0; rep < 10; rep++) {
+		hist_iter_init(&it, TM_CH_DO, 0, BENCH_N * STEP);
+		while ((k = hist_iter_next(&it, s, 64)) > 0) {
+			n += k;
+			last = s[k - 1].ms;
+		}
+	}
+	t[2] = test_us();
+	hist_stats(&st);
+	CHECK(st.evicted > 0 && n / 10 <= st.samples && last == (BENCH_N - 1) * STEP);
+	printf("  pool %4.2f B/sample (%u samples in %u blocks), append %3.0f ns, walk %5.1f Msamples/s\n",
+			(double)st.bytes / st.samples, st.samples, st.used, (t[1] - t[0]) * 1e3 / BENCH_N, n / (t[2] - t[1]));
+}
+
+int main(void)
+{
+	uint32_t start = 0u - (N / 2) * STEP + STEP / 2;	/*half the samples before the wrap*/
+	uint32_t end = start + N * STEP;				/*wrapped*/
+	uint32_t w = N * STEP / 100;
+
+	CHECK(hist_init(BUDGET) > TM_CH_MAX);
+	srand(2);
+	fill(start);
+	CHECK(end < start);
+
+	/*whole range, and the parts before and after the wrap*/
+	CHECK(walk(start, end, 0, N) == 0);
+	CHECK(walk(start, UINT32_MAX, 0, N / 2) == 0);
+	CHECK(walk(0, end, N / 2, N / 2) == 0);
+	CHECK(walk(start + (N / 4) * STEP + 500, start + (3 * N / 4) * STEP, N / 4 + 1, N / 2) == 0);
+
+	/*100 buckets, two points each, in time order across the wrap*/
+	CHECK(minmax(start, end, w) == 200);
+	CHECK(minmax(start - 2 * w, end, w) == 200);
+	CHECK(minmax(start + w / 2, end, w) == 200);
+
+	/*never more points than asked, ranges of whole buckets included*/
+	for (int pts = 2; pts <= 64; pts++) {
+		CHECK(drawn(start, start + (N - 1) * STEP, pts) > 0);
+		CHECK(drawn(start, start + (pts / 2) * 10 * STEP, pts) > 0);
+	}
+	CHECK(drawn(start, start + 3500 * STEP, 100) == 100);
+	CHECK(drawn(start, end - STEP, 500) == 500);
+
+	bench_week();
+	bench();
+	return TEST_END("history");
+}
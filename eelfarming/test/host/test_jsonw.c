@@ -0,0 +1,214 @@
+/*
+ * Host test of the JSON writer, and time and peak heap of a cmd:1 answer
+ * written with it against the same answer printed by cJSON.
+ *
+ * */
+#include <stdlib.h>
+#include <malloc.h>
+#include <math.h>
+
+#include "test.h"
+#include "jsonw.h"
+#include "cJSON.h"
+
+#define BENCH_N		1000000
+#define CH_N		4
+
+static const char *const NAMES[CH_N] = { "te_m", "di_m", "ph_m", "do_m" };
+static const jw_key_t KEYS[CH_N] = { JW_KEY_INIT("te_m"), JW_KEY_INIT("di_m"), JW_KEY_INIT("ph_m"), JW_KEY_INIT("do_m") };
+static const uint8_t DECIMALS[CH_N] = { 2, 1, 2, 2 };
+static const float VALUES[CH_N] = { 25.5f, 103.2f, 7.08f, 8.45f };
+static const uint32_t AGES[CH_N] = { 120, 370, 620, 870 };
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void __real_free(void *p);
+
+static size_t HEAP_live, HEAP_peak;
+static volatile uint32_t sink;
+
+void *__wrap_malloc(size_t size)
+{
+	void *p = __real_malloc(size);
+
+	HEAP_live += (p != NULL) ? malloc_usable_size(p) : 0;
+	HEAP_peak = (HEAP_live > HEAP_peak) ? HEAP_live : HEAP_peak;
+	return p;
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	void *p = __real_calloc(n, size);
+
+	HEAP_live += (p != NULL) ? malloc_usable_size(p) : 0;
+	HEAP_peak = (HEAP_live > HEAP_peak) ? HEAP_live : HEAP_peak;
+	return p;
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+	HEAP_live -= (p != NULL) ? malloc_usable_size(p) : 0;
+	p = __real_realloc(p, size);
+	HEAP_live += (p != NULL) ? malloc_usable_size(p) : 0;
+	HEAP_peak = (HEAP_live > HEAP_peak) ? HEAP_live : HEAP_peak;
+	return p;
+}
+
+void __wrap_free(void *p)
+{
+	HEAP_live -= (p != NULL) ? malloc_usable_size(p) : 0;
+	__real_free(p);
+}
+
+/*Write into buf and return jw_end, buf is filled with guard bytes first*/
+static int write_all(char *buf, size_t cap, size_t guard)
+{
+	jw_t w;
+
+	memset(buf, '#', cap + guard);
+	jw_init(&w, buf, cap);
+	jw_obj(&w, NULL);
+	jw_int(&w, JW_KEY("i"), -42);
+	jw_uint(&w, JW_KEY("u"), 4294967295u);
+	jw_float(&w, JW_KEY("f"), 25.5f, 2);
+	jw_arr(&w, JW_KEY("a"));
+	jw_int(&w, NULL, 1);
+	jw_null(&w, NULL);
+	jw_str(&w, NULL, "x");
+	jw_close(&w);
+	jw_obj(&w, JW_KEY("o"));
+	jw_raw(&w, JW_KEY("r"), "[1]", 3);
+	return jw_end(&w);
+}
+
+static void test_values(void)
+{
+	char buf[128];
+	int len = write_all(buf, 100, 0);
+
+	CHECK(len > 0);
+	CHECK_STR(buf, "{\"i\":-42,\"u\":4294967295,\"f\":25.5,\"a\":[1,null,\"x\"],\"o\":{\"r\":[1]}}");
+}
+
+static void test_float(void)
+{
+	static const struct {
+		float v;
+		uint8_t d;
+		const char *s;
+	} cases[] = {
+		{ 0.0f, 2, "0" }, { 1.0f, 2, "1" }, { -0.5f, 1, "-0.5" }, { 0.125f, 2, "0.13" },
+		{ 19.999f, 2, "20" }, { -3.07f, 2, "-3.07" }, { 100.0f, 0, "100" },
+		{ NAN, 2, "null" }, { INFINITY, 1, "null" },
+	};
+	char buf[32];
+	jw_t w;
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		jw_init(&w, buf, sizeof(buf));
+		jw_float(&w, NULL, cases[i].v, cases[i].d);
+		CHECK(jw_end(&w) > 0);
+		CHECK_STR(buf, cases[i].s);
+	}
+}
+
+static void test_escape(void)
+{
+	char buf[64];
+	jw_t w;
+
+	jw_init(&w, buf, sizeof(buf));
+	jw_str(&w, NULL, "a\"b\\c\n\x01");
+	CHECK(jw_end(&w) > 0);
+	CHECK_STR(buf, "\"a\\\"b\\\\c\\u000a\\u0001\"");
+}
+
+/*Every buffer size short of the output must fail without writing past cap*/
+static void test_overflow(void)
+{
+	char full[128], buf[128];
+	int len = write_all(full, 100, 0);
+
+	for (int cap = 0; cap < len; cap++) {
+		CHECK(write_all(buf, cap, 8) == -1);
+		for (int i = cap; i < cap + 8; i++) {
+			CHECK(buf[i] == '#');
+		}
+	}
+	/*exact fit returns the length, there is no room for the terminator*/
+	CHECK(write_all(buf, len, 8) == len);
+	CHECK(memcmp(buf, full, len) == 0 && buf[len] == '#');
+}
+
+/*The answer of cmd:1 as cmd_meters writes it*/
+static int meters_jw(char *buf, size_t cap)
+{
+	jw_t w;
+
+	jw_init(&w, buf, cap);
+	jw_obj(&w, NULL);
+	for (int ch = 0; ch < CH_N; ch++) {
+		jw_float(&w, &KEYS[ch], VALUES[ch], DECIMALS[ch]);
+	}
+	jw_uint(&w, JW_KEY("seq"), 1234);
+	jw_obj(&w, JW_KEY("age"));
+	for (int ch = 0; ch < CH_N; ch++) {
+		jw_uint(&w, &KEYS[ch], AGES[ch]);
+	}
+	jw_close(&w);
+	return jw_end(&w);
+}
+
+/*The same answer as a cJSON tree printed with cJSON_Print, the way it was sent before the writer*/
+static int meters_cjson(char *buf, size_t cap)
+{
+	cJSON *res = cJSON_CreateObject(), *age = cJSON_CreateObject();
+	char *p;
+	int len;
+
+	for (int ch = 0; ch < CH_N; ch++) {
+		cJSON_AddNumberToObject(res, NAMES[ch], VALUES[ch]);
+	}
+	cJSON_AddNumberToObject(res, "seq", 1234);
+	for (int ch = 0; ch < CH_N; ch++) {
+		cJSON_AddNumberToObject(age, NAMES[ch], AGES[ch]);
+	}
+	cJSON_AddItemToObject(res, "age", age);
+	p = cJSON_Print(res);
+	len = snprintf(buf, cap, "%s", p);
+	free(p);
+	cJSON_Delete(res);
+	return len;
+}
+
+/*ns per answer and the heap it needed at most, the buffer is on the stack*/
+static size_t bench(const char *name, int (*fn)(char *, size_t))
+{
+	char buf[256];
+	size_t base = HEAP_live;
+	int len;
+	double t;
+
+	HEAP_peak = base;
+	len = fn(buf, sizeof(buf));
+	CHECK(len > 0 && HEAP_live == base);
+	t = test_us();
+	for (int k = 0; k < BENCH_N; k++) {
+		sink += fn(buf, sizeof(buf));
+	}
+	t = test_us() - t;
+	printf("  %-6s %3d B, %4.0f ns/answer, peak heap %4zu B\n", name, len, t * 1e3 / BENCH_N, HEAP_peak - base);
+	return HEAP_peak - base;
+}
+
+int main(void)
+{
+	test_values();
+	test_float();
+	test_escape();
+	test_overflow();
+	CHECK(bench("jw", meters_jw) == 0);
+	bench("cJSON", meters_cjson);
+	return TEST_END("jsonw");
+}
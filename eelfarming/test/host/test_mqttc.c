@@ -0,0 +1,205 @@
+/*
+ * Host test of the MQTT client against a minimal broker on the loopback
+ * interface: packet framing, the in-flight window and the resend of the
+ * QoS 1 packets after a connection lost in the middle of a send.
+ *
+ * */
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "lwip/sockets.h"
+
+#include "test.h"
+#include "mqttc.h"
+
+int64_t TEST_now_us;
+
+#define TOPIC		"t/s"
+#define PKT_MAX		64
+
+/*PUBLISH packets the broker got*/
+typedef struct {
+	uint8_t type;		/*First byte, flags included*/
+	uint16_t id;		/*0 for QoS 0*/
+	uint32_t rem;		/*Remaining length*/
+} pkt_t;
+
+static pkt_t PKT[PKT_MAX];
+static int npkt;
+static int connects;
+static volatile int broker_ack = 1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int read_all(int s, uint8_t *p, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = recv(s, p, len, 0);
+
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*Next packet of the client into p, returns its remaining length or -1 once closed*/
+static int read_packet(int s, uint8_t *p, size_t max)
+{
+	uint32_t rem = 0;
+	uint8_t b;
+	int shift = 0;
+
+	if (read_all(s, p, 1) != 0) {
+		return -1;
+	}
+	do {
+		if (read_all(s, &b, 1) != 0) {
+			return -1;
+		}
+		rem |= (b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	if (rem + 1 > max || read_all(s, p + 1, rem) != 0) {
+		return -1;
+	}
+	return rem;
+}
+
+/*Accepts one connection after the other, answers CONNECT and acks QoS 1 while broker_ack is set*/
+static void *broker(void *arg)
+{
+	static uint8_t p[2048];
+	int ls = *(int *)arg, s, rem;
+
+	while ((s = accept(ls, NULL, NULL)) >= 0) {
+		while ((rem = read_packet(s, p, sizeof(p))) >= 0) {
+			if ((p[0] & 0xF0) == 0x10) {
+				uint8_t ack[4] = { 0x20, 2, connects > 0, 0 };
+
+				connects++;
+				send(s, ack, sizeof(ack), 0);
+			} else if ((p[0] & 0xF0) == 0x30) {
+				int tl = (p[1] << 8) | p[2];
+				uint16_t id = (p[0] & 0x06) ? (p[3 + tl] << 8) | p[4 + tl] : 0;
+				uint8_t ack[4] = { 0x40, 2, id >> 8, id & 0xFF };
+
+				pthread_mutex_lock(&lock);
+				if (npkt < PKT_MAX) {
+					PKT[npkt++] = (pkt_t){ p[0], id, rem };
+				}
+				pthread_mutex_unlock(&lock);
+				if (id != 0 && broker_ack) {
+					send(s, ack, sizeof(ack), 0);
+				}
+			}
+		}
+		close(s);
+	}
+	return NULL;
+}
+
+/*Wait until the broker got n packets*/
+static int wait_pkts(int n)
+{
+	for (int i = 0; i < 2000; i++) {
+		int got;
+
+		pthread_mutex_lock(&lock);
+		got = npkt;
+		pthread_mutex_unlock(&lock);
+		if (got >= n) {
+			return 0;
+		}
+		usleep(1000);
+	}
+	return -1;
+}
+
+/*Poll until the window is empty again*/
+static int wait_acks(mqttc_t *c)
+{
+	for (int i = 0; i < 200 && mqttc_window(c) < MQTTC_INFLIGHT_MAX; i++) {
+		if (mqttc_poll(c, 10) != ESP_OK) {
+			return -1;
+		}
+	}
+	return (mqttc_window(c) == MQTTC_INFLIGHT_MAX) ? 0 : -1;
+}
+
+int main(void)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t addr_l = sizeof(addr);
+	mqttc_config_t cfg = { .host = "127.0.0.1", .client_id = "eel-test", .keepalive_s = 0, .clean_session = false };
+	static char data[MQTTC_MSG_L];
+	mqttc_stats_t st;
+	pthread_t th;
+	mqttc_t c;
+	bool present;
+	int ls, n;
+
+	/*a send on the closed socket fails with EPIPE*/
+	signal(SIGPIPE, SIG_IGN);
+	memset(data, 'x', sizeof(data));
+	ls = socket(AF_INET, SOCK_STREAM, 0);
+	CHECK(bind(ls, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(ls, 1) == 0);
+	CHECK(getsockname(ls, (struct sockaddr *)&addr, &addr_l) == 0);
+	cfg.port = ntohs(addr.sin_port);
+	pthread_create(&th, NULL, broker, &ls);
+
+	CHECK(mqttc_init(&c, &cfg) == ESP_OK);
+	CHECK(mqttc_connect(&c, &present) == ESP_OK && !present);
+
+	/*QoS 0 retained, two bytes of remaining length*/
+	CHECK(mqttc_publish(&c, TOPIC, data, 200, 0, true) == ESP_OK);
+	CHECK(wait_pkts(1) == 0);
+	CHECK(PKT[0].type == 0x31 && PKT[0].id == 0 && PKT[0].rem == 2 + 3 + 200);
+
+	/*QoS 1, identifiers in order, the window empties with the acks*/
+	for (int i = 0; i < 3; i++) {
+		CHECK(mqttc_publish(&c, TOPIC, data, 100, 1, false) == ESP_OK);
+	}
+	CHECK(wait_pkts(4) == 0);
+	CHECK(wait_acks(&c) == 0);
+	for (int i = 1; i < 4; i++) {
+		CHECK(PKT[i].type == 0x32 && PKT[i].id == i && PKT[i].rem == 2 + 3 + 2 + 100);
+	}
+
+	/*connection lost in a send: the QoS 1 packet keeps its slot, QoS 0 is gone*/
+	broker_ack = 0;
+	CHECK(mqttc_publish(&c, TOPIC, data, 100, 1, false) == ESP_OK);
+	CHECK(mqttc_publish(&c, TOPIC, data, 100, 1, false) == ESP_OK);
+	CHECK(wait_pkts(6) == 0);
+	shutdown(c.sock, SHUT_WR);
+	CHECK(mqttc_publish(&c, TOPIC, data, 100, 1, false) == MQTTC_ERR_QUEUED);
+	CHECK(c.sock < 0);
+	CHECK(mqttc_publish(&c, TOPIC, data, 100, 0, false) == ESP_FAIL);
+	CHECK(mqttc_publish(&c, TOPIC, data, 100, 1, false) == ESP_FAIL);
+	CHECK(mqttc_window(&c) == MQTTC_INFLIGHT_MAX - 3);
+
+	/*all three again after the reconnect, in order and flagged DUP*/
+	broker_ack = 1;
+	CHECK(mqttc_connect(&c, &present) == ESP_OK && present);
+	CHECK(wait_pkts(9) == 0);
+	for (int i = 6; i < 9; i++) {
+		CHECK(PKT[i].type == (0x32 | 0x08) && PKT[i].id == i - 2);
+	}
+	CHECK(wait_acks(&c) == 0);
+	mqttc_stats(&c, &st);
+	CHECK(st.resent == 3 && st.acked == 6);
+
+	/*full window, too long*/
+	broker_ack = 0;
+	for (n = 0; mqttc_publish(&c, TOPIC, data, 100, 1, false) == ESP_OK; n++) {
+	}
+	CHECK(n == MQTTC_INFLIGHT_MAX);
+	CHECK(mqttc_publish(&c, TOPIC, data, 100, 1, false) == ESP_ERR_NO_MEM);
+	CHECK(mqttc_publish(&c, TOPIC, data, MQTTC_MSG_L - 4, 0, false) == ESP_ERR_INVALID_SIZE);
+	CHECK(wait_pkts(9 + MQTTC_INFLIGHT_MAX) == 0 && PKT[9].id == 7);
+
+	mqttc_close(&c);
+	return TEST_END("mqttc");
+}
@@ -0,0 +1,161 @@
+/*
+ * Host test of the telemetry outbox: WiFi outages of a device sampling
+ * four channels at 1 Hz, replayed to a client that loses frames on the way.
+ * The device clock crosses the 49.7 day wrap during the outages.
+ *
+ * */
+#include <stdlib.h>
+#include <math.h>
+
+#include "test.h"
+#include "history.h"
+#include "outbox.h"
+
+int64_t TEST_now_us;
+const uint8_t TM_CH_DECIMALS[TM_CH_MAX] = { 2, 1, 2, 2 };
+
+#define POOL_KB		128
+#define HOUR_MS		3600000u
+#define WIN			4		/*Frames per request, as cmd_replay*/
+#define FRAME_L		4096	/*CONFIG_OUTBOX_FRAME_L*/
+#define LOSS_PCT	5		/*Frames lost mid replay*/
+#define TAKEN_MAX	(24 * 3600 * TM_CH_MAX)
+
+static uint32_t T;					/*Device clock, ms*/
+static uint32_t ticks;				/*10 ms ticks since the start, the clock wraps*/
+static uint32_t TAKEN[TAKEN_MAX];	/*Sample times of the outage*/
+static uint32_t taken;
+
+/*
+ * Device running until the clock reaches until: the channels are sampled at
+ * phases 0/250/500/750 ms, all of them at once every 97th second. Values
+ * drift slowly with a few hundredths of noise, like the sensors.
+ *
+ * */
+static void device_run(uint32_t until, int outage)
+{
+	for (; T != until; T += 10, ticks++) {
+		uint32_t s = ticks / 100, ph = ticks % 100 * 10;
+
+		for (int ch = 0; ch < TM_CH_MAX; ch++) {
+			if (ph != ((s % 97 == 0) ? 0 : ch * 250)) {
+				continue;
+			}
+			hist_append_at(ch, T, 20 + ch + 2 * sinf(s / 13750.0f) + ((s * 2654435761u + ch) >> 28) * 0.01f);
+			if (outage && taken < TAKEN_MAX) {
+				TAKEN[taken++] = T;
+			}
+		}
+	}
+}
+
+/*Client state*/
+static uint32_t acked;				/*seq of the last frame received*/
+static uint32_t last;				/*Time of the last sample received*/
+static uint32_t got, dup, misorder, frames, bytes, requests;
+static uint32_t first_in, last_in, in;	/*Samples received of the outage*/
+static uint32_t w0, w1;
+
+/*A batch frame arrives, rows are [dt,ch,value]*/
+static void client_frame(const char *frame)
+{
+	char *p = strstr(frame, "\"base\":");
+	uint32_t base = strtoul(p + 7, NULL, 10);
+
+	for (p = strstr(frame, "\"s\":[") + 5; *p == '['; p++) {
+		uint32_t ms = base + strtoul(p + 1, &p, 10);
+
+		strtoul(p + 1, &p, 10);
+		strtod(p + 1, &p);
+		dup += (acked != 0 && (int32_t)(ms - acked) <= 0);
+		misorder += (got > 0 && (int32_t)(ms - last) < 0);
+		if ((int32_t)(ms - w0) >= 0 && (int32_t)(ms - w1) < 0) {
+			first_in = (in++ == 0) ? ms : first_in;
+			last_in = ms;
+		}
+		last = ms;
+		got++;
+		if (p[1] == ',') {
+			p++;
+		}
+	}
+	acked = strtoul(strstr(frame, "\"seq\":") + 6, NULL, 10);
+}
+
+/*Requests of the client until the device has nothing more, live samples keep coming*/
+static void client_replay(int loss_pct)
+{
+	static char frame[FRAME_L];
+	outbox_t ob;
+	int more = 1, len;
+
+	while (more) {
+		int lost = 0;
+
+		requests++;
+		outbox_init(&ob, acked, T);
+		for (int f = 0; f < WIN; f++) {
+			if ((len = outbox_batch(&ob, frame, sizeof(frame))) <= 0) {
+				break;
+			}
+			if (rand() % 100 < loss_pct) {
+				lost = 1;
+				break;
+			}
+			frames++;
+			bytes += len;
+			client_frame(frame);
+			device_run(T + 20, 0);
+		}
+		more = lost || (len != 0 && outbox_more(&ob));
+	}
+}
+
+/*Outage of the given length, returns the hours of it kept by the history*/
+static double outage(uint32_t ms, int evicted)
+{
+	uint32_t got0;
+
+	w0 = T;
+	taken = 0;
+	device_run(T + ms, 1);
+	w1 = T;
+	got0 = got;
+	in = dup = misorder = frames = bytes = requests = 0;
+	client_replay(LOSS_PCT);
+
+	/*no duplicates, in time order, all of the outage or its newest samples*/
+	CHECK(dup == 0);
+	CHECK(misorder == 0);
+	CHECK(in > 0 && last_in == TAKEN[taken - 1]);
+	CHECK(evicted ? in < taken : in == taken && first_in == TAKEN[0]);
+	printf("  outage %4.1f h: taken %6u replayed %6u, %4u frames in %3u requests, %.1f B/sample\n",
+			ms / (double)HOUR_MS, taken, in, frames, requests, (double)bytes / (got - got0));
+	return (w1 - first_in) / (double)HOUR_MS;
+}
+
+int main(void)
+{
+	hist_stats_t st;
+	double kept;
+
+	CHECK(hist_init(POOL_KB * 1024) > TM_CH_MAX);
+	srand(3);
+
+	/*a minute connected, the client follows, then outages across the wrap*/
+	T = 0u - 2 * HOUR_MS - 60000;
+	device_run(T + 60000, 0);
+	client_replay(0);
+	CHECK(got > 0 && dup == 0);
+
+	outage(1 * HOUR_MS, 0);
+	outage(3 * HOUR_MS, 0);
+	CHECK(T < 3 * HOUR_MS);
+	outage(8 * HOUR_MS, 0);
+	kept = outage(24 * HOUR_MS, 1);
+
+	hist_stats(&st);
+	CHECK(st.evicted > 0);
+	printf("  %u KB of history hold %.1f h of the four channels\n", st.blocks * HIST_BLOCK_L / 1024, kept);
+	return TEST_END("outbox");
+}
@@ -0,0 +1,201 @@
+/*
+ * Host test of the telemetry push against cmd:1 polling: an hour of the four
+ * channels sampled at 1 Hz (phases 0/250/500/750 ms) goes to one dashboard
+ * client. Bytes on the connection, CPU time and age per reading delivered
+ * are compared.
+ *
+ * Every frame is counted as a TCP segment of its own with 40 bytes of
+ * TCP/IP headers, acks are not counted.
+ *
+ * */
+#include <stdlib.h>
+#include <math.h>
+
+#include "test.h"
+#include "cmd.h"
+
+/*the push loop is static, it is compiled into the test*/
+#include "telemetry.c"
+
+int64_t TEST_now_us;
+
+#define CLIENT		1
+#define HOUR_TICKS	(3600 * 100)	/*10 ms ticks*/
+#define TCPIP_L		40				/*IPv4 and TCP header of a segment*/
+#define STD_L		125				/*Longest payload without an extended length*/
+#define POLL_REQ	"{\"cmd\":1}"
+
+static uint32_t frames, bytes, readings;
+static double age_ms;				/*Sum of the age of the readings delivered*/
+static int protocol = -1;			/*Subprotocol of the client*/
+static int64_t sample_us[TM_CH_MAX];	/*Time of the last sample*/
+static float sample[TM_CH_MAX];
+static uint32_t sample_seq;
+static uint32_t tick;					/*10 ms ticks, runs follow each other*/
+
+/*Length of a frame on the wire, client frames are masked*/
+static uint32_t wire_l(size_t len, int masked)
+{
+	return TCPIP_L + 2 + (len > STD_L ? 2 : 0) + (masked ? 4 : 0) + len;
+}
+
+/*WebSocket stand-in, counts what would be sent and the readings in it*/
+err_t WS_write(int client, WS_OPCODES opcode, char *p_data, size_t length, int flags)
+{
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		int in = (opcode == WS_OP_BIN) ? (p_data[2] >> ch) & 1 : strstr(p_data, TM_CH_KEYS[ch]) != NULL;
+
+		if (in) {
+			readings++;
+			age_ms += (TEST_now_us - sample_us[ch]) / 1000.0;
+		}
+	}
+	frames++;
+	bytes += wire_l(length, 0);
+	return ERR_OK;
+}
+
+err_t WS_write_data(int client, char *p_data, size_t length)
+{
+	return WS_write(client, WS_OP_TXT, p_data, length, 0);
+}
+
+int WS_client_protocol(int client)
+{
+	return protocol;
+}
+
+/*Sensor values drift slowly with a few hundredths of noise*/
+static float value(int ch, uint32_t s)
+{
+	return 20 + ch + 2 * sinf(s / 13750.0f) + ((s * 2654435761u + ch) >> 28) * 0.01f;
+}
+
+/*Samples of the tick*/
+static void sample_tick(int publish)
+{
+	uint32_t ph = tick % 100 * 10;
+
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		if (ph == ch * 250) {
+			sample[ch] = value(ch, tick / 100);
+			sample_us[ch] = TEST_now_us;
+			sample_seq++;
+			if (publish) {
+				telemetry_publish(ch, sample[ch]);
+			}
+		}
+	}
+}
+
+/*The answer of cmd:1 as cmd_meters writes it*/
+static void cmd_meters(const cmd_req_t *req, jw_t *res)
+{
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		jw_float(res, &TM_CH_JKEYS[ch], sample[ch], TM_CH_DECIMALS[ch]);
+	}
+	jw_uint(res, JW_KEY("seq"), sample_seq);
+	jw_obj(res, JW_KEY("age"));
+	for (int ch = 0; ch < TM_CH_MAX; ch++) {
+		jw_uint(res, &TM_CH_JKEYS[ch], (TEST_now_us - sample_us[ch]) / 1000);
+	}
+	jw_close(res);
+}
+
+static void report(const char *name, double cpu_us)
+{
+	printf("  %-14s %5u readings %5u frames %6.1f KB/h %5.1f B/reading, CPU %5.2f us/reading %6.2f ms/h, age %3.0f ms\n",
+			name, readings, frames, bytes / 1024.0, (double)bytes / readings, cpu_us / readings, cpu_us / 1000,
+			age_ms / readings);
+}
+
+/*A client polling hz times per second, readings are the samples it had not seen yet*/
+static double run_poll(int hz)
+{
+	char name[32], req[sizeof(POLL_REQ)], res[CMD_RES_L];
+	int64_t seen_us[TM_CH_MAX] = { 0 };
+	double cpu = 0;
+	jw_t w;
+
+	frames = bytes = readings = 0;
+	age_ms = 0;
+	for (uint32_t end = tick + HOUR_TICKS; tick < end; tick++) {
+		TEST_now_us = tick * 10000LL;
+		sample_tick(0);
+		if (tick % (100 / hz) != 100 / hz - 1) {
+			continue;
+		}
+
+		/*request parsed and answered like waiting_req does*/
+		double t = test_us();
+		int len;
+
+		memcpy(req, POLL_REQ, sizeof(req));
+		jw_init(&w, res, sizeof(res));
+		jw_obj(&w, NULL);
+		cmd_dispatch(CLIENT, req, sizeof(req) - 1, &w, NULL, 0);
+		len = jw_end(&w);
+		cpu += test_us() - t;
+
+		CHECK(len > 0);
+		frames += 2;
+		bytes += wire_l(sizeof(req) - 1, 1) + wire_l(len, 0);
+		for (int ch = 0; ch < TM_CH_MAX; ch++) {
+			if (sample_us[ch] != seen_us[ch]) {
+				seen_us[ch] = sample_us[ch];
+				readings++;
+				age_ms += (TEST_now_us - sample_us[ch]) / 1000.0;
+			}
+		}
+	}
+	snprintf(name, sizeof(name), "poll %d Hz", hz);
+	report(name, cpu);
+	return (double)bytes / readings;
+}
+
+/*A client subscribed to all channels, the push task wakes on samples and deadlines*/
+static double run_push(const char *name, int proto, uint32_t min_ms, float th)
+{
+	TickType_t due = portMAX_DELAY;
+	double cpu = 0;
+
+	frames = bytes = readings = 0;
+	age_ms = 0;
+	protocol = proto;
+	CHECK(telemetry_subscribe(CLIENT, TM_CH_ALL, min_ms, th) == 0);
+	for (uint32_t end = tick + HOUR_TICKS; tick < end; tick++) {
+		TEST_now_us = tick * 10000LL;
+		if (tick % 100 * 10 % 250 != 0 && tick < due) {
+			continue;
+		}
+
+		double t = test_us();
+		TickType_t wait;
+
+		sample_tick(1);
+		wait = telemetry_push();
+		cpu += test_us() - t;
+		due = (wait == portMAX_DELAY) ? portMAX_DELAY : tick + wait;
+	}
+	telemetry_unsubscribe(CLIENT, TM_CH_ALL);
+	report(name, cpu);
+	return (double)bytes / readings;
+}
+
+int main(void)
+{
+	double poll, push;
+
+	cmd_register(1, cmd_meters);
+
+	/*polling four times a second still delivers readings up to 250 ms old*/
+	run_poll(1);
+	poll = run_poll(4);
+	push = run_push("push json", -1, 0, 0);
+	CHECK(age_ms == 0);
+	run_push("push binary", BP_PROTOCOL_ID, 0, 0);
+	run_push("push json 0.1", -1, 0, 0.1f);
+	run_push("push json 5 s", -1, 5000, 0);
+	CHECK(push * 2 < poll);
+	return TEST_END("telemetry");
+}
@@ -0,0 +1,689 @@
+/*
+ * Host test of the websocket server: the upgrade request fed in pieces,
+ * rejected requests and subprotocol selection, frames fed to the parser in pieces,
+ * reassembly of fragmented messages, the close status sent on protocol
+ * errors, messages dropped instead of waiting for a buffer or queue slot,
+ * send errors before and after part of a frame went out, the throughput of
+ * 1 KB, 16 KB and 256 KB messages, the frames/s of small commands and the
+ * connections/s from accept to the 101 response.
+ *
+ * The server end of a connection is a client slot on a socket pair, the
+ * test holds the other end. Round trips of 1, 4 and 8 clients run through
+ * ws_server in a thread on the loopback interface, answered by two request
+ * workers.
+ *
+ * */
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "test.h"
+
+/*the parser is static, it is compiled into the test*/
+#include "websocket.c"
+
+int64_t TEST_now_us;
+QueueHandle_t WebSocket_rx_queue;
+
+#define RX_QUEUE_L		64					/*One read holds up to 62 commands*/
+#define BENCH_L			(8 * 1024 * 1024)	/*Bytes per benchmark run*/
+#define WORKERS			2					/*CONFIG_REQ_WORKERS*/
+#define ROUND_TRIPS		20000				/*Requests of each client*/
+#define ANSWER_L		300					/*About a sensor read*/
+#define CLIENTS_MAX		8
+#define COMMAND			"{\"cmd\":1,\"id\":42}"
+#define CONNECTIONS		2000
+
+/*Upgrade request with the key of RFC 6455 1.3, hdr adds headers*/
+#define REQUEST(hdr)	"GET /eel HTTP/1.1\r\nHost: eel\r\nUpgrade: websocket\r\nConnection: keep-alive, Upgrade\r\n" \
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n" hdr "Sec-WebSocket-Version: 13\r\n\r\n"
+#define ACCEPT			"s3pPLMBiTxaQ9kYGzzhZRbK+xOo="
+
+static const char *const PROTOCOLS[] = { "eel-bin.1", "eel-json" };
+
+static const uint8_t MASK[WS_MASK_L] = { 0x37, 0xFA, 0x21, 0x3D };
+static int peer = -1;		/*Client end of the connection*/
+
+/*Client table and buffers as ws_server sets them up*/
+static void server_init(void)
+{
+	ws_pool_init();
+	WebSocket_rx_queue = xQueueCreate(RX_QUEUE_L, sizeof(WebSocket_frame_t));
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		WS_clients[i].sock = -1;
+		WS_clients[i].state = WS_CL_FREE;
+		WS_clients[i].tx_lock = xSemaphoreCreateMutex();
+	}
+}
+
+/*Slot 0 open on a new socket pair, as after the handshake*/
+static ws_client_t *client_open(void)
+{
+	ws_client_t *cl = &WS_clients[0];
+	int sv[2];
+
+	if (cl->state != WS_CL_FREE) {
+		ws_client_close(cl);
+	}
+	if (peer >= 0) {
+		close(peer);
+	}
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	cl->sock = sv[0];
+	peer = sv[1];
+	cl->id = ++WS_last_id;
+	cl->protocol = -1;
+	cl->tx_err = ERR_OK;
+	cl->hdr_l = 0;
+	cl->hdr_need = sizeof(WS_frame_header_t);
+	cl->msg_active = 0;
+	cl->state = WS_CL_OPEN;
+	return cl;
+}
+
+/*Request fed to the handshake parser in pieces, returns the result and the bytes used*/
+static int hs_feed(const char *req, size_t piece, int *protocol, size_t *used)
+{
+	static ws_client_t cl;
+	size_t len = strlen(req), n;
+	int r = 0;
+
+	memset(&cl.hs, 0, sizeof(cl.hs));
+	cl.protocol = -1;
+	*used = 0;
+	for (size_t i = 0; i < len && r == 0; i += piece) {
+		r = ws_hs_feed(&cl, &req[i], (len - i < piece) ? len - i : piece, &n);
+		*used += n;
+	}
+	*protocol = cl.protocol;
+	return r;
+}
+
+/*Request of a loopback connection, returns the client end with the response in resp*/
+static int hs_connect(int ls, const char *req, char *resp, size_t cap, int *r)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_l = sizeof(addr);
+	int s = socket(AF_INET, SOCK_STREAM, 0), n = 0;
+	ws_client_t *cl = NULL;
+
+	getsockname(ls, (struct sockaddr *)&addr, &addr_l);
+	CHECK(connect(s, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	send(s, req, strlen(req), 0);
+	ws_client_accept(ls);
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		if (WS_clients[i].state == WS_CL_HANDSHAKE) {
+			cl = &WS_clients[i];
+		}
+	}
+	*r = -1;
+	if (cl != NULL) {
+		*r = ws_client_handshake(cl);
+		n = recv(s, resp, cap - 1, 0);
+		if (*r < 0 || cl->state != WS_CL_OPEN) {
+			ws_client_close(cl);
+		}
+	}
+	resp[(n > 0) ? n : 0] = 0;
+	return s;
+}
+
+static void test_handshake(void)
+{
+	static const char *const split[] = { REQUEST(""), REQUEST("Sec-WebSocket-Protocol: chat\r\n"), NULL };
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	char req[WS_HS_MAX_L + 64], resp[512];
+	int protocol, ls, c, r;
+	size_t used;
+
+	WS_set_protocols(PROTOCOLS, 2);
+
+	/*header lines split anywhere, data behind the request is left*/
+	for (int k = 0; split[k] != NULL; k++) {
+		for (size_t piece = 1; piece <= 16; piece++) {
+			CHECK(hs_feed(split[k], piece, &protocol, &used) == 1 && used == strlen(split[k]) && protocol == -1);
+		}
+	}
+	snprintf(req, sizeof(req), "%s\x81\x80", REQUEST(""));
+	CHECK(hs_feed(req, sizeof(req), &protocol, &used) == 1 && used == strlen(req) - 2);
+
+	/*first protocol of the client's list that is offered, the first header counts*/
+	CHECK(hs_feed(REQUEST("Sec-WebSocket-Protocol: chat, eel-json, eel-bin.1\r\n"), 5, &protocol, &used) == 1 && protocol == 1);
+	CHECK(hs_feed(REQUEST("Sec-WebSocket-Protocol: eel-bin.1\r\nSec-WebSocket-Protocol: eel-json\r\n"), 64, &protocol, &used) == 1
+			&& protocol == 0);
+	CHECK(hs_feed(REQUEST("Sec-WebSocket-Protocol: eel-bin, eel-json.1\r\n"), 64, &protocol, &used) == 1 && protocol == -1);
+
+	/*bad requests*/
+	CHECK(hs_feed("POST /eel HTTP/1.1\r\n", 64, &protocol, &used) == 400);
+	CHECK(hs_feed("GET /eel HTTP/1.0\r\n", 64, &protocol, &used) == 400);
+	CHECK(hs_feed("GET /eel HTTP/1.1\r\nHost: eel\r\nUpgrade websocket\r\n", 64, &protocol, &used) == 400);
+	CHECK(hs_feed("GET /eel HTTP/1.1\r\nHost: eel\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+			"Sec-WebSocket-Version: 13\r\n\r\n", 64, &protocol, &used) == 400);
+	CHECK(hs_feed("GET /eel HTTP/1.1\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ\r\n", 64, &protocol, &used) == 400);
+	CHECK(hs_feed("GET /eel HTTP/1.1\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==x\r\n", 64, &protocol, &used) == 400);
+	CHECK(hs_feed("GET /eel HTTP/1.1\r\nHost: eel\r\nUpgrade: h2c\r\nConnection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n", 64, &protocol, &used) == 400);
+	CHECK(hs_feed("GET /eel HTTP/1.1\r\nHost: eel\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 8\r\n\r\n", 64, &protocol, &used) == 426);
+	strcpy(req, "GET /eel HTTP/1.1\r\n");
+	while (strlen(req) < WS_HS_MAX_L) {
+		strcat(req, "X-Pad: 0123456789abcdef0123456789abcdef\r\n");
+	}
+	CHECK(hs_feed(req, 64, &protocol, &used) == 400);
+
+	/*responses on a loopback connection*/
+	ls = socket(AF_INET, SOCK_STREAM, 0);
+	CHECK(bind(ls, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(ls, 4) == 0);
+	c = hs_connect(ls, REQUEST("Sec-WebSocket-Protocol: eel-json\r\n"), resp, sizeof(resp), &r);
+	CHECK(r == 0 && strncmp(resp, "HTTP/1.1 101 ", 13) == 0);
+	CHECK(strstr(resp, "\r\nSec-WebSocket-Accept: " ACCEPT "\r\n") != NULL);
+	CHECK(strstr(resp, "\r\nSec-WebSocket-Protocol: eel-json\r\n\r\n") != NULL);
+	CHECK(WS_client_protocol(WS_last_id) == 1);
+	close(c);
+	c = hs_connect(ls, REQUEST(""), resp, sizeof(resp), &r);
+	CHECK(r == 0 && strstr(resp, "Sec-WebSocket-Protocol") == NULL && WS_client_protocol(WS_last_id) == -1);
+	close(c);
+	c = hs_connect(ls, "GET /eel HTTP/1.1\r\nSec-WebSocket-Version: 7\r\n\r\n", resp, sizeof(resp), &r);
+	CHECK(r < 0 && strcmp(resp, WS_srv_426) == 0);
+	close(c);
+	c = hs_connect(ls, "GET /eel HTTP/1.1\r\n\r\n", resp, sizeof(resp), &r);
+	CHECK(r < 0 && strcmp(resp, WS_srv_400) == 0);
+	close(c);
+	for (int i = 0; i < CONFIG_WS_MAX_CLIENTS; i++) {
+		if (WS_clients[i].state != WS_CL_FREE) {
+			ws_client_close(&WS_clients[i]);
+		}
+	}
+	close(ls);
+	WS_set_protocols(NULL, 0);
+}
+
+/*Frame of the client into buf, returns its length*/
+static size_t frame(uint8_t *buf, int fin, int opcode, int masked, const char *p, size_t len)
+{
+	size_t l = 0;
+
+	buf[l++] = (fin ? 0x80 : 0) | opcode;
+	if (len <= WS_STD_LEN) {
+		buf[l++] = (masked ? 0x80 : 0) | len;
+	} else if (len <= 0xFFFF) {
+		buf[l++] = (masked ? 0x80 : 0) | WS_EXT16_LEN;
+		buf[l++] = len >> 8;
+		buf[l++] = len;
+	} else {
+		buf[l++] = (masked ? 0x80 : 0) | WS_EXT64_LEN;
+		for (int i = 7; i >= 0; i--) {
+			buf[l++] = (uint64_t)len >> (8 * i);
+		}
+	}
+	if (masked) {
+		memcpy(&buf[l], MASK, WS_MASK_L);
+		l += WS_MASK_L;
+	}
+	for (size_t i = 0; i < len; i++) {
+		buf[l + i] = p[i] ^ (masked ? MASK[i % WS_MASK_L] : 0);
+	}
+	return l + len;
+}
+
+/*Data to the parser in pieces of the given size*/
+static int feed(ws_client_t *cl, const uint8_t *p, size_t len, size_t piece)
+{
+	for (size_t i = 0; i < len; i += piece) {
+		if (ws_client_feed(cl, (const char *)&p[i], (len - i < piece) ? len - i : piece) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*Next message of the receive queue, compared with the expected one and released*/
+static int message(int opcode, const char *p, size_t len)
+{
+	WebSocket_frame_t f;
+	int ok;
+
+	if (xQueueReceive(WebSocket_rx_queue, &f, 0) != pdTRUE) {
+		return 0;
+	}
+	ok = f.frame_header.opcode == opcode && f.payload_length == len && memcmp(f.payload, p, len) == 0
+			&& f.payload[len] == 0;
+	WS_frame_free(f.payload);
+	return ok;
+}
+
+/*Next frame the server sent, returns its payload length or -1 if there is none*/
+static int server_frame(int *opcode, uint8_t *p, size_t max)
+{
+	uint8_t hdr[2];
+	int len;
+
+	if (recv(peer, hdr, 2, MSG_DONTWAIT) != 2 || (hdr[1] & 0x7F) > WS_STD_LEN) {
+		return -1;
+	}
+	*opcode = hdr[0] & 0x0F;
+	len = hdr[1] & 0x7F;
+	if ((size_t)len > max || (len > 0 && recv(peer, p, len, MSG_DONTWAIT) != len)) {
+		return -1;
+	}
+	return len;
+}
+
+/*A protocol error ends the connection with a close frame of the status*/
+static int closed_with(ws_client_t *cl, const uint8_t *p, size_t len, uint16_t status)
+{
+	uint8_t payload[WS_STD_LEN];
+	int opcode;
+
+	client_open();
+	return feed(cl, p, len, len) < 0 && server_frame(&opcode, payload, sizeof(payload)) == 2
+			&& opcode == WS_OP_CLS && payload[0] == status >> 8 && payload[1] == (status & 0xFF);
+}
+
+static void test_parser(void)
+{
+	static uint8_t buf[2 * WS_MAX_MSG_LEN];
+	static char big[WS_MAX_MSG_LEN + 1];
+	ws_client_t *cl = client_open();
+	uint8_t payload[WS_STD_LEN];
+	WS_pool_stats_t st[WS_POOL_CLASSES];
+	size_t l;
+	int opcode;
+
+	for (size_t i = 0; i < sizeof(big); i++) {
+		big[i] = 'a' + i % 26;
+	}
+
+	/*one byte at a time*/
+	l = frame(buf, 1, WS_OP_TXT, 1, "{\"cmd\":1}", 9);
+	CHECK(feed(cl, buf, l, 1) == 0);
+	CHECK(message(WS_OP_TXT, "{\"cmd\":1}", 9));
+
+	/*three frames in one read*/
+	l = frame(buf, 1, WS_OP_TXT, 1, "one", 3);
+	l += frame(&buf[l], 1, WS_OP_BIN, 1, "two", 3);
+	l += frame(&buf[l], 1, WS_OP_TXT, 1, "", 0);
+	CHECK(feed(cl, buf, l, l) == 0);
+	CHECK(message(WS_OP_TXT, "one", 3));
+	CHECK(message(WS_OP_BIN, "two", 3));
+	CHECK(message(WS_OP_TXT, "", 0));
+
+	/*fragments with a ping in between, the ping is answered right away*/
+	l = frame(buf, 0, WS_OP_TXT, 1, "ab", 2);
+	l += frame(&buf[l], 1, WS_OP_PIN, 1, "p", 1);
+	l += frame(&buf[l], 0, WS_OP_CON, 1, "cd", 2);
+	l += frame(&buf[l], 1, WS_OP_CON, 1, "ef", 2);
+	CHECK(feed(cl, buf, l, 3) == 0);
+	CHECK(message(WS_OP_TXT, "abcdef", 6));
+	CHECK(server_frame(&opcode, payload, sizeof(payload)) == 1 && opcode == WS_OP_PON && payload[0] == 'p');
+
+	/*16 bit length, the message outgrows the small buffer and moves*/
+	l = frame(buf, 0, WS_OP_TXT, 1, big, 200);
+	l += frame(&buf[l], 1, WS_OP_CON, 1, &big[200], 300);
+	CHECK(feed(cl, buf, l, 7) == 0);
+	CHECK(message(WS_OP_TXT, big, 500));
+
+	/*largest message*/
+	l = frame(buf, 0, WS_OP_TXT, 1, big, WS_MAX_MSG_LEN - 1);
+	l += frame(&buf[l], 1, WS_OP_CON, 1, &big[WS_MAX_MSG_LEN - 1], 1);
+	CHECK(feed(cl, buf, l, WS_RX_CHUNK_L) == 0);
+	CHECK(message(WS_OP_TXT, big, WS_MAX_MSG_LEN));
+
+	/*protocol errors close with 1002, too long with 1009*/
+	l = frame(buf, 1, WS_OP_TXT, 0, "x", 1);
+	CHECK(closed_with(cl, buf, l, WS_CLOSE_PROTOCOL));
+	l = frame(buf, 1, WS_OP_PIN, 1, big, WS_STD_LEN + 1);
+	CHECK(closed_with(cl, buf, l, WS_CLOSE_PROTOCOL));
+	l = frame(buf, 0, WS_OP_PIN, 1, "p", 1);
+	CHECK(closed_with(cl, buf, l, WS_CLOSE_PROTOCOL));
+	l = frame(buf, 1, 0x3, 1, "x", 1);
+	CHECK(closed_with(cl, buf, l, WS_CLOSE_PROTOCOL));
+	l = frame(buf, 1, WS_OP_CON, 1, "x", 1);
+	CHECK(closed_with(cl, buf, l, WS_CLOSE_PROTOCOL));
+	l = frame(buf, 1, WS_OP_TXT, 1, big, WS_MAX_MSG_LEN + 1);
+	CHECK(closed_with(cl, buf, l, WS_CLOSE_TOO_BIG));
+	l = frame(buf, 0, WS_OP_TXT, 1, big, WS_MAX_MSG_LEN);
+	l += frame(&buf[l], 1, WS_OP_CON, 1, "x", 1);
+	CHECK(closed_with(cl, buf, l, WS_CLOSE_TOO_BIG));
+
+	/*close of the client is answered, nothing queued, no buffer kept*/
+	client_open();
+	l = frame(buf, 0, WS_OP_TXT, 1, "half", 4);
+	l += frame(&buf[l], 1, WS_OP_CLS, 1, "\x03\xE8", 2);
+	CHECK(feed(cl, buf, l, 5) < 0);
+	CHECK(server_frame(&opcode, payload, sizeof(payload)) == 0 && opcode == WS_OP_CLS);
+	ws_client_close(cl);
+	CHECK(uxQueueMessagesWaiting(WebSocket_rx_queue) == 0);
+	WS_pool_stats(st);
+	CHECK(st[0].in_use == 0 && st[1].in_use == 0);
+}
+
+/*The server task never waits: a full queue or a missing buffer drops the message*/
+static void test_drop(void)
+{
+	static uint8_t buf[(RX_QUEUE_L + 2) * 16];
+	char *held[CONFIG_WS_POOL_SMALL_NUM + CONFIG_WS_POOL_LARGE_NUM + 1];
+	ws_client_t *cl = client_open();
+	WS_conn_stats_t st;
+	uint32_t dropped;
+	size_t l = 0;
+	int n;
+
+	WS_conn_stats(&st);
+	dropped = st.rx_dropped;
+	for (int i = 0; i < RX_QUEUE_L + 2; i++) {
+		l += frame(&buf[l], 1, WS_OP_TXT, 1, "{\"cmd\":0}", 9);
+	}
+	CHECK(feed(cl, buf, l, WS_RX_CHUNK_L) == 0);
+	WS_conn_stats(&st);
+	CHECK(st.rx_dropped == dropped + 2);
+	for (int i = 0; i < RX_QUEUE_L; i++) {
+		CHECK(message(WS_OP_TXT, "{\"cmd\":0}", 9));
+	}
+
+	/*no buffer free, the stream stays in sync for the next message*/
+	for (n = 0; (held[n] = ws_pool_get(1)) != NULL; n++) {
+	}
+	CHECK(n == CONFIG_WS_POOL_SMALL_NUM + CONFIG_WS_POOL_LARGE_NUM);
+	l = frame(buf, 0, WS_OP_TXT, 1, "lo", 2);
+	l += frame(&buf[l], 1, WS_OP_CON, 1, "st", 2);
+	CHECK(feed(cl, buf, l, 3) == 0);
+	WS_frame_free(held[0]);
+	l = frame(buf, 1, WS_OP_TXT, 1, "kept", 4);
+	CHECK(feed(cl, buf, l, l) == 0);
+	CHECK(message(WS_OP_TXT, "kept", 4));
+	CHECK(uxQueueMessagesWaiting(WebSocket_rx_queue) == 0);
+	for (int i = 1; i < n; i++) {
+		WS_frame_free(held[i]);
+	}
+	WS_conn_stats(&st);
+	CHECK(st.rx_dropped == dropped + 3);
+}
+
+/*Send timeout of 50 ms with a small socket buffer, the client end reads nothing*/
+static void stall(ws_client_t *cl)
+{
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 50000 };
+	int buf = 4096;
+
+	setsockopt(cl->sock, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+	setsockopt(cl->sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/*Bytes waiting at the client end up to the end of stream, -1 if it is still open*/
+static long pending(void)
+{
+	static char buf[4096];
+	long total = 0;
+	ssize_t n;
+
+	while ((n = recv(peer, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		total += n;
+	}
+	return (n == 0) ? total : -1;
+}
+
+static void test_send(void)
+{
+	static char msg[256 * 1024];
+	ws_client_t *cl = client_open();
+	uint8_t payload[WS_STD_LEN];
+	long filled = 0;
+	int opcode;
+
+	/*nothing written: the frame may be sent again once the client reads*/
+	stall(cl);
+	while (send(cl->sock, msg, 256, MSG_DONTWAIT) == 256) {
+		filled += 256;
+	}
+	CHECK(WS_write(cl->id, WS_OP_TXT, "late", 4, 0) == ERR_TIMEOUT);
+	CHECK(cl->tx_err == ERR_OK && cl->state == WS_CL_OPEN);
+	for (long n = 0; n < filled; n += recv(peer, msg, (filled - n < 256) ? filled - n : 256, 0)) {
+	}
+	CHECK(WS_write(cl->id, WS_OP_TXT, "late", 4, 0) == ERR_OK);
+	CHECK(server_frame(&opcode, payload, sizeof(payload)) == 4 && memcmp(payload, "late", 4) == 0);
+
+	/*part of the frame written: the connection is shut down, later frames fail right away*/
+	cl = client_open();
+	stall(cl);
+	CHECK(WS_write(cl->id, WS_OP_TXT, msg, sizeof(msg), WS_TX_NOCOPY) == ERR_CONN);
+	CHECK(cl->tx_err == ERR_CONN);
+	CHECK(WS_write(cl->id, WS_OP_TXT, "x", 1, 0) == ERR_CONN);
+	CHECK(pending() > 0);
+	ws_client_close(cl);
+}
+
+/*Connections from connect to the 101 response, one at a time*/
+static void bench_connections(void)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	char resp[512];
+	int ls = socket(AF_INET, SOCK_STREAM, 0), ok = 0, r;
+	double t;
+
+	bind(ls, (struct sockaddr *)&addr, sizeof(addr));
+	listen(ls, 4);
+	t = test_us();
+	for (int i = 0; i < CONNECTIONS; i++) {
+		close(hs_connect(ls, REQUEST(""), resp, sizeof(resp), &r));
+		ok += (r == 0 && strncmp(resp, "HTTP/1.1 101 ", 13) == 0);
+		ws_client_close(&WS_clients[0]);
+	}
+	t = test_us() - t;
+	close(ls);
+	CHECK(ok == CONNECTIONS);
+	printf("  handshakes: %7.0f connections/s\n", CONNECTIONS / t * 1e6);
+}
+
+/*Reads the client end until it is closed*/
+static void *drain(void *arg)
+{
+	static char buf[65536];
+
+	while (recv(peer, buf, sizeof(buf), 0) > 0) {
+	}
+	return NULL;
+}
+
+/*Messages of len bytes through the parser, 1436 bytes per read like the server task*/
+static void bench_rx(size_t len)
+{
+	static uint8_t stream[BENCH_L + 2 * WS_MAX_MSG_LEN];
+	static char msg[WS_MAX_MSG_LEN];
+	ws_client_t *cl = client_open();
+	WebSocket_frame_t f;
+	size_t l = 0, n = 0;
+	double t;
+
+	while (l < BENCH_L) {
+		l += frame(&stream[l], 1, WS_OP_TXT, 1, msg, len);
+		n++;
+	}
+	t = test_us();
+	for (size_t i = 0; i < l; i += WS_RX_CHUNK_L) {
+		CHECK(ws_client_feed(cl, (const char *)&stream[i], (l - i < WS_RX_CHUNK_L) ? l - i : WS_RX_CHUNK_L) == 0);
+		while (xQueueReceive(WebSocket_rx_queue, &f, 0) == pdTRUE) {
+			WS_frame_free(f.payload);
+			n--;
+		}
+	}
+	t = test_us() - t;
+	CHECK(n == 0);
+	printf("  rx %6zu B: %8.1f MB/s %9.0f messages/s\n", len, l / t, (l / (len + 8.0)) / t * 1e6);
+}
+
+/*Small commands through the parser, the receive queue is emptied after every read*/
+static void bench_commands(void)
+{
+	static uint8_t stream[BENCH_L / 8 + 64];
+	ws_client_t *cl = client_open();
+	WebSocket_frame_t f;
+	size_t l = 0, n = 0, got = 0;
+	double t;
+
+	while (l < BENCH_L / 8) {
+		l += frame(&stream[l], 1, WS_OP_TXT, 1, COMMAND, sizeof(COMMAND) - 1);
+		n++;
+	}
+	t = test_us();
+	for (size_t i = 0; i < l; i += WS_RX_CHUNK_L) {
+		ws_client_feed(cl, (const char *)&stream[i], (l - i < WS_RX_CHUNK_L) ? l - i : WS_RX_CHUNK_L);
+		while (xQueueReceive(WebSocket_rx_queue, &f, 0) == pdTRUE) {
+			WS_frame_free(f.payload);
+			got++;
+		}
+	}
+	t = test_us() - t;
+	CHECK(got == n);
+	printf("  rx %6zu B: %9.0f frames/s\n", sizeof(COMMAND) - 1, n / t * 1e6);
+}
+
+/*Messages of len bytes written to the socket, a thread reads them*/
+static void bench_tx(size_t len)
+{
+	static char msg[256 * 1024];
+	ws_client_t *cl = client_open();
+	size_t n = BENCH_L / len;
+	pthread_t th;
+	double t;
+
+	pthread_create(&th, NULL, drain, NULL);
+	t = test_us();
+	for (size_t i = 0; i < n; i++) {
+		CHECK(WS_write(cl->id, WS_OP_TXT, msg, len, WS_TX_NOCOPY) == ERR_OK);
+	}
+	t = test_us() - t;
+	ws_client_close(cl);
+	pthread_join(th, NULL);
+	printf("  tx %6zu B: %8.1f MB/s %9.0f messages/s\n", len, n * len / t, n / t * 1e6);
+}
+
+static int read_all(int s, void *p, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = recv(s, p, len, 0);
+
+		if (n <= 0) {
+			return -1;
+		}
+		p = (char *)p + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*Request worker, answers every message like waiting_req*/
+static void *worker(void *arg)
+{
+	static char answer[ANSWER_L];
+	WebSocket_frame_t f;
+
+	memset(answer, 'x', sizeof(answer));
+	while (xQueueReceive(WebSocket_rx_queue, &f, portMAX_DELAY) == pdTRUE) {
+		WS_write(f.client, WS_OP_TXT, answer, sizeof(answer), 0);
+		WS_frame_free(f.payload);
+	}
+	return NULL;
+}
+
+/*Client connecting to the server task, one request at a time, latencies into arg*/
+static void *client(void *arg)
+{
+	static const char hs[] = "GET / HTTP/1.1\r\nHost: eel\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(WS_PORT), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	double *lat = arg;
+	uint8_t req[64], resp[4 + ANSWER_L];
+	char line[256];
+	size_t req_l = frame(req, 1, WS_OP_TXT, 1, COMMAND, sizeof(COMMAND) - 1), l = 0;
+	int s = socket(AF_INET, SOCK_STREAM, 0), one = 1, tries = 0;
+
+	while (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0 && tries++ < 1000) {
+		usleep(1000);
+	}
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	send(s, hs, sizeof(hs) - 1, 0);
+	while (l < 4 || memcmp(&line[l - 4], "\r\n\r\n", 4) != 0) {
+		if (l == sizeof(line) || recv(s, &line[l++], 1, 0) != 1) {
+			CHECK(0);
+			close(s);
+			return NULL;
+		}
+	}
+
+	for (int i = 0; i < ROUND_TRIPS; i++) {
+		double t = test_us();
+
+		send(s, req, req_l, 0);
+		if (read_all(s, resp, sizeof(resp)) != 0 || resp[1] != WS_EXT16_LEN) {
+			CHECK(0);
+			break;
+		}
+		lat[i] = test_us() - t;
+	}
+	close(s);
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	return (*(const double *)a > *(const double *)b) - (*(const double *)a < *(const double *)b);
+}
+
+/*n clients at once through the server task*/
+static void bench_clients(int n)
+{
+	static double lat[CLIENTS_MAX * ROUND_TRIPS];
+	pthread_t th[CLIENTS_MAX];
+	double t;
+
+	/*slots of the last run are closed by the server task*/
+	for (int i = 0; i < 1000 && ws_check_client() > 0; i++) {
+		usleep(1000);
+	}
+	memset(lat, 0, sizeof(lat));
+	t = test_us();
+	for (int i = 0; i < n; i++) {
+		pthread_create(&th[i], NULL, client, &lat[i * ROUND_TRIPS]);
+	}
+	for (int i = 0; i < n; i++) {
+		pthread_join(th[i], NULL);
+	}
+	t = test_us() - t;
+	qsort(lat, n * ROUND_TRIPS, sizeof(lat[0]), cmp_double);
+	printf("  %d clients: %8.0f requests/s, latency p50 %4.0f us p99 %4.0f us\n", n,
+			n * ROUND_TRIPS / t * 1e6, lat[n * ROUND_TRIPS / 2], lat[n * ROUND_TRIPS * 99 / 100]);
+}
+
+int main(void)
+{
+	pthread_t th;
+
+	/*a send on the closed socket fails with EPIPE*/
+	signal(SIGPIPE, SIG_IGN);
+	server_init();
+	test_handshake();
+	test_parser();
+	test_drop();
+	test_send();
+
+	/*256 KB messages are more than the largest receive buffer, they are only sent*/
+	bench_commands();
+	bench_rx(1024);
+	bench_rx(16 * 1024);
+	bench_tx(1024);
+	bench_tx(16 * 1024);
+	bench_tx(256 * 1024);
+	bench_connections();
+
+	/*the server task takes over the client table*/
+	pthread_create(&th, NULL, (void *(*)(void *))ws_server, NULL);
+	for (int i = 0; i < WORKERS; i++) {
+		pthread_create(&th, NULL, worker, NULL);
+	}
+	bench_clients(1);
+	bench_clients(4);
+	bench_clients(8);
+	return TEST_END("websocket");
+}